@@ -111,6 +111,9 @@ enum json_types JSON_GetJSONType(Tcl_Obj* obj) //{{{
 	for (t=JSON_OBJECT; t<JSON_TYPE_MAX && ir==NULL; t++)
 		ir = Tcl_FetchInternalRep(obj, g_objtype_for_type[t]);
 
+	if (ir == NULL && is_packed(obj))
+		return packed_type(obj);
+
 	return (ir == NULL) ? JSON_UNDEF : t-1;
 }
 
@@ -400,7 +403,8 @@ int JSON_Extract(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, Tcl_Obj** res)
 	if (pathc > 0) {
 		TEST_OK_LABEL(finally, code, resolve_path(interp, obj, pathv, pathc, &target, 0, 0, def));
 	} else {
-		TEST_OK_LABEL(finally, code, JSON_ForceJSON(interp, obj));
+		if (!is_packed(obj))
+			TEST_OK_LABEL(finally, code, JSON_ForceJSON(interp, obj));
 		replace_tclobj(&target, obj);
 	}
 
@@ -599,6 +603,8 @@ int JSON_Set(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj *path, Tcl_Obj* replaceme
 
 		TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, target, &type, &ir));
 		val = get_unshared_val(ir);
+		// target may be a duplicate carrying a copy of the original's string rep
+		Tcl_InvalidateStringRep(target);
 	}
 
 	goto set_val;
@@ -790,6 +796,7 @@ int JSON_Unset(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj *path) //{{{
 			Tcl_ObjInternalRep*	ir = NULL;
 			TEST_OK_LABEL(finally, retval, JSON_GetIntrepFromObj(interp, target, &type, &ir));
 			val = get_unshared_val(ir);
+			Tcl_InvalidateStringRep(target);
 		}
 		//fprintf(stderr, "Walked on to new type %s\n", type_names[type]);
 	}
@@ -908,229 +915,1696 @@ bad_path:
 }
 
 //}}}
-int JSON_Normalize(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** normalized) //{{{
+static int merge_object(Tcl_Interp* interp, Tcl_Obj** targetPtr, Tcl_Obj* patchdict, int shared, int* modifiedPtr) //{{{
 {
-	int				retval = TCL_OK;
-	Tcl_Obj*		json = NULL;
-	enum json_types	type;
+	// Apply the RFC 7386 merge of the JSON object patch (whose dict is
+	// patchdict) to *targetPtr, which must be a JSON object.  Containers are
+	// only unshared when something in them actually changes: if *targetPtr
+	// (or anything above it, signalled by shared) is shared then a duplicate
+	// is made on the first write and returned in *targetPtr (with a zero
+	// refcount, for the caller to store), otherwise it is modified in place.
+	int					code = TCL_OK;
+	Tcl_Obj*			target = *targetPtr;
+	Tcl_Obj*			val = NULL;
+	Tcl_Obj*			k = NULL;	// On loan from patchdict
+	Tcl_Obj*			v = NULL;	// On loan from patchdict
+	Tcl_Obj*			child = NULL;
+	Tcl_Obj*			newchild = NULL;
+	Tcl_ObjInternalRep*	ir = NULL;
+	Tcl_DictSearch		search;
+	int					done, writable = 0, modified = 0, children_shared;
+	enum json_types		type, ptype;
 
-	type = JSON_GetJSONType(obj);
+	TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, target, &type, &ir));
+	val = ir->twoPtrValue.ptr1;
+	// Our children are only safe to modify in place if nothing above them
+	// is shared
+	children_shared = shared || Tcl_IsShared(target) || Tcl_IsShared(val);
+
+	#define ENSURE_WRITABLE() do { \
+		if (!writable) { \
+			if (shared || Tcl_IsShared(target)) target = Tcl_DuplicateObj(target); \
+			TEST_OK_LABEL(done, code, JSON_GetIntrepFromObj(interp, target, &type, &ir)); \
+			val = get_unshared_val(ir); \
+			writable = 1; \
+		} \
+	} while(0)
+
+	TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, patchdict, &search, &k, &v, &done));
+	for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+		Tcl_Obj*	pval = NULL;
+
+		TEST_OK_LABEL(done, code, JSON_GetJvalFromObj(interp, v, &ptype, &pval));
+		TEST_OK_LABEL(done, code, Tcl_DictObjGet(interp, val, k, &child));
+
+		switch (ptype) {
+			case JSON_NULL:
+				if (child == NULL) break;	// Removing a key that isn't there changes nothing
+				ENSURE_WRITABLE();
+				TEST_OK_LABEL(done, code, Tcl_DictObjRemove(interp, val, k));
+				modified = 1;
+				break;
 
-	if (type != JSON_UNDEF && !Tcl_HasStringRep(obj))
-		return TCL_OK;		// Nothing to do - already parsed as json and have no string rep
+			case JSON_OBJECT:
+			{
+				Tcl_Obj*		merged = child;	// On loan from val
+				Tcl_Obj*		cval = NULL;
+				enum json_types	ctype = JSON_UNDEF;
+				int				child_modified = 0;
+
+				if (child) TEST_OK_LABEL(done, code, JSON_GetJvalFromObj(interp, child, &ctype, &cval));
+				if (ctype != JSON_OBJECT) {
+					// A patch object merged into anything but an object is
+					// merged into an empty object (which strips the nulls out
+					// of the patch)
+					replace_tclobj(&newchild, JSON_NewJvalObj(JSON_OBJECT, Tcl_NewDictObj()));
+					merged = newchild;
+				}
 
-	if (Tcl_IsShared(obj)) {
-		replace_tclobj(&json, Tcl_DuplicateObj(obj));
-	} else {
-		replace_tclobj(&json, obj);
-	}
+				TEST_OK_LABEL(done, code, merge_object(interp, &merged, pval, merged == child ? children_shared : 0, &child_modified));
+
+				if (merged != child) {
+					if (merged != newchild) replace_tclobj(&newchild, merged);
+					ENSURE_WRITABLE();
+					TEST_OK_LABEL(done, code, Tcl_DictObjPut(interp, val, k, newchild));
+					modified = 1;
+				} else if (child_modified) {
+					// child was unshared and changed in place, which implies
+					// that we were too
+					modified = 1;
+				}
+				release_tclobj(&newchild);
+				break;
+			}
 
-	retval = JSON_ForceJSON(interp, json);
-	Tcl_InvalidateStringRep(json);			// Defer string rep generation to our caller
+			default:
+				if (child == v) break;	// Same value, nothing to do
+				ENSURE_WRITABLE();
+				TEST_OK_LABEL(done, code, Tcl_DictObjPut(interp, val, k, v));
+				modified = 1;
+		}
+	}
 
-	if (retval == TCL_OK)
-		replace_tclobj(normalized, json);
+done:
+	Tcl_DictObjDone(&search);
+	#undef ENSURE_WRITABLE
+
+	if (code == TCL_OK && modified) {
+		if (!writable) {
+			// A descendant was modified in place, so our cached template
+			// actions (if any) are stale
+			TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, target, &type, &ir));
+			get_unshared_val(ir);
+		}
+		Tcl_InvalidateStringRep(target);
+	}
 
-	release_tclobj(&json);
+	if (code == TCL_OK) {
+		*targetPtr = target;
+		*modifiedPtr = modified;
+	} else if (target != *targetPtr) {
+		// Discard our private duplicate
+		Tcl_IncrRefCount(target);
+		Tcl_DecrRefCount(target);
+	}
 
-	return retval;
+finally:
+	release_tclobj(&newchild);
+	return code;
 }
 
 //}}}
-int JSON_Pretty(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* indent, Tcl_Obj** prettyString) //{{{
+int JSON_Merge(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* patch) //{{{
 {
-	int					retval = TCL_OK;
-	Tcl_DString			ds;
-	Tcl_Obj*			lindent = NULL;
-	Tcl_Obj*			pad = NULL;
-	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	int					code = TCL_OK;
+	enum json_types		type, ptype;
+	Tcl_ObjInternalRep*	ir = NULL;
+	Tcl_Obj*			pval = NULL;
+	Tcl_Obj*			target = obj;
+	int					modified = 0;
 
-	if (indent == NULL) {
-		replace_tclobj(&lindent, get_string(l, "    ", 4));
-		indent = lindent;
-	}
+	if (Tcl_IsShared(obj))
+		THROW_ERROR_LABEL(finally, code, "JSON_Merge called with shared object");
 
-	replace_tclobj(&pad, l->tcl_empty);
-	Tcl_DStringInit(&ds);
-	retval = json_pretty(interp, obj, indent, pad, &ds);
+	TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, obj, &type, &ir));
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, patch, &ptype, &pval));
 
-	if (retval == TCL_OK)
-		replace_tclobj(prettyString, Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+	if (ptype != JSON_OBJECT) {
+		// RFC 7386: a patch that isn't an object replaces the target entirely
+		TEST_OK_LABEL(finally, code, JSON_SetIntRep(obj, ptype, pval));
+	} else {
+		if (type != JSON_OBJECT)
+			TEST_OK_LABEL(finally, code, JSON_SetIntRep(obj, JSON_OBJECT, Tcl_NewDictObj()));
 
-	Tcl_DStringFree(&ds);
-	release_tclobj(&pad);
-	release_tclobj(&lindent);
+		// obj is unshared, so merge_object will update it in place
+		TEST_OK_LABEL(finally, code, merge_object(interp, &target, pval, 0, &modified));
+		if (target != obj)
+			Tcl_Panic("JSON_Merge: unshared target was duplicated");
+	}
 
-	return retval;
+finally:
+	return code;
 }
 
 //}}}
-int JSON_Template(Tcl_Interp* interp, Tcl_Obj* template, Tcl_Obj* dict, Tcl_Obj** res) //{{{
+static Tcl_WideUInt hash_mix(Tcl_WideUInt h) //{{{
 {
-	//struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
-	Tcl_Obj*			actions = NULL;
-	int					retcode = TCL_OK;
-	Tcl_ObjInternalRep*	ir;
-	enum json_types		type;
-
-	TEST_OK(JSON_GetIntrepFromObj(interp, template, &type, &ir));
+	// splitmix64 finalizer
+	h ^= h >> 30;	h *= 0xbf58476d1ce4e5b9ULL;
+	h ^= h >> 27;	h *= 0x94d049bb133111ebULL;
+	h ^= h >> 31;
+	return h;
+}
 
-	replace_tclobj(&actions, ir->twoPtrValue.ptr2);
-	if (actions == NULL) {
-		//DBG("Building template actions and storing in intrep ptr2 for %s\n", name(template));
-		TEST_OK_LABEL(finally, retcode, build_template_actions(interp, template, &actions));
-		replace_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2, actions);
+//}}}
+static Tcl_WideUInt hash_bytes(Tcl_WideUInt h, const char* bytes, int len) //{{{
+{
+	// FNV-1a
+	const unsigned char*		p = (const unsigned char*)bytes;
+	const unsigned char*const	e = p + len;
+
+	h ^= 0xcbf29ce484222325ULL;
+	for (; p<e; p++) {
+		h ^= *p;
+		h *= 0x100000001b3ULL;
 	}
-
-	//DBG("template %s refcount before: %d\n", name(template), template->refCount);
-	retcode = apply_template_actions(interp, template, actions, dict, res);
-	//DBG("template %s refcount after: %d\n", name(template), template->refCount);
-	release_tclobj(&actions);
-
-finally:
-	return retcode;
+	return h;
 }
 
 //}}}
-int JSON_IsNULL(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, int* isnull) //{{{
+static int json_hash(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_WideUInt* hashPtr) //{{{
 {
-	int			retval = TCL_OK;
-	Tcl_Obj*	jval = NULL;
+	// Structural hash, consistent with values_equal: values that compare
+	// equal hash the same.  Object members are combined with a commutative
+	// sum so that key order doesn't matter, and numbers are hashed by their
+	// double value.  Container hashes are memoized in the value's cache,
+	// which is released by anything that modifies the value
+	int					code = TCL_OK;
+	enum json_types		type;
+	Tcl_ObjInternalRep*	ir = NULL;
+	Tcl_Obj*			val = NULL;
+	struct json_cache*	cache = NULL;
+	Tcl_WideUInt		h;
 
-	retval = JSON_Extract(interp, obj, path, &jval);
+	TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, obj, &type, &ir));
+	val = ir->twoPtrValue.ptr1;
+	h = hash_mix(0x9e3779b97f4a7c15ULL * (type+1));
 
-	if (retval == TCL_OK)
-		*isnull = (JSON_NULL == JSON_GetJSONType(jval));
+	switch (type) {
+		case JSON_OBJECT: //{{{
+		{
+			Tcl_DictSearch	search;
+			Tcl_Obj*		k = NULL;
+			Tcl_Obj*		v = NULL;
+			Tcl_WideUInt	vh, sum = 0;
+			int				done, klen, size = 0;
+			const char*		kstr;
+
+			cache = get_json_cache(ir, 0);
+			if (cache && cache->have_hash) {
+				*hashPtr = cache->hash;
+				goto finally;
+			}
 
-	release_tclobj(&jval);
+			TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+			for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+				TEST_OK_BREAK(code, json_hash(interp, v, &vh));
+				kstr = Tcl_GetStringFromObj(k, &klen);
+				sum += hash_mix(hash_bytes(0, kstr, klen) ^ hash_mix(vh + 0x9e3779b97f4a7c15ULL));
+				size++;
+			}
+			Tcl_DictObjDone(&search);
+			if (code != TCL_OK) goto finally;
 
-	return retval;
+			h = hash_mix(h ^ sum ^ (Tcl_WideUInt)size);
+			break;
+		}
+		//}}}
+		case JSON_ARRAY: //{{{
+		{
+			int				oc, i;
+			Tcl_Obj**		ov = NULL;
+			Tcl_WideUInt	eh;
+
+			cache = get_json_cache(ir, 0);
+			if (cache && cache->have_hash) {
+				*hashPtr = cache->hash;
+				goto finally;
+			}
+
+			TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, val, &oc, &ov));
+			for (i=0; i<oc; i++) {
+				TEST_OK_LABEL(finally, code, json_hash(interp, ov[i], &eh));
+				h = hash_mix(h + eh);
+			}
+			h = hash_mix(h ^ (Tcl_WideUInt)oc);
+			break;
+		}
+		//}}}
+		case JSON_NUMBER: //{{{
+		{
+			double	d;
+
+			if (TCL_OK == Tcl_GetDoubleFromObj(NULL, val, &d)) {
+				Tcl_WideUInt	bits;
+
+				if (d == 0.0) d = 0.0;		// -0 == 0
+				memcpy(&bits, &d, sizeof(bits));
+				h = hash_mix(h ^ bits);
+			} else {
+				int			len;
+				const char*	str = Tcl_GetStringFromObj(val, &len);
+				h = hash_bytes(h, str, len);
+			}
+			break;
+		}
+		//}}}
+		case JSON_BOOL: //{{{
+		{
+			int		b;
+			TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, val, &b));
+			h = hash_mix(h ^ (Tcl_WideUInt)b);
+			break;
+		}
+		//}}}
+		case JSON_NULL:
+			break;
+
+		default:
+		{
+			int			len;
+			const char*	str = Tcl_GetStringFromObj(val, &len);
+			h = hash_bytes(h, str, len);
+		}
+	}
+
+	if (type == JSON_OBJECT || type == JSON_ARRAY) {
+		// The hashes of the children may have been computed (and cached) by
+		// the recursion, but nothing there modifies this value, so ir is
+		// still valid
+		cache = get_json_cache(ir, 1);
+		cache->hash = h;
+		cache->have_hash = 1;
+	}
+	*hashPtr = h;
+
+finally:
+	return code;
 }
 
 //}}}
-int JSON_Type(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, enum json_types* type) //{{{
+static int cached_hashes_differ(Tcl_ObjInternalRep* air, Tcl_ObjInternalRep* bir) //{{{
 {
-	int			retval = TCL_OK;
-	Tcl_Obj*	jval = NULL;
+	struct json_cache*	ac = get_json_cache(air, 0);
+	struct json_cache*	bc = get_json_cache(bir, 0);
 
-	retval = JSON_Extract(interp, obj, path, &jval);
+	return ac && bc && ac->have_hash && bc->have_hash && ac->hash != bc->hash;
+}
 
-	if (retval == TCL_OK)
-		*type = JSON_GetJSONType(jval);
+//}}}
+static int numbers_equal(Tcl_Obj* a, Tcl_Obj* b) //{{{
+{
+	Tcl_WideInt	wa, wb;
+	mp_int		ba, bb;
+	double		da, db;
+
+	if (TCL_OK == Tcl_GetWideIntFromObj(NULL, a, &wa) && TCL_OK == Tcl_GetWideIntFromObj(NULL, b, &wb))
+		return wa == wb;
+
+	if (TCL_OK == Tcl_GetBignumFromObj(NULL, a, &ba)) {
+		if (TCL_OK == Tcl_GetBignumFromObj(NULL, b, &bb)) {
+			const int	cmp = mp_cmp(&ba, &bb);
+			mp_clear(&ba);
+			mp_clear(&bb);
+			return cmp == MP_EQ;
+		}
+		mp_clear(&ba);
+	}
 
-	release_tclobj(&jval);
+	if (TCL_OK == Tcl_GetDoubleFromObj(NULL, a, &da) && TCL_OK == Tcl_GetDoubleFromObj(NULL, b, &db))
+		return da == db;
 
-	return retval;
+	return 0;
 }
 
 //}}}
-int JSON_Length(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, int* length) //{{{
+static int values_equal(Tcl_Interp* interp, Tcl_Obj* a, Tcl_Obj* b, int* equalPtr) //{{{
 {
-	enum json_types	type;
-	int				retval = TCL_OK;
-	Tcl_Obj*		val = NULL;
-	Tcl_Obj*		target = NULL;
+	// Structural equality as defined by RFC 6902 section 4.6: object key
+	// order is not significant and numbers compare by value
+	int					code = TCL_OK;
+	enum json_types		atype, btype;
+	Tcl_ObjInternalRep*	air = NULL;
+	Tcl_ObjInternalRep*	bir = NULL;
+	Tcl_Obj*			aval = NULL;
+	Tcl_Obj*			bval = NULL;
+	int					equal = 0;
+
+	if (a == b) {
+		equal = 1;
+		goto done;
+	}
 
-	TEST_OK_LABEL(finally, retval, JSON_Extract(interp, obj, path, &target));
+	TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, a, &atype, &air));
+	TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, b, &btype, &bir));
+	aval = air->twoPtrValue.ptr1;
+	bval = bir->twoPtrValue.ptr1;
 
-	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, target, &type, &val));
+	if (atype != btype) goto done;
+	if (aval == bval) {
+		equal = 1;
+		goto done;
+	}
+	if (cached_hashes_differ(air, bir)) goto done;
 
-	switch (type) {
-		case JSON_ARRAY:  retval = Tcl_ListObjLength(interp, val, length); break;
-		case JSON_OBJECT: retval = Tcl_DictObjSize(interp, val, length);   break;
+	switch (atype) {
+		case JSON_OBJECT: //{{{
+		{
+			int				asize, bsize, isdone;
+			Tcl_DictSearch	search;
+			Tcl_Obj*		k = NULL;
+			Tcl_Obj*		v = NULL;
+			Tcl_Obj*		bv = NULL;
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjSize(interp, aval, &asize));
+			TEST_OK_LABEL(finally, code, Tcl_DictObjSize(interp, bval, &bsize));
+			if (asize != bsize) goto done;
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, aval, &search, &k, &v, &isdone));
+			for (; !isdone; Tcl_DictObjNext(&search, &k, &v, &isdone)) {
+				TEST_OK_BREAK(code, Tcl_DictObjGet(interp, bval, k, &bv));
+				if (bv == NULL) break;
+				TEST_OK_BREAK(code, values_equal(interp, v, bv, &equal));
+				if (!equal) break;
+			}
+			Tcl_DictObjDone(&search);
+			if (code != TCL_OK) goto finally;
+			equal = isdone;
+			break;
+		}
+		//}}}
+		case JSON_ARRAY: //{{{
+		{
+			int			ac, bc, i;
+			Tcl_Obj**	av = NULL;
+			Tcl_Obj**	bv = NULL;
 
-		case JSON_DYN_STRING:
-		case JSON_DYN_NUMBER:
-		case JSON_DYN_BOOL:
-		case JSON_DYN_JSON:
-		case JSON_DYN_TEMPLATE:
-		case JSON_DYN_LITERAL:   *length = Tcl_GetCharLength(val) + 3; break;	// dynamic types have a 3 character prefix
-		case JSON_STRING:        *length = Tcl_GetCharLength(val);     break;
+			TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, aval, &ac, &av));
+			TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, bval, &bc, &bv));
+			if (ac != bc) goto done;
+
+			equal = 1;
+			for (i=0; i<ac && equal; i++)
+				TEST_OK_LABEL(finally, code, values_equal(interp, av[i], bv[i], &equal));
+			break;
+		}
+		//}}}
+		case JSON_NUMBER:
+			equal = numbers_equal(aval, bval);
+			break;
+
+		case JSON_BOOL:
+		{
+			int		ab, bb;
+			TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, aval, &ab));
+			TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, bval, &bb));
+			equal = ab == bb;
+			break;
+		}
+
+		case JSON_NULL:
+			equal = 1;
+			break;
 
 		default:
-			Tcl_SetObjResult(interp, Tcl_ObjPrintf("Named JSON value type isn't supported: %s", get_type_name(type)));
-			retval = TCL_ERROR;
+		{
+			int			alen, blen;
+			const char*	astr = Tcl_GetStringFromObj(aval, &alen);
+			const char*	bstr = Tcl_GetStringFromObj(bval, &blen);
+			equal = alen == blen && memcmp(astr, bstr, alen) == 0;
+		}
 	}
 
-finally:
-	release_tclobj(&target);
+done:
+	*equalPtr = equal;
 
-	return retval;
+finally:
+	return code;
 }
 
 //}}}
-int JSON_Keys(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, Tcl_Obj** keyslist) //{{{
+static void patch_error(Tcl_Interp* interp, const char* reason, Tcl_Obj* pointer, Tcl_Obj* msg) //{{{
 {
-	enum json_types		type;
-	int					retval = TCL_OK;
-	Tcl_Obj*			val = NULL;
-	Tcl_Obj*			target = NULL;
-
-	TEST_OK_LABEL(finally, retval, JSON_Extract(interp, obj, path, &target));
-	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, target, &type, &val));
-
-	if (type != JSON_OBJECT) {
-		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Named JSON value type isn't supported: %s", get_type_name(type)));
-		retval = TCL_ERROR;
-	} else {
-		Tcl_Obj*		res = NULL;
-		Tcl_Obj*		k = NULL;
-		Tcl_Obj*		v = NULL;
-		Tcl_DictSearch	search;
-		int				done;
+	Tcl_SetErrorCode(interp, "RL", "JSON", "PATCH", reason, pointer ? Tcl_GetString(pointer) : NULL, NULL);
+	Tcl_SetObjResult(interp, msg);
+}
 
-		replace_tclobj(&res, Tcl_NewListObj(0, NULL));
+//}}}
+static int parse_pointer(Tcl_Interp* interp, Tcl_Obj* pointer, Tcl_Obj** tokensPtr) //{{{
+{
+	// Split a JSON Pointer (RFC 6901) into its unescaped reference tokens
+	int					code = TCL_OK;
+	int					len;
+	const char*			str = Tcl_GetStringFromObj(pointer, &len);
+	const char*const	end = str + len;
+	const char*			p = str;
+	Tcl_Obj*			tokens = NULL;
+	Tcl_DString			ds;
 
-		TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
-		for (; !done; Tcl_DictObjNext(&search, &k, &v, &done))
-			TEST_OK_BREAK(retval, Tcl_ListObjAppendElement(interp, res, k));
-		Tcl_DictObjDone(&search);
+	Tcl_DStringInit(&ds);
+	replace_tclobj(&tokens, Tcl_NewListObj(0, NULL));
 
-		if (retval == TCL_OK)
-			replace_tclobj(keyslist, res);
+	if (len > 0 && *p != '/') {
+		patch_error(interp, "BAD_POINTER", pointer, Tcl_ObjPrintf("Invalid JSON pointer \"%s\": must be empty or start with \"/\"", str));
+		code = TCL_ERROR;
+		goto finally;
+	}
 
-		release_tclobj(&res);
+	while (p < end) {
+		p++;	// Skip the "/"
+		Tcl_DStringSetLength(&ds, 0);
+		while (p < end && *p != '/') {
+			if (*p == '~') {
+				if (p+1 < end && p[1] == '0') {
+					Tcl_DStringAppend(&ds, "~", 1);
+				} else if (p+1 < end && p[1] == '1') {
+					Tcl_DStringAppend(&ds, "/", 1);
+				} else {
+					patch_error(interp, "BAD_POINTER", pointer, Tcl_ObjPrintf("Invalid JSON pointer \"%s\": bad escape", str));
+					code = TCL_ERROR;
+					goto finally;
+				}
+				p += 2;
+			} else {
+				const char*	s = p;
+				while (p < end && *p != '/' && *p != '~') p++;
+				Tcl_DStringAppend(&ds, s, p-s);
+			}
+		}
+		TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(interp, tokens, Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds))));
 	}
 
-finally:
-	release_tclobj(&target);
+	replace_tclobj(tokensPtr, tokens);
 
-	return retval;
+finally:
+	Tcl_DStringFree(&ds);
+	release_tclobj(&tokens);
+	return code;
 }
 
 //}}}
-int JSON_Decode(Tcl_Interp* interp, Tcl_Obj* bytes, Tcl_Obj* encoding, Tcl_Obj** decodedstring) //{{{
+static int pointer_array_index(Tcl_Obj* token) //{{{
 {
-	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
-	Tcl_Obj*			ov[4] = {l->apply, l->decode_bytes};
-	int					retval;
-
-	replace_tclobj(&ov[2], bytes);
-	replace_tclobj(&ov[3], encoding);
-	retval = Tcl_EvalObjv(interp, encoding ? 4 : 3, ov, TCL_EVAL_GLOBAL);
-	replace_tclobj(&ov[2], NULL);
-	replace_tclobj(&ov[3], NULL);
-
-	if (retval == TCL_OK) {
-		replace_tclobj(decodedstring, Tcl_GetObjResult(interp));
-		Tcl_ResetResult(interp);
+	// Returns the array index named by token, or -1 if it isn't a valid
+	// (non-negative, no leading zeros) array index
+	int			len, i;
+	const char*	str = Tcl_GetStringFromObj(token, &len);
+	long		index = 0;
+
+	if (len == 0 || len > 9 || (len > 1 && str[0] == '0')) return -1;
+	for (i=0; i<len; i++) {
+		if (str[i] < '0' || str[i] > '9') return -1;
+		index = index*10 + (str[i] - '0');
 	}
 
-	return retval;
+	return index;
 }
 
 //}}}
-int JSON_Foreach(Tcl_Interp* interp, Tcl_Obj* iterators, JSON_ForeachBody* body, enum collecting_mode collect, Tcl_Obj** res, ClientData cdata) //{{{
+static int resolve_pointer(Tcl_Interp* interp, Tcl_Obj* doc, Tcl_Obj* pointer, int for_add, Tcl_Obj** pathPtr, Tcl_Obj** targetPtr, Tcl_Obj** parentPtr, enum json_types* parent_typePtr) //{{{
 {
-#if 1
-	unsigned int			i;
-	int						retcode=TCL_OK;
-	struct foreach_state*	state = NULL;
-	int						objc;
-	Tcl_Obj**				objv = NULL;
-	Tcl_Obj*				it_res = NULL;
-	struct interp_cx*		l = Tcl_GetAssocData(interp, "rl_json", NULL);
-	Tcl_Obj*				loopvars = NULL;
+	// Follow the JSON pointer through doc, translating it into a path list
+	// for JSON_Set / JSON_Unset / JSON_Extract in *pathPtr.  Every token must
+	// name an existing value, except that when for_add is set the last token
+	// may name a new object key or the array position to insert at (which
+	// may be one past the end, or "-").  *targetPtr gets the value named by
+	// the pointer (NULL when adding a new member), *parentPtr its container
+	// and *parent_typePtr the container's type (NULL and JSON_UNDEF for the
+	// root).  The values are borrowed from doc.
+	int				code = TCL_OK;
+	Tcl_Obj*		tokens = NULL;
+	Tcl_Obj*		path = NULL;
+	Tcl_Obj**		tokv = NULL;
+	int				tokc, i;
+	Tcl_Obj*		target = doc;
+	Tcl_Obj*		parent = NULL;
+	enum json_types	parent_type = JSON_UNDEF;
+
+	TEST_OK_LABEL(finally, code, parse_pointer(interp, pointer, &tokens));
+	TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, tokens, &tokc, &tokv));
+	replace_tclobj(&path, Tcl_NewListObj(0, NULL));
+
+	for (i=0; i<tokc; i++) {
+		enum json_types	type;
+		Tcl_Obj*		val = NULL;
+		const int		last = i == tokc-1;
+
+		TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, target, &type, &val));
+		parent = target;
+		parent_type = type;
+
+		switch (type) {
+			case JSON_OBJECT:
+				TEST_OK_LABEL(finally, code, Tcl_DictObjGet(interp, val, tokv[i], &target));
+				if (target == NULL && !(for_add && last)) goto not_found;
+				TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(interp, path, tokv[i]));
+				break;
+
+			case JSON_ARRAY:
+			{
+				int			ac, index;
+				Tcl_Obj**	av = NULL;
+
+				TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, val, &ac, &av));
+				if (for_add && last && strcmp(Tcl_GetString(tokv[i]), "-") == 0) {
+					index = ac;
+				} else {
+					index = pointer_array_index(tokv[i]);
+					if (index < 0) {
+						patch_error(interp, "BAD_POINTER", pointer, Tcl_ObjPrintf("Invalid array index \"%s\" in JSON pointer \"%s\"", Tcl_GetString(tokv[i]), Tcl_GetString(pointer)));
+						code = TCL_ERROR;
+						goto finally;
+					}
+				}
+				if (index > ac || (index == ac && !(for_add && last))) goto not_found;
+				target = index < ac ? av[index] : NULL;
+				TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(interp, path, Tcl_NewIntObj(index)));
+				break;
+			}
+
+			default:
+				goto not_found;
+		}
+	}
+
+	replace_tclobj(pathPtr, path);
+	if (targetPtr)		*targetPtr = target;
+	if (parentPtr)		*parentPtr = parent;
+	if (parent_typePtr)	*parent_typePtr = parent_type;
+
+finally:
+	release_tclobj(&tokens);
+	release_tclobj(&path);
+	return code;
+
+not_found:
+	patch_error(interp, "NOT_FOUND", pointer, Tcl_ObjPrintf("JSON pointer \"%s\" doesn't exist", Tcl_GetString(pointer)));
+	code = TCL_ERROR;
+	goto finally;
+}
+
+//}}}
+static int patch_add(Tcl_Interp* interp, Tcl_Obj* doc, Tcl_Obj* pointer, Tcl_Obj* value) //{{{
+{
+	int				code = TCL_OK;
+	Tcl_Obj*		path = NULL;
+	Tcl_Obj*		parent = NULL;
+	Tcl_Obj*		parentpath = NULL;
+	Tcl_Obj*		newlist = NULL;
+	enum json_types	parent_type;
+
+	TEST_OK_LABEL(finally, code, resolve_pointer(interp, doc, pointer, 1, &path, NULL, &parent, &parent_type));
+
+	if (parent_type != JSON_ARRAY) {
+		// Adding to an object sets the key, replacing any existing value
+		TEST_OK_LABEL(finally, code, JSON_Set(interp, doc, path, value));
+	} else {
+		// Adding to an array inserts before the element at index, which
+		// means rebuilding the array and setting it back at its path
+		int			pathc, ac, index;
+		Tcl_Obj**	pathv = NULL;
+		Tcl_Obj**	av = NULL;
+
+		TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, path, &pathc, &pathv));
+		TEST_OK_LABEL(finally, code, Tcl_GetIntFromObj(interp, pathv[pathc-1], &index));
+		TEST_OK_LABEL(finally, code, JSON_JArrayObjGetElements(interp, parent, &ac, &av));
+
+		replace_tclobj(&newlist, Tcl_NewListObj(index, av));
+		TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(interp, newlist, value));
+		TEST_OK_LABEL(finally, code, Tcl_ListObjReplace(interp, newlist, index+1, 0, ac-index, av+index));
+
+		replace_tclobj(&parentpath, Tcl_NewListObj(pathc-1, pathv));
+		TEST_OK_LABEL(finally, code, JSON_Set(interp, doc, parentpath, JSON_NewJvalObj(JSON_ARRAY, newlist)));
+	}
+
+finally:
+	release_tclobj(&path);
+	release_tclobj(&parentpath);
+	release_tclobj(&newlist);
+	return code;
+}
+
+//}}}
+static int get_op_member(Tcl_Interp* interp, int opnum, Tcl_Obj* opdict, const char* name, int required, Tcl_Obj** jvalPtr, Tcl_Obj** strPtr) //{{{
+{
+	// Fetch the member name from the operation object.  If strPtr is given,
+	// the member must be a JSON string and its value is returned there
+	int				code = TCL_OK;
+	Tcl_Obj*		key = NULL;
+	Tcl_Obj*		member = NULL;
+	enum json_types	type;
+	Tcl_Obj*		val = NULL;
+
+	replace_tclobj(&key, Tcl_NewStringObj(name, -1));
+	TEST_OK_LABEL(finally, code, Tcl_DictObjGet(interp, opdict, key, &member));
+
+	if (member == NULL) {
+		if (!required) goto finally;
+		patch_error(interp, "BAD_OP", NULL, Tcl_ObjPrintf("Patch operation %d is missing the \"%s\" member", opnum, name));
+		code = TCL_ERROR;
+		goto finally;
+	}
+
+	if (strPtr) {
+		TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, member, &type, &val));
+		if (type != JSON_STRING) {
+			patch_error(interp, "BAD_OP", NULL, Tcl_ObjPrintf("Patch operation %d: \"%s\" must be a string, got %s", opnum, name, get_type_name(type)));
+			code = TCL_ERROR;
+			goto finally;
+		}
+		*strPtr = val;
+	}
+	if (jvalPtr) *jvalPtr = member;
+
+finally:
+	release_tclobj(&key);
+	return code;
+}
+
+//}}}
+static int apply_patch_op(Tcl_Interp* interp, Tcl_Obj* doc, int opnum, Tcl_Obj* op) //{{{
+{
+	int				code = TCL_OK;
+	enum json_types	type;
+	Tcl_Obj*		opdict = NULL;
+	Tcl_Obj*		opname = NULL;
+	Tcl_Obj*		pointer = NULL;
+	Tcl_Obj*		from = NULL;
+	Tcl_Obj*		value = NULL;
+	Tcl_Obj*		path = NULL;
+	Tcl_Obj*		target = NULL;
+	Tcl_Obj*		moving = NULL;
+	int				opidx;
+	static const char* ops[] = {
+		"add",
+		"remove",
+		"replace",
+		"move",
+		"copy",
+		"test",
+		(char*)NULL
+	};
+	enum {
+		OP_ADD,
+		OP_REMOVE,
+		OP_REPLACE,
+		OP_MOVE,
+		OP_COPY,
+		OP_TEST
+	};
+
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, op, &type, &opdict));
+	if (type != JSON_OBJECT) {
+		patch_error(interp, "BAD_OP", NULL, Tcl_ObjPrintf("Patch operation %d must be an object, got %s", opnum, get_type_name(type)));
+		code = TCL_ERROR;
+		goto finally;
+	}
+
+	TEST_OK_LABEL(finally, code, get_op_member(interp, opnum, opdict, "op",   1, NULL, &opname));
+	TEST_OK_LABEL(finally, code, get_op_member(interp, opnum, opdict, "path", 1, NULL, &pointer));
+	TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, opname, ops, "op", TCL_EXACT, &opidx));
+
+	switch (opidx) {
+		case OP_ADD:
+			TEST_OK_LABEL(finally, code, get_op_member(interp, opnum, opdict, "value", 1, &value, NULL));
+			TEST_OK_LABEL(finally, code, patch_add(interp, doc, pointer, value));
+			break;
+
+		case OP_REMOVE:
+			TEST_OK_LABEL(finally, code, resolve_pointer(interp, doc, pointer, 0, &path, NULL, NULL, &type));
+			if (type == JSON_UNDEF) {
+				patch_error(interp, "BAD_OP", pointer, Tcl_ObjPrintf("Patch operation %d: cannot remove the root of the document", opnum));
+				code = TCL_ERROR;
+				goto finally;
+			}
+			TEST_OK_LABEL(finally, code, JSON_Unset(interp, doc, path));
+			break;
+
+		case OP_REPLACE:
+			TEST_OK_LABEL(finally, code, get_op_member(interp, opnum, opdict, "value", 1, &value, NULL));
+			TEST_OK_LABEL(finally, code, resolve_pointer(interp, doc, pointer, 0, &path, NULL, NULL, NULL));
+			TEST_OK_LABEL(finally, code, JSON_Set(interp, doc, path, value));
+			break;
+
+		case OP_MOVE:
+		case OP_COPY:
+		{
+			TEST_OK_LABEL(finally, code, get_op_member(interp, opnum, opdict, "from", 1, NULL, &from));
+			TEST_OK_LABEL(finally, code, resolve_pointer(interp, doc, from, 0, &path, &target, NULL, &type));
+			replace_tclobj(&moving, target);
+
+			if (opidx == OP_MOVE) {
+				int			flen, plen;
+				const char*	fstr = Tcl_GetStringFromObj(from, &flen);
+				const char*	pstr = Tcl_GetStringFromObj(pointer, &plen);
+
+				if (flen == plen && memcmp(fstr, pstr, flen) == 0) break;	// Moving to itself is a no-op
+				if (plen > flen && memcmp(fstr, pstr, flen) == 0 && pstr[flen] == '/') {
+					patch_error(interp, "BAD_OP", pointer, Tcl_ObjPrintf("Patch operation %d: cannot move \"%s\" into one of its children", opnum, fstr));
+					code = TCL_ERROR;
+					goto finally;
+				}
+				if (type == JSON_UNDEF) {
+					patch_error(interp, "BAD_OP", from, Tcl_ObjPrintf("Patch operation %d: cannot move the root of the document", opnum));
+					code = TCL_ERROR;
+					goto finally;
+				}
+				TEST_OK_LABEL(finally, code, JSON_Unset(interp, doc, path));
+				Tcl_ResetResult(interp);
+			}
+			TEST_OK_LABEL(finally, code, patch_add(interp, doc, pointer, moving));
+			break;
+		}
+
+		case OP_TEST:
+		{
+			int		equal;
+
+			TEST_OK_LABEL(finally, code, get_op_member(interp, opnum, opdict, "value", 1, &value, NULL));
+			TEST_OK_LABEL(finally, code, resolve_pointer(interp, doc, pointer, 0, &path, &target, NULL, NULL));
+			TEST_OK_LABEL(finally, code, values_equal(interp, target, value, &equal));
+			if (!equal) {
+				patch_error(interp, "TEST_FAILED", pointer, Tcl_ObjPrintf("Patch operation %d: test failed for \"%s\"", opnum, Tcl_GetString(pointer)));
+				code = TCL_ERROR;
+				goto finally;
+			}
+			break;
+		}
+	}
+
+	// JSON_Set and JSON_Unset leave doc in the interp result, which would
+	// make it shared for the next operation
+	Tcl_ResetResult(interp);
+
+finally:
+	release_tclobj(&path);
+	release_tclobj(&moving);
+	return code;
+}
+
+//}}}
+int JSON_Patch(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* patch, Tcl_Obj** res) //{{{
+{
+	// Apply the JSON Patch (RFC 6902) patch to obj, storing the result in
+	// *res.  obj is not modified, and *res is untouched if any operation
+	// fails, so the patch is applied atomically
+	int				code = TCL_OK;
+	enum json_types	type;
+	Tcl_Obj*		val = NULL;
+	Tcl_Obj*		doc = NULL;
+	Tcl_Obj**		opv = NULL;
+	int				opc, i;
+
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, obj, &type, &val));
+	TEST_OK_LABEL(finally, code, JSON_JArrayObjGetElements(interp, patch, &opc, &opv));
+
+	// doc starts off sharing obj's value (but not its string rep, which
+	// would just be invalidated).  Containers along the paths touched by the
+	// operations are unshared as JSON_Set / JSON_Unset descend, everything
+	// else remains shared with obj
+	replace_tclobj(&doc, JSON_NewJvalObj(type, val));
+
+	for (i=0; i<opc; i++) {
+		code = apply_patch_op(interp, doc, i, opv[i]);
+		if (code != TCL_OK) {
+			Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf("\n    (applying JSON patch operation %d)", i));
+			goto finally;
+		}
+	}
+
+	replace_tclobj(res, doc);
+
+finally:
+	release_tclobj(&doc);
+	return code;
+}
+
+//}}}
+static int diff_op(Tcl_Interp* interp, Tcl_Obj* ops, const char* op, Tcl_Obj* pointer, Tcl_Obj* value) //{{{
+{
+	int			code = TCL_OK;
+	Tcl_Obj*	opdict = NULL;
+
+	replace_tclobj(&opdict, Tcl_NewDictObj());
+	TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, opdict, Tcl_NewStringObj("op", 2),   JSON_NewJvalObj(JSON_STRING, Tcl_NewStringObj(op, -1))));
+	TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, opdict, Tcl_NewStringObj("path", 4), JSON_NewJvalObj(JSON_STRING, pointer)));
+	if (value)
+		TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, opdict, Tcl_NewStringObj("value", 5), value));
+	TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(interp, ops, JSON_NewJvalObj(JSON_OBJECT, opdict)));
+
+finally:
+	release_tclobj(&opdict);
+	return code;
+}
+
+//}}}
+static Tcl_Obj* pointer_append(Tcl_Obj* pointer, Tcl_Obj* token) //{{{
+{
+	int					len;
+	const char*			str = Tcl_GetStringFromObj(token, &len);
+	const char*const	end = str + len;
+	const char*			p;
+	Tcl_Obj*			res = Tcl_DuplicateObj(pointer);
+
+	Tcl_AppendToObj(res, "/", 1);
+	for (p=str; p<end; p++) {
+		if (*p == '~' || *p == '/') {
+			Tcl_AppendToObj(res, str, p-str);
+			Tcl_AppendToObj(res, *p == '~' ? "~0" : "~1", 2);
+			str = p+1;
+		}
+	}
+	Tcl_AppendToObj(res, str, end-str);
+
+	return res;
+}
+
+//}}}
+#define DIFF_MAX_CELLS	(1<<20)		// Largest edit distance table (elements of one array times the other) built for an array diff
+
+static int diff_values(Tcl_Interp* interp, Tcl_Obj* a, Tcl_Obj* b, Tcl_Obj* pointer, Tcl_Obj* ops);
+
+static int diff_array_ops(Tcl_Interp* interp, Tcl_Obj** av, int n, Tcl_Obj** bv, int m, int* dist, char* script) //{{{
+{
+	/* Work out the fewest removes, adds and replaces (or nested diffs) that
+	 * turn av into bv, writing them to script as 'm' (equal), 'r' (replace),
+	 * 'd' (remove) and 'a' (add), terminated by a 0.  dist holds
+	 * (n+1)*(m+1) ints, the edit distance of each pair of suffixes.
+	 */
+	int				code = TCL_OK;
+	Tcl_WideUInt*	ah = NULL;
+	Tcl_WideUInt*	bh = NULL;
+	int				i, j;
+	const int		w = m+1;
+
+	#define D(i, j)		dist[(i)*w + (j)]
+	#define EQ(i, j)	(av[i] == bv[j] || ah[i] == bh[j])
+
+	ah = ckalloc(sizeof(Tcl_WideUInt) * (n+m+1));
+	bh = ah + n;
+	for (i=0; i<n; i++) TEST_OK_LABEL(finally, code, json_hash(interp, av[i], &ah[i]));
+	for (j=0; j<m; j++) TEST_OK_LABEL(finally, code, json_hash(interp, bv[j], &bh[j]));
+
+	for (i=n; i>=0; i--) {
+		for (j=m; j>=0; j--) {
+			if (i == n)			D(i, j) = m-j;
+			else if (j == m)	D(i, j) = n-i;
+			else if (EQ(i, j))	D(i, j) = D(i+1, j+1);
+			else {
+				int	best = D(i+1, j+1);
+				if (D(i+1, j) < best) best = D(i+1, j);
+				if (D(i, j+1) < best) best = D(i, j+1);
+				D(i, j) = best + 1;
+			}
+		}
+	}
+
+	// Equal hashes are only taken as a match: the nested diff of the pair
+	// is still generated, so a collision just costs a longer patch
+	for (i=j=0; i<n || j<m; ) {
+		if (i < n && j < m && EQ(i, j) && D(i, j) == D(i+1, j+1)) {
+			*script++ = 'm'; i++; j++;
+		} else if (i < n && D(i, j) == D(i+1, j) + 1) {
+			*script++ = 'd'; i++;
+		} else if (j < m && D(i, j) == D(i, j+1) + 1) {
+			*script++ = 'a'; j++;
+		} else {
+			*script++ = 'r'; i++; j++;
+		}
+	}
+	*script = 0;
+
+	#undef D
+	#undef EQ
+
+finally:
+	if (ah) {
+		ckfree(ah);
+		ah = NULL;
+	}
+	return code;
+}
+
+//}}}
+static int diff_array(Tcl_Interp* interp, Tcl_Obj** av, int ac, Tcl_Obj** bv, int bc, Tcl_Obj* pointer, Tcl_Obj* ops) //{{{
+{
+	/* Append to ops the operations that turn the array av into bv: an edit
+	 * script with the fewest removes, adds and replaces, or, for arrays too
+	 * long to build the table for, their elements paired off in order with
+	 * the excess removed or added.
+	 */
+	int			code = TCL_OK;
+	int			head, tail, n, m, pos, i, j, equal;
+	int*		dist = NULL;
+	char*		script = NULL;
+	const char*	op;
+	Tcl_Obj*	idx = NULL;
+	Tcl_Obj*	childptr = NULL;
+
+	// Trim the common prefix and suffix
+	for (head=0; head<ac && head<bc; head++) {
+		TEST_OK_LABEL(finally, code, values_equal(interp, av[head], bv[head], &equal));
+		if (!equal) break;
+	}
+	for (tail=0; tail<ac-head && tail<bc-head; tail++) {
+		TEST_OK_LABEL(finally, code, values_equal(interp, av[ac-1-tail], bv[bc-1-tail], &equal));
+		if (!equal) break;
+	}
+	n = ac-head-tail;
+	m = bc-head-tail;
+
+	script = ckalloc(n+m+1);
+	if (n > 0 && m > 0 && (Tcl_WideInt)(n+1)*(m+1) <= DIFF_MAX_CELLS) {
+		dist = ckalloc(sizeof(int) * (n+1)*(m+1));
+		TEST_OK_LABEL(finally, code, diff_array_ops(interp, av+head, n, bv+head, m, dist, script));
+	} else {
+		const int	common = n < m ? n : m;
+
+		memset(script, 'r', common);
+		memset(script+common, 'd', n-common);
+		memset(script+n, 'a', m-common);
+		script[n+m-common] = 0;
+	}
+
+	// Follow the script through the array as it is being changed: pos is
+	// where the next operation applies
+	for (op=script, pos=head, i=head, j=head; *op; ) {
+		switch (*op) {
+			case 'd':
+			{
+				// Remove runs from their end, so that the paths name the original elements
+				int	run = 0;
+
+				while (op[run] == 'd') run++;
+				for (int k=run-1; k>=0; k--) {
+					replace_tclobj(&idx, Tcl_NewIntObj(pos+k));
+					replace_tclobj(&childptr, pointer_append(pointer, idx));
+					TEST_OK_LABEL(finally, code, diff_op(interp, ops, "remove", childptr, NULL));
+				}
+				op += run;
+				i += run;
+				break;
+			}
+			case 'a':
+				replace_tclobj(&idx, Tcl_NewIntObj(pos));
+				replace_tclobj(&childptr, pointer_append(pointer, idx));
+				TEST_OK_LABEL(finally, code, diff_op(interp, ops, "add", childptr, bv[j]));
+				op++; j++; pos++;
+				break;
+			default:	// 'm' and 'r'
+				if (av[i] != bv[j]) {
+					replace_tclobj(&idx, Tcl_NewIntObj(pos));
+					replace_tclobj(&childptr, pointer_append(pointer, idx));
+					TEST_OK_LABEL(finally, code, diff_values(interp, av[i], bv[j], childptr, ops));
+				}
+				op++; i++; j++; pos++;
+		}
+	}
+
+finally:
+	if (dist) {
+		ckfree(dist);
+		dist = NULL;
+	}
+	if (script) {
+		ckfree(script);
+		script = NULL;
+	}
+	release_tclobj(&idx);
+	release_tclobj(&childptr);
+	return code;
+}
+
+//}}}
+static int diff_values(Tcl_Interp* interp, Tcl_Obj* a, Tcl_Obj* b, Tcl_Obj* pointer, Tcl_Obj* ops) //{{{
+{
+	int				code = TCL_OK;
+	enum json_types	atype, btype;
+	Tcl_Obj*		aval = NULL;
+	Tcl_Obj*		bval = NULL;
+	Tcl_Obj*		childptr = NULL;
+	int				equal;
+
+	// Identical subtrees (the common case for values derived from one
+	// another) are skipped without looking inside them
+	if (a == b) goto finally;
+
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, a, &atype, &aval));
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, b, &btype, &bval));
+	if (atype == btype && aval == bval) goto finally;
+
+	if (atype != btype) goto replace;
+
+	switch (atype) {
+		case JSON_OBJECT: //{{{
+		{
+			Tcl_DictSearch	search;
+			Tcl_Obj*		k = NULL;
+			Tcl_Obj*		v = NULL;
+			Tcl_Obj*		other = NULL;
+			int				done;
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, aval, &search, &k, &v, &done));
+			for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+				TEST_OK_BREAK(code, Tcl_DictObjGet(interp, bval, k, &other));
+				if (other == v) continue;
+				replace_tclobj(&childptr, pointer_append(pointer, k));
+				if (other == NULL) {
+					TEST_OK_BREAK(code, diff_op(interp, ops, "remove", childptr, NULL));
+				} else {
+					TEST_OK_BREAK(code, diff_values(interp, v, other, childptr, ops));
+				}
+			}
+			Tcl_DictObjDone(&search);
+			if (code != TCL_OK) goto finally;
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, bval, &search, &k, &v, &done));
+			for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+				TEST_OK_BREAK(code, Tcl_DictObjGet(interp, aval, k, &other));
+				if (other == NULL) {
+					replace_tclobj(&childptr, pointer_append(pointer, k));
+					TEST_OK_BREAK(code, diff_op(interp, ops, "add", childptr, v));
+				}
+			}
+			Tcl_DictObjDone(&search);
+			break;
+		}
+		//}}}
+		case JSON_ARRAY: //{{{
+		{
+			int			ac, bc;
+			Tcl_Obj**	av = NULL;
+			Tcl_Obj**	bv = NULL;
+
+			TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, aval, &ac, &av));
+			TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, bval, &bc, &bv));
+			TEST_OK_LABEL(finally, code, diff_array(interp, av, ac, bv, bc, pointer, ops));
+			break;
+		}
+		//}}}
+		default:
+			TEST_OK_LABEL(finally, code, values_equal(interp, a, b, &equal));
+			if (!equal) goto replace;
+	}
+
+finally:
+	release_tclobj(&childptr);
+	return code;
+
+replace:
+	code = diff_op(interp, ops, "replace", pointer, b);
+	goto finally;
+}
+
+//}}}
+int JSON_Diff(Tcl_Interp* interp, Tcl_Obj* from, Tcl_Obj* to, Tcl_Obj** patch) //{{{
+{
+	// Generate a JSON Patch (RFC 6902) that transforms from into to
+	int			code = TCL_OK;
+	Tcl_Obj*	ops = NULL;
+	Tcl_Obj*	root = NULL;
+
+	replace_tclobj(&ops, Tcl_NewListObj(0, NULL));
+	replace_tclobj(&root, Tcl_NewObj());
+
+	TEST_OK_LABEL(finally, code, JSON_ForceJSON(interp, from));
+	TEST_OK_LABEL(finally, code, JSON_ForceJSON(interp, to));
+	TEST_OK_LABEL(finally, code, diff_values(interp, from, to, root, ops));
+
+	replace_tclobj(patch, JSON_NewJvalObj(JSON_ARRAY, ops));
+
+finally:
+	release_tclobj(&ops);
+	release_tclobj(&root);
+	return code;
+}
+
+//}}}
+int JSON_Hash(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_WideInt* hash) //{{{
+{
+	Tcl_WideUInt	h;
+
+	TEST_OK(json_hash(interp, obj, &h));
+	*hash = (Tcl_WideInt)h;
+	return TCL_OK;
+}
+
+//}}}
+int JSON_Equal(Tcl_Interp* interp, Tcl_Obj* a, Tcl_Obj* b, int* equal) //{{{
+{
+	Tcl_WideUInt	ah, bh;
+
+	if (a == b) {
+		*equal = 1;
+		return TCL_OK;
+	}
+
+	// Hashing both sides is no more expensive than comparing them, and the
+	// hashes are memoized, so comparing one value against many others (or
+	// the same values repeatedly) mostly reduces to comparing hashes
+	TEST_OK(json_hash(interp, a, &ah));
+	TEST_OK(json_hash(interp, b, &bh));
+	if (ah != bh) {
+		*equal = 0;
+		return TCL_OK;
+	}
+
+	return values_equal(interp, a, b, equal);
+}
+
+//}}}
+int JSON_Canonical(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** canonical) //{{{
+{
+	// RFC 8785 JSON Canonicalization Scheme: no whitespace, object members
+	// sorted by key, numbers in their shortest ECMAScript form.  The result
+	// is cached on the value, so canonicalizing (and signing or hashing) the
+	// same document again costs nothing until it's modified
+	int							code = TCL_OK;
+	enum json_types				type;
+	Tcl_ObjInternalRep*			ir = NULL;
+	struct json_cache*			cache = NULL;
+	struct serialize_context	scx;
+	Tcl_DString					ds;
+
+	TEST_OK(JSON_GetIntrepFromObj(interp, obj, &type, &ir));
+
+	cache = get_json_cache(ir, 0);
+	if (cache && cache->canonical) {
+		replace_tclobj(canonical, cache->canonical);
+		return TCL_OK;
+	}
+
+	Tcl_DStringInit(&ds);
+	scx.ds = &ds;
+	scx.serialize_mode = SERIALIZE_CANONICAL;
+	scx.fromdict = NULL;
+	scx.l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	scx.allow_null = 1;
+
+	TEST_OK_LABEL(finally, code, serialize(interp, &scx, obj));
+
+	cache = get_json_cache(ir, 1);
+	replace_tclobj(&cache->canonical, Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+	replace_tclobj(canonical, cache->canonical);
+
+finally:
+	Tcl_DStringFree(&ds);
+	return code;
+}
+
+//}}}
+int JSON_Normalize(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** normalized) //{{{
+{
+	int				retval = TCL_OK;
+	Tcl_Obj*		json = NULL;
+	enum json_types	type;
+
+	type = JSON_GetJSONType(obj);
+
+	if (type != JSON_UNDEF && !Tcl_HasStringRep(obj))
+		return TCL_OK;		// Nothing to do - already parsed as json and have no string rep
+
+	if (Tcl_IsShared(obj)) {
+		replace_tclobj(&json, Tcl_DuplicateObj(obj));
+	} else {
+		replace_tclobj(&json, obj);
+	}
+
+	retval = JSON_ForceJSON(interp, json);
+	Tcl_InvalidateStringRep(json);			// Defer string rep generation to our caller
+
+	if (retval == TCL_OK)
+		replace_tclobj(normalized, json);
+
+	release_tclobj(&json);
+
+	return retval;
+}
+
+//}}}
+int JSON_Pretty(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* indent, Tcl_Obj** prettyString) //{{{
+{
+	int					retval = TCL_OK;
+	Tcl_DString			ds;
+	Tcl_Obj*			lindent = NULL;
+	Tcl_Obj*			pad = NULL;
+	Tcl_Obj*			thawed = NULL;
+	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+
+	if (indent == NULL) {
+		replace_tclobj(&lindent, get_string(l, "    ", 4));
+		indent = lindent;
+	}
+
+	// Walk a thawed copy of a packed value, so that it stays packed
+	if (is_packed(obj)) replace_tclobj(&thawed, Tcl_DuplicateObj(obj));
+
+	replace_tclobj(&pad, l->tcl_empty);
+	Tcl_DStringInit(&ds);
+	retval = json_pretty(interp, thawed ? thawed : obj, indent, pad, &ds);
+
+	if (retval == TCL_OK)
+		replace_tclobj(prettyString, Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+
+	Tcl_DStringFree(&ds);
+	release_tclobj(&pad);
+	release_tclobj(&lindent);
+	release_tclobj(&thawed);
+
+	return retval;
+}
+
+//}}}
+int JSON_Template(Tcl_Interp* interp, Tcl_Obj* template, Tcl_Obj* dict, Tcl_Obj** res) //{{{
+{
+	//struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	struct template_program*	program = NULL;
+	int							retcode = TCL_OK;
+	Tcl_Obj*					thawed = NULL;
+
+	// Compile and apply a thawed copy of a packed template, so that it stays packed
+	if (is_packed(template)) {
+		replace_tclobj(&thawed, Tcl_DuplicateObj(template));
+		template = thawed;
+	}
+
+	TEST_OK_LABEL(finally, retcode, get_template_program(interp, template, &program));
+
+	//DBG("template %s refcount before: %d\n", name(template), template->refCount);
+	retcode = apply_template_actions(interp, template, program, dict, res);
+	//DBG("template %s refcount after: %d\n", name(template), template->refCount);
+
+finally:
+	release_template_program(&program);
+	release_tclobj(&thawed);
+	return retcode;
+}
+
+//}}}
+int JSON_IsNULL(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, int* isnull) //{{{
+{
+	int			retval = TCL_OK;
+	Tcl_Obj*	jval = NULL;
+
+	retval = JSON_Extract(interp, obj, path, &jval);
+
+	if (retval == TCL_OK)
+		*isnull = (JSON_NULL == JSON_GetJSONType(jval));
+
+	release_tclobj(&jval);
+
+	return retval;
+}
+
+//}}}
+int JSON_Type(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, enum json_types* type) //{{{
+{
+	int			retval = TCL_OK;
+	Tcl_Obj*	jval = NULL;
+
+	retval = JSON_Extract(interp, obj, path, &jval);
+
+	if (retval == TCL_OK)
+		*type = JSON_GetJSONType(jval);
+
+	release_tclobj(&jval);
+
+	return retval;
+}
+
+//}}}
+int JSON_Length(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, int* length) //{{{
+{
+	enum json_types	type;
+	int				retval = TCL_OK;
+	Tcl_Obj*		val = NULL;
+	Tcl_Obj*		target = NULL;
+
+	TEST_OK_LABEL(finally, retval, JSON_Extract(interp, obj, path, &target));
+
+	if (is_packed(target)) {
+		type = packed_type(target);
+		if (type == JSON_ARRAY || type == JSON_OBJECT || type == JSON_STRING || type_is_dynamic(type)) {
+			*length = packed_length(target);
+			goto finally;
+		}
+	}
+
+	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, target, &type, &val));
+
+	switch (type) {
+		case JSON_ARRAY:  retval = Tcl_ListObjLength(interp, val, length); break;
+		case JSON_OBJECT: retval = Tcl_DictObjSize(interp, val, length);   break;
+
+		case JSON_DYN_STRING:
+		case JSON_DYN_NUMBER:
+		case JSON_DYN_BOOL:
+		case JSON_DYN_JSON:
+		case JSON_DYN_TEMPLATE:
+		case JSON_DYN_LITERAL:   *length = Tcl_GetCharLength(val) + 3; break;	// dynamic types have a 3 character prefix
+		case JSON_STRING:        *length = Tcl_GetCharLength(val);     break;
+
+		default:
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("Named JSON value type isn't supported: %s", get_type_name(type)));
+			retval = TCL_ERROR;
+	}
+
+finally:
+	release_tclobj(&target);
+
+	return retval;
+}
+
+//}}}
+int JSON_Keys(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj* path, Tcl_Obj** keyslist) //{{{
+{
+	enum json_types		type;
+	int					retval = TCL_OK;
+	Tcl_Obj*			val = NULL;
+	Tcl_Obj*			target = NULL;
+
+	TEST_OK_LABEL(finally, retval, JSON_Extract(interp, obj, path, &target));
+
+	if (is_packed(target) && packed_type(target) == JSON_OBJECT) {
+		replace_tclobj(keyslist, packed_keys(interp, target));
+		goto finally;
+	}
+
+	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, target, &type, &val));
+
+	if (type != JSON_OBJECT) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Named JSON value type isn't supported: %s", get_type_name(type)));
+		retval = TCL_ERROR;
+	} else {
+		Tcl_Obj*		res = NULL;
+		Tcl_Obj*		k = NULL;
+		Tcl_Obj*		v = NULL;
+		Tcl_DictSearch	search;
+		int				done;
+
+		replace_tclobj(&res, Tcl_NewListObj(0, NULL));
+
+		TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+		for (; !done; Tcl_DictObjNext(&search, &k, &v, &done))
+			TEST_OK_BREAK(retval, Tcl_ListObjAppendElement(interp, res, k));
+		Tcl_DictObjDone(&search);
+
+		if (retval == TCL_OK)
+			replace_tclobj(keyslist, res);
+
+		release_tclobj(&res);
+	}
+
+finally:
+	release_tclobj(&target);
+
+	return retval;
+}
+
+//}}}
+enum decode_encoding {
+	DECODE_AUTO,
+	DECODE_UTF8,
+	DECODE_UTF16LE,
+	DECODE_UTF16BE,
+	DECODE_UTF32LE,
+	DECODE_UTF32BE
+};
+
+static const char* decode_encoding_names[] = {
+	"auto",
+	"utf-8",
+	"utf-16le",
+	"utf-16be",
+	"utf-32le",
+	"utf-32be",
+	NULL
+};
+
+static enum decode_encoding detect_encoding(const uint8_t* b, size_t len) //{{{
+{
+	// BOM, then the pattern of nulls in the first 4 bytes (RFC 4627
+	// section 3: the first two characters of a JSON text are ASCII)
+	if (len >= 4 && b[0] == 0x00 && b[1] == 0x00 && b[2] == 0xFE && b[3] == 0xFF) return DECODE_UTF32BE;
+	if (len >= 4 && b[0] == 0xFF && b[1] == 0xFE && b[2] == 0x00 && b[3] == 0x00) return DECODE_UTF32LE;
+	if (len >= 2 && b[0] == 0xFE && b[1] == 0xFF) return DECODE_UTF16BE;
+	if (len >= 2 && b[0] == 0xFF && b[1] == 0xFE) return DECODE_UTF16LE;
+
+	if (len >= 4) {
+		if (b[0] == 0 && b[1] == 0 && b[2] == 0 && b[3] != 0) return DECODE_UTF32BE;
+		if (b[0] != 0 && b[1] == 0 && b[2] == 0 && b[3] == 0) return DECODE_UTF32LE;
+		if (b[0] == 0 && b[1] != 0 && b[2] == 0 && b[3] != 0) return DECODE_UTF16BE;
+		if (b[0] != 0 && b[1] == 0 && b[2] != 0 && b[3] == 0) return DECODE_UTF16LE;
+	} else if (len >= 2) {
+		if (b[0] == 0 && b[1] != 0) return DECODE_UTF16BE;
+		if (b[0] != 0 && b[1] == 0) return DECODE_UTF16LE;
+	}
+
+	return DECODE_UTF8;		// Including the UTF-8 BOM
+}
+
+//}}}
+static int utf8_is_tcl_utf(const uint8_t* p, size_t len) //{{{
+{
+	// True if p is valid UTF-8 that Tcl can use as a string rep without
+	// conversion: no nulls (which Tcl encodes as C0 80), no surrogates or
+	// overlong forms, and (unless Tcl stores them directly) no characters
+	// beyond the BMP.  Runs of ASCII are checked 8 bytes at a time
+	const uint8_t*	e = p + len;
+	uint64_t		w;
+
+	while (p < e) {
+		while (e - p >= 8) {
+			memcpy(&w, p, 8);
+			if ((w & 0x8080808080808080ULL) || ((w - 0x0101010101010101ULL) & ~w & 0x8080808080808080ULL))
+				break;		// Non-ASCII or a null in this word
+			p += 8;
+		}
+		if (p >= e) break;
+
+		if (*p < 0x80) {
+			if (*p == 0) return 0;
+			p++;
+		} else if (*p < 0xC2) {
+			return 0;		// Continuation byte, or overlong 2 byte form (including C0 80)
+		} else if (*p < 0xE0) {
+			if (e - p < 2 || (p[1] & 0xC0) != 0x80) return 0;
+			p += 2;
+		} else if (*p < 0xF0) {
+			if (e - p < 3 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80) return 0;
+			if (p[0] == 0xE0 && p[1] < 0xA0) return 0;		// Overlong
+			if (p[0] == 0xED && p[1] >= 0xA0) return 0;		// Surrogate
+			p += 3;
+#if TCL_UTF_MAX > 3
+		} else if (*p < 0xF5) {
+			if (e - p < 4 || (p[1] & 0xC0) != 0x80 || (p[2] & 0xC0) != 0x80 || (p[3] & 0xC0) != 0x80) return 0;
+			if (p[0] == 0xF0 && p[1] < 0x90) return 0;		// Overlong
+			if (p[0] == 0xF4 && p[1] >= 0x90) return 0;		// > U+10FFFF
+			p += 4;
+#endif
+		} else {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+//}}}
+static inline char* put_utf(char* o, uint32_t c) //{{{
+{
+	// Append the code point c as Tcl's internal UTF-8 (nulls as C0 80)
+	if (c == 0) {
+		*o++ = (char)0xC0;
+		*o++ = (char)0x80;
+	} else if (c < 0x80) {
+		*o++ = (char)c;
+	} else if (c < 0x800) {
+		*o++ = (char)(0xC0 | (c >> 6));
+		*o++ = (char)(0x80 | (c & 0x3F));
+	} else if (c < 0x10000) {
+		*o++ = (char)(0xE0 | (c >> 12));
+		*o++ = (char)(0x80 | ((c >> 6) & 0x3F));
+		*o++ = (char)(0x80 | (c & 0x3F));
+	} else if (c < 0x110000) {
+#if TCL_UTF_MAX > 3
+		*o++ = (char)(0xF0 | (c >> 18));
+		*o++ = (char)(0x80 | ((c >> 12) & 0x3F));
+		*o++ = (char)(0x80 | ((c >> 6) & 0x3F));
+		*o++ = (char)(0x80 | (c & 0x3F));
+#else
+		// Stored as a surrogate pair, as Tcl's utf-8 encoding does
+		o = put_utf(o, 0xD800 | ((c - 0x10000) >> 10));
+		o = put_utf(o, 0xDC00 | ((c - 0x10000) & 0x3FF));
+#endif
+	} else {
+		o = put_utf(o, 0xFFFD);
+	}
+
+	return o;
+}
+
+//}}}
+static Tcl_Obj* decode_utf16(const uint8_t* p, size_t len, int bigendian) //{{{
+{
+	// Worst case is 3 bytes of output per code unit
+	const uint8_t*	e = p + (len & ~(size_t)1);		// A trailing odd byte is ignored
+	Tcl_Obj*		res = Tcl_NewObj();
+	char*			o;
+	uint64_t		w;
+	uint32_t		u, u2;
+
+	Tcl_SetObjLength(res, (int)(len/2*3));
+	o = Tcl_GetString(res);
+
+	while (p < e) {
+		// Runs of ASCII, 4 code units at a time
+		while (e - p >= 8) {
+			memcpy(&w, p, 8);
+			w = bigendian ? be64toh(w) : le64toh(w);
+			if ((w & 0xFF80FF80FF80FF80ULL) || ((w - 0x0001000100010001ULL) & ~w & 0x8000800080008000ULL))
+				break;		// Non-ASCII or a null in this word
+			if (bigendian) {
+				o[0] = (char)(w >> 48); o[1] = (char)(w >> 32); o[2] = (char)(w >> 16); o[3] = (char)w;
+			} else {
+				o[0] = (char)w; o[1] = (char)(w >> 16); o[2] = (char)(w >> 32); o[3] = (char)(w >> 48);
+			}
+			o += 4;
+			p += 8;
+		}
+		if (p >= e) break;
+
+		u = bigendian ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+		p += 2;
+		if ((u & 0xFC00) == 0xD800) {
+			if (e - p >= 2) {
+				u2 = bigendian ? (p[0] << 8 | p[1]) : (p[1] << 8 | p[0]);
+				if ((u2 & 0xFC00) == 0xDC00) {
+					p += 2;
+					o = put_utf(o, 0x10000 + ((u & 0x3FF) << 10 | (u2 & 0x3FF)));
+					continue;
+				}
+			}
+			u = 0xFFFD;		// Unpaired high surrogate
+		} else if ((u & 0xFC00) == 0xDC00) {
+			u = 0xFFFD;		// Unpaired low surrogate
+		}
+		o = put_utf(o, u);
+	}
+
+	Tcl_SetObjLength(res, (int)(o - res->bytes));
+	return res;
+}
+
+//}}}
+static Tcl_Obj* decode_utf32(const uint8_t* p, size_t len, int bigendian) //{{{
+{
+	// Worst case is 6 bytes of output (a surrogate pair) per code point
+	const uint8_t*	e = p + (len & ~(size_t)3);		// A trailing partial code point is ignored
+	Tcl_Obj*		res = Tcl_NewObj();
+	char*			o;
+	uint32_t		c;
+
+	Tcl_SetObjLength(res, (int)(len/4*6));
+	o = Tcl_GetString(res);
+
+	for (; p < e; p += 4) {
+		c = bigendian ?
+			((uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]) :
+			((uint32_t)p[3] << 24 | p[2] << 16 | p[1] << 8 | p[0]);
+		if ((c & 0xFFFFF800) == 0xD800) c = 0xFFFD;		// Surrogates aren't characters
+		o = put_utf(o, c);
+	}
+
+	Tcl_SetObjLength(res, (int)(o - res->bytes));
+	return res;
+}
+
+//}}}
+int utf8_to_tclobj(Tcl_Interp* interp, const uint8_t* b, size_t len, Tcl_Obj** out) //{{{
+{
+	if (likely(utf8_is_tcl_utf(b, len))) {
+		// Already in the form Tcl uses internally, no conversion needed
+		replace_tclobj(out, Tcl_NewStringObj((const char*)b, (int)len));
+	} else {
+		// Invalid sequences, nulls or characters Tcl stores
+		// differently: let Tcl's utf-8 encoding deal with them
+		Tcl_Encoding	utf8 = Tcl_GetEncoding(interp, "utf-8");
+		Tcl_DString		ds;
+
+		if (utf8 == NULL) return TCL_ERROR;
+		Tcl_ExternalToUtfDString(utf8, (const char*)b, (int)len, &ds);
+		replace_tclobj(out, Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+		Tcl_DStringFree(&ds);
+		Tcl_FreeEncoding(utf8);
+	}
+
+	return TCL_OK;
+}
+
+//}}}
+int JSON_Decode(Tcl_Interp* interp, Tcl_Obj* bytes, Tcl_Obj* encoding, Tcl_Obj** decodedstring) //{{{
+{
+	const uint8_t*			b;
+	size_t					len;
+	int						idx = DECODE_AUTO;
+	enum decode_encoding	enc;
+	const char*				encname;
+
+	if (encoding) {
+		encname = Tcl_GetString(encoding);
+		for (idx=0; decode_encoding_names[idx]; idx++)
+			if (strcmp(encname, decode_encoding_names[idx]) == 0) break;
+
+		if (decode_encoding_names[idx] == NULL) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unsupported encoding \"%s\"", Tcl_GetString(encoding)));
+			Tcl_SetErrorCode(interp, "RL", "JSON", "DECODE", "ENCODING", NULL);
+			return TCL_ERROR;
+		}
+	}
+
+	b = Tcl_GetBytesFromObj(interp, bytes, &len);
+	if (b == NULL) return TCL_ERROR;
+
+	enc = idx == DECODE_AUTO ? detect_encoding(b, len) : idx;
+
+	switch (enc) {
+		case DECODE_UTF16LE: replace_tclobj(decodedstring, decode_utf16(b, len, 0)); break;
+		case DECODE_UTF16BE: replace_tclobj(decodedstring, decode_utf16(b, len, 1)); break;
+		case DECODE_UTF32LE: replace_tclobj(decodedstring, decode_utf32(b, len, 0)); break;
+		case DECODE_UTF32BE: replace_tclobj(decodedstring, decode_utf32(b, len, 1)); break;
+
+		case DECODE_AUTO:
+		case DECODE_UTF8:
+			TEST_OK(utf8_to_tclobj(interp, b, len, decodedstring));
+			break;
+	}
+
+	return TCL_OK;
+}
+
+//}}}
+int JSON_Foreach(Tcl_Interp* interp, Tcl_Obj* iterators, JSON_ForeachBody* body, enum collecting_mode collect, Tcl_Obj** res, ClientData cdata) //{{{
+{
+#if 1
+	unsigned int			i;
+	int						retcode=TCL_OK;
+	struct foreach_state*	state = NULL;
+	int						objc;
+	Tcl_Obj**				objv = NULL;
+	Tcl_Obj*				it_res = NULL;
+	struct interp_cx*		l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	Tcl_Obj*				loopvars = NULL;
 
 	TEST_OK(Tcl_ListObjGetElements(interp, iterators, &objc, &objv));
 
@@ -1391,6 +2865,12 @@ int JSON_Valid(Tcl_Interp* interp, Tcl_Obj* json, int* valid, enum extensions ex
 	if (interp)
 		l = Tcl_GetAssocData(interp, "rl_json", NULL);
 
+	if (is_packed(json)) {
+		// Checked when it was packed or mapped, and its string rep would be a full copy of it
+		*valid = 1;
+		return TCL_OK;
+	}
+
 #if 1
 	// Snoop on the intrep for clues on optimized conversions {{{
 	{
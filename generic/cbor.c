@@ -7,11 +7,6 @@ enum svalue_types {
 	S_UNDEF = 23
 };
 
-enum indexmode {
-	IDX_ABS,
-	IDX_ENDREL
-};
-
 #define CBOR_TRUNCATED(l, c) \
 	do { \
 		Tcl_SetErrorCode(interp, "CBOR", "TRUNCATED", NULL); \
@@ -37,11 +32,12 @@ enum indexmode {
 	} while(0);
 
 
-#define CIRCULAR_STATIC_SLOTS	20
-static const uint8_t*	g_circular_buf[CIRCULAR_STATIC_SLOTS*sizeof(uint8_t*)];
+#define MT_BREAK	((uint8_t)-1)	// Major type reported by well_formed() for the break stop code
+
+#define CIRCULAR_STATIC_SLOTS	20		// end-N lookups on indefinite length arrays up to this N don't allocate
 static int cbor_matches(Tcl_Interp* interp, const uint8_t** pPtr, const uint8_t* e, Tcl_Obj* pathElem, int* matchesPtr);
 
-static float decode_float(const uint8_t* p) { //{{{
+float decode_float(const uint8_t* p) { //{{{
 	float		val;
 	uint32_t	uval = be32toh(*(uint32_t*)p);
 	memcpy(&val, &uval, sizeof(float));
@@ -49,7 +45,7 @@ static float decode_float(const uint8_t* p) { //{{{
 }
 
 //}}}
-static double decode_double(const uint8_t* p) { //{{{
+double decode_double(const uint8_t* p) { //{{{
 	double		val;
 	uint64_t	uval = be64toh(*(uint64_t*)p);
 	memcpy(&val, &uval, sizeof(double));
@@ -76,12 +72,12 @@ static double decode_half(const uint8_t* halfp) { //{{{
 }
 
 //}}}
-static int take(Tcl_Interp* interp, const uint8_t** pPtr, const uint8_t* end, int len, const uint8_t** partPtr) //{{{
+static int take(Tcl_Interp* interp, const uint8_t** pPtr, const uint8_t* end, uint64_t len, const uint8_t** partPtr) //{{{
 {
 	int				code = TCL_OK;
 	const uint8_t*	p = *pPtr;
 
-	if (p + len > end) CBOR_TRUNCATED(finally, code);
+	if (len > end - p) CBOR_TRUNCATED(finally, code);
 
 	*partPtr = p;
 	*pPtr = p + len;
@@ -139,7 +135,7 @@ static int well_formed_indefinite(Tcl_Interp* interp, const uint8_t** pPtr, cons
 		case 3:
 			for (;;) {
 				TEST_OK_LABEL(finally, code, well_formed(interp, pPtr, e, 1, &it));
-				if (it == -1) break;
+				if (it == MT_BREAK) break;
 				// need definite-length chunk of the same type
 				if (it != mt) CBOR_INVALID(finally, code, "indefinite-length chunk type: %d doesn't match parent: %d", it, mt);
 			}
@@ -148,21 +144,21 @@ static int well_formed_indefinite(Tcl_Interp* interp, const uint8_t** pPtr, cons
 		case 4:
 			for (;;) {
 				TEST_OK_LABEL(finally, code, well_formed(interp, pPtr, e, 1, &it));
-				if (it == -1) break;
+				if (it == MT_BREAK) break;
 			}
 			break;
 
 		case 5:
 			for (;;) {
 				TEST_OK_LABEL(finally, code, well_formed(interp, pPtr, e, 1, &it));
-				if (it == -1) break;
+				if (it == MT_BREAK) break;
+				TEST_OK_LABEL(finally, code, well_formed(interp, pPtr, e, 0, &it));
 			}
-			TEST_OK_LABEL(finally, code, well_formed(interp, pPtr, e, 0, &it));
 			break;
 
 		case 7:
 			if (breakable) {
-				if (mtPtr) *mtPtr = -1;	// signal break out
+				if (mtPtr) *mtPtr = MT_BREAK;	// signal break out
 				goto finally;
 			}
 			CBOR_INVALID(finally, code, "break outside indefinite-length data item");
@@ -179,7 +175,7 @@ finally:
 //}}}
 // From RFC8948 }}}
 
-static int parse_index(Tcl_Interp* interp, Tcl_Obj* obj, enum indexmode* mode, ssize_t* ofs) //{{{
+int parse_index(Tcl_Interp* interp, Tcl_Obj* obj, enum indexmode* mode, ssize_t* ofs) //{{{
 {
 	int				code = TCL_OK;
 	const char*		str = Tcl_GetString(obj);
@@ -208,75 +204,7 @@ finally:
 }
 
 //}}}
-static int utf8_codepoint(Tcl_Interp* interp, const uint8_t** p, const uint8_t* e, uint32_t* codepointPtr) //{{{
-{
-	int				code = TCL_OK;
-	const uint8_t*	c = *p;
-	uint32_t		codepoint = 0;
-	uint32_t		composed = 0;
-
-part:
-	if ((*c & 0x80) == 0) {
-		if (c >= e) CBOR_TRUNCATED(finally, code);
-		codepoint = *c++;
-	} else if ((*c & 0xE0) == 0xC0) { // Two byte encoding
-		if (c+1 >= e) CBOR_TRUNCATED(finally, code);
-		codepoint  = (*c++ & 0x1F) << 6;
-		codepoint |= (*c++ & 0x3F);
-	} else if ((*c & 0xF0) == 0xE0) { // Three byte encoding
-		if (c+2 >= e) CBOR_TRUNCATED(finally, code);
-		codepoint  = (*c++ & 0x0F) << 12;
-		codepoint |= (*c++ & 0x3F) << 6;
-		codepoint |= (*c++ & 0x3F);
-	} else if ((*c & 0xF8) == 0xF0) { // Four byte encoding
-		if (c+3 >= e) CBOR_TRUNCATED(finally, code);
-		codepoint  = (*c++ & 0x07) << 18;
-		codepoint |= (*c++ & 0x3F) << 12;
-		codepoint |= (*c++ & 0x3F) << 6;
-		codepoint |= (*c++ & 0x3F);
-	} else if ((*c & 0xFC) == 0xF8) { // Five byte encoding
-		if (c+4 >= e) CBOR_TRUNCATED(finally, code);
-		codepoint  = (*c++ & 0x03) << 24;
-		codepoint |= (*c++ & 0x3F) << 18;
-		codepoint |= (*c++ & 0x3F) << 12;
-		codepoint |= (*c++ & 0x3F) << 6;
-		codepoint |= (*c++ & 0x3F);
-	} else if ((*c & 0xFE) == 0xFC) { // Six byte encoding
-		if (c+5 >= e) CBOR_TRUNCATED(finally, code);
-		codepoint  = (*c++ & 0x01) << 30;
-		codepoint |= (*c++ & 0x3F) << 24;
-		codepoint |= (*c++ & 0x3F) << 18;
-		codepoint |= (*c++ & 0x3F) << 12;
-		codepoint |= (*c++ & 0x3F) << 6;
-		codepoint |= (*c++ & 0x3F);
-	} else {	// Invalid encoding
-		CBOR_INVALID(finally, code, "Invalid UTF-8 encoding");
-	}
-
-	if (composed) {
-		if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) { // Low surrogate
-			codepoint = composed + (codepoint - 0xDC00);
-		} else {
-			CBOR_INVALID(finally, code, "UTF-8 low surrogate missing");
-		}
-	} else {
-		if (codepoint >= 0xD800 && codepoint <= 0xDBFF) { // High surrogate
-			composed = 0x10000 + ((codepoint - 0xD800) << 16);
-			goto part;
-		} else if (codepoint >= 0xDC00 && codepoint <= 0xDFFF) { // Orphan low surrogate
-			CBOR_INVALID(finally, code, "UTF-8 orphan low surrogate");
-		}
-	}
-
-	*p = c;
-	*codepointPtr = codepoint;
-
-finally:
-	return code;
-}
-
-//}}}
-static Tcl_Obj* new_tcl_uint64(uint64_t val) //<<<
+Tcl_Obj* new_tcl_uint64(uint64_t val) //<<<
 {
 	Tcl_Obj*	res = NULL;
 
@@ -301,41 +229,141 @@ static Tcl_Obj* new_tcl_uint64(uint64_t val) //<<<
 }
 
 //}}}
-static Tcl_Obj* new_tcl_nint64(uint64_t val) //<<<
+Tcl_Obj* new_tcl_nint64(uint64_t val) //<<<
 {
 	Tcl_Obj*	res = NULL;
 
 	if (val < INT64_MIN) {
 		res = Tcl_NewWideIntObj(-1-val);
 	} else {
-		int		rc;
 		mp_int	n = {0};
-		mp_int	minusone = {0};
-		const int	digits = (sizeof(uint64_t)*CHAR_BIT + MP_DIGIT_BIT-1) / (MP_DIGIT_BIT);	// Need at least 64 bits to represent val
 
-		//if ((rc = mp_init_size(&n, digits)) != MP_OKAY) Tcl_Panic("mp_init_size failed: %s", mp_error_to_string(rc));
-		//if ((rc = mp_init(&minusone)) != MP_OKAY) Tcl_Panic("mp_init failed: %s", mp_error_to_string(rc));
-		if ((rc = mp_init_size(&n, digits)) != MP_OKAY) Tcl_Panic("mp_init_size failed");
-		if ((rc = mp_init(&minusone)) != MP_OKAY) Tcl_Panic("mp_init failed");
+		// Value is -1-val, which doesn't fit in a Tcl_WideInt.  Build the magnitude val+1 a byte at a time
+		if (mp_init(&n) != MP_OKAY) Tcl_Panic("mp_init failed");
+		for (int shift=56; shift >= 0; shift -= 8) {
+			if (mp_mul_2d(&n, 8, &n) != MP_OKAY || mp_add_d(&n, (val >> shift) & 0xff, &n) != MP_OKAY)
+				Tcl_Panic("bignum arithmetic failed");
+		}
+		if (mp_add_d(&n, 1, &n) != MP_OKAY || mp_neg(&n, &n) != MP_OKAY)
+			Tcl_Panic("bignum arithmetic failed");
 
-		n.sign = MP_NEG;
-		n.used = digits;
-		for (int i=0; i<digits; i++) n.dp[i] = (val >> (i*MP_DIGIT_BIT)) & MP_MASK;
+		res = Tcl_NewBignumObj(&n);
+	}
+
+	return res;
+}
+
+//}}}
+// Lazy values {{{
+/* cbor get -lazy returns arrays and maps as references to their bytes in
+ * the original CBOR value.  Their value is those bytes, as cbor extract
+ * would return them: the string rep is that of the equivalent byte array,
+ * so that a value that loses its intrep (used as a list, passed through a
+ * string) comes back as the same bytes.  The commands taking CBOR bytes
+ * (cbor get, extract, tojson ...) walk the bytes of one of these in place.
+ */
+struct cbor_lazy {
+	Tcl_Obj*	bytes;		// The byte array the item is in, referenced so that it can't be changed or freed
+	size_t		ofs;		// The item's place in bytes, including any tags
+	size_t		len;
+};
 
-		mp_set(&minusone, -1);
+static void free_internal_rep_cbor_lazy(Tcl_Obj* obj);
+static void dup_internal_rep_cbor_lazy(Tcl_Obj* src, Tcl_Obj* dest);
+static void update_string_rep_cbor_lazy(Tcl_Obj* obj);
 
-		//if ((rc = mp_add(&n, &minusone, &n)) != MP_OKAY) Tcl_Panic("mp_add failed: %s", mp_error_to_string(rc));
-		if ((rc = mp_add(&n, &minusone, &n)) != MP_OKAY) Tcl_Panic("mp_add failed");
+static Tcl_ObjType cbor_lazy_type = {
+	"CBOR",
+	free_internal_rep_cbor_lazy,
+	dup_internal_rep_cbor_lazy,
+	update_string_rep_cbor_lazy,
+	NULL		// Only created from CBOR bytes
+};
 
-		res = Tcl_NewBignumObj(&n);
-		mp_clear(&n);
-		mp_clear(&minusone);
+static void free_internal_rep_cbor_lazy(Tcl_Obj* obj) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &cbor_lazy_type);
+	struct cbor_lazy*	lazy = ir->twoPtrValue.ptr1;
+
+	replace_tclobj(&lazy->bytes, NULL);
+	ckfree(lazy);
+}
+
+//}}}
+static void dup_internal_rep_cbor_lazy(Tcl_Obj* src, Tcl_Obj* dest) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(src, &cbor_lazy_type);
+	struct cbor_lazy*	lazy = ir->twoPtrValue.ptr1;
+	struct cbor_lazy*	dup = ckalloc(sizeof *dup);
+
+	*dup = (struct cbor_lazy){.ofs = lazy->ofs, .len = lazy->len};
+	replace_tclobj(&dup->bytes, lazy->bytes);
+	Tcl_StoreInternalRep(dest, &cbor_lazy_type, &(Tcl_ObjInternalRep){.twoPtrValue.ptr1 = dup});
+}
+
+//}}}
+static void update_string_rep_cbor_lazy(Tcl_Obj* obj) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &cbor_lazy_type);
+	struct cbor_lazy*	lazy = ir->twoPtrValue.ptr1;
+	const uint8_t*		p = Tcl_GetByteArrayFromObj(lazy->bytes, NULL) + lazy->ofs;
+	size_t				len = lazy->len;
+	char*				out;
+
+	// As a byte array's: each byte is the character with that code, U+0000 and U+0080 up taking two bytes
+	for (size_t i=0; i<lazy->len; i++)
+		if (p[i] == 0 || p[i] >= 0x80) len++;
+
+	out = obj->bytes = ckalloc(len+1);
+	for (size_t i=0; i<lazy->len; i++) {
+		if (p[i] == 0 || p[i] >= 0x80) {
+			*out++ = 0xC0 | p[i] >> 6;
+			*out++ = 0x80 | (p[i] & 0x3F);
+		} else {
+			*out++ = p[i];
+		}
 	}
+	*out = 0;
+	obj->length = len;
+}
+
+//}}}
+static Tcl_Obj* new_cbor_lazy(Tcl_Obj* bytes, size_t ofs, size_t len) //{{{
+{
+	Tcl_Obj*			res = Tcl_NewObj();
+	struct cbor_lazy*	lazy = ckalloc(sizeof *lazy);
+
+	*lazy = (struct cbor_lazy){.ofs = ofs, .len = len};
+	replace_tclobj(&lazy->bytes, bytes);
+	Tcl_InvalidateStringRep(res);
+	Tcl_StoreInternalRep(res, &cbor_lazy_type, &(Tcl_ObjInternalRep){.twoPtrValue.ptr1 = lazy});
 
 	return res;
 }
 
 //}}}
+static const uint8_t* cbor_get_bytes(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** srcPtr, size_t* lenPtr) //{{{
+{
+	/* Return the CBOR bytes of obj: its byte array, or for a lazy value its
+	 * range of the byte array it refers to.  *srcPtr is set to the byte array.
+	 * Returns NULL (with an error in interp) if obj isn't bytes.
+	 */
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &cbor_lazy_type);
+
+	if (ir) {
+		struct cbor_lazy*	lazy = ir->twoPtrValue.ptr1;
+
+		if (srcPtr) *srcPtr = lazy->bytes;
+		*lenPtr = lazy->len;
+		return Tcl_GetByteArrayFromObj(lazy->bytes, NULL) + lazy->ofs;
+	}
+
+	if (srcPtr) *srcPtr = obj;
+	return Tcl_GetBytesFromObj(interp, obj, lenPtr);
+}
+
+//}}}
+// Lazy values }}}
 static int cbor_get_obj(Tcl_Interp* interp, const uint8_t** pPtr, const uint8_t* e, Tcl_Obj** resPtr, Tcl_Obj** tagsPtr) //{{{
 {
 	int					code = TCL_OK;
@@ -511,28 +539,188 @@ finally:
 }
 
 //}}}
-static int cbor_match_map(Tcl_Interp* interp, uint8_t ai, uint64_t val, const uint8_t** pPtr, const uint8_t* e, Tcl_Obj* pathElem, int* matchesPtr) //{{{
+// Path element keys {{{
+/* Path elements are compared against every key of every map walked, on
+ * every lookup.  Their standard UTF-8 form (and integer value, if they have
+ * one) is cached on them so that text and integer keys can be compared
+ * without decoding either side.  Integers also keep their magnitude as
+ * bytes, to compare against the CBOR integers and bignums (tags 2 and 3)
+ * outside the range of Tcl_WideInt.
+ */
+struct cbor_key_rep {
+	int			is_int;		// ival holds the path element's value as an integer
+	Tcl_WideInt	ival;
+	int			is_integer;	// The path element is an integer, maybe too large for ival ...
+	int			negative;
+	uint64_t	mag64;		// ... the magnitude when it fits in 64 bits ...
+	size_t		maglen;		// ... with this many bytes of magnitude following utf8
+	size_t		len;
+	uint8_t		utf8[];		// The string rep as standard UTF-8 - Tcl's differs for U+0000 and characters outside the BMP
+};
+
+static void free_internal_rep_cbor_key(Tcl_Obj* obj);
+static void dup_internal_rep_cbor_key(Tcl_Obj* src, Tcl_Obj* dest);
+
+static Tcl_ObjType cbor_key_type = {
+	"CBOR_key",
+	free_internal_rep_cbor_key,
+	dup_internal_rep_cbor_key,
+	NULL,		// Only set on values that have a string rep
+	NULL
+};
+
+static const Tcl_ObjType*	g_list_type = NULL;
+static const Tcl_ObjType*	g_dict_type = NULL;
+static const Tcl_ObjType*	g_bytearray_type = NULL;
+
+static void free_internal_rep_cbor_key(Tcl_Obj* obj) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &cbor_key_type);
+
+	if (ir) ckfree(ir->twoPtrValue.ptr1);
+}
+
+//}}}
+static void dup_internal_rep_cbor_key(Tcl_Obj* src, Tcl_Obj* dest) //{{{
+{
+	Tcl_ObjInternalRep*			ir = Tcl_FetchInternalRep(src, &cbor_key_type);
+	const struct cbor_key_rep*	rep = ir->twoPtrValue.ptr1;
+	const size_t				size = sizeof *rep + rep->len + rep->maglen;
+	struct cbor_key_rep*		dup = ckalloc(size);
+
+	memcpy(dup, rep, size);
+	Tcl_StoreInternalRep(dest, &cbor_key_type, &(Tcl_ObjInternalRep){.twoPtrValue.ptr1 = dup});
+}
+
+//}}}
+void get_cbor_key(Tcl_Obj* obj, Tcl_DString* scratch, struct cbor_key* key) //{{{
+{
+	/* Fill key with the forms of obj that map keys are compared against,
+	 * caching them on obj.  Lists, dicts and byte arrays aren't disturbed
+	 * (they're compared against array and map keys and byte strings in their
+	 * own forms), theirs are built in scratch instead.
+	 */
+	Tcl_ObjInternalRep*		ir = Tcl_FetchInternalRep(obj, &cbor_key_type);
+	struct cbor_key_rep*	rep;
+
+	if (ir == NULL) {
+		Tcl_WideInt		ival = 0;
+		int				is_int = 0;
+		int				is_integer = 0;
+		int				negative = 0;
+		uint64_t		mag64 = 0;
+		mp_int			n = {0};
+		const int		cache = obj->typePtr == NULL || (
+				obj->typePtr != g_list_type &&
+				obj->typePtr != g_dict_type &&
+				obj->typePtr != g_bytearray_type
+		);
+		Tcl_DString		ds;
+		Tcl_DString		magds;
+		size_t			len;
+
+		Tcl_DStringInit(&ds);
+		Tcl_DStringInit(&magds);
+
+		/* Tcl_GetWideIntFromObj wraps integers up to 64 bits in magnitude
+		 * into the range of Tcl_WideInt, so take them as bignums to tell
+		 * 2**64-1 from -1
+		 */
+		if (TCL_OK == Tcl_GetBignumFromObj(NULL, obj, &n)) {
+			negative = n.sign == MP_NEG;
+			if (!negative || (mp_neg(&n, &n) == MP_OKAY && mp_sub_d(&n, 1, &n) == MP_OKAY)) {
+				const size_t	size = mp_ubin_size(&n);
+
+				Tcl_DStringSetLength(&magds, size);
+				is_integer = mp_to_ubin(&n, (uint8_t*)Tcl_DStringValue(&magds), size, NULL) == MP_OKAY;
+			}
+			mp_clear(&n);
+		}
+		if (is_integer && Tcl_DStringLength(&magds) <= 8) {
+			for (int i=0; i<Tcl_DStringLength(&magds); i++)
+				mag64 = mag64 << 8 | (uint8_t)Tcl_DStringValue(&magds)[i];
+			if (mag64 <= INT64_MAX) {
+				is_int = 1;
+				ival = negative ? -1-(Tcl_WideInt)mag64 : (Tcl_WideInt)mag64;
+			}
+		}
+
+		int				slen;
+		const char*		s = Tcl_GetStringFromObj(obj, &slen);
+		const uint8_t*	utf8 = tcl_to_utf8(s, slen, &ds, &len);
+		const size_t	maglen = is_integer ? Tcl_DStringLength(&magds) : 0;
+
+		if (cache) {
+			rep = ckalloc(sizeof *rep + len + maglen);
+		} else {
+			Tcl_DStringSetLength(scratch, sizeof *rep + len + maglen);
+			rep = (struct cbor_key_rep*)Tcl_DStringValue(scratch);
+		}
+		rep->is_int = is_int;
+		rep->ival = ival;
+		rep->is_integer = is_integer;
+		rep->negative = negative;
+		rep->mag64 = mag64;
+		rep->maglen = maglen;
+		rep->len = len;
+		memcpy(rep->utf8, utf8, len);
+		memcpy(rep->utf8 + len, Tcl_DStringValue(&magds), maglen);
+		Tcl_DStringFree(&ds);
+		Tcl_DStringFree(&magds);
+
+		if (cache) {
+			Tcl_FreeInternalRep(obj);
+			Tcl_StoreInternalRep(obj, &cbor_key_type, &(Tcl_ObjInternalRep){.twoPtrValue.ptr1 = rep});
+		}
+	} else {
+		rep = ir->twoPtrValue.ptr1;
+	}
+
+	key->is_int = rep->is_int;
+	key->ival = rep->ival;
+	key->len = rep->len;
+	key->utf8 = rep->utf8;
+	key->is_integer = rep->is_integer;
+	key->negative = rep->negative;
+	key->mag64 = rep->mag64;
+	key->maglen = rep->maglen;
+	key->mag = rep->utf8 + rep->len;
+}
+
+//}}}
+// Path element keys }}}
+static int cbor_match_map(Tcl_Interp* interp, const uint8_t* item, uint8_t ai, uint64_t val, const uint8_t** pPtr, const uint8_t* e, Tcl_Obj* pathElem, int* matchesPtr) //{{{
 {
+	/* A map matches a dict path element if each of its entries matches a
+	 * different entry of the dict, in any order.  The dict's list form holds
+	 * its keys and values for comparison (and is kept as its intrep), the
+	 * keys and values have their own forms cached by cbor_matches.
+	 */
 	int				code = TCL_OK;
-	Tcl_Obj*		tmp = NULL;
-	Tcl_Obj*		key = NULL;
-	Tcl_Obj*		cbor_val = NULL;
-	Tcl_HashTable	remaining;
 	const uint8_t*	p = *pPtr;
-	int				size;
+	int				oc;
+	Tcl_Obj**		ov;
+	uint64_t		used_static[4];	// Bitmap of the path element's entries that have been matched
+	uint64_t*		used = used_static;
+	size_t			pairs = 0;
+	size_t			matched = 0;
 	int				skipping = 0;
 
-	Tcl_InitHashTable(&remaining, TCL_ONE_WORD_KEYS);
-
-	if (TCL_OK == Tcl_DictObjSize(NULL, pathElem, &size)) {
-		replace_tclobj(&tmp, pathElem);	// Take a private copy to remove entries as we match them
-	} else {
-		// Not a dict, so we can't match (but it's not an error)
-		skipping = 1;
+	if (
+		TCL_OK != Tcl_ListObjGetElements(NULL, pathElem, &oc, &ov) ||
+		oc % 2 != 0 ||
+		(ai != 31 && val != oc/2)
+	) {
+		// Not a dict, or different numbers of entries, so we can't match (but it's not an error)
+		p = item;
+		TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
+		goto mismatch;
 	}
 
-	if (!skipping && ai != 31 && val != size)
-		skipping = 1;	// If there are different numbers of entries, we can't match
+	pairs = oc/2;
+	if (pairs > sizeof(used_static)*8)
+		used = ckalloc((pairs+63)/64 * sizeof(uint64_t));
+	memset(used, 0, (pairs+63)/64 * sizeof(uint64_t));
 
 	for (size_t i=0; ; i++) {
 		if (ai == 31) {
@@ -542,100 +730,43 @@ static int cbor_match_map(Tcl_Interp* interp, uint8_t ai, uint64_t val, const ui
 			if (i >= val) break;
 		}
 
-		if (skipping) {
-			TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
-			TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
-			continue;
-		}
+		const uint8_t*	entry = p;
 
-		const uint8_t		key_mt = *p >> 5;
-		switch (key_mt) {
-			case M_TAG: continue;
+		if (!skipping) {
+			size_t	j;
 
-			case M_UINT:
-			case M_NINT:
-			case M_BSTR:
-			case M_UTF8:
-			case M_REAL:
-			{
-				Tcl_Obj*	valobj = NULL;	// On loan from the dict
-				int			matches;
-				TEST_OK_LABEL(finally, code, cbor_get_obj(interp, &p, e, &key, NULL));
-				TEST_OK_LABEL(finally, code, Tcl_DictObjGet(interp, tmp, key, &valobj));
-				if (valobj == NULL) {
-					skipping = 1;
-					TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
-					continue;
-				}
-				TEST_OK_LABEL(finally, code, cbor_matches(interp, &p, e, valobj, &matches));
-				if (matches) {
-					TEST_OK_LABEL(finally, code, Tcl_DictObjRemove(interp, tmp, key));
-					valobj = NULL;
-					size--;
-				} else {
-					skipping = 1;
-				}
-				continue;
-			}
+			for (j=0; j<pairs; j++) {
+				const uint8_t*	q = entry;
+				int				matches;
 
-			case M_ARR:
-			case M_MAP:
-			{
-				// Defer dealing with these until there is nothing else that could cause a mismatch
-				Tcl_HashEntry*	he = NULL;
-				Tcl_CreateHashEntry(&remaining, i, NULL);
-				Tcl_SetHashValue(he, (void*)p);
-				TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
-				break;
+				if (used[j/64] & (1ULL << j%64)) continue;
+				TEST_OK_LABEL(finally, code, cbor_matches(interp, &q, e, ov[j*2], &matches));
+				if (!matches) continue;
+				TEST_OK_LABEL(finally, code, cbor_matches(interp, &q, e, ov[j*2+1], &matches));
+				if (matches) break;
 			}
-		}
-	}
-
-	if (skipping) goto mismatch;
 
-	// Having knocked out the easier matches, try to match up the compound types
-	Tcl_HashSearch	search;
-	for (Tcl_HashEntry* he=Tcl_FirstHashEntry(&remaining, &search); he; he=Tcl_NextHashEntry(&search)) {
-		if (size == 0) goto mismatch; // No more entries in the path, so we can't match
-
-		const uint8_t*	rp = (const uint8_t*)Tcl_GetHashValue(he);
-		Tcl_DictSearch	search;
-		int				done;
-		Tcl_Obj*		k = NULL;	// On loan from the dict
-		Tcl_Obj*		v = NULL;	// On loan from the dict
-		int				matches = 0;
-
-		TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, tmp, &search, &k, &v, &done));
-		for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-			const uint8_t*	rpc = rp;
-			TEST_OK_LABEL(finally, code, cbor_matches(interp, &rpc, e, k, &matches));
-			if (matches) {
-				TEST_OK_LABEL(finally, code, cbor_matches(interp, &rpc, e, v, &matches));
-				if (matches) {
-					TEST_OK_LABEL(finally, code, Tcl_DictObjRemove(interp, tmp, k));
-					k = NULL;
-					v = NULL;
-					size--;
-					break;
-				}
+			if (j < pairs) {
+				used[j/64] |= 1ULL << j%64;
+				matched++;
 			} else {
-				TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
+				skipping = 1;	// No entry of the path element matches this entry
 			}
 		}
-		Tcl_DictObjDone(&search);
-		if (!matches) goto mismatch;	// No matching entry found in dict for remaining entry in map
+
+		// Skip the key and value
+		p = entry;
+		TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
+		TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
 	}
 
-	if (size > 0) goto mismatch;	// Unmatched keys remain in dict
+	if (skipping || matched != pairs) goto mismatch;
 
 	*matchesPtr = 1;
 
 finally:
 	*pPtr = p;
-	replace_tclobj(&tmp, NULL);
-	replace_tclobj(&key, NULL);
-	replace_tclobj(&cbor_val, NULL);
-	Tcl_DeleteHashTable(&remaining);
+	if (used != used_static) ckfree(used);
 	return code;
 
 mismatch:
@@ -646,12 +777,18 @@ mismatch:
 //}}}
 static int cbor_matches(Tcl_Interp* interp, const uint8_t** pPtr, const uint8_t* e, Tcl_Obj* pathElem, int* matchesPtr) //{{{
 {
+	/* Compare the data item at *pPtr with pathElem, leaving *pPtr after it.
+	 * Only malformed CBOR is an error: path elements that can't be
+	 * interpreted as the data item's type simply don't match.
+	 */
 	int						code = TCL_OK;
 	const uint8_t*			p = *pPtr;
+	const uint8_t*			item;
 	int						matches = 0;
-	//Tcl_DString			tags;
+	Tcl_DString				scratch;
+	struct cbor_key			key;
 
-	//Tcl_DStringInit(&tags);
+	Tcl_DStringInit(&scratch);
 
 	const uint8_t*	valPtr;
 
@@ -664,6 +801,7 @@ static int cbor_matches(Tcl_Interp* interp, const uint8_t** pPtr, const uint8_t*
 
 data_item: // loop: read off tags
 	// Read head {{{
+	item = p;
 	TAKE(1);
 	const uint8_t		ib = valPtr[0];
 	const enum cbor_mt	mt = ib >> 5;
@@ -696,94 +834,70 @@ data_item: // loop: read off tags
 	}
 
 	switch (mt) {
-		//case M_TAG:	Tcl_DStringAppend(&tags, (uint64_t*)&val, sizeof(uint64_t*)); goto data_item;
-		case M_TAG:	goto data_item;	// Skip tags
+		case M_TAG: // Skip tags, but compare bignums with integer path elements {{{
+		{
+			if ((val == 2 || val == 3) && p < e && *p >> 5 == M_BSTR && (*p & 0x1f) < 28) {
+				get_cbor_key(pathElem, &scratch, &key);
+				if (key.is_integer) {
+					const uint8_t	bai = *p & 0x1f;
+					uint64_t		blen = bai;
+
+					TAKE(1);
+					switch (bai) {
+						case 24: TAKE(1); blen = *(uint8_t*)valPtr;           break;
+						case 25: TAKE(2); blen = be16toh(*(uint16_t*)valPtr); break;
+						case 26: TAKE(4); blen = be32toh(*(uint32_t*)valPtr); break;
+						case 27: TAKE(8); blen = be64toh(*(uint64_t*)valPtr); break;
+					}
+					TAKE(blen);
+					while (blen && *valPtr == 0) {valPtr++; blen--;}	// Leading zeros are allowed
+					if (key.negative == (val == 3) && blen == key.maglen && memcmp(valPtr, key.mag, blen) == 0) goto matches;
+					goto mismatch;
+				}
+			}
+			goto data_item;
+		}
+		//}}}
 		case M_UINT: case M_NINT: // Compare as integers {{{
 		{
-			// TODO: fix range issues: if val is in the range [-2^63, 2^63-1] then Tcl_WideInt is fine, otherwise we need to use bignums
-			Tcl_WideInt		pathval;
-			TEST_OK_LABEL(finally, code, Tcl_GetWideIntFromObj(interp, pathElem, &pathval));
-			if (pathval == (mt == M_UINT ? val : -1-val)) goto matches;
-			break;
+			get_cbor_key(pathElem, &scratch, &key);
+			if (key.is_integer && key.negative == (mt == M_NINT) && key.maglen <= 8 && key.mag64 == val) goto matches;
+			goto mismatch;
 		}
 		//}}}
 		case M_BSTR: // Compare as byte strings {{{
+		case M_UTF8: // Compare as UTF-8 strings
 		{
+			const uint8_t*		pathval;
 			size_t				pathlen;
-			const uint8_t*		pathval = (const uint8_t*)Tcl_GetBytesFromObj(interp, pathElem, &pathlen);
-			const uint8_t*const	pathend = pathval + pathlen;
-			const uint8_t*const	pe = p + val;
-
-			if (ai == 31) { // Indefinite length bytes: comprised of a sequence of definite-length byte dataitems {{{
-				int skipping = 0;
-
-				for (;;) {
-					const uint8_t		chunk_ib = *p++;
-					const enum cbor_mt	chunk_mt = chunk_ib >> 5;
-					const uint8_t		chunk_ai = chunk_ib & 0x1f;
-					uint64_t			chunk_val = ai;
-
-					if (chunk_ib == 0xFF) break;
-					if (chunk_mt != M_BSTR) CBOR_INVALID(finally, code, "wrong type for binary chunk: %d", chunk_mt);
 
-					switch (chunk_ai) {
-						case 24: TAKE(1); chunk_val = *(uint8_t*)valPtr;           break;
-						case 25: TAKE(2); chunk_val = be16toh(*(uint16_t*)valPtr); break;
-						case 26: TAKE(4); chunk_val = be32toh(*(uint32_t*)valPtr); break;
-						case 27: TAKE(8); chunk_val = be64toh(*(uint64_t*)valPtr); break;
-						case 28: case 29: case 30: CBOR_INVALID(finally, code, "reserved additional info value: %d", chunk_ai);
-						case 31: CBOR_INVALID(finally, code, "cannot nest indefinite length chunks");
-					}
-
-					const uint8_t*	chunk_pe = p + chunk_val;
-
-					if (skipping) {
-						p = chunk_pe;
-					} else {
-						for (; pathval < pathend && p < chunk_pe;) {
-							if (*pathval++ != *p++) {
-								p = pe;
-								skipping = 1;
-								break;
-							}
-						}
-					}
-				}
-				if (!skipping && (pathval == pathend && p == pe)) goto matches;
-				goto mismatch;
-				//}}}
-			} else { // Definite length bytes {{{
-				for (; pathval < pathend && p < pe;) {
-					if (*pathval++ != *p++) {
-						p = pe;
-						goto mismatch;
-					}
+			if (mt == M_UTF8) {
+				get_cbor_key(pathElem, &scratch, &key);
+				pathval = key.utf8;
+				pathlen = key.len;
+			} else {
+				pathval = Tcl_GetBytesFromObj(NULL, pathElem, &pathlen);
+				if (pathval == NULL) {
+					// Has characters that aren't bytes: can't match
+					p = item;
+					TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
+					goto mismatch;
 				}
-				if (pathval == pathend && p == pe) goto matches;
-				goto mismatch;
-				//}}}
 			}
-			break;
-		}
-		//}}}
-		case M_UTF8: // Compare as UTF-8 strings {{{
-		{
-			int					s_pathlen;
-			const uint8_t*		s_pathval = (const uint8_t*)Tcl_GetStringFromObj(pathElem, &s_pathlen);
-			const uint8_t*const	s_pathend = s_pathval + s_pathlen;
-			const uint8_t*const	s_pe = p + val;
 
-			if (ai == 31) { // Indefinite length UTF-8 string: comprised of a sequence of definite-length utf-8 dataitems {{{
-				int skipping = 0;
+			if (ai == 31) { // Indefinite length: comprised of a sequence of definite-length chunks {{{
+				size_t	ofs = 0;
+				int		skipping = 0;
 
 				for (;;) {
-					const uint8_t		chunk_ib = *p++;
+					TAKE(1);
+					const uint8_t		chunk_ib = valPtr[0];
 					const enum cbor_mt	chunk_mt = chunk_ib >> 5;
 					const uint8_t		chunk_ai = chunk_ib & 0x1f;
-					uint64_t			chunk_val = ai;
+					uint64_t			chunk_val = chunk_ai;
 
 					if (chunk_ib == 0xFF) break;
-					if (chunk_mt != M_UTF8) CBOR_INVALID(finally, code, "wrong type for UTF-8 chunk: %d", chunk_mt);
+					if (chunk_mt != mt) CBOR_INVALID(finally, code, "wrong type for string chunk: %d", chunk_mt);
 
 					switch (chunk_ai) {
 						case 24: TAKE(1); chunk_val = *(uint8_t*)valPtr;           break;
@@ -793,114 +907,67 @@ data_item: // loop: read off tags
 						case 28: case 29: case 30: CBOR_INVALID(finally, code, "reserved additional info value: %d", chunk_ai);
 						case 31: CBOR_INVALID(finally, code, "cannot nest indefinite length chunks");
 					}
+					TAKE(chunk_val);
 
-					const uint8_t*	c_pe = p + chunk_val;
-
-					if (skipping) {
-						p = c_pe;
-					} else {
-						for (; s_pathval < s_pathend && p < c_pe;) {
-							uint32_t	path_c;
-							uint32_t	di_c;
-
-							TEST_OK_LABEL(finally, code, utf8_codepoint(interp, &s_pathval, s_pathend, &path_c));
-							TEST_OK_LABEL(finally, code, utf8_codepoint(interp, &p,         c_pe,      &di_c));
-							if (path_c != di_c) {
-								p = c_pe;
-								skipping = 1;
-								break;
-							}
+					if (!skipping) {
+						if (chunk_val > pathlen - ofs || memcmp(valPtr, pathval + ofs, chunk_val) != 0) {
+							skipping = 1;
+						} else {
+							ofs += chunk_val;
 						}
 					}
 				}
-				if (!skipping && (s_pathval == s_pathend && p == s_pe)) goto matches;
+				if (!skipping && ofs == pathlen) goto matches;
 				goto mismatch;
 				//}}}
-			} else { // Definite length UTF-8 string {{{
-				for (; s_pathval < s_pathend && p < s_pe;) {
-					uint32_t	path_c;
-					uint32_t	di_c;
-
-					TEST_OK_LABEL(finally, code, utf8_codepoint(interp, &s_pathval, s_pathend, &path_c));
-					TEST_OK_LABEL(finally, code, utf8_codepoint(interp, &p,       s_pe,      &di_c));
-					if (path_c != di_c) {
-						p = s_pe;
-						goto mismatch;
-					}
-				}
-				if (s_pathval == s_pathend && p == s_pe) goto matches;
+			} else { // Definite length {{{
+				TAKE(val);
+				if (val == pathlen && memcmp(valPtr, pathval, val) == 0) goto matches;
 				goto mismatch;
 				//}}}
 			}
-			break;
 		}
 		//}}}
 		case M_ARR:  // Compare as a list {{{
 		{
 			int			oc;
 			Tcl_Obj**	ov;
-			if (TCL_OK != Tcl_ListObjGetElements(NULL, pathElem, &oc, &ov)) {
-				// Skip remaining elements {{{
-				for (;;) {
-					uint8_t		elem_mt;
-					TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 1, &elem_mt));
-					if (elem_mt == -1) break;
-				}
-				//}}}
+			int			skipping = 0;
+			size_t		i;
+
+			if (
+				TCL_OK != Tcl_ListObjGetElements(NULL, pathElem, &oc, &ov) ||
+				(ai != 31 && oc != val)
+			) {
+				// Not a list, or a different number of elements
+				p = item;
+				TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
 				goto mismatch;
 			}
-			if (ai == 31) { // Indefinite length array {{{
-				for (int i=0; i<oc; i++) {
-					if (*p == 0xFF) { // End of indefinite length array before end of pathelem
-						p++;
-						goto mismatch;
-					}
-					TEST_OK_LABEL(finally, code, cbor_matches(interp, &p, e, ov[i], &matches));
-					if (!matches) {
-						// Skip remaining elements {{{
-						for (;;) {
-							uint8_t		elem_mt;
-							TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 1, &elem_mt));
-							if (elem_mt == -1) break;
-						}
-						//}}}
-						goto mismatch;
-					}
-				}
-				if (*p != 0xFF) { // End of pathelem before end of indefinite length array
-					// Skip remaining elements {{{
-					for (;;) {
-						uint8_t		elem_mt;
-						TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 1, &elem_mt));
-						if (elem_mt == -1) break;
-					}
-					//}}}
-					goto mismatch;
+
+			for (i=0; ; i++) {
+				if (ai == 31) {
+					if (p >= e) CBOR_TRUNCATED(finally, code);
+					if (*p == 0xFF) {p++; break;}
+				} else {
+					if (i >= val) break;
 				}
-				goto matches;
-				//}}}
-			} else { // Definite length array {{{
-				int		skipping = oc != val;
-				for (int i=0; i<val; i++) {
-					if (skipping) {
-						TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
-					} else {
-						TEST_OK_LABEL(finally, code, cbor_matches(interp, &p, e, ov[i], &matches));
-						if (!matches) {
-							skipping = 1;
-							continue;
-						}
-					}
+
+				if (skipping || i >= oc) {
+					skipping = 1;
+					TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
+				} else {
+					TEST_OK_LABEL(finally, code, cbor_matches(interp, &p, e, ov[i], &matches));
+					if (!matches) skipping = 1;
 				}
-				if (!skipping) goto matches;
-				//}}}
 			}
+			if (!skipping && i == oc) goto matches;	// Indefinite length arrays can turn out to be shorter than the path element
 			goto mismatch;
 		}
 		//}}}
 		case M_MAP:  // Compare as dictionary {{{
 		{
-			TEST_OK_LABEL(finally, code, cbor_match_map(interp, ai, val, &p, e, pathElem, &matches));
+			TEST_OK_LABEL(finally, code, cbor_match_map(interp, item, ai, val, &p, e, pathElem, &matches));
 			if (matches) goto matches;
 			goto mismatch;
 		}
@@ -913,7 +980,7 @@ data_item: // loop: read off tags
 				case 20: case 21:	// Simple value: false / true
 				{
 					int boolval;
-					TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, pathElem, &boolval));
+					if (TCL_OK != Tcl_GetBooleanFromObj(NULL, pathElem, &boolval)) goto mismatch;
 					if (boolval == (ai == 21)) goto matches;
 					goto mismatch;
 				}
@@ -927,11 +994,11 @@ data_item: // loop: read off tags
 				case 25:	rvalue = decode_half(valPtr);	break;
 				case 26:	rvalue = decode_float(valPtr);	break;
 				case 27:	rvalue = decode_double(valPtr);	break;
-				default:	CBOR_INVALID(finally, code, "invalid additional info: %d", ai);
+				default:	goto mismatch;	// Other simple values
 			}
 
 			double		pathval;
-			TEST_OK_LABEL(finally, code, Tcl_GetDoubleFromObj(interp, pathElem, &pathval));
+			if (TCL_OK != Tcl_GetDoubleFromObj(NULL, pathElem, &pathval)) goto mismatch;
 			if (pathval == rvalue) goto matches;
 			goto mismatch;
 		}
@@ -941,7 +1008,7 @@ data_item: // loop: read off tags
 finally:
 	*pPtr = p;
 	#undef TAKE
-	//Tcl_DStringFree(&tags);
+	Tcl_DStringFree(&scratch);
 	return code;
 
 matches:
@@ -953,44 +1020,1667 @@ mismatch:
 }
 
 //}}}
-// Private API }}}
-// Stubs API {{{
-int CBOR_GetDataItemFromPath(Tcl_Interp* interp, Tcl_Obj* cborObj, Tcl_Obj* pathObj, const uint8_t** dataitemPtr, const uint8_t** ePtr, Tcl_DString* tagsPtr) //{{{
+// Offset index {{{
+/* Path lookups can only find a container's members by walking every data
+ * item before them.  For values that are looked up more than once, the
+ * offsets of each container's members are recorded the first time the
+ * container is walked, so that later lookups can jump straight to them.
+ *
+ * The index is keyed by the address of the Tcl_Obj.  A value looked up once
+ * isn't referenced, so that single lookups never keep a large value alive,
+ * but no offsets are recorded for it either, so a different value reusing
+ * its address just starts being indexed a lookup early.  Once offsets are
+ * recorded the index holds a reference, so the address can't be reused and
+ * the (shared, so unchanging) bytes can't differ from those the offsets were
+ * recorded against.  The reference is dropped again by the first lookup
+ * after the index has become the only holder.
+ */
+struct cbor_container {
+	size_t		count;		// Elements of an array, or pairs of a map
+	size_t		ofs[];		// Offsets of the elements, or of each key followed by its value
+};
+
+static void cbor_index_unlink(struct interp_cx* l, struct cbor_index_entry* ie) //{{{
 {
-	int						code = TCL_OK;
-	Tcl_Obj**				pathv = NULL;
-	int						pathc = 0;
-	const uint8_t*			p = NULL;
-	size_t					byteslen = 0;
-	const uint8_t*			bytes = NULL;
-	const uint8_t**			circular = g_circular_buf;
+	if (ie->prev) ie->prev->next = ie->next; else l->cbor_index_head = ie->next;
+	if (ie->next) ie->next->prev = ie->prev; else l->cbor_index_tail = ie->prev;
+	ie->prev = ie->next = NULL;
+}
 
-	bytes = Tcl_GetBytesFromObj(interp, cborObj, &byteslen);
-	if (bytes == NULL) {code = TCL_ERROR; goto finally;}
-	TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, pathObj, &pathc, &pathv));
+//}}}
+static void cbor_index_reset(struct cbor_index_entry* ie) //{{{
+{
+	Tcl_HashSearch	search;
+	Tcl_HashEntry*	he;
 
-	const uint8_t*const	e = bytes + byteslen;
-	p = bytes;
-	*ePtr = e;
+	for (he = Tcl_FirstHashEntry(&ie->containers, &search); he; he = Tcl_NextHashEntry(&search))
+		ckfree(Tcl_GetHashValue(he));
+	Tcl_DeleteHashTable(&ie->containers);
+	Tcl_InitHashTable(&ie->containers, TCL_ONE_WORD_KEYS);
+}
 
-	const uint8_t*	valPtr;
+//}}}
+static void cbor_index_evict(struct interp_cx* l, struct cbor_index_entry* ie) //{{{
+{
+	cbor_index_unlink(l, ie);
+	Tcl_DeleteHashEntry(ie->he);
+	cbor_index_reset(ie);
+	Tcl_DeleteHashTable(&ie->containers);
+	release_tclobj(&ie->cbor);
+	ckfree(ie);
+	l->cbor_index_count--;
+}
 
-	#define TAKE(n) do { \
-		const size_t	nb = n; \
-		if (e - p < nb) CBOR_TRUNCATED(finally, code); \
-		valPtr = p; \
-		p += nb; \
-	} while (0)
+//}}}
+void cbor_index_clear(struct interp_cx* l) //{{{
+{
+	while (l->cbor_index_head)
+		cbor_index_evict(l, l->cbor_index_head);
+}
 
+//}}}
+static struct cbor_index_entry* cbor_index_lookup(struct interp_cx* l, Tcl_Obj* cborObj, const uint8_t* bytes, size_t len) //{{{
+{
+	/* Returns the index for cborObj if it has been looked up before, NULL
+	 * otherwise (a single lookup doesn't pay for indexing the containers it
+	 * walks)
+	 */
+	struct cbor_index_entry*	ie;
+	struct cbor_index_entry*	next;
+	Tcl_HashEntry*				he;
+	int							isnew;
+
+	// Drop the values nothing but the index refers to any more
+	for (ie = l->cbor_index_head; ie; ie = next) {
+		next = ie->next;
+		if (ie->cbor && ie->cbor != cborObj && ie->cbor->refCount == 1)
+			cbor_index_evict(l, ie);
+	}
 
-	for (int pathi=0; pathi<pathc; pathi++) {
-		Tcl_Obj*	pathElem = pathv[pathi];
-		Tcl_DStringSetLength(tagsPtr, 0);
+	he = Tcl_CreateHashEntry(&l->cbor_index, (const char*)cborObj, &isnew);
+	if (!isnew) {
+		ie = Tcl_GetHashValue(he);
+		if (ie != l->cbor_index_head) {
+			cbor_index_unlink(l, ie);
+			ie->next = l->cbor_index_head;
+			l->cbor_index_head->prev = ie;
+			l->cbor_index_head = ie;
+		}
+		if (ie->bytes != bytes || ie->len != len) {
+			// Shimmered, or freed and reused before it was indexed
+			cbor_index_reset(ie);
+			ie->bytes = bytes;
+			ie->len = len;
+			ie->lookups = 1;
+			l->cbor_index_misses++;
+			return NULL;
+		}
+		// Offsets will be recorded against these bytes from now on
+		replace_tclobj(&ie->cbor, cborObj);
+		ie->lookups++;
+		l->cbor_index_hits++;
+		return ie;
+	}
 
-	data_item: // loop: read off tags
-		// Read head {{{
-		TAKE(1);
-		const uint8_t	ib = valPtr[0];
+	l->cbor_index_misses++;
+	ie = ckalloc(sizeof *ie);
+	*ie = (struct cbor_index_entry){
+		.he				= he,
+		.bytes			= bytes,
+		.len			= len,
+		.lookups		= 1
+	};
+	Tcl_InitHashTable(&ie->containers, TCL_ONE_WORD_KEYS);
+	Tcl_SetHashValue(he, ie);
+
+	ie->next = l->cbor_index_head;
+	if (ie->next) ie->next->prev = ie; else l->cbor_index_tail = ie;
+	l->cbor_index_head = ie;
+	l->cbor_index_count++;
+
+	if (l->cbor_index_count > CBOR_INDEX_CACHE_SIZE) {
+		cbor_index_evict(l, l->cbor_index_tail);
+		l->cbor_index_evictions++;
+	}
+
+	return NULL;
+}
+
+//}}}
+static struct cbor_container* cbor_index_container(Tcl_Interp* interp, struct cbor_index_entry* ie, const uint8_t* head, const uint8_t* first, const uint8_t* e, enum cbor_mt mt, uint8_t ai, uint64_t val) //{{{
+{
+	/* Return the member offsets of the array or map whose head is at head
+	 * and whose first member is at first, recording them if this is the
+	 * first time the container has been walked.  Returns NULL if the members
+	 * aren't well formed, leaving the caller's linear walk to report it.
+	 */
+	struct cbor_container*	c = NULL;
+	Tcl_HashEntry*			he;
+	int						isnew;
+	Tcl_DString				ofs;
+	const uint8_t*			p = first;
+	const size_t			items_per = mt == M_MAP ? 2 : 1;
+
+	he = Tcl_CreateHashEntry(&ie->containers, (const char*)(uintptr_t)(head - ie->bytes), &isnew);
+	if (!isnew) return Tcl_GetHashValue(he);
+
+	Tcl_DStringInit(&ofs);
+
+	if (ai != 31 && val > (e - first) / items_per) goto failed;	// Every item takes at least one byte
+
+	for (size_t i=0; ; i++) {
+		uint8_t	item_mt;
+
+		if (ai != 31 && i >= val*items_per) break;
+		const size_t	o = p - ie->bytes;
+		if (TCL_OK != well_formed(interp, &p, e, ai == 31 && i % items_per == 0, &item_mt)) goto failed;
+		if (item_mt == MT_BREAK) break;
+		Tcl_DStringAppend(&ofs, (const char*)&o, sizeof o);
+	}
+
+	const size_t	items = Tcl_DStringLength(&ofs) / sizeof(size_t);
+	c = ckalloc(sizeof *c + items*sizeof(size_t));
+	c->count = items / items_per;
+	memcpy(c->ofs, Tcl_DStringValue(&ofs), items*sizeof(size_t));
+	Tcl_SetHashValue(he, c);
+	Tcl_DStringFree(&ofs);
+	return c;
+
+failed:
+	Tcl_ResetResult(interp);
+	Tcl_DeleteHashEntry(he);
+	Tcl_DStringFree(&ofs);
+	return NULL;
+}
+
+//}}}
+// Offset index }}}
+// Encoder {{{
+struct map_entry {
+	const uint8_t*	key;		// Encoded key, followed by its encoded value
+	size_t			keylen;
+	size_t			ofs;		// Offset of the key from the start of the map's entries
+	size_t			len;		// Encoded length of the key and value
+};
+
+static int head_bytes(uint8_t buf[9], enum cbor_mt mt, uint64_t val) //{{{
+{
+	// Write the shortest head for mt and val into buf, returning its length
+	buf[0] = mt << 5;
+	if (val < 24) {
+		buf[0] |= val;
+		return 1;
+	} else if (val <= UINT8_MAX) {
+		buf[0] |= 24;
+		buf[1] = val;
+		return 2;
+	} else if (val <= UINT16_MAX) {
+		const uint16_t	be = htobe16(val);
+		buf[0] |= 25;
+		memcpy(buf+1, &be, 2);
+		return 3;
+	} else if (val <= UINT32_MAX) {
+		const uint32_t	be = htobe32(val);
+		buf[0] |= 26;
+		memcpy(buf+1, &be, 4);
+		return 5;
+	} else {
+		const uint64_t	be = htobe64(val);
+		buf[0] |= 27;
+		memcpy(buf+1, &be, 8);
+		return 9;
+	}
+}
+
+//}}}
+static void put_head(Tcl_DString* ds, enum cbor_mt mt, uint64_t val) //{{{
+{
+	uint8_t		buf[9];
+
+	Tcl_DStringAppend(ds, (const char*)buf, head_bytes(buf, mt, val));
+}
+
+//}}}
+const uint8_t* tcl_to_utf8(const char* str, int len, Tcl_DString* scratch, size_t* lenPtr) //{{{
+{
+	/* Tcl's internal string encoding differs from UTF-8 in two ways: U+0000
+	 * is stored as C0 80, and (when TCL_UTF_MAX is 3) characters beyond the
+	 * BMP are stored as CESU-8 surrogate pairs.  Neither can appear in a
+	 * well-formed CBOR or MessagePack string, so those have to be rewritten.
+	 * Returns str itself if it needs no rewriting, otherwise the rewritten
+	 * form in scratch (which is never longer than the original).
+	 */
+	const uint8_t*	s = (const uint8_t*)str;
+	const uint8_t*	e = s + len;
+	const uint8_t*	p = s;
+	uint8_t*		o;
+
+	while (p < e && *p != 0xC0 && *p != 0xED) p++;
+	if (likely(p == e)) {
+		*lenPtr = len;
+		return s;
+	}
+
+	Tcl_DStringSetLength(scratch, len);
+	o = (uint8_t*)Tcl_DStringValue(scratch);
+	memcpy(o, s, p-s);
+	o += p-s;
+
+	while (p < e) {
+		if (p[0] == 0xC0 && e-p >= 2 && p[1] == 0x80) {
+			*o++ = 0;
+			p += 2;
+		} else if (p[0] == 0xED && e-p >= 3 && p[1] >= 0xA0) {
+			if (
+				p[1] <= 0xAF &&
+				e-p >= 6 &&
+				p[3] == 0xED &&
+				p[4] >= 0xB0 && p[4] <= 0xBF
+			) {
+				const uint32_t	hi = 0xD000 | (p[1] & 0x3F) << 6 | (p[2] & 0x3F);
+				const uint32_t	lo = 0xD000 | (p[4] & 0x3F) << 6 | (p[5] & 0x3F);
+				const uint32_t	c = 0x10000 + ((hi - 0xD800) << 10) + (lo - 0xDC00);
+
+				*o++ = 0xF0 | (c >> 18);
+				*o++ = 0x80 | ((c >> 12) & 0x3F);
+				*o++ = 0x80 | ((c >> 6) & 0x3F);
+				*o++ = 0x80 | (c & 0x3F);
+				p += 6;
+			} else {
+				// Unpaired surrogate: replace with U+FFFD
+				*o++ = 0xEF;
+				*o++ = 0xBF;
+				*o++ = 0xBD;
+				p += 3;
+			}
+		} else {
+			*o++ = *p++;
+		}
+	}
+
+	*lenPtr = o - (uint8_t*)Tcl_DStringValue(scratch);
+	Tcl_DStringSetLength(scratch, *lenPtr);
+	return (const uint8_t*)Tcl_DStringValue(scratch);
+}
+
+//}}}
+static void put_string(Tcl_DString* ds, enum cbor_mt mt, const char* str, int len) //{{{
+{
+	Tcl_DString		scratch;
+	size_t			utf8len;
+	const uint8_t*	utf8;
+
+	Tcl_DStringInit(&scratch);
+	utf8 = tcl_to_utf8(str, len, &scratch, &utf8len);
+	put_head(ds, mt, utf8len);
+	Tcl_DStringAppend(ds, (const char*)utf8, utf8len);
+	Tcl_DStringFree(&scratch);
+}
+
+//}}}
+static int double_to_half(double d, uint16_t* half) //{{{
+{
+	// Returns 1 and the binary16 encoding of d in *half if d can be represented exactly as a binary16
+	const float	f = d;
+	uint32_t	fbits;
+	uint16_t	sign;
+	int			exp;
+	uint32_t	mant;
+
+	if ((double)f != d) return 0;
+
+	memcpy(&fbits, &f, sizeof(fbits));
+	sign = (fbits >> 16) & 0x8000;
+	exp  = (int)((fbits >> 23) & 0xff) - 127;
+	mant = fbits & 0x7fffff;
+
+	if (exp == 128) {				// Inf (NaN never gets here, since NaN != NaN)
+		*half = sign | 0x7c00;
+		return 1;
+	}
+
+	if (exp == -127 && mant == 0) {	// Zero
+		*half = sign;
+		return 1;
+	}
+
+	if (exp >= -14 && exp <= 15) {	// Normal binary16 range
+		if (mant & 0x1fff) return 0;
+		*half = sign | (exp + 15) << 10 | mant >> 13;
+		return 1;
+	}
+
+	if (exp >= -24 && exp < -14) {	// Subnormal binary16 range
+		const uint32_t	m = mant | 0x800000;
+		const int		shift = -(exp+1);
+
+		if (m & ((1 << shift) - 1)) return 0;
+		*half = sign | m >> shift;
+		return 1;
+	}
+
+	return 0;
+}
+
+//}}}
+static void put_double(Tcl_DString* ds, double d) //{{{
+{
+	// Preferred serialization (RFC 8949 section 4.1): the shortest float that represents d exactly
+	uint8_t		buf[9];
+	uint16_t	half;
+	int			len;
+
+	if (isnan(d)) {
+		half = 0x7e00;
+		goto put_half;
+	}
+
+	if (double_to_half(d, &half)) {
+		uint16_t	be;
+put_half:
+		be = htobe16(half);
+		buf[0] = M_REAL << 5 | 25;
+		memcpy(buf+1, &be, 2);
+		len = 3;
+	} else if ((double)(float)d == d) {
+		const float	f = d;
+		uint32_t	bits;
+
+		memcpy(&bits, &f, 4);
+		bits = htobe32(bits);
+		buf[0] = M_REAL << 5 | 26;
+		memcpy(buf+1, &bits, 4);
+		len = 5;
+	} else {
+		uint64_t	bits;
+
+		memcpy(&bits, &d, 8);
+		bits = htobe64(bits);
+		buf[0] = M_REAL << 5 | 27;
+		memcpy(buf+1, &bits, 8);
+		len = 9;
+	}
+
+	Tcl_DStringAppend(ds, (const char*)buf, len);
+}
+
+//}}}
+static int put_bignum(Tcl_Interp* interp, Tcl_DString* ds, Tcl_Obj* obj) //{{{
+{
+	int				code = TCL_OK;
+	mp_int			n = {0};
+	int				neg;
+	size_t			size;
+
+	TEST_OK_LABEL(finally, code, Tcl_GetBignumFromObj(interp, obj, &n));
+
+	neg = n.sign == MP_NEG;
+	if (neg) {
+		// Negative integers are encoded as -1-n
+		if (mp_neg(&n, &n) != MP_OKAY || mp_sub_d(&n, 1, &n) != MP_OKAY)
+			THROW_ERROR_LABEL(finally, code, "Bignum arithmetic failed");
+	}
+
+	size = mp_ubin_size(&n);
+	if (size <= 8) {
+		uint8_t		bytes[8];
+		uint64_t	val = 0;
+
+		if (mp_to_ubin(&n, bytes, sizeof(bytes), NULL) != MP_OKAY)
+			THROW_ERROR_LABEL(finally, code, "Bignum conversion failed");
+		for (size_t i=0; i<size; i++) val = val << 8 | bytes[i];
+		put_head(ds, neg ? M_NINT : M_UINT, val);
+	} else {
+		int		ofs;
+
+		put_head(ds, M_TAG, neg ? 3 : 2);
+		put_head(ds, M_BSTR, size);
+		ofs = Tcl_DStringLength(ds);
+		Tcl_DStringSetLength(ds, ofs + size);
+		if (mp_to_ubin(&n, (uint8_t*)Tcl_DStringValue(ds) + ofs, size, NULL) != MP_OKAY)
+			THROW_ERROR_LABEL(finally, code, "Bignum conversion failed");
+	}
+
+finally:
+	mp_clear(&n);
+	return code;
+}
+
+//}}}
+int get_double(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* obj, double* d) //{{{
+{
+	// Like Tcl_GetDoubleFromObj, but NaN is a value CBOR can represent, so don't reject it
+	Tcl_ObjInternalRep*	ir;
+
+	if (TCL_OK == Tcl_GetDoubleFromObj(NULL, obj, d))
+		return TCL_OK;
+
+	ir = l->typeDouble ? Tcl_FetchInternalRep(obj, l->typeDouble) : NULL;
+	if (ir && isnan(ir->doubleValue)) {
+		*d = ir->doubleValue;
+		return TCL_OK;
+	}
+
+	return Tcl_GetDoubleFromObj(interp, obj, d);	// Get the error message
+}
+
+//}}}
+static int put_number(Tcl_Interp* interp, struct interp_cx* l, Tcl_DString* ds, Tcl_Obj* obj) //{{{
+{
+	Tcl_WideInt	w;
+	double		d;
+
+	if (l->typeInt && Tcl_FetchInternalRep(obj, l->typeInt)) {
+		TEST_OK(Tcl_GetWideIntFromObj(interp, obj, &w));
+		goto put_wide;
+	}
+
+	if (l->typeBignum && Tcl_FetchInternalRep(obj, l->typeBignum))
+		return put_bignum(interp, ds, obj);
+
+	if (l->typeDouble && Tcl_FetchInternalRep(obj, l->typeDouble)) {
+		TEST_OK(get_double(interp, l, obj, &d));
+		put_double(ds, d);
+		return TCL_OK;
+	}
+
+	{
+		int				len;
+		const char*		s = Tcl_GetStringFromObj(obj, &len);
+		const char*		e = s + len;
+		const char*		p = s;
+		const int		neg = *p == '-';
+		uint64_t		acc = 0;
+
+		// Fast path for the plain integers that make up most JSON numbers
+		if (neg) p++;
+		if (p < e) {
+			int		overflow = 0;
+
+			while (p < e && *p >= '0' && *p <= '9') {
+				const unsigned	digit = *p - '0';
+				if (acc > (UINT64_MAX - digit) / 10) overflow = 1;
+				acc = acc * 10 + digit;
+				p++;
+			}
+			if (p == e) {
+				if (overflow)
+					return put_bignum(interp, ds, obj);
+
+				if (neg && acc > 0) {
+					put_head(ds, M_NINT, acc-1);
+				} else {
+					put_head(ds, M_UINT, acc);
+				}
+				return TCL_OK;
+			}
+		}
+	}
+
+	if (TCL_OK == Tcl_GetWideIntFromObj(NULL, obj, &w))
+		goto put_wide;
+
+	TEST_OK(get_double(interp, l, obj, &d));
+	put_double(ds, d);
+	return TCL_OK;
+
+put_wide:
+	if (w < 0) {
+		put_head(ds, M_NINT, -1 - w);
+	} else {
+		put_head(ds, M_UINT, w);
+	}
+	return TCL_OK;
+}
+
+//}}}
+static int compare_map_entries(const void* a, const void* b) //{{{
+{
+	const struct map_entry*	ea = a;
+	const struct map_entry*	eb = b;
+	const int				cmp = memcmp(ea->key, eb->key, ea->keylen < eb->keylen ? ea->keylen : eb->keylen);
+
+	if (cmp != 0) return cmp;
+	return ea->keylen < eb->keylen ? -1 : ea->keylen > eb->keylen;
+}
+
+//}}}
+static void sort_map(Tcl_DString* ds, int start, struct map_entry* entries, int count) //{{{
+{
+	/* Core deterministic encoding (RFC 8949 section 4.2.1): map entries are
+	 * sorted by the bytewise lexicographic order of their encoded keys.  The
+	 * entries have already been encoded in place, so sort an index of them
+	 * and rearrange the bytes to match.
+	 */
+	uint8_t*		base = (uint8_t*)Tcl_DStringValue(ds) + start;
+	const size_t	total = Tcl_DStringLength(ds) - start;
+	uint8_t*		tmp;
+	uint8_t*		o;
+
+	if (count < 2) return;
+
+	for (int i=0; i<count; i++)
+		entries[i].key = base + entries[i].ofs;
+
+	qsort(entries, count, sizeof(entries[0]), compare_map_entries);
+
+	o = tmp = (uint8_t*)ckalloc(total);
+	for (int i=0; i<count; i++) {
+		memcpy(o, entries[i].key, entries[i].len);
+		o += entries[i].len;
+	}
+	memcpy(base, tmp, total);
+	ckfree(tmp);
+}
+
+//}}}
+static int encode_json(Tcl_Interp* interp, struct interp_cx* l, Tcl_DString* ds, int canonical, Tcl_Obj* obj) //{{{
+{
+	int					code = TCL_OK;
+	enum json_types		type;
+	Tcl_Obj*			val = NULL;
+	struct map_entry*	entries = NULL;
+
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, obj, &type, &val));
+
+	switch (type) {
+		case JSON_OBJECT:
+		{
+			Tcl_DictSearch	search;
+			Tcl_Obj*		k = NULL;
+			Tcl_Obj*		v = NULL;
+			int				done, size, i = 0, start;
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjSize(interp, val, &size));
+			put_head(ds, M_MAP, size);
+			start = Tcl_DStringLength(ds);
+			if (canonical && size > 1)
+				entries = (struct map_entry*)ckalloc(size * sizeof(struct map_entry));
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+			for (; !done; Tcl_DictObjNext(&search, &k, &v, &done), i++) {
+				int				keylen;
+				const char*		key = Tcl_GetStringFromObj(k, &keylen);
+				const int		ofs = Tcl_DStringLength(ds);
+
+				put_string(ds, M_UTF8, key, keylen);
+				if (entries) {
+					entries[i].ofs = ofs - start;
+					entries[i].keylen = Tcl_DStringLength(ds) - ofs;
+				}
+				if (TCL_OK != (code = encode_json(interp, l, ds, canonical, v))) {
+					Tcl_DictObjDone(&search);
+					goto finally;
+				}
+				if (entries)
+					entries[i].len = Tcl_DStringLength(ds) - ofs;
+			}
+			Tcl_DictObjDone(&search);
+
+			if (entries)
+				sort_map(ds, start, entries, size);
+			break;
+		}
+
+		case JSON_ARRAY:
+		{
+			Tcl_Obj**	ov;
+			int			oc;
+
+			TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, val, &oc, &ov));
+			put_head(ds, M_ARR, oc);
+			for (int i=0; i<oc; i++)
+				TEST_OK_LABEL(finally, code, encode_json(interp, l, ds, canonical, ov[i]));
+			break;
+		}
+
+		case JSON_STRING:
+		{
+			int			len;
+			const char*	str = Tcl_GetStringFromObj(val, &len);
+
+			put_string(ds, M_UTF8, str, len);
+			break;
+		}
+
+		case JSON_NUMBER:
+			TEST_OK_LABEL(finally, code, put_number(interp, l, ds, val));
+			break;
+
+		case JSON_BOOL:
+		{
+			int		b;
+
+			TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, val, &b));
+			put_head(ds, M_REAL, b ? S_TRUE : S_FALSE);
+			break;
+		}
+
+		case JSON_NULL:
+			put_head(ds, M_REAL, S_NULL);
+			break;
+
+		case JSON_DYN_STRING:
+		case JSON_DYN_NUMBER:
+		case JSON_DYN_BOOL:
+		case JSON_DYN_JSON:
+		case JSON_DYN_TEMPLATE:
+		case JSON_DYN_LITERAL:
+		{
+			// Template placeholders are just strings in this context
+			Tcl_Obj*	str = NULL;
+			int			len;
+			const char*	s;
+
+			replace_tclobj(&str, Tcl_ObjPrintf("%s%s", get_dyn_prefix(type), Tcl_GetString(val)));
+			s = Tcl_GetStringFromObj(str, &len);
+			put_string(ds, M_UTF8, s, len);
+			replace_tclobj(&str, NULL);
+			break;
+		}
+
+		default:
+			THROW_ERROR_LABEL(finally, code, "Invalid value type");
+	}
+
+finally:
+	if (entries) ckfree(entries);
+	return code;
+}
+
+//}}}
+static int encode_typed(Tcl_Interp* interp, struct interp_cx* l, Tcl_DString* ds, int canonical, Tcl_Obj* typed) //{{{
+{
+	/* Encode a type-annotated Tcl value: a list of a type and its value,
+	 * using the same types as [json new], plus some that only CBOR has:
+	 *		bytes val			- a byte string
+	 *		undefined			- the undefined simple value
+	 *		tag num typedval	- typedval, tagged with num
+	 *		cbor val			- an already encoded CBOR data item
+	 */
+	int					code = TCL_OK;
+	int					objc, type;
+	Tcl_Obj**			objv;
+	struct map_entry*	entries = NULL;
+	static const char* types[] = {
+		"string",
+		"object",
+		"array",
+		"number",
+		"true",
+		"false",
+		"null",
+		"boolean",
+		"json",
+		"bytes",
+		"undefined",
+		"tag",
+		"cbor",
+		(char*)NULL
+	};
+	enum {
+		T_STRING,
+		T_OBJECT,
+		T_ARRAY,
+		T_NUMBER,
+		T_TRUE,
+		T_FALSE,
+		T_NULL,
+		T_BOOL,
+		T_JSON,
+		T_BYTES,
+		T_UNDEFINED,
+		T_TAG,
+		T_CBOR
+	};
+
+	TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, typed, &objc, &objv));
+	enum {A_cmd=-1, A_TYPE, A_args};
+	CHECK_MIN_ARGS_LABEL(finally, code, "type ?val?");
+	TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[A_TYPE], types, "type", 0, &type));
+
+	switch (type) {
+		case T_STRING: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			int			len;
+			const char*	str = Tcl_GetStringFromObj(objv[A_VAL], &len);
+			put_string(ds, M_UTF8, str, len);
+			break;
+		}
+		//}}}
+		case T_OBJECT: //{{{
+		{
+			int			oc, size, start;
+			Tcl_Obj**	ov;
+
+			if (objc == 2) {
+				TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, objv[1], &oc, &ov));
+			} else {
+				oc = objc-1;
+				ov = objv+1;
+			}
+			if (oc % 2 != 0)
+				THROW_ERROR_LABEL(finally, code, "cbor encode object needs an even number of arguments");
+
+			size = oc/2;
+			put_head(ds, M_MAP, size);
+			start = Tcl_DStringLength(ds);
+			if (canonical && size > 1)
+				entries = (struct map_entry*)ckalloc(size * sizeof(struct map_entry));
+
+			for (int i=0; i<size; i++) {
+				int				keylen;
+				const char*		key = Tcl_GetStringFromObj(ov[i*2], &keylen);
+				const int		ofs = Tcl_DStringLength(ds);
+
+				put_string(ds, M_UTF8, key, keylen);
+				if (entries) {
+					entries[i].ofs = ofs - start;
+					entries[i].keylen = Tcl_DStringLength(ds) - ofs;
+				}
+				TEST_OK_LABEL(finally, code, encode_typed(interp, l, ds, canonical, ov[i*2+1]));
+				if (entries)
+					entries[i].len = Tcl_DStringLength(ds) - ofs;
+			}
+
+			if (entries)
+				sort_map(ds, start, entries, size);
+			break;
+		}
+		//}}}
+		case T_ARRAY: //{{{
+			put_head(ds, M_ARR, objc-1);
+			for (int i=1; i<objc; i++)
+				TEST_OK_LABEL(finally, code, encode_typed(interp, l, ds, canonical, objv[i]));
+			break;
+			//}}}
+		case T_NUMBER: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			TEST_OK_LABEL(finally, code, put_number(interp, l, ds, objv[A_VAL]));
+			break;
+		}
+		//}}}
+		case T_TRUE: case T_FALSE: case T_NULL: case T_UNDEFINED: //{{{
+		{
+			enum {A_cmd, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "");
+			put_head(ds, M_REAL,
+				type == T_TRUE  ? S_TRUE  :
+				type == T_FALSE ? S_FALSE :
+				type == T_NULL  ? S_NULL  :
+				S_UNDEF);
+			break;
+		}
+		//}}}
+		case T_BOOL: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			int		b;
+			TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, objv[A_VAL], &b));
+			put_head(ds, M_REAL, b ? S_TRUE : S_FALSE);
+			break;
+		}
+		//}}}
+		case T_JSON: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			TEST_OK_LABEL(finally, code, encode_json(interp, l, ds, canonical, objv[A_VAL]));
+			break;
+		}
+		//}}}
+		case T_BYTES: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			size_t			len;
+			const uint8_t*	bytes = cbor_get_bytes(interp, objv[A_VAL], NULL, &len);	// Lazy values are read in place
+
+			if (bytes == NULL) {code = TCL_ERROR; goto finally;}
+			put_head(ds, M_BSTR, len);
+			Tcl_DStringAppend(ds, (const char*)bytes, len);
+			break;
+		}
+		//}}}
+		case T_TAG: //{{{
+		{
+			enum {A_cmd, A_NUM, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "num typedval");
+			Tcl_WideInt	num;
+			TEST_OK_LABEL(finally, code, Tcl_GetWideIntFromObj(interp, objv[A_NUM], &num));
+			if (num < 0)
+				THROW_ERROR_LABEL(finally, code, "Tag number must not be negative");
+			put_head(ds, M_TAG, num);
+			TEST_OK_LABEL(finally, code, encode_typed(interp, l, ds, canonical, objv[A_VAL]));
+			break;
+		}
+		//}}}
+		case T_CBOR: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			size_t			len;
+			const uint8_t*	bytes = cbor_get_bytes(interp, objv[A_VAL], NULL, &len);	// Lazy values are read in place
+			const uint8_t*	p = bytes;
+
+			if (bytes == NULL) {code = TCL_ERROR; goto finally;}
+			TEST_OK_LABEL(finally, code, well_formed(interp, &p, bytes+len, 0, NULL));
+			if (p != bytes+len) CBOR_TRAILING(finally, code);
+			Tcl_DStringAppend(ds, (const char*)bytes, len);
+			break;
+		}
+		//}}}
+		default:
+			THROW_ERROR_LABEL(finally, code, "Invalid type");
+	}
+
+finally:
+	if (entries) ckfree(entries);
+	return code;
+}
+
+//}}}
+int cbor_from_json(Tcl_Interp* interp, Tcl_Obj* json, int canonical, Tcl_Obj** res) //{{{
+{
+	int					code = TCL_OK;
+	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	Tcl_DString			ds;
+
+	Tcl_DStringInit(&ds);
+	TEST_OK_LABEL(finally, code, encode_json(interp, l, &ds, canonical, json));
+	replace_tclobj(res, Tcl_NewByteArrayObj((const uint8_t*)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+
+finally:
+	Tcl_DStringFree(&ds);
+	return code;
+}
+
+//}}}
+// Encoder }}}
+// CBOR to JSON {{{
+/* The mapping follows RFC 8949 section 6.1, except that bignums become JSON
+ * numbers, since rl_json numbers aren't limited to doubles:
+ *	- Integers, bignums (tags 2 and 3) and finite floats become numbers
+ *	- Non-finite floats, null, undefined and other simple values become null
+ *	- Byte strings become base64url strings without padding, or base64 or
+ *	  base16 inside tags 22 and 23 (expected conversions)
+ *	- Other tags are dropped, leaving their content
+ *	- Map keys that aren't text strings become the text of their JSON value
+ */
+void append_bytes_encoded(Tcl_DString* ds, const uint8_t* bytes, size_t len, enum bytes_encoding enc) //{{{
+{
+	static const char	b64url[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+	static const char	b64[]    = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	static const char	hex[]    = "0123456789abcdef";
+	const int			ofs = Tcl_DStringLength(ds);
+	char*				o;
+
+	if (enc == BYTES_BASE16) {
+		Tcl_DStringSetLength(ds, ofs + len*2);
+		o = Tcl_DStringValue(ds) + ofs;
+		for (size_t i=0; i<len; i++) {
+			*o++ = hex[bytes[i] >> 4];
+			*o++ = hex[bytes[i] & 0xf];
+		}
+		return;
+	}
+
+	{
+		const char*		alphabet = enc == BYTES_BASE64 ? b64 : b64url;
+		const size_t	full = len / 3;
+		const size_t	rem = len % 3;
+		size_t			i;
+
+		Tcl_DStringSetLength(ds, ofs + (len+2)/3*4);
+		o = Tcl_DStringValue(ds) + ofs;
+		for (i=0; i<full*3; i+=3) {
+			const uint32_t	w = bytes[i] << 16 | bytes[i+1] << 8 | bytes[i+2];
+			*o++ = alphabet[w >> 18];
+			*o++ = alphabet[(w >> 12) & 0x3f];
+			*o++ = alphabet[(w >> 6) & 0x3f];
+			*o++ = alphabet[w & 0x3f];
+		}
+		if (rem) {
+			const uint32_t	w = bytes[i] << 16 | (rem == 2 ? bytes[i+1] << 8 : 0);
+			*o++ = alphabet[w >> 18];
+			*o++ = alphabet[(w >> 12) & 0x3f];
+			if (rem == 2) *o++ = alphabet[(w >> 6) & 0x3f];
+			if (enc == BYTES_BASE64) {
+				if (rem == 1) *o++ = '=';
+				*o++ = '=';
+			}
+		}
+		Tcl_DStringSetLength(ds, o - Tcl_DStringValue(ds));
+	}
+}
+
+//}}}
+void append_json_escaped(Tcl_DString* ds, const uint8_t* s, size_t len) //{{{
+{
+	// Append s as the body of a JSON string.  s can be raw UTF-8 or a Tcl string rep (with nulls as C0 80)
+	const uint8_t*	e = s + len;
+	const uint8_t*	chunk = s;
+	const uint8_t*	p = s;
+	char			ustr[7];
+
+	while (p < e) {
+		const uint8_t	c = *p;
+
+		if (likely(c > 0x1f && c != '"' && c != '\\' && c != 0xC0)) {
+			p++;
+			continue;
+		}
+
+		if (c == 0xC0 && !(e-p >= 2 && p[1] == 0x80)) {
+			p++;
+			continue;
+		}
+
+		Tcl_DStringAppend(ds, (const char*)chunk, p-chunk);
+		switch (c) {
+			case '"':	Tcl_DStringAppend(ds, "\\\"", 2); break;
+			case '\\':	Tcl_DStringAppend(ds, "\\\\", 2); break;
+			case 0x8:	Tcl_DStringAppend(ds, "\\b", 2); break;
+			case 0xC:	Tcl_DStringAppend(ds, "\\f", 2); break;
+			case 0xA:	Tcl_DStringAppend(ds, "\\n", 2); break;
+			case 0xD:	Tcl_DStringAppend(ds, "\\r", 2); break;
+			case 0x9:	Tcl_DStringAppend(ds, "\\t", 2); break;
+			case 0xC0:	Tcl_DStringAppend(ds, "\\u0000", 6); p++; break;	// Tcl's encoding of U+0000
+			default:
+				snprintf(ustr, 7, "\\u%04X", c);
+				Tcl_DStringAppend(ds, ustr, 6);
+				break;
+		}
+		p++;
+		chunk = p;
+	}
+
+	Tcl_DStringAppend(ds, (const char*)chunk, p-chunk);
+}
+
+//}}}
+static int cbor_to_json(Tcl_Interp* interp, struct interp_cx* l, const uint8_t** pPtr, const uint8_t* e, enum bytes_encoding enc, Tcl_DString* ds, Tcl_Obj** resPtr) //{{{
+{
+	/* Convert the data item at *pPtr to JSON.  If ds is not NULL the JSON
+	 * text is appended to it (as UTF-8, which the caller converts to a Tcl
+	 * string), otherwise a JSON value is built and left in *resPtr.
+	 */
+	int				code = TCL_OK;
+	const uint8_t*	p = *pPtr;
+	Tcl_Obj*		res = NULL;
+	Tcl_Obj*		tmp1 = NULL;
+	Tcl_Obj*		tmp2 = NULL;
+	Tcl_DString		scratch;
+	uint64_t		tag = UINT64_MAX;	// Innermost tag on this item, if any
+	char			numbuf[JSON_DOUBLE_BUFSIZE];
+	const uint8_t*	valPtr;
+
+	Tcl_DStringInit(&scratch);
+
+	#define TAKE(n) do { \
+		const size_t	nb = n; \
+		if (e - p < nb) CBOR_TRUNCATED(finally, code); \
+		valPtr = p; \
+		p += nb; \
+	} while (0)
+
+read_dataitem:
+	TAKE(1);
+	const uint8_t		ib = valPtr[0];
+	const enum cbor_mt	mt = ib >> 5;
+	const uint8_t		ai = ib & 0x1f;
+	uint64_t			val = ai;
+
+	switch (ai) {
+		case 24: TAKE(1); val = *(uint8_t*)valPtr;           break;
+		case 25: TAKE(2); val = be16toh(*(uint16_t*)valPtr); break;
+		case 26: TAKE(4); val = be32toh(*(uint32_t*)valPtr); break;
+		case 27: TAKE(8); val = be64toh(*(uint64_t*)valPtr); break;
+		case 28: case 29: case 30: CBOR_INVALID(finally, code, "reserved additional info value: %d", ai);
+		case 31:
+			switch (mt) {
+				case M_BSTR: case M_UTF8: case M_ARR: case M_MAP: break;
+				default: CBOR_INVALID(finally, code, "invalid indefinite length for major type %d", mt);
+			}
+			break;
+	}
+
+	switch (mt) {
+		case M_TAG:
+			tag = val;
+			switch (tag) {
+				case 21: enc = BYTES_BASE64URL;	break;
+				case 22: enc = BYTES_BASE64;	break;
+				case 23: enc = BYTES_BASE16;	break;
+			}
+			goto read_dataitem;
+
+		case M_UINT:
+		case M_NINT:
+			if (ds) {
+				if (mt == M_NINT && val == UINT64_MAX) {
+					Tcl_DStringAppend(ds, "-18446744073709551616", -1);
+				} else {
+					const int len = mt == M_UINT ?
+						snprintf(numbuf, sizeof(numbuf), "%" PRIu64, val) :
+						snprintf(numbuf, sizeof(numbuf), "-%" PRIu64, val+1);
+					Tcl_DStringAppend(ds, numbuf, len);
+				}
+			} else {
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_NUMBER, mt == M_UINT ? new_tcl_uint64(val) : new_tcl_nint64(val)));
+			}
+			break;
+
+		case M_BSTR:
+		case M_UTF8:
+		{
+			const uint8_t*	str;
+			size_t			len;
+
+			if (ai == 31) {
+				for (;;) {
+					TAKE(1);
+					if (valPtr[0] == 0xFF) break;
+					const enum cbor_mt	chunk_mt = valPtr[0] >> 5;
+					if (chunk_mt != mt) CBOR_INVALID(finally, code, "String chunk type: %d doesn't match parent: %d", chunk_mt, mt);
+					const uint8_t		chunk_ai = valPtr[0] & 0x1f;
+					uint64_t			chunk_val;
+
+					switch (chunk_ai) {
+						case 0 ... 23:    chunk_val = chunk_ai; break;
+						case 24: TAKE(1); chunk_val = *(uint8_t*)valPtr;           break;
+						case 25: TAKE(2); chunk_val = be16toh(*(uint16_t*)valPtr); break;
+						case 26: TAKE(4); chunk_val = be32toh(*(uint32_t*)valPtr); break;
+						case 27: TAKE(8); chunk_val = be64toh(*(uint64_t*)valPtr); break;
+						default: CBOR_INVALID(finally, code, "invalid chunk additional info: %d", chunk_ai);
+					}
+					TAKE(chunk_val);
+					Tcl_DStringAppend(&scratch, (const char*)valPtr, chunk_val);
+				}
+				str = (const uint8_t*)Tcl_DStringValue(&scratch);
+				len = Tcl_DStringLength(&scratch);
+			} else {
+				TAKE(val);
+				str = valPtr;
+				len = val;
+			}
+
+			if (mt == M_BSTR && (tag == 2 || tag == 3)) { // Bignum {{{
+				mp_int	n = {0};
+
+				if (mp_init(&n) != MP_OKAY) Tcl_Panic("mp_init failed");
+				for (size_t i=0; i<len; i++) {
+					if (mp_mul_2d(&n, 8, &n) != MP_OKAY || mp_add_d(&n, str[i], &n) != MP_OKAY)
+						Tcl_Panic("bignum arithmetic failed");
+				}
+				if (tag == 3) {
+					// Value is -1-n
+					if (mp_add_d(&n, 1, &n) != MP_OKAY || mp_neg(&n, &n) != MP_OKAY)
+						Tcl_Panic("bignum arithmetic failed");
+				}
+				replace_tclobj(&tmp1, Tcl_NewBignumObj(&n));	// Clears n
+				if (ds) {
+					int			numlen;
+					const char*	num = Tcl_GetStringFromObj(tmp1, &numlen);
+					Tcl_DStringAppend(ds, num, numlen);
+				} else {
+					replace_tclobj(&res, JSON_NewJvalObj(JSON_NUMBER, tmp1));
+				}
+				break;
+			}
+			//}}}
+
+			if (ds) {
+				Tcl_DStringAppend(ds, "\"", 1);
+				if (mt == M_UTF8) {
+					append_json_escaped(ds, str, len);
+				} else {
+					append_bytes_encoded(ds, str, len, enc);
+				}
+				Tcl_DStringAppend(ds, "\"", 1);
+			} else {
+				if (mt == M_UTF8) {
+					TEST_OK_LABEL(finally, code, utf8_to_tclobj(interp, str, len, &tmp1));
+				} else {
+					Tcl_DString	encoded;
+
+					Tcl_DStringInit(&encoded);
+					append_bytes_encoded(&encoded, str, len, enc);
+					replace_tclobj(&tmp1, Tcl_NewStringObj(Tcl_DStringValue(&encoded), Tcl_DStringLength(&encoded)));
+					Tcl_DStringFree(&encoded);
+				}
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_STRING, tmp1));
+			}
+			break;
+		}
+
+		case M_ARR:
+		{
+			if (ds) {
+				Tcl_DStringAppend(ds, "[", 1);
+			} else {
+				replace_tclobj(&tmp2, Tcl_NewListObj(0, NULL));
+			}
+
+			for (size_t i=0; ; i++) {
+				if (ai == 31) {
+					if (p >= e) CBOR_TRUNCATED(finally, code);
+					if (*p == 0xFF) {p++; break;}
+				} else {
+					if (i >= val) break;
+				}
+
+				if (ds) {
+					if (i > 0) Tcl_DStringAppend(ds, ",", 1);
+					TEST_OK_LABEL(finally, code, cbor_to_json(interp, l, &p, e, enc, ds, NULL));
+				} else {
+					TEST_OK_LABEL(finally, code, cbor_to_json(interp, l, &p, e, enc, NULL, &tmp1));
+					TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(interp, tmp2, tmp1));
+				}
+			}
+
+			if (ds) {
+				Tcl_DStringAppend(ds, "]", 1);
+			} else {
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_ARRAY, tmp2));
+			}
+			break;
+		}
+
+		case M_MAP:
+		{
+			Tcl_Obj*	key = NULL;
+
+			if (ds) {
+				Tcl_DStringAppend(ds, "{", 1);
+			} else {
+				replace_tclobj(&tmp2, Tcl_NewDictObj());
+			}
+
+			for (size_t i=0; ; i++) {
+				if (ai == 31) {
+					if (p >= e) CBOR_TRUNCATED(finally, code);
+					if (*p == 0xFF) {p++; break;}
+				} else {
+					if (i >= val) break;
+				}
+
+				if (ds && i > 0) Tcl_DStringAppend(ds, ",", 1);
+
+				if ((*p >> 5) == M_UTF8 && ds) {
+					// Text string key: can be written straight out
+					TEST_OK_LABEL(finally, code, cbor_to_json(interp, l, &p, e, enc, ds, NULL));
+				} else {
+					enum json_types	keytype;
+					Tcl_Obj*		keyval = NULL;
+
+					// Other key types are converted to a JSON value, and keyed by its text
+					TEST_OK_LABEL(finally, code, cbor_to_json(interp, l, &p, e, enc, NULL, &tmp1));
+					TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, tmp1, &keytype, &keyval));
+					key = keytype == JSON_STRING ? keyval : tmp1;
+					if (ds) {
+						int			keylen;
+						const char*	keystr = Tcl_GetStringFromObj(key, &keylen);
+
+						Tcl_DStringAppend(ds, "\"", 1);
+						append_json_escaped(ds, (const uint8_t*)keystr, keylen);
+						Tcl_DStringAppend(ds, "\"", 1);
+					} else {
+						Tcl_IncrRefCount(key);
+						replace_tclobj(&tmp1, key);
+						Tcl_DecrRefCount(key);
+					}
+				}
+
+				if (ds) {
+					Tcl_DStringAppend(ds, ":", 1);
+					TEST_OK_LABEL(finally, code, cbor_to_json(interp, l, &p, e, enc, ds, NULL));
+				} else {
+					Tcl_Obj*	v = NULL;
+
+					code = cbor_to_json(interp, l, &p, e, enc, NULL, &v);
+					if (code == TCL_OK)
+						code = Tcl_DictObjPut(interp, tmp2, tmp1, v);
+					replace_tclobj(&v, NULL);
+					if (code != TCL_OK) goto finally;
+				}
+			}
+
+			if (ds) {
+				Tcl_DStringAppend(ds, "}", 1);
+			} else {
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_OBJECT, tmp2));
+			}
+			break;
+		}
+
+		case M_REAL:
+		{
+			double	d;
+
+			switch (ai) {
+				case S_FALSE:
+				case S_TRUE:
+					if (ds) {
+						Tcl_DStringAppend(ds, ai == S_TRUE ? "true" : "false", -1);
+					} else {
+						replace_tclobj(&res, ai == S_TRUE ? l->json_true : l->json_false);
+					}
+					goto done;
+
+				case 24:
+					if (val < 32) CBOR_INVALID(finally, code, "invalid simple value: %" PRIu64, val);
+					goto null;
+
+				case 25:	d = decode_half(valPtr);	break;
+				case 26:	d = decode_float(valPtr);	break;
+				case 27:	d = decode_double(valPtr);	break;
+
+				default:	goto null;	// null, undefined and unassigned simple values
+			}
+
+			if (!isfinite(d)) goto null;
+
+			if (ds) {
+				Tcl_DStringAppend(ds, numbuf, json_format_double(d, numbuf));
+			} else {
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_NUMBER, Tcl_NewDoubleObj(d)));
+			}
+			break;
+
+		null:
+			if (ds) {
+				Tcl_DStringAppend(ds, "null", 4);
+			} else {
+				replace_tclobj(&res, l->json_null);
+			}
+			break;
+		}
+	}
+
+done:
+	if (resPtr) replace_tclobj(resPtr, res);
+
+finally:
+	#undef TAKE
+	replace_tclobj(&res, NULL);
+	replace_tclobj(&tmp1, NULL);
+	replace_tclobj(&tmp2, NULL);
+	Tcl_DStringFree(&scratch);
+	*pPtr = p;
+	return code;
+}
+
+//}}}
+// CBOR to JSON }}}
+// Sequences {{{
+/* cbor foreach iterates over a CBOR sequence (RFC 8742): data items
+ * concatenated with nothing between them.  From a channel, bytes that have
+ * been read but not yet yielded (a partial item at the end of what was
+ * available, or the rest of the sequence after a break) are kept with the
+ * channel for the next cbor foreach on it.
+ */
+struct cbor_foreach_state {
+	Tcl_Obj*				var;
+	Tcl_Obj*				script;
+	Tcl_Obj*				bytes;		// When iterating over a byte array, the bytes
+	size_t					ofs;		// ... and the offset of the next item in them
+	struct cbor_stream*		stream;		// When iterating over a channel
+};
+
+static void cbor_stream_release(struct cbor_stream* s) //{{{
+{
+	if (--s->refs > 0) return;
+
+	if (s->buf) {
+		ckfree(s->buf);
+		s->buf = NULL;
+	}
+	ckfree(s);
+}
+
+//}}}
+static void cbor_stream_closed(ClientData cdata) //{{{
+{
+	struct cbor_stream*	s = cdata;
+
+	s->chan = NULL;
+	if (s->he) {
+		Tcl_DeleteHashEntry(s->he);
+		s->he = NULL;
+	}
+	cbor_stream_release(s);
+}
+
+//}}}
+void cbor_streams_clear(struct interp_cx* l) //{{{
+{
+	Tcl_HashSearch	search;
+	Tcl_HashEntry*	he;
+
+	while ((he = Tcl_FirstHashEntry(&l->cbor_streams, &search))) {
+		struct cbor_stream*	s = Tcl_GetHashValue(he);
+
+		Tcl_DeleteCloseHandler(s->chan, cbor_stream_closed, s);
+		cbor_stream_closed(s);
+	}
+}
+
+//}}}
+static struct cbor_stream* cbor_stream_get(struct interp_cx* l, Tcl_Channel chan) //{{{
+{
+	Tcl_HashEntry*		he;
+	int					new;
+	struct cbor_stream*	s;
+
+	he = Tcl_CreateHashEntry(&l->cbor_streams, chan, &new);
+	if (!new) return Tcl_GetHashValue(he);
+
+	s = ckalloc(sizeof *s);
+	*s = (struct cbor_stream){
+		.he		= he,
+		.chan	= chan,
+		.refs	= 1		// Held by the table until the channel closes
+	};
+	Tcl_SetHashValue(he, s);
+	Tcl_CreateCloseHandler(chan, cbor_stream_closed, s);
+
+	return s;
+}
+
+//}}}
+static int cbor_stream_check(Tcl_Interp* interp, Tcl_Channel chan) //{{{
+{
+	/* Tcl_Read applies the channel's end of line translation and stops at
+	 * its eofchar, either of which would corrupt the items read, so insist
+	 * on input being read as it is (-translation binary, or lf)
+	 */
+	int			code = TCL_OK;
+	Tcl_DString	ds;
+	Tcl_Obj*	opt = NULL;
+	Tcl_Obj*	in = NULL;
+	int			binary;
+
+	Tcl_DStringInit(&ds);
+
+	TEST_OK_LABEL(finally, code, Tcl_GetChannelOption(interp, chan, "-translation", &ds));
+	replace_tclobj(&opt, Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+	TEST_OK_LABEL(finally, code, Tcl_ListObjIndex(interp, opt, 0, &in));
+	if (in == NULL || strcmp(Tcl_GetString(in), "lf") != 0) {
+		binary = 0;
+	} else {
+		Tcl_DStringSetLength(&ds, 0);
+		TEST_OK_LABEL(finally, code, Tcl_GetChannelOption(interp, chan, "-eofchar", &ds));
+		replace_tclobj(&opt, Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+		TEST_OK_LABEL(finally, code, Tcl_ListObjIndex(interp, opt, 0, &in));
+		binary = in == NULL || Tcl_GetCharLength(in) == 0;
+	}
+
+	if (!binary) {
+		Tcl_SetErrorCode(interp, "CBOR", "CHANNEL", "TRANSLATION", NULL);
+		THROW_PRINTF_LABEL(finally, code, "channel \"%s\" must be configured with -translation binary", Tcl_GetChannelName(chan));
+	}
+
+finally:
+	Tcl_DStringFree(&ds);
+	release_tclobj(&opt);
+	return code;
+}
+
+//}}}
+static int cbor_stream_fill(Tcl_Interp* interp, struct cbor_stream* s, int* gotPtr) //{{{
+{
+	/* Append whatever can be read from the channel without waiting for more
+	 * than the first byte.  *gotPtr is left 0 at the end of the channel, or if
+	 * it is non-blocking and nothing is available.
+	 */
+	int		code = TCL_OK;
+	int		got = 0;
+
+	if (s->start > 0) {
+		memmove(s->buf, s->buf + s->start, s->len - s->start);
+		s->len -= s->start;
+		s->start = 0;
+	}
+
+	for (int pass=0; pass<2; pass++) {
+		const int	avail = Tcl_InputBuffered(s->chan);
+		const int	want = avail > 0 ? avail : pass == 0 ? 1 : 0;
+		int			n;
+
+		if (want == 0) break;
+
+		if (s->len + want > s->cap) {
+			size_t	cap = s->cap ? s->cap : 4096;
+			while (cap < s->len + want) cap *= 2;
+			s->buf = ckrealloc(s->buf, cap);
+			s->cap = cap;
+		}
+
+		n = Tcl_Read(s->chan, (char*)s->buf + s->len, want);
+		if (n < 0) {
+			const char*	err = Tcl_PosixError(interp);
+			THROW_PRINTF_LABEL(finally, code, "error reading \"%s\": %s", Tcl_GetChannelName(s->chan), err);
+		}
+		if (n == 0) break;
+
+		s->len += n;
+		got += n;
+	}
+
+finally:
+	*gotPtr = got;
+	return code;
+}
+
+//}}}
+static int cbor_truncated(Tcl_Interp* interp) //{{{
+{
+	// Was the error just left in interp caused by running out of bytes?
+	Tcl_Obj*	options = NULL;
+	Tcl_Obj*	key = NULL;
+	Tcl_Obj*	errorcode = NULL;	// On loan from options
+	Tcl_Obj**	ev;
+	int			ec;
+	int			truncated = 0;
+
+	replace_tclobj(&options, Tcl_GetReturnOptions(interp, TCL_ERROR));
+	replace_tclobj(&key, Tcl_NewStringObj("-errorcode", -1));
+	if (
+		TCL_OK == Tcl_DictObjGet(NULL, options, key, &errorcode) &&
+		errorcode &&
+		TCL_OK == Tcl_ListObjGetElements(NULL, errorcode, &ec, &ev) &&
+		ec >= 2 &&
+		strcmp(Tcl_GetString(ev[0]), "CBOR") == 0 &&
+		strcmp(Tcl_GetString(ev[1]), "TRUNCATED") == 0
+	) truncated = 1;
+
+	replace_tclobj(&options, NULL);
+	replace_tclobj(&key, NULL);
+	return truncated;
+}
+
+//}}}
+static int cbor_next_item(Tcl_Interp* interp, struct cbor_foreach_state* state, Tcl_Obj** itemPtr) //{{{
+{
+	/* Set *itemPtr to the next item of the sequence as a byte array, or NULL
+	 * if there are no more (for now, for a non-blocking channel).
+	 */
+	int				code = TCL_OK;
+	const uint8_t*	p;
+
+	*itemPtr = NULL;
+
+	if (state->bytes) {
+		size_t			len;
+		const uint8_t*	bytes = cbor_get_bytes(interp, state->bytes, NULL, &len);	// Fetched again each time: the script may have shimmered it
+
+		if (bytes == NULL) {code = TCL_ERROR; goto finally;}
+		if (state->ofs >= len) goto finally;
+		p = bytes + state->ofs;
+		TEST_OK_LABEL(finally, code, well_formed(interp, &p, bytes+len, 0, NULL));
+		*itemPtr = Tcl_NewByteArrayObj(bytes + state->ofs, p - (bytes + state->ofs));
+		state->ofs = p - bytes;
+		goto finally;
+	}
+
+	struct cbor_stream*	s = state->stream;
+
+	for (;;) {
+		int		got;
+
+		if (s->chan == NULL) goto finally;	// Closed by the script
+
+		if (s->start < s->len) {
+			p = s->buf + s->start;
+			if (TCL_OK == well_formed(interp, &p, s->buf + s->len, 0, NULL)) {
+				*itemPtr = Tcl_NewByteArrayObj(s->buf + s->start, p - (s->buf + s->start));
+				s->start = p - s->buf;
+				goto finally;
+			}
+			if (!cbor_truncated(interp)) {
+				code = TCL_ERROR;
+				goto finally;
+			}
+			Tcl_ResetResult(interp);
+		}
+
+		TEST_OK_LABEL(finally, code, cbor_stream_fill(interp, s, &got));
+		if (got > 0) continue;
+
+		if (Tcl_Eof(s->chan) && s->start < s->len) {
+			// The sequence ends part way through an item
+			s->start = s->len;
+			CBOR_TRUNCATED(finally, code);
+		}
+		goto finally;	// End of the channel, or nothing more available yet
+	}
+
+finally:
+	return code;
+}
+
+//}}}
+static void cbor_foreach_free(struct cbor_foreach_state* state) //{{{
+{
+	replace_tclobj(&state->var, NULL);
+	replace_tclobj(&state->script, NULL);
+	replace_tclobj(&state->bytes, NULL);
+	if (state->stream) {
+		cbor_stream_release(state->stream);
+		state->stream = NULL;
+	}
+	ckfree(state);
+}
+
+//}}}
+static int cbor_foreach_bottom(ClientData cdata[], Tcl_Interp* interp, int code);
+static int cbor_foreach_top(Tcl_Interp* interp, struct cbor_foreach_state* state) //{{{
+{
+	int			code = TCL_OK;
+	Tcl_Obj*	item = NULL;
+
+	TEST_OK_LABEL(finally, code, cbor_next_item(interp, state, &item));
+	if (item == NULL) {
+		Tcl_ResetResult(interp);
+		goto finally;
+	}
+
+	if (NULL == Tcl_ObjSetVar2(interp, state->var, NULL, item, TCL_LEAVE_ERR_MSG)) {
+		code = TCL_ERROR;
+		goto finally;
+	}
+
+	Tcl_NRAddCallback(interp, cbor_foreach_bottom, state, NULL, NULL, NULL);
+	return Tcl_NREvalObj(interp, state->script, 0);
+
+finally:
+	cbor_foreach_free(state);
+	return code;
+}
+
+//}}}
+static int cbor_foreach_bottom(ClientData cdata[], Tcl_Interp* interp, int code) //{{{
+{
+	struct cbor_foreach_state*	state = cdata[0];
+
+	switch (code) {
+		case TCL_OK:
+		case TCL_CONTINUE:
+			return cbor_foreach_top(interp, state);
+
+		case TCL_BREAK:
+			Tcl_ResetResult(interp);
+			code = TCL_OK;
+			break;
+
+		case TCL_ERROR:
+			Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf("\n    (\"cbor foreach\" body line %d)", Tcl_GetErrorLine(interp)));
+			break;
+	}
+
+	cbor_foreach_free(state);
+	return code;
+}
+
+//}}}
+// Sequences }}}
+// Private API }}}
+// Stubs API {{{
+int CBOR_GetDataItemFromPath(Tcl_Interp* interp, Tcl_Obj* cborObj, Tcl_Obj* pathObj, const uint8_t** dataitemPtr, const uint8_t** ePtr, Tcl_DString* tagsPtr) //{{{
+{
+	int						code = TCL_OK;
+	Tcl_Obj**				pathv = NULL;
+	int						pathc = 0;
+	const uint8_t*			p = NULL;
+	size_t					byteslen = 0;
+	const uint8_t*			bytes = NULL;
+	const uint8_t*			circular_static[CIRCULAR_STATIC_SLOTS];	// On the stack: path lookups can run concurrently in other threads
+	const uint8_t**			circular = circular_static;
+	struct interp_cx*		l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	struct cbor_index_entry*	ix = NULL;
+	struct cbor_container*	idx = NULL;
+	const uint8_t*			head = NULL;
+
+	Tcl_Obj*				src = NULL;	// The byte array holding the value: cborObj unless it is lazy
+
+	p = cbor_get_bytes(interp, cborObj, &src, &byteslen);
+	if (p == NULL) {code = TCL_ERROR; goto finally;}
+	TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, pathObj, &pathc, &pathv));
+	if (pathc > 0 && l) {
+		// Lazy values share the offset index of the whole value they are part of
+		int		srclen;
+		bytes = Tcl_GetByteArrayFromObj(src, &srclen);
+		ix = cbor_index_lookup(l, src, bytes, srclen);
+	}
+
+	const uint8_t*const	e = p + byteslen;
+	*ePtr = e;
+
+	const uint8_t*	valPtr;
+
+	#define TAKE(n) do { \
+		const size_t	nb = n; \
+		if (e - p < nb) CBOR_TRUNCATED(finally, code); \
+		valPtr = p; \
+		p += nb; \
+	} while (0)
+
+
+	for (int pathi=0; pathi<pathc; pathi++) {
+		Tcl_Obj*	pathElem = pathv[pathi];
+		Tcl_DStringSetLength(tagsPtr, 0);
+
+	data_item: // loop: read off tags
+		// Read head {{{
+		head = p;
+		TAKE(1);
+		const uint8_t	ib = valPtr[0];
 		const uint8_t	mt = ib >> 5;
 		const uint8_t	ai = ib & 0x1f;
 		uint64_t		val = ai;
@@ -1034,34 +2724,37 @@ int CBOR_GetDataItemFromPath(Tcl_Interp* interp, Tcl_Obj* cborObj, Tcl_Obj* path
 
 				TEST_OK_LABEL(finally, code, parse_index(interp, pathElem, &mode, &ofs));
 				const size_t	absofs = ofs < 0 ? ofs*-1 : ofs;
+
+				if (ix && (idx = cbor_index_container(interp, ix, head, p, e, mt, ai, val))) {
+					const ssize_t	i = mode == IDX_ENDREL ? (ssize_t)idx->count-1 + ofs : ofs;
+
+					if (i < 0 || i >= idx->count) goto not_found;
+					p = ix->bytes + idx->ofs[i];
+					goto next_path_elem;
+				}
+
 				if (mode == IDX_ENDREL) { //{{{
 					if (ai == 31) { // end-x, indefinite length array {{{
-						uint8_t		elem_mt;
-
-						// Skip absofs elements
-						for (ssize_t i=0; i<absofs; i++) {
-							TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 1, &elem_mt));
-							if (elem_mt == -1) goto not_found;	// Index before start: reached end of indefinite array before skipping enough
-						}
+						uint8_t			elem_mt;
+						const size_t	slots = absofs+2;	// The indexed element, the absofs elements after it and the break
+						size_t			count = 0;
 
-						// Start recording the offsets so that when we reach the end we can look back ofs elements
-						if (circular != g_circular_buf) {
+						// Record the offsets of the last slots elements, so that when we reach the end we can look back absofs elements
+						if (circular != circular_static) {
 							ckfree(circular);
-							circular = g_circular_buf;
+							circular = circular_static;
 						}
-						if (absofs > CIRCULAR_STATIC_SLOTS) circular = ckalloc(absofs * sizeof(uint8_t*));
-						for (ssize_t c=0; ; c = (c+1)%absofs) {
-							circular[c] = p;
-							TEST_OK_LABEL(finally, code, well_formed_indefinite(interp, &p, e, 1, &elem_mt, mt));
-							if (elem_mt == -1) {
-								// Found the end: c-1 is the index of the last element, circular[(c-1+ofs)%absofs] is the indexed element
-								p = circular[((c-1+ofs)%absofs + absofs)%absofs];
-								break;
-							}
+						if (slots > CIRCULAR_STATIC_SLOTS) circular = ckalloc(slots * sizeof(uint8_t*));
+						for (;; count++) {
+							circular[count % slots] = p;
+							TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 1, &elem_mt));
+							if (elem_mt == MT_BREAK) break;
 						}
+						if (count < absofs+1) goto not_found;	// Index before start
+						p = circular[(count+1) % slots];
 						//}}}
 					} else { // end-x, known length array {{{
-						if (val-1 - ofs < 0) goto not_found;	// Index before start
+						if ((ssize_t)val-1 + ofs < 0) goto not_found;	// Index before start
 						// Skip val-1+ofs elements
 						const size_t skip = val-1+ofs;
 						for (ssize_t i=0; i<skip; i++) TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 1, NULL));
@@ -1069,13 +2762,14 @@ int CBOR_GetDataItemFromPath(Tcl_Interp* interp, Tcl_Obj* cborObj, Tcl_Obj* path
 					//}}}
 					//}}}
 				} else { //{{{
+					if (ofs < 0) goto not_found;
 					if (ai == 31) { // ofs x, indefinite length array {{{
 						const uint8_t*	last_p = p;
 						for (ssize_t i=0; i<ofs+1; i++) { // Need to visit the referenced elem to be sure it isn't the break symbol (end of array)
 							uint8_t	elem_mt;
 							last_p = p;
-							TEST_OK_LABEL(finally, code, well_formed_indefinite(interp, &p, e, 1, &elem_mt, mt));
-							if (elem_mt == -1) goto not_found;	// Index beyond end
+							TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 1, &elem_mt));
+							if (elem_mt == MT_BREAK) goto not_found;	// Index beyond end
 						}
 						p = last_p;
 						//}}}
@@ -1090,6 +2784,20 @@ int CBOR_GetDataItemFromPath(Tcl_Interp* interp, Tcl_Obj* cborObj, Tcl_Obj* path
 			}
 			//}}}
 			case M_MAP: //{{{
+				if (ix && (idx = cbor_index_container(interp, ix, head, p, e, mt, ai, val))) {
+					for (size_t i=0; i<idx->count; i++) {
+						const uint8_t*	k = ix->bytes + idx->ofs[i*2];
+						int				matches;
+
+						TEST_OK_LABEL(finally, code, cbor_matches(interp, &k, e, pathElem, &matches));
+						if (matches) {
+							p = ix->bytes + idx->ofs[i*2+1];
+							goto next_path_elem;
+						}
+					}
+					goto not_found;
+				}
+
 				for (size_t i=0; ; i++) {
 					if (ai == 31) {
 						if (p >= e) CBOR_TRUNCATED(finally, code);
@@ -1121,9 +2829,9 @@ int CBOR_GetDataItemFromPath(Tcl_Interp* interp, Tcl_Obj* cborObj, Tcl_Obj* path
 
 finally:
 	#undef TAKE
-	if (circular != g_circular_buf) {
+	if (circular != circular_static) {
 		ckfree(circular);
-		circular = g_circular_buf;
+		circular = circular_static;
 	}
 	return code;
 
@@ -1139,7 +2847,7 @@ int CBOR_Length(Tcl_Interp* interp, const uint8_t* p, const uint8_t* e, size_t*
 	const uint8_t*	pl = p;
 
 	TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
-	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(p-pl));
+	*lenPtr = p - pl;
 
 finally:
 	return code;
@@ -1148,6 +2856,16 @@ finally:
 //}}}
 // Stubs API }}}
 // Script API {{{
+static int is_flag(Tcl_Obj* obj, const char* flag) //{{{
+{
+	/* Options are written in scripts, so they have a string rep.  Checking
+	 * for one this way avoids generating the string rep of a CBOR value in
+	 * the same place.
+	 */
+	return obj->bytes != NULL && strcmp(obj->bytes, flag) == 0;
+}
+
+//}}}
 static int cbor_nr_cmd(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj*const objv[]) //{{{
 {
 	int					code = TCL_OK;
@@ -1156,12 +2874,20 @@ static int cbor_nr_cmd(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj*c
 		"get",
 		"extract",
 		"wellformed",
+		"encode",
+		"tojson",
+		"foreach",
+		"index_cache",
 		NULL
 	};
 	enum {
 		OP_GET,
 		OP_EXTRACT,
 		OP_WELLFORMED,
+		OP_ENCODE,
+		OP_TOJSON,
+		OP_FOREACH,
+		OP_INDEX_CACHE,
 	};
 	int			op;
 	Tcl_Obj*	res = NULL;
@@ -1178,11 +2904,20 @@ static int cbor_nr_cmd(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj*c
 	switch (op) {
 		case OP_GET: //{{{
 		{
-			enum {A_cmd=A_OP, A_CBOR, A_args};
-			const int A_PATH = A_args;
-			CHECK_MIN_ARGS_LABEL(finally, code, "cbor ?key ...?");
+			int	lazy = 0;
+			int	A_CBOR = 2;
 
-			replace_tclobj(&path, Tcl_NewListObj(objc-A_PATH, objv+A_PATH));
+			if (objc > 3 && is_flag(objv[A_CBOR], "-lazy")) {
+				lazy = 1;
+				A_CBOR++;
+			}
+			if (objc <= A_CBOR) {
+				Tcl_WrongNumArgs(interp, 2, objv, "?-lazy? cbor ?key ...?");
+				code = TCL_ERROR;
+				goto finally;
+			}
+
+			replace_tclobj(&path, Tcl_NewListObj(objc-A_CBOR-1, objv+A_CBOR+1));
 
 			const uint8_t*	dataitem = NULL;
 			const uint8_t*	e = NULL;
@@ -1191,6 +2926,30 @@ static int cbor_nr_cmd(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj*c
 				Tcl_SetErrorCode(interp, "CBOR", "NOTFOUND", Tcl_GetString(path), NULL);
 				THROW_ERROR_LABEL(finally, code, "path not found");
 			}
+
+			if (lazy) {
+				// Arrays and maps are left as references to their bytes
+				const uint8_t*	item = dataitem;
+				const uint8_t*	p = dataitem;
+				const uint8_t*	q = dataitem;
+
+				TEST_OK_LABEL(finally, code, well_formed(interp, &p, e, 0, NULL));
+				while (*q >> 5 == M_TAG) {	// Tag heads are well formed: checked above
+					const uint8_t	ai = *q & 0x1f;
+					q += ai < 24 ? 1 : 1 + (1 << (ai - 24));
+				}
+				if (*q >> 5 == M_ARR || *q >> 5 == M_MAP) {
+					Tcl_Obj*		src = NULL;
+					size_t			srclen;
+					const uint8_t*	base;
+
+					cbor_get_bytes(interp, objv[A_CBOR], &src, &srclen);
+					base = Tcl_GetByteArrayFromObj(src, NULL);
+					Tcl_SetObjResult(interp, new_cbor_lazy(src, item - base, p - item));
+					break;
+				}
+			}
+
 			TEST_OK_LABEL(finally, code, cbor_get_obj(interp, &dataitem, e, &res, NULL));
 
 			/*
@@ -1253,10 +3012,12 @@ static int cbor_nr_cmd(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj*c
 			enum {A_cmd=A_OP, A_BYTES, A_objc};
 			CHECK_ARGS_LABEL(finally, code, "bytes");
 
-			int				len;
-			const uint8_t*	bytes = Tcl_GetByteArrayFromObj(objv[A_BYTES], &len);
+			size_t			len;
+			const uint8_t*	bytes = cbor_get_bytes(interp, objv[A_BYTES], NULL, &len);
 			const uint8_t*	p = bytes;
 
+			if (bytes == NULL) {code = TCL_ERROR; goto finally;}
+
 			TEST_OK_LABEL(finally, code, well_formed(interp, &p, bytes+len, 0, NULL));
 			if (p != bytes+len) CBOR_TRAILING(finally, code);
 
@@ -1264,6 +3025,187 @@ static int cbor_nr_cmd(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj*c
 			break;
 		}
 		//}}}
+		case OP_ENCODE: //{{{
+		{
+			static const char* options[] = {
+				"-canonical",
+				"-typed",
+				NULL
+			};
+			enum {
+				O_CANONICAL,
+				O_TYPED
+			};
+			int			canonical = 0, typed = 0;
+			Tcl_DString	ds;
+
+			if (objc < 3) {
+				Tcl_WrongNumArgs(interp, 2, objv, "?-canonical? ?-typed? value");
+				code = TCL_ERROR;
+				goto finally;
+			}
+
+			for (int i=2; i<objc-1; i++) {
+				int		option;
+				TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT, &option));
+				switch (option) {
+					case O_CANONICAL:	canonical = 1;	break;
+					case O_TYPED:		typed = 1;		break;
+				}
+			}
+
+			Tcl_DStringInit(&ds);
+			code = typed ?
+				encode_typed(interp, l, &ds, canonical, objv[objc-1]) :
+				encode_json( interp, l, &ds, canonical, objv[objc-1]);
+			if (code == TCL_OK)
+				Tcl_SetObjResult(interp, Tcl_NewByteArrayObj((const uint8_t*)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+			Tcl_DStringFree(&ds);
+			break;
+		}
+		//}}}
+		case OP_TOJSON: //{{{
+		{
+			int	text = 0;
+			int	A_CBOR = 2;
+
+			if (objc > 3 && is_flag(objv[A_CBOR], "-text")) {
+				text = 1;
+				A_CBOR++;
+			}
+			if (objc <= A_CBOR) {
+				Tcl_WrongNumArgs(interp, 2, objv, "?-text? cbor ?key ...?");
+				code = TCL_ERROR;
+				goto finally;
+			}
+
+			replace_tclobj(&path, Tcl_NewListObj(objc-A_CBOR-1, objv+A_CBOR+1));
+
+			const uint8_t*	dataitem = NULL;
+			const uint8_t*	e = NULL;
+			TEST_OK_LABEL(finally, code, CBOR_GetDataItemFromPath(interp, objv[A_CBOR], path, &dataitem, &e, &tags));
+			if (dataitem == NULL) {
+				Tcl_SetErrorCode(interp, "CBOR", "NOTFOUND", Tcl_GetString(path), NULL);
+				THROW_ERROR_LABEL(finally, code, "path not found");
+			}
+
+			if (text) {
+				Tcl_DString	ds;
+
+				Tcl_DStringInit(&ds);
+				code = cbor_to_json(interp, l, &dataitem, e, BYTES_BASE64URL, &ds, NULL);
+				if (code == TCL_OK)
+					code = utf8_to_tclobj(interp, (const uint8_t*)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds), &res);
+				Tcl_DStringFree(&ds);
+				if (code != TCL_OK) goto finally;
+			} else {
+				TEST_OK_LABEL(finally, code, cbor_to_json(interp, l, &dataitem, e, BYTES_BASE64URL, NULL, &res));
+			}
+
+			Tcl_SetObjResult(interp, res);
+			break;
+		}
+		//}}}
+		case OP_FOREACH: //{{{
+		{
+			/* cbor foreach var bytes script iterates over the sequence in
+			 * bytes, cbor foreach -channel chan var script over the one read
+			 * from chan.  The source is never guessed from its value: a
+			 * sequence could happen to be the name of a channel
+			 */
+			struct cbor_foreach_state*	state = NULL;
+			Tcl_Obj*					source = NULL;
+			Tcl_Channel					chan = NULL;
+			Tcl_Obj*					var = NULL;
+			Tcl_Obj*					script = NULL;
+			int							mode;
+
+			if (objc > 2 && is_flag(objv[2], "-channel")) {
+				enum {A_cmd=A_OP, A_FLAG, A_CHAN, A_VAR, A_SCRIPT, A_objc};
+				CHECK_ARGS_LABEL(finally, code, "-channel chan var script");
+
+				chan = Tcl_GetChannel(interp, Tcl_GetString(objv[A_CHAN]), &mode);
+				if (chan == NULL) {
+					code = TCL_ERROR;
+					goto finally;
+				}
+				if (!(mode & TCL_READABLE))
+					THROW_ERROR_LABEL(finally, code, "channel \"", Tcl_GetString(objv[A_CHAN]), "\" wasn't opened for reading");
+				TEST_OK_LABEL(finally, code, cbor_stream_check(interp, chan));
+				var		= objv[A_VAR];
+				script	= objv[A_SCRIPT];
+			} else {
+				enum {A_cmd=A_OP, A_VAR, A_BYTES, A_SCRIPT, A_objc};
+				CHECK_ARGS_LABEL(finally, code, "var bytes script");
+
+				size_t	len;
+
+				source	= objv[A_BYTES];
+				if (cbor_get_bytes(interp, source, NULL, &len) == NULL) {
+					code = TCL_ERROR;
+					goto finally;
+				}
+				var		= objv[A_VAR];
+				script	= objv[A_SCRIPT];
+			}
+
+			state = ckalloc(sizeof *state);
+			*state = (struct cbor_foreach_state){0};
+			replace_tclobj(&state->var,    var);
+			replace_tclobj(&state->script, script);
+			if (chan) {
+				state->stream = cbor_stream_get(l, chan);
+				state->stream->refs++;
+			} else {
+				replace_tclobj(&state->bytes, source);
+			}
+
+			code = cbor_foreach_top(interp, state);	// Takes ownership of state
+			break;
+		}
+		//}}}
+		case OP_INDEX_CACHE: //{{{
+		{
+			static const char* cache_ops[] = {
+				"clear",
+				"stats",
+				NULL
+			};
+			enum {
+				CACHE_CLEAR,
+				CACHE_STATS
+			};
+			int	cache_op;
+
+			enum {A_cmd=A_OP, A_CACHE_OP, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "clear|stats");
+
+			TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[A_CACHE_OP], cache_ops, "operation", TCL_EXACT, &cache_op));
+
+			switch (cache_op) {
+				case CACHE_CLEAR:
+					cbor_index_clear(l);
+					l->cbor_index_hits = 0;
+					l->cbor_index_misses = 0;
+					l->cbor_index_evictions = 0;
+					break;
+
+				case CACHE_STATS:
+					replace_tclobj(&res, Tcl_NewDictObj());
+					TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, res, Tcl_NewStringObj("size", -1),      Tcl_NewIntObj(l->cbor_index_count)));
+					TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, res, Tcl_NewStringObj("capacity", -1),  Tcl_NewIntObj(CBOR_INDEX_CACHE_SIZE)));
+					TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, res, Tcl_NewStringObj("hits", -1),      Tcl_NewWideIntObj(l->cbor_index_hits)));
+					TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, res, Tcl_NewStringObj("misses", -1),    Tcl_NewWideIntObj(l->cbor_index_misses)));
+					TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, res, Tcl_NewStringObj("evictions", -1), Tcl_NewWideIntObj(l->cbor_index_evictions)));
+					Tcl_SetObjResult(interp, res);
+					break;
+
+				default:
+					THROW_ERROR_LABEL(finally, code, "Unhandled operation");
+			}
+			break;
+		}
+		//}}}
 		default: THROW_ERROR_LABEL(finally, code, "op not implemented yet");
 	}
 
@@ -1287,6 +3229,10 @@ int cbor_init(Tcl_Interp* interp, struct interp_cx* l) //{{{
 {
 	int		code = TCL_OK;
 
+	g_list_type			= Tcl_GetObjType("list");
+	g_dict_type			= Tcl_GetObjType("dict");
+	g_bytearray_type	= Tcl_GetObjType("bytearray");
+
 	Tcl_NRCreateCommand(interp, NS "::cbor", cbor_cmd, cbor_nr_cmd, l, NULL);
 
 	return code;
@@ -236,6 +236,18 @@ Tcl_ObjType json_dyn_literal = {
 
 Tcl_ObjType* g_objtype_for_type[JSON_TYPE_MAX];
 
+static void free_internal_rep_cache(Tcl_Obj* obj);
+static void dup_internal_rep_cache(Tcl_Obj* src, Tcl_Obj* dest);
+
+// Not a JSON value type - holds the struct json_cache in a JSON value's ptr2
+static Tcl_ObjType json_cache = {
+	"JSON_cache",
+	free_internal_rep_cache,
+	dup_internal_rep_cache,
+	NULL,		// The string rep is always the empty string
+	NULL
+};
+
 
 int JSON_IsJSON(Tcl_Obj* obj, enum json_types* type, Tcl_ObjInternalRep** ir) //{{{
 {
@@ -314,7 +326,7 @@ int JSON_SetIntRep(Tcl_Obj* target, enum json_types type, Tcl_Obj* replacement)
 	objtype = g_objtype_for_type[type];
 
 	// ptr1 is the Tcl_Obj holding the Tcl structure for this value               
-	// ptr2 holds the template actions, if any have been generated for this value 
+	// ptr2 holds the JSON_cache for this value, if anything has been cached
 	replace_tclobj((Tcl_Obj**)&intrep.twoPtrValue.ptr1, rep);
 
 	Tcl_StoreInternalRep(target, objtype, &intrep); record_instance(target);
@@ -553,8 +565,12 @@ static void update_string_rep_dyn_literal(Tcl_Obj* obj) //{{{
 }
 
 //}}}
-static int set_from_any(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_ObjType** objtype, enum json_types* out_type) //{{{
+static int parse_doc(Tcl_Interp* interp, Tcl_Obj* obj, enum parse_mode mode, enum json_types* out_type, Tcl_Obj** out) //{{{
 {
+	/* Parse the string rep of obj, setting *out to the top-level value and
+	 * *out_type to its type.  In PARSE mode the values are JSON values, in
+	 * NATIVE mode the Tcl values that convert_to_tcl would give for them.
+	 */
 	struct interp_cx*		l = NULL;
 	const unsigned char*	err_at = NULL;
 	const char*				errmsg = "Illegal character";
@@ -573,32 +589,6 @@ static int set_from_any(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_ObjType** objtype,
 	if (interp)
 		l = Tcl_GetAssocData(interp, "rl_json", NULL);
 
-#if 1
-	// Snoop on the intrep for clues on optimized conversions {{{
-	{
-		if (
-			l && (
-				(l->typeInt    && Tcl_FetchInternalRep(obj, l->typeInt)    != NULL) ||
-				(l->typeDouble && Tcl_FetchInternalRep(obj, l->typeDouble) != NULL) ||
-				(l->typeBignum && Tcl_FetchInternalRep(obj, l->typeBignum) != NULL)
-			)
-		) {
-			Tcl_ObjInternalRep		ir = {.twoPtrValue = {0}};
-
-			// Must dup because obj will soon be us, creating a circular ref
-			replace_tclobj((Tcl_Obj**)&ir.twoPtrValue.ptr1, Tcl_DuplicateObj(obj));
-			release_tclobj((Tcl_Obj**)&ir.twoPtrValue.ptr2);
-
-			*out_type = JSON_NUMBER;
-			*objtype = g_objtype_for_type[JSON_NUMBER];
-
-			Tcl_StoreInternalRep(obj, *objtype, &ir); record_instance(obj);
-			return TCL_OK;
-		}
-	}
-	// Snoop on the intrep for clues on optimized conversions }}}
-#endif
-
 	cx[0].prev = NULL;
 	cx[0].last = cx;
 	cx[0].hold_key = NULL;
@@ -607,7 +597,7 @@ static int set_from_any(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_ObjType** objtype,
 	cx[0].char_ofs = 0;
 	cx[0].closed = 0;
 	cx[0].l = l;
-	cx[0].mode = PARSE;
+	cx[0].mode = mode;
 
 	p = doc = (const unsigned char*)Tcl_GetStringFromObj(obj, &len);
 	e = p + len;
@@ -702,11 +692,16 @@ static int set_from_any(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_ObjType** objtype,
 			case JSON_DYN_JSON:
 			case JSON_DYN_TEMPLATE:
 			case JSON_DYN_LITERAL:
+				if (mode == NATIVE) {
+					// Just semantically normal JSON string values in this context
+					replace_tclobj(&val, Tcl_ObjPrintf("%s%s", get_dyn_prefix(type), Tcl_GetString(val)));
+				}
+				// Falls through
 			case JSON_STRING:
 			case JSON_BOOL:
 			case JSON_NULL:
 			case JSON_NUMBER:
-				append_to_cx(cx->last, JSON_NewJvalObj(type, val));
+				append_to_cx(cx->last, mode == NATIVE ? val : JSON_NewJvalObj(type, val));
 				if (unlikely(cx->last->container != JSON_OBJECT && cx->last->container != JSON_ARRAY))
 					cx->last->container = type;	// Record our type (at the document top-level)
 				break;
@@ -785,39 +780,128 @@ after_value:	// Yeah, goto.  But the alternative abusing loops was worse
 		goto whitespace_err;
 	}
 
-	//Tcl_FreeInternalRep(obj);
+	// Transfer our ref on cx[0].val to *out
+	replace_tclobj(out, cx[0].val);
+	release_tclobj(&cx[0].val);
+	*out_type = cx[0].container;
+	release_tclobj(&val);
+	return TCL_OK;
+
+whitespace_err:
+	parse_error(&details, errmsg, doc, (err_at - doc) - char_adj);
+
+err:
+	if (details.errmsg)
+		throw_parse_error(interp, &details);
 
+	release_tclobj(&val);
+	free_cx(cx);
+	return TCL_ERROR;
+}
+
+//}}}
+static int set_from_any(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_ObjType** objtype, enum json_types* out_type) //{{{
+{
+	struct interp_cx*		l = NULL;
+	Tcl_Obj*				top = NULL;
+
+	if (interp)
+		l = Tcl_GetAssocData(interp, "rl_json", NULL);
+
+	if (is_packed(obj)) { // Unpack from the tape rather than parsing the string rep {{{
+		Tcl_ObjInternalRep		ir = {.twoPtrValue = {0}};
+		Tcl_ObjInternalRep*		unpacked_ir = NULL;
+		Tcl_Obj*				unpacked = NULL;
+
+		if (TCL_OK != packed_to_json(interp, obj, &unpacked)) return TCL_ERROR;
+		if (!JSON_IsJSON(unpacked, out_type, &unpacked_ir))
+			Tcl_Panic("Unpacked value is not JSON");
+
+		replace_tclobj((Tcl_Obj**)&ir.twoPtrValue.ptr1, unpacked_ir->twoPtrValue.ptr1);
+		release_tclobj(&unpacked);
+
+		*objtype = g_objtype_for_type[*out_type];
+
+		// The unpacked intrep holds the same value, so there is no need for a string rep to keep it
+		Tcl_FreeInternalRep(obj);
+		Tcl_StoreInternalRep(obj, *objtype, &ir); record_instance(obj);
+		return TCL_OK;
+	}
+	//}}}
+
+#if 1
+	// Snoop on the intrep for clues on optimized conversions {{{
 	{
-		Tcl_ObjType*		top_objtype = g_objtype_for_type[cx[0].container];
-		Tcl_ObjInternalRep*	top_ir = Tcl_FetchInternalRep(cx[0].val, top_objtype);
+		if (
+			l && (
+				(l->typeInt    && Tcl_FetchInternalRep(obj, l->typeInt)    != NULL) ||
+				(l->typeDouble && Tcl_FetchInternalRep(obj, l->typeDouble) != NULL) ||
+				(l->typeBignum && Tcl_FetchInternalRep(obj, l->typeBignum) != NULL)
+			)
+		) {
+			Tcl_ObjInternalRep		ir = {.twoPtrValue = {0}};
+
+			// Must dup because obj will soon be us, creating a circular ref
+			replace_tclobj((Tcl_Obj**)&ir.twoPtrValue.ptr1, Tcl_DuplicateObj(obj));
+			release_tclobj((Tcl_Obj**)&ir.twoPtrValue.ptr2);
+
+			*out_type = JSON_NUMBER;
+			*objtype = g_objtype_for_type[JSON_NUMBER];
+
+			Tcl_StoreInternalRep(obj, *objtype, &ir); record_instance(obj);
+			return TCL_OK;
+		}
+	}
+	// Snoop on the intrep for clues on optimized conversions }}}
+#endif
+
+	if (parse_doc(interp, obj, PARSE, out_type, &top) != TCL_OK)
+		return TCL_ERROR;
+
+	{
+		Tcl_ObjType*		top_objtype = g_objtype_for_type[*out_type];
+		Tcl_ObjInternalRep*	top_ir = Tcl_FetchInternalRep(top, top_objtype);
 		Tcl_ObjInternalRep	ir = {.twoPtrValue = {0}};
 
 		if (unlikely(top_ir == NULL))
 			Tcl_Panic("Can't get intrep for the top container");
 
-		// We're transferring the ref from cx[0].val to our intrep
+		// We're transferring the ref from top to our intrep
 		replace_tclobj((Tcl_Obj**)&ir.twoPtrValue.ptr1, top_ir->twoPtrValue.ptr1);
 		release_tclobj((Tcl_Obj**)&ir.twoPtrValue.ptr2);
-		release_tclobj(&cx[0].val);
+		release_tclobj(&top);
 
 		Tcl_StoreInternalRep(obj, top_objtype, &ir); record_instance(obj);
 		*objtype = top_objtype;
-		*out_type = cx[0].container;
 	}
 
-	release_tclobj(&val);
 	return TCL_OK;
+}
 
-whitespace_err:
-	parse_error(&details, errmsg, doc, (err_at - doc) - char_adj);
+//}}}
+int parse_to_tcl(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** out) //{{{
+{
+	/* Parse obj directly into the Tcl values that convert_to_tcl would
+	 * produce from its JSON intrep, without building the JSON intrep first
+	 */
+	struct interp_cx*		l = NULL;
+	enum json_types			type;
 
-err:
-	if (details.errmsg)
-		throw_parse_error(interp, &details);
+	if (interp)
+		l = Tcl_GetAssocData(interp, "rl_json", NULL);
 
-	release_tclobj(&val);
-	free_cx(cx);
-	return TCL_ERROR;
+	if (
+		l && (
+			(l->typeInt    && Tcl_FetchInternalRep(obj, l->typeInt)    != NULL) ||
+			(l->typeDouble && Tcl_FetchInternalRep(obj, l->typeDouble) != NULL) ||
+			(l->typeBignum && Tcl_FetchInternalRep(obj, l->typeBignum) != NULL)
+		)
+	) {
+		replace_tclobj(out, obj);
+		return TCL_OK;
+	}
+
+	return parse_doc(interp, obj, NATIVE, &type, out);
 }
 
 //}}}
@@ -852,6 +936,77 @@ Tcl_Obj* get_unshared_val(Tcl_ObjInternalRep* ir) //{{{
 	return ir->twoPtrValue.ptr1;
 }
 
+//}}}
+static void free_internal_rep_cache(Tcl_Obj* obj) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_cache);
+
+	if (ir) {
+		struct json_cache*	cache = ir->otherValuePtr;
+
+		release_template_program(&cache->program);
+		release_template_fragments(&cache->fragments);
+		release_match_program(&cache->match);
+		release_tclobj(&cache->canonical);
+		ckfree(cache);
+		ir->otherValuePtr = NULL;
+	}
+}
+
+//}}}
+static void dup_internal_rep_cache(Tcl_Obj* src, Tcl_Obj* dest) //{{{
+{
+	Tcl_ObjInternalRep*	srcir = Tcl_FetchInternalRep(src, &json_cache);
+	Tcl_ObjInternalRep	destir;
+	struct json_cache*	cache = ckalloc(sizeof(*cache));
+
+	*cache = *(struct json_cache*)srcir->otherValuePtr;
+	if (cache->program) cache->program->refCount++;
+	if (cache->fragments) cache->fragments->refCount++;
+	if (cache->match) cache->match->refCount++;
+	if (cache->canonical) Tcl_IncrRefCount(cache->canonical);
+	destir.otherValuePtr = cache;
+	Tcl_StoreInternalRep(dest, &json_cache, &destir);
+}
+
+//}}}
+struct json_cache* get_json_cache(Tcl_ObjInternalRep* ir, int create) //{{{
+{
+	// Returns the cache for the JSON value whose intrep is ir, or NULL if it
+	// doesn't have one and create is false.  The cache may be shared with
+	// duplicates of the value, which is safe because they have the same
+	// value until one is modified (and releases its ref to the cache)
+	Tcl_Obj*			cacheobj = ir->twoPtrValue.ptr2;
+	Tcl_ObjInternalRep*	cacheir;
+
+	if (cacheobj == NULL) {
+		Tcl_ObjInternalRep	newir;
+		struct json_cache*	cache = NULL;
+
+		if (!create) return NULL;
+
+		cache = ckalloc(sizeof(*cache));
+		cache->program		= NULL;
+		cache->fragments	= NULL;
+		cache->match		= NULL;
+		cache->have_hash	= 0;
+		cache->hash			= 0;
+		cache->canonical	= NULL;
+		newir.otherValuePtr = cache;
+
+		cacheobj = Tcl_NewObj();
+		Tcl_StoreInternalRep(cacheobj, &json_cache, &newir);
+		replace_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2, cacheobj);
+		return cache;
+	}
+
+	cacheir = Tcl_FetchInternalRep(cacheobj, &json_cache);
+	if (cacheir == NULL)
+		Tcl_Panic("JSON value intrep ptr2 isn't a JSON_cache");
+
+	return cacheir->otherValuePtr;
+}
+
 //}}}
 
 int init_types(Tcl_Interp* interp) //{{{
@@ -0,0 +1,1351 @@
+#include "rl_jsonInt.h"
+
+/* MessagePack support, on the same terms as the CBOR support in cbor.c (and
+ * sharing its integer, float, key and text helpers): values are read in
+ * place from their bytes, path lookups walk the encoded value without
+ * decoding anything but the keys, and conversion to and from JSON goes
+ * directly between the bytes and JSON values.
+ */
+
+#define MSGPACK_TRUNCATED(l, c) \
+	do { \
+		Tcl_SetErrorCode(interp, "MSGPACK", "TRUNCATED", NULL); \
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("MessagePack value truncated")); \
+		c = TCL_ERROR; \
+		goto l; \
+	} while(0);
+
+#define MSGPACK_INVALID(l, c, fmtstr, ...) \
+	do { \
+		Tcl_SetErrorCode(interp, "MSGPACK", "INVALID", NULL); \
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("MessagePack syntax error: " fmtstr, ##__VA_ARGS__)); \
+		c = TCL_ERROR; \
+		goto l; \
+	} while(0);
+
+#define MSGPACK_TRAILING(l, c) \
+	do { \
+		Tcl_SetErrorCode(interp, "MSGPACK", "TRAILING", NULL); \
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Excess bytes after MessagePack value")); \
+		c = TCL_ERROR; \
+		goto l; \
+	} while(0);
+
+#define MSGPACK_DEPTH(l, c) \
+	do { \
+		Tcl_SetErrorCode(interp, "MSGPACK", "DEPTH", NULL); \
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("MessagePack value nested more than %d deep", MSGPACK_MAX_DEPTH)); \
+		c = TCL_ERROR; \
+		goto l; \
+	} while(0);
+
+#define MSGPACK_MAX_DEPTH	1000		// Decoding recurses for each level of arrays and maps, so limit it to keep within the C stack
+
+enum mp_kind {
+	MP_NIL,
+	MP_BOOL,
+	MP_UINT,
+	MP_INT,
+	MP_FLOAT,
+	MP_STR,
+	MP_BIN,
+	MP_ARR,
+	MP_MAP,
+	MP_EXT
+};
+
+struct mp_head {
+	enum mp_kind	kind;
+	union {
+		uint64_t	u;		// MP_BOOL, MP_UINT, and the length of MP_STR, MP_BIN and MP_EXT, elements of MP_ARR, entries of MP_MAP
+		int64_t		i;		// MP_INT: always negative, non-negative integers are reported as MP_UINT whatever their encoding
+		double		d;		// MP_FLOAT
+	};
+	int8_t			ext;	// MP_EXT type
+};
+
+static const Tcl_ObjType*	g_bytearray_type = NULL;
+
+// Decoder {{{
+static uint64_t get_be(const uint8_t* p, int n) //{{{
+{
+	switch (n) {
+		case 1:		return *p;
+		case 2:		return be16toh(*(uint16_t*)p);
+		case 4:		return be32toh(*(uint32_t*)p);
+		default:	return be64toh(*(uint64_t*)p);
+	}
+}
+
+//}}}
+static int read_head(Tcl_Interp* interp, const uint8_t** pPtr, const uint8_t* e, struct mp_head* h) //{{{
+{
+	/* Read the type byte and any length or value following it, leaving *pPtr
+	 * at the payload of strings, binaries and extensions (which is checked to
+	 * be present) or at the first element of arrays and maps.
+	 */
+	int				code = TCL_OK;
+	const uint8_t*	p = *pPtr;
+	const uint8_t*	valPtr;
+	uint8_t			ib;
+	int				n;
+
+	#define TAKE(nb) do { \
+		if (e - p < nb) MSGPACK_TRUNCATED(finally, code); \
+		valPtr = p; \
+		p += nb; \
+	} while (0)
+
+	TAKE(1);
+	ib = valPtr[0];
+
+	switch (ib) {
+		case 0x00 ... 0x7f:	h->kind = MP_UINT;	h->u = ib;			break;	// positive fixint
+		case 0x80 ... 0x8f:	h->kind = MP_MAP;	h->u = ib & 0x0f;	break;	// fixmap
+		case 0x90 ... 0x9f:	h->kind = MP_ARR;	h->u = ib & 0x0f;	break;	// fixarray
+		case 0xa0 ... 0xbf:	h->kind = MP_STR;	h->u = ib & 0x1f;	break;	// fixstr
+		case 0xc0:			h->kind = MP_NIL;						break;
+		case 0xc1:			MSGPACK_INVALID(finally, code, "never used type byte 0xc1");
+		case 0xc2:
+		case 0xc3:			h->kind = MP_BOOL;	h->u = ib & 1;		break;
+
+		case 0xc4 ... 0xc6:	// bin 8, 16, 32
+			n = 1 << (ib - 0xc4);
+			TAKE(n);
+			h->kind = MP_BIN;
+			h->u = get_be(valPtr, n);
+			break;
+
+		case 0xc7 ... 0xc9:	// ext 8, 16, 32
+			n = 1 << (ib - 0xc7);
+			TAKE(n + 1);
+			h->kind = MP_EXT;
+			h->u = get_be(valPtr, n);
+			h->ext = valPtr[n];
+			break;
+
+		case 0xca:	TAKE(4);	h->kind = MP_FLOAT;	h->d = decode_float(valPtr);	break;
+		case 0xcb:	TAKE(8);	h->kind = MP_FLOAT;	h->d = decode_double(valPtr);	break;
+
+		case 0xcc ... 0xcf:	// uint 8, 16, 32, 64
+			n = 1 << (ib - 0xcc);
+			TAKE(n);
+			h->kind = MP_UINT;
+			h->u = get_be(valPtr, n);
+			break;
+
+		case 0xd0 ... 0xd3:	// int 8, 16, 32, 64
+		{
+			int64_t	i;
+
+			n = 1 << (ib - 0xd0);
+			TAKE(n);
+			switch (n) {
+				case 1:		i = (int8_t)get_be(valPtr, n);	break;
+				case 2:		i = (int16_t)get_be(valPtr, n);	break;
+				case 4:		i = (int32_t)get_be(valPtr, n);	break;
+				default:	i = (int64_t)get_be(valPtr, n);	break;
+			}
+			if (i < 0) {
+				h->kind = MP_INT;
+				h->i = i;
+			} else {
+				h->kind = MP_UINT;
+				h->u = i;
+			}
+			break;
+		}
+
+		case 0xd4 ... 0xd8:	// fixext 1, 2, 4, 8, 16
+			TAKE(1);
+			h->kind = MP_EXT;
+			h->u = 1 << (ib - 0xd4);
+			h->ext = valPtr[0];
+			break;
+
+		case 0xd9 ... 0xdb:	// str 8, 16, 32
+			n = 1 << (ib - 0xd9);
+			TAKE(n);
+			h->kind = MP_STR;
+			h->u = get_be(valPtr, n);
+			break;
+
+		case 0xdc:
+		case 0xdd:			// array 16, 32
+			n = 2 << (ib - 0xdc);
+			TAKE(n);
+			h->kind = MP_ARR;
+			h->u = get_be(valPtr, n);
+			break;
+
+		case 0xde:
+		case 0xdf:			// map 16, 32
+			n = 2 << (ib - 0xde);
+			TAKE(n);
+			h->kind = MP_MAP;
+			h->u = get_be(valPtr, n);
+			break;
+
+		case 0xe0 ... 0xff:	h->kind = MP_INT;	h->i = (int8_t)ib;	break;	// negative fixint
+	}
+
+	switch (h->kind) {
+		case MP_STR:
+		case MP_BIN:
+		case MP_EXT:
+			if (h->u > e - p) MSGPACK_TRUNCATED(finally, code);
+			break;
+		default:
+			break;
+	}
+
+	*pPtr = p;
+
+finally:
+	#undef TAKE
+	return code;
+}
+
+//}}}
+static int skip_value(Tcl_Interp* interp, const uint8_t** pPtr, const uint8_t* e) //{{{
+{
+	/* Step over one complete value, checking that it is well formed and that
+	 * it is nested no deeper than get_obj and msgpack_to_json will decode.
+	 * Each open array or map just keeps a count of the values still to be
+	 * read in it, so this doesn't recurse however deep the value is.
+	 */
+	int				code = TCL_OK;
+	const uint8_t*	p = *pPtr;
+	uint64_t		pending = 1;		// Values still to be read, at all levels
+	uint64_t*		remaining = NULL;	// Values still to be read at each level
+	int				depth = 0, stacksize = 0;
+	uint64_t		top = 1;			// remaining at the current level, kept out of the stack
+
+	while (pending) {
+		struct mp_head	h;
+
+		while (top == 0) top = remaining[--depth];
+
+		TEST_OK_LABEL(finally, code, read_head(interp, &p, e, &h));
+		pending--;
+		top--;
+		switch (h.kind) {
+			case MP_STR:
+			case MP_BIN:
+			case MP_EXT:	p += h.u;	break;
+			case MP_ARR:
+			case MP_MAP:
+			{
+				const uint64_t	count = h.kind == MP_MAP ? h.u*2 : h.u;
+
+				if (h.u > e - p) MSGPACK_TRUNCATED(finally, code);
+				if (depth >= MSGPACK_MAX_DEPTH) MSGPACK_DEPTH(finally, code);
+				if (count == 0) break;
+				if (depth == stacksize) {
+					stacksize = stacksize ? stacksize*2 : 16;
+					remaining = ckrealloc(remaining, stacksize * sizeof *remaining);
+				}
+				remaining[depth++] = top;
+				top = count;
+				pending += count;
+				break;
+			}
+			default:					break;
+		}
+		// Every value takes at least one byte
+		if (pending > e - p) MSGPACK_TRUNCATED(finally, code);
+	}
+
+	*pPtr = p;
+
+finally:
+	if (remaining) {
+		ckfree(remaining);
+		remaining = NULL;
+	}
+	return code;
+}
+
+//}}}
+static int get_obj(Tcl_Interp* interp, struct interp_cx* l, const uint8_t** pPtr, const uint8_t* e, int depth, Tcl_Obj** resPtr) //{{{
+{
+	/* Decode the value at *pPtr to its natural Tcl form: maps become dicts,
+	 * arrays lists, binaries (and the data of extension types) byte arrays,
+	 * nil an empty string and booleans true or false.
+	 */
+	int				code = TCL_OK;
+	const uint8_t*	p = *pPtr;
+	Tcl_Obj*		res = NULL;
+	Tcl_Obj*		tmp1 = NULL;
+	Tcl_Obj*		tmp2 = NULL;
+	struct mp_head	h;
+
+	TEST_OK_LABEL(finally, code, read_head(interp, &p, e, &h));
+
+	switch (h.kind) {
+		case MP_NIL:	replace_tclobj(&res, l->cbor_null);								break;
+		case MP_BOOL:	replace_tclobj(&res, h.u ? l->cbor_true : l->cbor_false);		break;
+		case MP_UINT:	replace_tclobj(&res, new_tcl_uint64(h.u));						break;
+		case MP_INT:	replace_tclobj(&res, Tcl_NewWideIntObj(h.i));					break;
+		case MP_FLOAT:	replace_tclobj(&res, Tcl_NewDoubleObj(h.d));					break;
+
+		case MP_STR:
+			TEST_OK_LABEL(finally, code, utf8_to_tclobj(interp, p, h.u, &res));
+			p += h.u;
+			break;
+
+		case MP_BIN:
+		case MP_EXT:
+			replace_tclobj(&res, Tcl_NewByteArrayObj(p, h.u));
+			p += h.u;
+			break;
+
+		case MP_ARR:
+			if (h.u > e - p) MSGPACK_TRUNCATED(finally, code);
+			if (depth >= MSGPACK_MAX_DEPTH) MSGPACK_DEPTH(finally, code);
+			replace_tclobj(&res, Tcl_NewListObj(0, NULL));
+			for (uint64_t i=0; i<h.u; i++) {
+				TEST_OK_LABEL(finally, code, get_obj(interp, l, &p, e, depth+1, &tmp1));
+				TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(interp, res, tmp1));
+			}
+			break;
+
+		case MP_MAP:
+			if (h.u > e - p) MSGPACK_TRUNCATED(finally, code);
+			if (depth >= MSGPACK_MAX_DEPTH) MSGPACK_DEPTH(finally, code);
+			replace_tclobj(&res, Tcl_NewDictObj());
+			for (uint64_t i=0; i<h.u; i++) {
+				TEST_OK_LABEL(finally, code, get_obj(interp, l, &p, e, depth+1, &tmp1));
+				TEST_OK_LABEL(finally, code, get_obj(interp, l, &p, e, depth+1, &tmp2));
+				TEST_OK_LABEL(finally, code, Tcl_DictObjPut(interp, res, tmp1, tmp2));
+			}
+			break;
+	}
+
+	replace_tclobj(resPtr, res);
+
+finally:
+	replace_tclobj(&res, NULL);
+	replace_tclobj(&tmp1, NULL);
+	replace_tclobj(&tmp2, NULL);
+	*pPtr = p;
+	return code;
+}
+
+//}}}
+static int get_bytes(Tcl_Interp* interp, Tcl_Obj* obj, const uint8_t** bytesPtr, const uint8_t** ePtr) //{{{
+{
+	size_t			len;
+	const uint8_t*	bytes = Tcl_GetBytesFromObj(interp, obj, &len);
+
+	if (bytes == NULL) return TCL_ERROR;
+	*bytesPtr = bytes;
+	*ePtr = bytes + len;
+	return TCL_OK;
+}
+
+//}}}
+static int get_item_from_path(Tcl_Interp* interp, Tcl_Obj* msgpackObj, Tcl_Obj*const pathv[], int pathc, const uint8_t** itemPtr, const uint8_t** ePtr) //{{{
+{
+	/* Find the value at the path, leaving it in *itemPtr (or NULL if it
+	 * doesn't exist).  Array elements and map entries before it are stepped
+	 * over without being decoded.  Map keys match path elements as they do
+	 * for cbor: text keys by their UTF-8, integer keys by value and binary
+	 * keys only against byte arrays.
+	 */
+	int				code = TCL_OK;
+	const uint8_t*	p;
+	const uint8_t*	e;
+	Tcl_DString		scratch;
+
+	Tcl_DStringInit(&scratch);
+	TEST_OK_LABEL(finally, code, get_bytes(interp, msgpackObj, &p, &e));
+	*ePtr = e;
+
+	for (int pathi=0; pathi<pathc; pathi++) {
+		Tcl_Obj*		pathElem = pathv[pathi];
+		struct mp_head	h;
+
+		TEST_OK_LABEL(finally, code, read_head(interp, &p, e, &h));
+
+		switch (h.kind) {
+			case MP_ARR: //{{{
+			{
+				enum indexmode	mode;
+				ssize_t			ofs;
+
+				TEST_OK_LABEL(finally, code, parse_index(interp, pathElem, &mode, &ofs));
+				const ssize_t	i = mode == IDX_ENDREL ? (ssize_t)h.u-1 + ofs : ofs;
+
+				if (i < 0 || i >= h.u) goto not_found;
+				for (ssize_t j=0; j<i; j++)
+					TEST_OK_LABEL(finally, code, skip_value(interp, &p, e));
+				break;
+			}
+			//}}}
+			case MP_MAP: //{{{
+			{
+				struct cbor_key	key;
+				int				blen = 0;
+				const uint8_t*	b = NULL;
+
+				get_cbor_key(pathElem, &scratch, &key);
+				if (pathElem->typePtr == g_bytearray_type)
+					b = Tcl_GetByteArrayFromObj(pathElem, &blen);
+
+				for (uint64_t j=0; j<h.u; j++) {
+					const uint8_t*	k = p;
+					struct mp_head	kh;
+					int				matches = 0;
+
+					TEST_OK_LABEL(finally, code, read_head(interp, &p, e, &kh));
+					switch (kh.kind) {
+						case MP_STR:
+							matches = kh.u == key.len && memcmp(p, key.utf8, key.len) == 0;
+							p += kh.u;
+							break;
+						case MP_BIN:
+							matches = b && kh.u == blen && memcmp(p, b, blen) == 0;
+							p += kh.u;
+							break;
+						case MP_UINT:
+							matches = key.is_integer && !key.negative && key.maglen <= 8 && key.mag64 == kh.u;
+							break;
+						case MP_INT:
+							matches = key.is_int && key.ival == kh.i;
+							break;
+						default:
+							p = k;
+							TEST_OK_LABEL(finally, code, skip_value(interp, &p, e));
+							break;
+					}
+					if (matches) goto next_path_elem;
+					TEST_OK_LABEL(finally, code, skip_value(interp, &p, e));	// Skip value
+				}
+				goto not_found;
+			}
+			//}}}
+			default:
+				THROW_PRINTF_LABEL(finally, code, "Cannot index into atomic MessagePack value with path element %d: \"%s\"", pathi, Tcl_GetString(pathElem));
+		}
+
+	next_path_elem:
+		continue;
+	}
+
+	*itemPtr = p;
+
+finally:
+	Tcl_DStringFree(&scratch);
+	return code;
+
+not_found:
+	*itemPtr = NULL;
+	goto finally;
+}
+
+//}}}
+// Decoder }}}
+// Encoder {{{
+static void put_be(Tcl_DString* ds, uint8_t type, uint64_t val, int n) //{{{
+{
+	// Append the type byte followed by the low n bytes of val, big-endian
+	uint8_t		buf[9];
+
+	buf[0] = type;
+	for (int i=0; i<n; i++)
+		buf[1+i] = val >> (8*(n-1-i));
+	Tcl_DStringAppend(ds, (const char*)buf, 1+n);
+}
+
+//}}}
+static void put_uint(Tcl_DString* ds, uint64_t val) //{{{
+{
+	if (val <= 0x7f) {
+		put_be(ds, val, 0, 0);
+	} else if (val <= UINT8_MAX) {
+		put_be(ds, 0xcc, val, 1);
+	} else if (val <= UINT16_MAX) {
+		put_be(ds, 0xcd, val, 2);
+	} else if (val <= UINT32_MAX) {
+		put_be(ds, 0xce, val, 4);
+	} else {
+		put_be(ds, 0xcf, val, 8);
+	}
+}
+
+//}}}
+static void put_int(Tcl_DString* ds, int64_t val) //{{{
+{
+	if (val >= 0) {
+		put_uint(ds, val);
+	} else if (val >= -32) {
+		put_be(ds, (uint8_t)val, 0, 0);
+	} else if (val >= INT8_MIN) {
+		put_be(ds, 0xd0, val, 1);
+	} else if (val >= INT16_MIN) {
+		put_be(ds, 0xd1, val, 2);
+	} else if (val >= INT32_MIN) {
+		put_be(ds, 0xd2, val, 4);
+	} else {
+		put_be(ds, 0xd3, val, 8);
+	}
+}
+
+//}}}
+static void put_len(Tcl_DString* ds, enum mp_kind kind, uint64_t len) //{{{
+{
+	// Shortest head for a string, binary, array or map of len bytes, elements or entries
+	switch (kind) {
+		case MP_STR:
+			if (len < 32) {
+				put_be(ds, 0xa0 | len, 0, 0);
+			} else if (len <= UINT8_MAX) {
+				put_be(ds, 0xd9, len, 1);
+			} else if (len <= UINT16_MAX) {
+				put_be(ds, 0xda, len, 2);
+			} else {
+				put_be(ds, 0xdb, len, 4);
+			}
+			break;
+
+		case MP_BIN:
+			if (len <= UINT8_MAX) {
+				put_be(ds, 0xc4, len, 1);
+			} else if (len <= UINT16_MAX) {
+				put_be(ds, 0xc5, len, 2);
+			} else {
+				put_be(ds, 0xc6, len, 4);
+			}
+			break;
+
+		case MP_ARR:
+		case MP_MAP:
+		{
+			const int	map = kind == MP_MAP;
+
+			if (len < 16) {
+				put_be(ds, (map ? 0x80 : 0x90) | len, 0, 0);
+			} else if (len <= UINT16_MAX) {
+				put_be(ds, map ? 0xde : 0xdc, len, 2);
+			} else {
+				put_be(ds, map ? 0xdf : 0xdd, len, 4);
+			}
+			break;
+		}
+
+		default:
+			Tcl_Panic("put_len called for kind %d", kind);
+	}
+}
+
+//}}}
+static void put_string(Tcl_DString* ds, const char* str, int len) //{{{
+{
+	Tcl_DString		scratch;
+	size_t			utf8len;
+	const uint8_t*	utf8;
+
+	Tcl_DStringInit(&scratch);
+	utf8 = tcl_to_utf8(str, len, &scratch, &utf8len);
+	put_len(ds, MP_STR, utf8len);
+	Tcl_DStringAppend(ds, (const char*)utf8, utf8len);
+	Tcl_DStringFree(&scratch);
+}
+
+//}}}
+static void put_double(Tcl_DString* ds, double d) //{{{
+{
+	// float 32 where that represents d exactly (NaN included), float 64 otherwise
+	if (isnan(d) || (double)(float)d == d) {
+		const float	f = d;
+		uint32_t	bits;
+
+		memcpy(&bits, &f, 4);
+		put_be(ds, 0xca, bits, 4);
+	} else {
+		uint64_t	bits;
+
+		memcpy(&bits, &d, 8);
+		put_be(ds, 0xcb, bits, 8);
+	}
+}
+
+//}}}
+static int put_bignum(Tcl_Interp* interp, Tcl_DString* ds, Tcl_Obj* obj) //{{{
+{
+	// MessagePack has no bignums: integers in the range of int 64 or uint 64 are encoded as those, others are an error
+	int				code = TCL_OK;
+	mp_int			n = {0};
+	int				neg;
+	uint8_t			bytes[8];
+	uint64_t		val = 0;
+	size_t			size;
+
+	TEST_OK_LABEL(finally, code, Tcl_GetBignumFromObj(interp, obj, &n));
+	neg = n.sign == MP_NEG;
+	if (neg && mp_neg(&n, &n) != MP_OKAY)
+		THROW_ERROR_LABEL(finally, code, "Bignum arithmetic failed");
+
+	size = mp_ubin_size(&n);
+	if (size > 8) goto range;
+	if (mp_to_ubin(&n, bytes, sizeof(bytes), NULL) != MP_OKAY)
+		THROW_ERROR_LABEL(finally, code, "Bignum conversion failed");
+	for (size_t i=0; i<size; i++) val = val << 8 | bytes[i];
+
+	if (!neg) {
+		put_uint(ds, val);
+	} else if (val <= (uint64_t)INT64_MAX + 1) {
+		put_int(ds, (int64_t)(0 - val));
+	} else {
+		goto range;
+	}
+
+finally:
+	mp_clear(&n);
+	return code;
+
+range:
+	Tcl_SetErrorCode(interp, "MSGPACK", "RANGE", NULL);
+	THROW_PRINTF_LABEL(finally, code, "Integer out of MessagePack range: %s", Tcl_GetString(obj));
+}
+
+//}}}
+static int put_number(Tcl_Interp* interp, struct interp_cx* l, Tcl_DString* ds, Tcl_Obj* obj) //{{{
+{
+	Tcl_WideInt	w;
+	double		d;
+
+	if (l->typeInt && Tcl_FetchInternalRep(obj, l->typeInt)) {
+		TEST_OK(Tcl_GetWideIntFromObj(interp, obj, &w));
+		put_int(ds, w);
+		return TCL_OK;
+	}
+
+	if (l->typeBignum && Tcl_FetchInternalRep(obj, l->typeBignum))
+		return put_bignum(interp, ds, obj);
+
+	if (l->typeDouble && Tcl_FetchInternalRep(obj, l->typeDouble)) {
+		TEST_OK(get_double(interp, l, obj, &d));
+		put_double(ds, d);
+		return TCL_OK;
+	}
+
+	{
+		int				len;
+		const char*		s = Tcl_GetStringFromObj(obj, &len);
+		const char*		e = s + len;
+		const char*		p = s;
+		const int		neg = *p == '-';
+		uint64_t		acc = 0;
+
+		// Fast path for the plain integers that make up most JSON numbers
+		if (neg) p++;
+		if (p < e) {
+			int		overflow = 0;
+
+			while (p < e && *p >= '0' && *p <= '9') {
+				const unsigned	digit = *p - '0';
+				if (acc > (UINT64_MAX - digit) / 10) overflow = 1;
+				acc = acc * 10 + digit;
+				p++;
+			}
+			if (p == e) {
+				if (overflow || (neg && acc > (uint64_t)INT64_MAX + 1))
+					return put_bignum(interp, ds, obj);
+				if (neg) {
+					put_int(ds, (int64_t)(0 - acc));
+				} else {
+					put_uint(ds, acc);
+				}
+				return TCL_OK;
+			}
+		}
+	}
+
+	if (TCL_OK == Tcl_GetWideIntFromObj(NULL, obj, &w)) {
+		put_int(ds, w);
+		return TCL_OK;
+	}
+
+	TEST_OK(get_double(interp, l, obj, &d));
+	put_double(ds, d);
+	return TCL_OK;
+}
+
+//}}}
+static int encode_json(Tcl_Interp* interp, struct interp_cx* l, Tcl_DString* ds, Tcl_Obj* obj) //{{{
+{
+	int					code = TCL_OK;
+	enum json_types		type;
+	Tcl_Obj*			val = NULL;
+
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, obj, &type, &val));
+
+	switch (type) {
+		case JSON_OBJECT:
+		{
+			Tcl_DictSearch	search;
+			Tcl_Obj*		k = NULL;
+			Tcl_Obj*		v = NULL;
+			int				done, size;
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjSize(interp, val, &size));
+			put_len(ds, MP_MAP, size);
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+			for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+				int				keylen;
+				const char*		key = Tcl_GetStringFromObj(k, &keylen);
+
+				put_string(ds, key, keylen);
+				if (TCL_OK != (code = encode_json(interp, l, ds, v))) {
+					Tcl_DictObjDone(&search);
+					goto finally;
+				}
+			}
+			Tcl_DictObjDone(&search);
+			break;
+		}
+
+		case JSON_ARRAY:
+		{
+			Tcl_Obj**	ov;
+			int			oc;
+
+			TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, val, &oc, &ov));
+			put_len(ds, MP_ARR, oc);
+			for (int i=0; i<oc; i++)
+				TEST_OK_LABEL(finally, code, encode_json(interp, l, ds, ov[i]));
+			break;
+		}
+
+		case JSON_STRING:
+		{
+			int			len;
+			const char*	str = Tcl_GetStringFromObj(val, &len);
+
+			put_string(ds, str, len);
+			break;
+		}
+
+		case JSON_NUMBER:
+			TEST_OK_LABEL(finally, code, put_number(interp, l, ds, val));
+			break;
+
+		case JSON_BOOL:
+		{
+			int		b;
+
+			TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, val, &b));
+			put_be(ds, b ? 0xc3 : 0xc2, 0, 0);
+			break;
+		}
+
+		case JSON_NULL:
+			put_be(ds, 0xc0, 0, 0);
+			break;
+
+		case JSON_DYN_STRING:
+		case JSON_DYN_NUMBER:
+		case JSON_DYN_BOOL:
+		case JSON_DYN_JSON:
+		case JSON_DYN_TEMPLATE:
+		case JSON_DYN_LITERAL:
+		{
+			// Template placeholders are just strings in this context
+			Tcl_Obj*	str = NULL;
+			int			len;
+			const char*	s;
+
+			replace_tclobj(&str, Tcl_ObjPrintf("%s%s", get_dyn_prefix(type), Tcl_GetString(val)));
+			s = Tcl_GetStringFromObj(str, &len);
+			put_string(ds, s, len);
+			replace_tclobj(&str, NULL);
+			break;
+		}
+
+		default:
+			THROW_ERROR_LABEL(finally, code, "Invalid value type");
+	}
+
+finally:
+	return code;
+}
+
+//}}}
+static int encode_typed(Tcl_Interp* interp, struct interp_cx* l, Tcl_DString* ds, Tcl_Obj* typed) //{{{
+{
+	/* Encode a type-annotated Tcl value: a list of a type and its value,
+	 * using the same types as [json new], plus some that only MessagePack has:
+	 *		bytes val			- a binary
+	 *		ext type val		- extension type type (-128 to 127) with the bytes val as its data
+	 *		msgpack val			- an already encoded MessagePack value
+	 */
+	int					code = TCL_OK;
+	int					objc, type;
+	Tcl_Obj**			objv;
+	static const char* types[] = {
+		"string",
+		"object",
+		"array",
+		"number",
+		"true",
+		"false",
+		"null",
+		"boolean",
+		"json",
+		"bytes",
+		"ext",
+		"msgpack",
+		(char*)NULL
+	};
+	enum {
+		T_STRING,
+		T_OBJECT,
+		T_ARRAY,
+		T_NUMBER,
+		T_TRUE,
+		T_FALSE,
+		T_NULL,
+		T_BOOL,
+		T_JSON,
+		T_BYTES,
+		T_EXT,
+		T_MSGPACK
+	};
+
+	TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, typed, &objc, &objv));
+	enum {A_cmd=-1, A_TYPE, A_args};
+	CHECK_MIN_ARGS_LABEL(finally, code, "type ?val?");
+	TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[A_TYPE], types, "type", 0, &type));
+
+	switch (type) {
+		case T_STRING: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			int			len;
+			const char*	str = Tcl_GetStringFromObj(objv[A_VAL], &len);
+			put_string(ds, str, len);
+			break;
+		}
+		//}}}
+		case T_OBJECT: //{{{
+		{
+			int			oc;
+			Tcl_Obj**	ov;
+
+			if (objc == 2) {
+				TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, objv[1], &oc, &ov));
+			} else {
+				oc = objc-1;
+				ov = objv+1;
+			}
+			if (oc % 2 != 0)
+				THROW_ERROR_LABEL(finally, code, "msgpack encode object needs an even number of arguments");
+
+			put_len(ds, MP_MAP, oc/2);
+			for (int i=0; i<oc; i+=2) {
+				int				keylen;
+				const char*		key = Tcl_GetStringFromObj(ov[i], &keylen);
+
+				put_string(ds, key, keylen);
+				TEST_OK_LABEL(finally, code, encode_typed(interp, l, ds, ov[i+1]));
+			}
+			break;
+		}
+		//}}}
+		case T_ARRAY: //{{{
+			put_len(ds, MP_ARR, objc-1);
+			for (int i=1; i<objc; i++)
+				TEST_OK_LABEL(finally, code, encode_typed(interp, l, ds, objv[i]));
+			break;
+			//}}}
+		case T_NUMBER: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			TEST_OK_LABEL(finally, code, put_number(interp, l, ds, objv[A_VAL]));
+			break;
+		}
+		//}}}
+		case T_TRUE: case T_FALSE: case T_NULL: //{{{
+		{
+			enum {A_cmd, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "");
+			put_be(ds,
+				type == T_TRUE  ? 0xc3 :
+				type == T_FALSE ? 0xc2 :
+				0xc0, 0, 0);
+			break;
+		}
+		//}}}
+		case T_BOOL: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			int		b;
+			TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, objv[A_VAL], &b));
+			put_be(ds, b ? 0xc3 : 0xc2, 0, 0);
+			break;
+		}
+		//}}}
+		case T_JSON: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			TEST_OK_LABEL(finally, code, encode_json(interp, l, ds, objv[A_VAL]));
+			break;
+		}
+		//}}}
+		case T_BYTES: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			int				len;
+			const uint8_t*	bytes = Tcl_GetByteArrayFromObj(objv[A_VAL], &len);
+			put_len(ds, MP_BIN, len);
+			Tcl_DStringAppend(ds, (const char*)bytes, len);
+			break;
+		}
+		//}}}
+		case T_EXT: //{{{
+		{
+			enum {A_cmd, A_TYPE, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "type val");
+			int				exttype, len;
+			const uint8_t*	bytes;
+
+			TEST_OK_LABEL(finally, code, Tcl_GetIntFromObj(interp, objv[A_TYPE], &exttype));
+			if (exttype < INT8_MIN || exttype > INT8_MAX)
+				THROW_ERROR_LABEL(finally, code, "Extension type must be between -128 and 127");
+			bytes = Tcl_GetByteArrayFromObj(objv[A_VAL], &len);
+
+			switch (len) {
+				case 1:		put_be(ds, 0xd4, 0, 0);	break;
+				case 2:		put_be(ds, 0xd5, 0, 0);	break;
+				case 4:		put_be(ds, 0xd6, 0, 0);	break;
+				case 8:		put_be(ds, 0xd7, 0, 0);	break;
+				case 16:	put_be(ds, 0xd8, 0, 0);	break;
+				default:
+					if (len <= UINT8_MAX) {
+						put_be(ds, 0xc7, len, 1);
+					} else if (len <= UINT16_MAX) {
+						put_be(ds, 0xc8, len, 2);
+					} else {
+						put_be(ds, 0xc9, len, 4);
+					}
+			}
+			Tcl_DStringAppend(ds, (const char*)&(int8_t){exttype}, 1);
+			Tcl_DStringAppend(ds, (const char*)bytes, len);
+			break;
+		}
+		//}}}
+		case T_MSGPACK: //{{{
+		{
+			enum {A_cmd, A_VAL, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "val");
+			int				len;
+			const uint8_t*	bytes = Tcl_GetByteArrayFromObj(objv[A_VAL], &len);
+			const uint8_t*	p = bytes;
+
+			TEST_OK_LABEL(finally, code, skip_value(interp, &p, bytes+len));
+			if (p != bytes+len) MSGPACK_TRAILING(finally, code);
+			Tcl_DStringAppend(ds, (const char*)bytes, len);
+			break;
+		}
+		//}}}
+		default:
+			THROW_ERROR_LABEL(finally, code, "Invalid type");
+	}
+
+finally:
+	return code;
+}
+
+//}}}
+int msgpack_from_json(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj** res) //{{{
+{
+	int					code = TCL_OK;
+	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	Tcl_DString			ds;
+
+	Tcl_DStringInit(&ds);
+	TEST_OK_LABEL(finally, code, encode_json(interp, l, &ds, json));
+	replace_tclobj(res, Tcl_NewByteArrayObj((const uint8_t*)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+
+finally:
+	Tcl_DStringFree(&ds);
+	return code;
+}
+
+//}}}
+// Encoder }}}
+// MessagePack to JSON {{{
+/* Integers and finite floats become numbers, nil and non-finite floats
+ * null, binaries and the data of extension types base64url strings
+ * without padding, and map keys that aren't strings the text of their JSON
+ * value.
+ */
+static int msgpack_to_json(Tcl_Interp* interp, struct interp_cx* l, const uint8_t** pPtr, const uint8_t* e, int depth, Tcl_DString* ds, Tcl_Obj** resPtr) //{{{
+{
+	/* Convert the value at *pPtr to JSON.  If ds is not NULL the JSON text is
+	 * appended to it (as UTF-8, which the caller converts to a Tcl string),
+	 * otherwise a JSON value is built and left in *resPtr.
+	 */
+	int				code = TCL_OK;
+	const uint8_t*	p = *pPtr;
+	Tcl_Obj*		res = NULL;
+	Tcl_Obj*		tmp1 = NULL;
+	Tcl_Obj*		tmp2 = NULL;
+	char			numbuf[JSON_DOUBLE_BUFSIZE];
+	struct mp_head	h;
+
+	TEST_OK_LABEL(finally, code, read_head(interp, &p, e, &h));
+
+	switch (h.kind) {
+		case MP_NIL:
+			goto null;
+
+		case MP_BOOL:
+			if (ds) {
+				Tcl_DStringAppend(ds, h.u ? "true" : "false", -1);
+			} else {
+				replace_tclobj(&res, h.u ? l->json_true : l->json_false);
+			}
+			break;
+
+		case MP_UINT:
+		case MP_INT:
+			if (ds) {
+				const int len = h.kind == MP_UINT ?
+					snprintf(numbuf, sizeof(numbuf), "%" PRIu64, h.u) :
+					snprintf(numbuf, sizeof(numbuf), "%" PRId64, h.i);
+				Tcl_DStringAppend(ds, numbuf, len);
+			} else {
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_NUMBER, h.kind == MP_UINT ? new_tcl_uint64(h.u) : Tcl_NewWideIntObj(h.i)));
+			}
+			break;
+
+		case MP_FLOAT:
+			if (!isfinite(h.d)) goto null;
+			if (ds) {
+				Tcl_DStringAppend(ds, numbuf, json_format_double(h.d, numbuf));
+			} else {
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_NUMBER, Tcl_NewDoubleObj(h.d)));
+			}
+			break;
+
+		case MP_STR:
+		case MP_BIN:
+		case MP_EXT:
+			if (ds) {
+				Tcl_DStringAppend(ds, "\"", 1);
+				if (h.kind == MP_STR) {
+					append_json_escaped(ds, p, h.u);
+				} else {
+					append_bytes_encoded(ds, p, h.u, BYTES_BASE64URL);
+				}
+				Tcl_DStringAppend(ds, "\"", 1);
+			} else {
+				if (h.kind == MP_STR) {
+					TEST_OK_LABEL(finally, code, utf8_to_tclobj(interp, p, h.u, &tmp1));
+				} else {
+					Tcl_DString	encoded;
+
+					Tcl_DStringInit(&encoded);
+					append_bytes_encoded(&encoded, p, h.u, BYTES_BASE64URL);
+					replace_tclobj(&tmp1, Tcl_NewStringObj(Tcl_DStringValue(&encoded), Tcl_DStringLength(&encoded)));
+					Tcl_DStringFree(&encoded);
+				}
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_STRING, tmp1));
+			}
+			p += h.u;
+			break;
+
+		case MP_ARR:
+			if (h.u > e - p) MSGPACK_TRUNCATED(finally, code);
+			if (depth >= MSGPACK_MAX_DEPTH) MSGPACK_DEPTH(finally, code);
+			if (ds) {
+				Tcl_DStringAppend(ds, "[", 1);
+			} else {
+				replace_tclobj(&tmp2, Tcl_NewListObj(0, NULL));
+			}
+
+			for (uint64_t i=0; i<h.u; i++) {
+				if (ds) {
+					if (i > 0) Tcl_DStringAppend(ds, ",", 1);
+					TEST_OK_LABEL(finally, code, msgpack_to_json(interp, l, &p, e, depth+1, ds, NULL));
+				} else {
+					TEST_OK_LABEL(finally, code, msgpack_to_json(interp, l, &p, e, depth+1, NULL, &tmp1));
+					TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(interp, tmp2, tmp1));
+				}
+			}
+
+			if (ds) {
+				Tcl_DStringAppend(ds, "]", 1);
+			} else {
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_ARRAY, tmp2));
+			}
+			break;
+
+		case MP_MAP:
+			if (h.u > e - p) MSGPACK_TRUNCATED(finally, code);
+			if (depth >= MSGPACK_MAX_DEPTH) MSGPACK_DEPTH(finally, code);
+			if (ds) {
+				Tcl_DStringAppend(ds, "{", 1);
+			} else {
+				replace_tclobj(&tmp2, Tcl_NewDictObj());
+			}
+
+			for (uint64_t i=0; i<h.u; i++) {
+				if (ds && i > 0) Tcl_DStringAppend(ds, ",", 1);
+
+				if (ds && p < e && ((*p >= 0xa0 && *p <= 0xbf) || (*p >= 0xd9 && *p <= 0xdb))) {
+					// String key: can be written straight out
+					TEST_OK_LABEL(finally, code, msgpack_to_json(interp, l, &p, e, depth+1, ds, NULL));
+				} else {
+					enum json_types	keytype;
+					Tcl_Obj*		keyval = NULL;
+					Tcl_Obj*		key = NULL;
+
+					// Other key types are converted to a JSON value, and keyed by its text
+					TEST_OK_LABEL(finally, code, msgpack_to_json(interp, l, &p, e, depth+1, NULL, &tmp1));
+					TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, tmp1, &keytype, &keyval));
+					key = keytype == JSON_STRING ? keyval : tmp1;
+					if (ds) {
+						int			keylen;
+						const char*	keystr = Tcl_GetStringFromObj(key, &keylen);
+
+						Tcl_DStringAppend(ds, "\"", 1);
+						append_json_escaped(ds, (const uint8_t*)keystr, keylen);
+						Tcl_DStringAppend(ds, "\"", 1);
+					} else {
+						Tcl_IncrRefCount(key);
+						replace_tclobj(&tmp1, key);
+						Tcl_DecrRefCount(key);
+					}
+				}
+
+				if (ds) {
+					Tcl_DStringAppend(ds, ":", 1);
+					TEST_OK_LABEL(finally, code, msgpack_to_json(interp, l, &p, e, depth+1, ds, NULL));
+				} else {
+					Tcl_Obj*	v = NULL;
+
+					code = msgpack_to_json(interp, l, &p, e, depth+1, NULL, &v);
+					if (code == TCL_OK)
+						code = Tcl_DictObjPut(interp, tmp2, tmp1, v);
+					replace_tclobj(&v, NULL);
+					if (code != TCL_OK) goto finally;
+				}
+			}
+
+			if (ds) {
+				Tcl_DStringAppend(ds, "}", 1);
+			} else {
+				replace_tclobj(&res, JSON_NewJvalObj(JSON_OBJECT, tmp2));
+			}
+			break;
+
+		null:
+			if (ds) {
+				Tcl_DStringAppend(ds, "null", 4);
+			} else {
+				replace_tclobj(&res, l->json_null);
+			}
+			break;
+	}
+
+	if (resPtr) replace_tclobj(resPtr, res);
+
+finally:
+	replace_tclobj(&res, NULL);
+	replace_tclobj(&tmp1, NULL);
+	replace_tclobj(&tmp2, NULL);
+	*pPtr = p;
+	return code;
+}
+
+//}}}
+// MessagePack to JSON }}}
+// Script API {{{
+static int is_flag(Tcl_Obj* obj, const char* flag) //{{{
+{
+	// As for cbor: options have a string rep, the MessagePack value needn't get one
+	return obj->bytes != NULL && strcmp(obj->bytes, flag) == 0;
+}
+
+//}}}
+static int msgpack_cmd(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj*const objv[]) //{{{
+{
+	int					code = TCL_OK;
+	struct interp_cx*	l = cdata;
+	static const char* ops[] = {
+		"get",
+		"extract",
+		"wellformed",
+		"encode",
+		"tojson",
+		NULL
+	};
+	enum {
+		OP_GET,
+		OP_EXTRACT,
+		OP_WELLFORMED,
+		OP_ENCODE,
+		OP_TOJSON
+	};
+	int				op;
+	Tcl_Obj*		res = NULL;
+	Tcl_Obj*		path = NULL;
+	const uint8_t*	item = NULL;
+	const uint8_t*	e = NULL;
+
+	enum {A_cmd, A_OP, A_args};
+	CHECK_MIN_ARGS_LABEL(finally, code, "op ?args ...?");
+
+	TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[A_OP], ops, "op", TCL_EXACT, &op));
+
+	#define NOT_FOUND(pathc, pathv) do { \
+		replace_tclobj(&path, Tcl_NewListObj(pathc, pathv)); \
+		Tcl_SetErrorCode(interp, "MSGPACK", "NOTFOUND", Tcl_GetString(path), NULL); \
+		THROW_PRINTF_LABEL(finally, code, "path not found"); \
+	} while (0)
+
+	switch (op) {
+		case OP_GET: //{{{
+		{
+			enum {A_cmd=A_OP, A_MSGPACK, A_args};
+			const int A_PATH = A_args;
+			CHECK_MIN_ARGS_LABEL(finally, code, "msgpack ?key ...?");
+
+			TEST_OK_LABEL(finally, code, get_item_from_path(interp, objv[A_MSGPACK], objv+A_PATH, objc-A_PATH, &item, &e));
+			if (item == NULL) NOT_FOUND(objc-A_PATH, objv+A_PATH);
+
+			TEST_OK_LABEL(finally, code, get_obj(interp, l, &item, e, 0, &res));
+			Tcl_SetObjResult(interp, res);
+			break;
+		}
+		//}}}
+		case OP_EXTRACT: //{{{
+		{
+			enum {A_cmd=A_OP, A_MSGPACK, A_args};
+			const int A_PATH = A_args;
+			CHECK_MIN_ARGS_LABEL(finally, code, "msgpack ?key ...?");
+
+			TEST_OK_LABEL(finally, code, get_item_from_path(interp, objv[A_MSGPACK], objv+A_PATH, objc-A_PATH, &item, &e));
+			if (item == NULL) NOT_FOUND(objc-A_PATH, objv+A_PATH);
+
+			const uint8_t*	p = item;
+			TEST_OK_LABEL(finally, code, skip_value(interp, &p, e));
+			Tcl_SetObjResult(interp, Tcl_NewByteArrayObj(item, p - item));
+			break;
+		}
+		//}}}
+		case OP_WELLFORMED: //{{{
+		{
+			enum {A_cmd=A_OP, A_BYTES, A_objc};
+			CHECK_ARGS_LABEL(finally, code, "bytes");
+
+			const uint8_t*	p;
+
+			TEST_OK_LABEL(finally, code, get_bytes(interp, objv[A_BYTES], &p, &e));
+			TEST_OK_LABEL(finally, code, skip_value(interp, &p, e));
+			if (p != e) MSGPACK_TRAILING(finally, code);
+
+			Tcl_SetObjResult(interp, l->tcl_true);
+			break;
+		}
+		//}}}
+		case OP_ENCODE: //{{{
+		{
+			int			typed = 0;
+			Tcl_DString	ds;
+
+			if (objc == 4 && is_flag(objv[2], "-typed")) {
+				typed = 1;
+			} else if (objc != 3) {
+				Tcl_WrongNumArgs(interp, 2, objv, "?-typed? value");
+				code = TCL_ERROR;
+				goto finally;
+			}
+
+			Tcl_DStringInit(&ds);
+			code = typed ?
+				encode_typed(interp, l, &ds, objv[objc-1]) :
+				encode_json( interp, l, &ds, objv[objc-1]);
+			if (code == TCL_OK)
+				Tcl_SetObjResult(interp, Tcl_NewByteArrayObj((const uint8_t*)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+			Tcl_DStringFree(&ds);
+			break;
+		}
+		//}}}
+		case OP_TOJSON: //{{{
+		{
+			int	text = 0;
+			int	A_MSGPACK = 2;
+
+			if (objc > 3 && is_flag(objv[A_MSGPACK], "-text")) {
+				text = 1;
+				A_MSGPACK++;
+			}
+			if (objc <= A_MSGPACK) {
+				Tcl_WrongNumArgs(interp, 2, objv, "?-text? msgpack ?key ...?");
+				code = TCL_ERROR;
+				goto finally;
+			}
+
+			TEST_OK_LABEL(finally, code, get_item_from_path(interp, objv[A_MSGPACK], objv+A_MSGPACK+1, objc-A_MSGPACK-1, &item, &e));
+			if (item == NULL) NOT_FOUND(objc-A_MSGPACK-1, objv+A_MSGPACK+1);
+
+			if (text) {
+				Tcl_DString	ds;
+
+				Tcl_DStringInit(&ds);
+				code = msgpack_to_json(interp, l, &item, e, 0, &ds, NULL);
+				if (code == TCL_OK)
+					code = utf8_to_tclobj(interp, (const uint8_t*)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds), &res);
+				Tcl_DStringFree(&ds);
+				if (code != TCL_OK) goto finally;
+			} else {
+				TEST_OK_LABEL(finally, code, msgpack_to_json(interp, l, &item, e, 0, NULL, &res));
+			}
+
+			Tcl_SetObjResult(interp, res);
+			break;
+		}
+		//}}}
+		default: THROW_ERROR_LABEL(finally, code, "op not implemented yet");
+	}
+
+	#undef NOT_FOUND
+
+finally:
+	replace_tclobj(&res, NULL);
+	replace_tclobj(&path, NULL);
+	return code;
+}
+
+//}}}
+// Script API }}}
+
+int msgpack_init(Tcl_Interp* interp, struct interp_cx* l) //{{{
+{
+	g_bytearray_type = Tcl_GetObjType("bytearray");
+
+	Tcl_CreateObjCommand(interp, NS "::msgpack", msgpack_cmd, l, NULL);
+
+	return TCL_OK;
+}
+
+//}}}
+void msgpack_release(Tcl_Interp* interp) //{{{
+{
+	// Called on unload.  Namespace changes (like commands) are handled automatically
+}
+
+//}}}
+
+// vim: foldmethod=marker foldmarker={{{,}}} ts=4 shiftwidth=4
@@ -0,0 +1,1123 @@
+#include "rl_jsonInt.h"
+#ifdef HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+/* Packed JSON: a binary tape of a JSON value that can be read in place.
+ *
+ * json pack produces it, json unpack turns it back into a JSON value, and
+ * json mmap maps a file holding one so that path lookups (json get, extract,
+ * exists ...) walk the tape in the file and unpack only the part of the value
+ * the path leads to.  json freeze builds one in memory as a compact form for
+ * values that are kept for a long time and only read.
+ *
+ * All integers are 32 bit little endian, offsets are from the start of the
+ * tape:
+ *
+ *   header:	"RLJT" version:u8 0:u8[3] keys:u32 length:u32
+ *   values:	the root value at offset 16, each value followed by its children
+ *				in order, so that the tape is a preorder walk of the value
+ *   keys:		count:u32 ofs:u32[count+1] bytes
+ *
+ * Each value starts with its enum json_types as a byte:
+ *
+ *   JSON_NULL:					tag
+ *   JSON_BOOL:					tag 0|1:u8
+ *   JSON_STRING, JSON_NUMBER,
+ *   JSON_DYN_*:				tag len:u32 bytes (the number text as written,
+ *								the name of a template placeholder)
+ *   JSON_ARRAY:				tag count:u32 child:u32[count]
+ *   JSON_OBJECT:				tag count:u32 {key:u32 child:u32}[count]
+ *
+ * Object keys are ids into the key table, which holds each distinct key once,
+ * sorted bytewise so that a path element is looked up there once and then
+ * compared with the entries of an object as an integer.  Strings are in Tcl's
+ * internal UTF-8.
+ */
+
+#define PACK_VERSION	1
+#define PACK_HDR_LEN	16
+
+#define PACK_CORRUPT(l, c, fmtstr, ...) \
+	do { \
+		Tcl_SetErrorCode(interp, "RL", "JSON", "PACK", "CORRUPT", NULL); \
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Corrupt packed JSON: " fmtstr, ##__VA_ARGS__)); \
+		c = TCL_ERROR; \
+		goto l; \
+	} while(0);
+
+struct tape {
+	size_t			refCount;
+	const uint8_t*	base;
+	size_t			len;
+	Tcl_Obj*		bytes;		// The byte array holding the tape, if it isn't mapped
+	void*			map;		// The mapping holding the tape, if it is
+	size_t			maplen;
+	uint32_t		nkeys;
+	const uint8_t*	keyofs;		// nkeys+1 offsets into keydata
+	const uint8_t*	keydata;
+};
+
+struct tape_item {
+	enum json_types	type;
+	uint32_t		count;		// Length in bytes of strings, elements of arrays, entries of objects
+	int				b;			// JSON_BOOL
+	const uint8_t*	data;		// String bytes, or the child table of arrays and objects
+	uint32_t		end;		// Offset after the item's head (its first child for containers)
+};
+
+static inline uint32_t get_u32(const uint8_t* p) //{{{
+{
+	return (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+}
+
+//}}}
+static inline void set_u32(uint8_t* p, uint32_t v) //{{{
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	p[2] = v >> 16;
+	p[3] = v >> 24;
+}
+
+//}}}
+static int keycmp(const char* a, size_t alen, const char* b, size_t blen) //{{{
+{
+	const int	c = memcmp(a, b, alen < blen ? alen : blen);
+
+	if (c) return c;
+	return alen < blen ? -1 : alen > blen;
+}
+
+//}}}
+// Reader {{{
+static void read_item(const struct tape* tape, uint32_t ofs, struct tape_item* item) //{{{
+{
+	/* Only called on tapes that tape_check has passed, so needs no bounds
+	 * checks of its own
+	 */
+	const uint8_t*	p = tape->base + ofs;
+
+	item->type = p[0];
+	switch (item->type) {
+		case JSON_NULL:
+			item->end = ofs + 1;
+			break;
+		case JSON_BOOL:
+			item->b = p[1];
+			item->end = ofs + 2;
+			break;
+		case JSON_ARRAY:
+			item->count = get_u32(p+1);
+			item->data = p+5;
+			item->end = ofs + 5 + 4*item->count;
+			break;
+		case JSON_OBJECT:
+			item->count = get_u32(p+1);
+			item->data = p+5;
+			item->end = ofs + 5 + 8*item->count;
+			break;
+		default:
+			item->count = get_u32(p+1);
+			item->data = p+5;
+			item->end = ofs + 5 + item->count;
+	}
+}
+
+//}}}
+static void tape_key(const struct tape* tape, uint32_t id, const char** str, int* len) //{{{
+{
+	const uint32_t	start = get_u32(tape->keyofs + 4*id);
+
+	*str = (const char*)tape->keydata + start;
+	*len = get_u32(tape->keyofs + 4*(id+1)) - start;
+}
+
+//}}}
+static int tape_key_id(const struct tape* tape, Tcl_Obj* key, uint32_t* id) //{{{
+{
+	int			len, keylen;
+	const char*	str = Tcl_GetStringFromObj(key, &len);
+	const char*	k;
+	uint32_t	lo = 0, hi = tape->nkeys;
+
+	while (lo < hi) {
+		const uint32_t	mid = lo + (hi-lo)/2;
+		int				c;
+
+		tape_key(tape, mid, &k, &keylen);
+		c = keycmp(str, len, k, keylen);
+		if (c == 0) {
+			*id = mid;
+			return 1;
+		}
+		if (c < 0) hi = mid; else lo = mid+1;
+	}
+
+	return 0;
+}
+
+//}}}
+static int is_tcl_utf8(const uint8_t* s, uint32_t len) //{{{
+{
+	/* Is s well formed in Tcl's internal UTF-8?  That is UTF-8 with NUL as
+	 * C0 80 and no raw NUL bytes, and surrogates allowed since 8.6 keeps
+	 * characters beyond the BMP as surrogate pairs.
+	 */
+	const uint8_t*	e = s + len;
+
+	while (s < e) {
+		const uint8_t	c = *s++;
+		int				more;
+		uint8_t			lo = 0x80, hi = 0xBF;
+
+		if (c == 0) return 0;
+		if (c < 0x80) continue;
+
+		if (c == 0xC0)					{ more = 1; lo = hi = 0x80; }
+		else if (c >= 0xC2 && c <= 0xDF)	more = 1;
+		else if (c == 0xE0)				{ more = 2; lo = 0xA0; }
+		else if (c >= 0xE1 && c <= 0xEF)	more = 2;
+		else if (c == 0xF0)				{ more = 3; lo = 0x90; }
+		else if (c >= 0xF1 && c <= 0xF3)	more = 3;
+		else if (c == 0xF4)				{ more = 3; hi = 0x8F; }
+		else return 0;
+
+		if (e - s < more || *s < lo || *s > hi) return 0;
+		for (s++, more--; more; s++, more--)
+			if ((*s & 0xC0) != 0x80) return 0;
+	}
+
+	return 1;
+}
+
+//}}}
+static int tape_check(Tcl_Interp* interp, struct tape* tape) //{{{
+{
+	/* Check the header, key table and every value in the tape, so that
+	 * nothing reading it afterwards has to.  The values must be laid out in
+	 * preorder, each container's children following it in order, which makes
+	 * this a single pass over the tape and rules out shared or cyclic
+	 * references.
+	 */
+	int				code = TCL_OK;
+	const uint8_t*	p = tape->base;
+	uint32_t		keys, i, pos, prev = 0;
+	const char*		prevkey = NULL;
+	int				prevkeylen = 0;
+	struct frame {
+		const uint8_t*	next;		// Next entry of the container's child table
+		uint32_t		remaining;
+		int				is_object;
+	}*				stack = NULL;
+	int				depth = 0, stacksize = 0;
+	uint32_t*		seen = NULL;	// Per key id, the offset of the last object it was found in
+
+	if (tape->len < PACK_HDR_LEN || memcmp(p, "RLJT", 4) != 0)
+		THROW_ERROR_LABEL(finally, code, "Not packed JSON");
+	if (p[4] != PACK_VERSION)
+		THROW_PRINTF_LABEL(finally, code, "Unsupported packed JSON version %d", p[4]);
+	if (get_u32(p+12) != tape->len)
+		PACK_CORRUPT(finally, code, "length %u, expecting %u", (unsigned)tape->len, get_u32(p+12));
+
+	// Key table {{{
+	keys = get_u32(p+8);
+	if (keys < PACK_HDR_LEN || keys > tape->len - 8)
+		PACK_CORRUPT(finally, code, "key table offset %u out of range", keys);
+	tape->nkeys = get_u32(p+keys);
+	if (tape->nkeys > (tape->len - keys - 8) / 4)
+		PACK_CORRUPT(finally, code, "key table too long");
+	tape->keyofs = p + keys + 4;
+	tape->keydata = tape->keyofs + 4*(tape->nkeys+1);
+	for (i=0; i<=tape->nkeys; i++) {
+		const uint32_t	ofs = get_u32(tape->keyofs + 4*i);
+
+		if (ofs < prev || ofs > tape->len - (tape->keydata - p) || (i == 0 && ofs != 0))
+			PACK_CORRUPT(finally, code, "key %u out of range", i);
+		prev = ofs;
+	}
+	if (tape->keydata + prev != p + tape->len)
+		PACK_CORRUPT(finally, code, "excess bytes after the key table");
+	for (i=0; i<tape->nkeys; i++) {
+		const char*	key;
+		int			keylen;
+
+		tape_key(tape, i, &key, &keylen);
+		if (!is_tcl_utf8((const uint8_t*)key, keylen))
+			PACK_CORRUPT(finally, code, "invalid key %u", i);
+		if (prevkey && keycmp(prevkey, prevkeylen, key, keylen) >= 0)
+			PACK_CORRUPT(finally, code, "key table not sorted at key %u", i);
+		prevkey = key;
+		prevkeylen = keylen;
+	}
+	// Key table }}}
+
+	// Values {{{
+	pos = PACK_HDR_LEN;
+	for (;;) {
+		const uint32_t		avail = keys - pos;
+		struct tape_item	item;
+
+		if (depth) {
+			// The value at pos is the next child of the innermost container
+			struct frame*	f = &stack[depth-1];
+
+			if (f->is_object) f->next += 4;		// Key ids were checked when the object was pushed
+			if (get_u32(f->next) != pos)
+				PACK_CORRUPT(finally, code, "child offset %u should be %u", get_u32(f->next), pos);
+			f->next += 4;
+			f->remaining--;
+		}
+
+		if (pos >= keys)
+			PACK_CORRUPT(finally, code, "value truncated at offset %u", pos);
+
+		switch (p[pos]) {
+			case JSON_NULL:
+				break;
+			case JSON_BOOL:
+				if (avail < 2 || p[pos+1] > 1)
+					PACK_CORRUPT(finally, code, "invalid boolean at offset %u", pos);
+				break;
+			case JSON_ARRAY:
+			case JSON_OBJECT:
+			case JSON_STRING:
+			case JSON_NUMBER:
+			case JSON_DYN_STRING:
+			case JSON_DYN_NUMBER:
+			case JSON_DYN_BOOL:
+			case JSON_DYN_JSON:
+			case JSON_DYN_TEMPLATE:
+			case JSON_DYN_LITERAL:
+				{
+					const uint64_t	unit = p[pos] == JSON_ARRAY ? 4 : p[pos] == JSON_OBJECT ? 8 : 1;
+
+					if (avail < 5 || unit * get_u32(p+pos+1) > avail - 5 || (unit == 1 && get_u32(p+pos+1) > INT_MAX))
+						PACK_CORRUPT(finally, code, "value truncated at offset %u", pos);
+					if (unit == 1 && !is_tcl_utf8(p+pos+5, get_u32(p+pos+1)))
+						PACK_CORRUPT(finally, code, "invalid string at offset %u", pos);
+					if (p[pos] == JSON_NUMBER && !is_json_number((const char*)p+pos+5, get_u32(p+pos+1)))
+						PACK_CORRUPT(finally, code, "invalid number at offset %u", pos);
+				}
+				break;
+			default:
+				PACK_CORRUPT(finally, code, "invalid type %d at offset %u", p[pos], pos);
+		}
+
+		read_item(tape, pos, &item);
+
+		if (item.type == JSON_OBJECT && item.count > 0) {
+			const uint8_t*	e = item.data;
+
+			if (seen == NULL) {
+				seen = ckalloc(tape->nkeys * sizeof *seen + 1);
+				memset(seen, 0, tape->nkeys * sizeof *seen);
+			}
+			for (i=0; i<item.count; i++, e += 8) {
+				const uint32_t	id = get_u32(e);
+
+				if (id >= tape->nkeys)
+					PACK_CORRUPT(finally, code, "key id %u out of range at offset %u", id, (unsigned)(e - p));
+				if (seen[id] == pos)
+					PACK_CORRUPT(finally, code, "key id %u repeated at offset %u", id, (unsigned)(e - p));
+				seen[id] = pos;
+			}
+		}
+
+		pos = item.end;
+
+		if ((item.type == JSON_ARRAY || item.type == JSON_OBJECT) && item.count > 0) {
+			if (depth == stacksize) {
+				stacksize = stacksize ? stacksize*2 : 16;
+				stack = ckrealloc(stack, stacksize * sizeof *stack);
+			}
+			stack[depth++] = (struct frame){
+				.next		= item.data,
+				.remaining	= item.count,
+				.is_object	= item.type == JSON_OBJECT
+			};
+		}
+
+		while (depth && stack[depth-1].remaining == 0) depth--;
+		if (depth == 0) break;
+	}
+	if (pos != keys)
+		PACK_CORRUPT(finally, code, "excess bytes after the root value");
+	// Values }}}
+
+finally:
+	if (stack) {
+		ckfree(stack);
+		stack = NULL;
+	}
+	if (seen) {
+		ckfree(seen);
+		seen = NULL;
+	}
+	return code;
+}
+
+//}}}
+static void tape_release(struct tape** tapePtr) //{{{
+{
+	struct tape*	tape = *tapePtr;
+
+	if (tape == NULL) return;
+	*tapePtr = NULL;
+	if (--tape->refCount > 0) return;
+
+#ifdef HAVE_SYS_MMAN_H
+	if (tape->map) munmap(tape->map, tape->maplen);
+#endif
+	replace_tclobj(&tape->bytes, NULL);
+	ckfree(tape);
+}
+
+//}}}
+static int tape_to_json(struct interp_cx* l, const struct tape* tape, uint32_t ofs, Tcl_Obj** res) //{{{
+{
+	/* Unpack the value at ofs.  The tape has been checked, so this can't fail
+	 * and doesn't need an interp (l is NULL when unpacking for a string rep)
+	 */
+	int					code = TCL_OK;
+	struct tape_item	item;
+	Tcl_Obj*			val = NULL;
+	Tcl_Obj*			child = NULL;
+
+	read_item(tape, ofs, &item);
+
+	switch (item.type) {
+		case JSON_OBJECT:
+			replace_tclobj(&val, Tcl_NewDictObj());
+			for (uint32_t i=0; i<item.count; i++) {
+				const char*	key;
+				int			keylen;
+
+				TEST_OK_LABEL(finally, code, tape_to_json(l, tape, get_u32(item.data + 8*i + 4), &child));
+				tape_key(tape, get_u32(item.data + 8*i), &key, &keylen);
+				TEST_OK_LABEL(finally, code, Tcl_DictObjPut(NULL, val, get_string(l, key, keylen), child));
+			}
+			replace_tclobj(res, JSON_NewJvalObj(JSON_OBJECT, val));
+			break;
+
+		case JSON_ARRAY:
+			replace_tclobj(&val, Tcl_NewListObj(item.count, NULL));
+			for (uint32_t i=0; i<item.count; i++) {
+				TEST_OK_LABEL(finally, code, tape_to_json(l, tape, get_u32(item.data + 4*i), &child));
+				TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(NULL, val, child));
+			}
+			replace_tclobj(res, JSON_NewJvalObj(JSON_ARRAY, val));
+			break;
+
+		case JSON_BOOL:
+			if (l) {
+				replace_tclobj(res, item.b ? l->json_true : l->json_false);
+			} else {
+				replace_tclobj(res, JSON_NewJvalObj(JSON_BOOL, Tcl_NewBooleanObj(item.b)));
+			}
+			break;
+
+		case JSON_NULL:
+			replace_tclobj(res, l ? l->json_null : JSON_NewJvalObj(JSON_NULL, NULL));
+			break;
+
+		case JSON_STRING:
+			if (l && item.count == 0) {
+				replace_tclobj(res, l->json_empty_string);
+				break;
+			}
+			// Falls through
+		default:
+			replace_tclobj(res, JSON_NewJvalObj(item.type, get_string(l, (const char*)item.data, item.count)));
+	}
+
+finally:
+	release_tclobj(&val);
+	release_tclobj(&child);
+	return code;
+}
+
+//}}}
+static int tape_to_tcl(struct interp_cx* l, const struct tape* tape, uint32_t ofs, Tcl_Obj** res) //{{{
+{
+	/* As convert_to_tcl, straight from the tape */
+	int					code = TCL_OK;
+	struct tape_item	item;
+	Tcl_Obj*			val = NULL;
+	Tcl_Obj*			child = NULL;
+
+	read_item(tape, ofs, &item);
+
+	switch (item.type) {
+		case JSON_OBJECT:
+			replace_tclobj(&val, Tcl_NewDictObj());
+			for (uint32_t i=0; i<item.count; i++) {
+				const char*	key;
+				int			keylen;
+
+				TEST_OK_LABEL(finally, code, tape_to_tcl(l, tape, get_u32(item.data + 8*i + 4), &child));
+				tape_key(tape, get_u32(item.data + 8*i), &key, &keylen);
+				TEST_OK_LABEL(finally, code, Tcl_DictObjPut(NULL, val, get_string(l, key, keylen), child));
+			}
+			replace_tclobj(res, val);
+			break;
+
+		case JSON_ARRAY:
+			replace_tclobj(&val, Tcl_NewListObj(item.count, NULL));
+			for (uint32_t i=0; i<item.count; i++) {
+				TEST_OK_LABEL(finally, code, tape_to_tcl(l, tape, get_u32(item.data + 4*i), &child));
+				TEST_OK_LABEL(finally, code, Tcl_ListObjAppendElement(NULL, val, child));
+			}
+			replace_tclobj(res, val);
+			break;
+
+		case JSON_BOOL:
+			replace_tclobj(res, item.b ? l->tcl_true : l->tcl_false);
+			break;
+
+		case JSON_NULL:
+			replace_tclobj(res, l->tcl_empty);
+			break;
+
+		case JSON_STRING:
+		case JSON_NUMBER:
+			replace_tclobj(res, get_string(l, (const char*)item.data, item.count));
+			break;
+
+		default:
+			// Template placeholders are just strings in this context
+			replace_tclobj(res, Tcl_NewStringObj(get_dyn_prefix(item.type), 3));
+			Tcl_AppendToObj(*res, (const char*)item.data, item.count);
+	}
+
+finally:
+	release_tclobj(&val);
+	release_tclobj(&child);
+	return code;
+}
+
+//}}}
+// Reader }}}
+// Packed values {{{
+/* json mmap returns the root of the tape as a value of the JSON_packed type,
+ * and path lookups in it return the values they find the same way.  One of
+ * these is unpacked into a normal JSON value the first time it is used as one
+ * (by set_from_any in json_types.c), and its string rep is generated from the
+ * tape on demand.
+ */
+static void free_internal_rep_packed(Tcl_Obj* obj);
+static void dup_internal_rep_packed(Tcl_Obj* src, Tcl_Obj* dest);
+static void update_string_rep_packed(Tcl_Obj* obj);
+
+static Tcl_ObjType json_packed = {
+	"JSON_packed",
+	free_internal_rep_packed,
+	dup_internal_rep_packed,
+	update_string_rep_packed,
+	NULL		// Only created from a tape
+};
+
+static void free_internal_rep_packed(Tcl_Obj* obj) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_packed);
+	struct tape*		tape = ir->twoPtrValue.ptr1;
+
+	tape_release(&tape);
+}
+
+//}}}
+static void dup_internal_rep_packed(Tcl_Obj* src, Tcl_Obj* dest) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(src, &json_packed);
+	struct tape*		tape = ir->twoPtrValue.ptr1;
+
+	tape->refCount++;
+	Tcl_StoreInternalRep(dest, &json_packed, ir);
+}
+
+//}}}
+static void update_string_rep_packed(Tcl_Obj* obj) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_packed);
+	Tcl_Obj*			json = NULL;
+	const char*			str;
+	int					len;
+
+	if (TCL_OK != tape_to_json(NULL, ir->twoPtrValue.ptr1, (uint32_t)(uintptr_t)ir->twoPtrValue.ptr2, &json))
+		Tcl_Panic("Packed JSON value could not be unpacked");
+
+	str = Tcl_GetStringFromObj(json, &len);
+	obj->bytes = ckalloc(len+1);
+	memcpy(obj->bytes, str, len+1);
+	obj->length = len;
+	release_tclobj(&json);
+}
+
+//}}}
+static Tcl_Obj* new_packed(struct tape* tape, uint32_t ofs) //{{{
+{
+	Tcl_Obj*	res = Tcl_NewObj();
+
+	tape->refCount++;
+	Tcl_InvalidateStringRep(res);
+	Tcl_StoreInternalRep(res, &json_packed, &(Tcl_ObjInternalRep){.twoPtrValue = {
+		.ptr1 = tape,
+		.ptr2 = (void*)(uintptr_t)ofs
+	}});
+
+	return res;
+}
+
+//}}}
+int is_packed(Tcl_Obj* obj) //{{{
+{
+	return Tcl_FetchInternalRep(obj, &json_packed) != NULL;
+}
+
+//}}}
+enum json_types packed_type(Tcl_Obj* obj) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_packed);
+	const struct tape*	tape = ir->twoPtrValue.ptr1;
+
+	return tape->base[(uint32_t)(uintptr_t)ir->twoPtrValue.ptr2];
+}
+
+//}}}
+int packed_to_json(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** res) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_packed);
+	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+
+	return tape_to_json(l, ir->twoPtrValue.ptr1, (uint32_t)(uintptr_t)ir->twoPtrValue.ptr2, res);
+}
+
+//}}}
+int packed_walk_path(Tcl_Obj** target, Tcl_Obj*const pathv[], int pathc, const int modifiers) //{{{
+{
+	/* Follow as many of the path elements as can be in the tape of the packed
+	 * value *target, replacing it with the packed value reached and returning
+	 * the number of elements followed.  Anything that isn't a plain key or
+	 * index (modifiers, slices, malformed indices, descending into atomic
+	 * values) is left to resolve_path.  So are missing keys and indices out of
+	 * range, but the container is replaced with an empty one first so that
+	 * isn't the cost of unpacking it.
+	 */
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(*target, &json_packed);
+	struct tape*		tape = ir->twoPtrValue.ptr1;
+	uint32_t			ofs = (uint32_t)(uintptr_t)ir->twoPtrValue.ptr2;
+	struct tape_item	item;
+	int					i;
+
+	for (i=0; i<pathc; i++) {
+		Tcl_Obj*	step = pathv[i];
+
+		if (i == pathc-1 && modifiers && Tcl_GetString(step)[0] == '?') break;
+
+		read_item(tape, ofs, &item);
+
+		if (item.type == JSON_OBJECT) {
+			uint32_t	id, e;
+
+			if (tape_key_id(tape, step, &id)) {
+				for (e=0; e<item.count; e++)
+					if (get_u32(item.data + 8*e) == id) break;
+			} else {
+				e = item.count;
+			}
+
+			if (e == item.count) {
+				replace_tclobj(target, JSON_NewJvalObj(JSON_OBJECT, Tcl_NewDictObj()));
+				return i;
+			}
+			ofs = get_u32(item.data + 8*e + 4);
+		} else if (item.type == JSON_ARRAY) {
+			long		index;
+
+			if (Tcl_GetLongFromObj(NULL, step, &index) != TCL_OK) {
+				int			len;
+				const char*	str = Tcl_GetStringFromObj(step, &len);
+				char*		end;
+
+				if (len < 3 || strncmp(str, "end", 3) != 0) break;
+				index = (long)item.count - 1;
+				if (len > 3) {
+					if (str[3] != '-') break;
+					errno = 0;
+					index += strtol(str+3, &end, 10);
+					if (errno != 0 || *end != 0) break;
+				}
+			}
+
+			if (index < 0 || index >= item.count) {
+				replace_tclobj(target, JSON_NewJvalObj(JSON_ARRAY, Tcl_NewListObj(0, NULL)));
+				return i;
+			}
+			ofs = get_u32(item.data + 4*index);
+		} else {
+			break;
+		}
+	}
+
+	if (i > 0) replace_tclobj(target, new_packed(tape, ofs));
+	return i;
+}
+
+//}}}
+int packed_to_tcl(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** res) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_packed);
+	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+
+	return tape_to_tcl(l, ir->twoPtrValue.ptr1, (uint32_t)(uintptr_t)ir->twoPtrValue.ptr2, res);
+}
+
+//}}}
+int packed_length(Tcl_Obj* obj) //{{{
+{
+	/* The number of elements or members of an array or object, or the length
+	 * in characters of a string (including the prefix of a template
+	 * placeholder)
+	 */
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_packed);
+	struct tape_item	item;
+
+	read_item(ir->twoPtrValue.ptr1, (uint32_t)(uintptr_t)ir->twoPtrValue.ptr2, &item);
+
+	switch (item.type) {
+		case JSON_ARRAY:
+		case JSON_OBJECT:
+			return item.count;
+		case JSON_STRING:
+			return Tcl_NumUtfChars((const char*)item.data, item.count);
+		default:
+			return Tcl_NumUtfChars((const char*)item.data, item.count) + 3;
+	}
+}
+
+//}}}
+int packed_child(Tcl_Interp* interp, Tcl_Obj* obj, int i, Tcl_Obj** key, Tcl_Obj** val) //{{{
+{
+	/* Set *val to the ith element of the packed array or member of the
+	 * packed object obj, and *key to its key if it's an object.  Arrays and
+	 * objects stay packed, other values are unpacked.
+	 */
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_packed);
+	struct tape*		tape = ir->twoPtrValue.ptr1;
+	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	struct tape_item	item;
+	uint32_t			ofs;
+
+	read_item(tape, (uint32_t)(uintptr_t)ir->twoPtrValue.ptr2, &item);
+
+	if (item.type == JSON_OBJECT) {
+		const char*	str;
+		int			len;
+
+		tape_key(tape, get_u32(item.data + 8*i), &str, &len);
+		replace_tclobj(key, get_string(l, str, len));
+		ofs = get_u32(item.data + 8*i + 4);
+	} else {
+		ofs = get_u32(item.data + 4*i);
+	}
+
+	switch (tape->base[ofs]) {
+		case JSON_ARRAY:
+		case JSON_OBJECT:
+			replace_tclobj(val, new_packed(tape, ofs));
+			return TCL_OK;
+		default:
+			return tape_to_json(l, tape, ofs, val);
+	}
+}
+
+//}}}
+Tcl_Obj* packed_keys(Tcl_Interp* interp, Tcl_Obj* obj) //{{{
+{
+	Tcl_ObjInternalRep*	ir = Tcl_FetchInternalRep(obj, &json_packed);
+	struct tape*		tape = ir->twoPtrValue.ptr1;
+	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	struct tape_item	item;
+	Tcl_Obj*			res = NULL;
+
+	read_item(tape, (uint32_t)(uintptr_t)ir->twoPtrValue.ptr2, &item);
+	res = Tcl_NewListObj(item.count, NULL);
+
+	for (uint32_t i=0; i<item.count; i++) {
+		const char*	str;
+		int			len;
+
+		tape_key(tape, get_u32(item.data + 8*i), &str, &len);
+		Tcl_ListObjAppendElement(NULL, res, get_string(l, str, len));
+	}
+
+	return res;
+}
+
+//}}}
+// Packed values }}}
+// Writer {{{
+static int collect_keys(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_HashTable* keys) //{{{
+{
+	int				code = TCL_OK;
+	enum json_types	type;
+	Tcl_Obj*		val = NULL;
+
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, obj, &type, &val));
+
+	if (type == JSON_OBJECT) {
+		Tcl_DictSearch	search;
+		Tcl_Obj*		k = NULL;
+		Tcl_Obj*		v = NULL;
+		int				done, isnew;
+
+		TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+		for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+			Tcl_CreateHashEntry(keys, Tcl_GetString(k), &isnew);
+			if (TCL_OK != (code = collect_keys(interp, v, keys))) {
+				Tcl_DictObjDone(&search);
+				goto finally;
+			}
+		}
+		Tcl_DictObjDone(&search);
+	} else if (type == JSON_ARRAY) {
+		Tcl_Obj**	ov;
+		int			oc;
+
+		TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, val, &oc, &ov));
+		for (int i=0; i<oc; i++)
+			TEST_OK_LABEL(finally, code, collect_keys(interp, ov[i], keys));
+	}
+
+finally:
+	return code;
+}
+
+//}}}
+static int compare_key_entries(const void* a, const void* b) //{{{
+{
+	const char*	ka = *(const char**)a;
+	const char*	kb = *(const char**)b;
+
+	return keycmp(ka, strlen(ka), kb, strlen(kb));
+}
+
+//}}}
+static void put_u32(Tcl_DString* ds, uint32_t v) //{{{
+{
+	uint8_t	buf[4];
+
+	set_u32(buf, v);
+	Tcl_DStringAppend(ds, (const char*)buf, 4);
+}
+
+//}}}
+static void put_head(Tcl_DString* ds, enum json_types type, uint32_t count) //{{{
+{
+	const char	tag = type;
+
+	Tcl_DStringAppend(ds, &tag, 1);
+	put_u32(ds, count);
+}
+
+//}}}
+static int pack_value(Tcl_Interp* interp, Tcl_DString* ds, Tcl_HashTable* keys, Tcl_Obj* obj) //{{{
+{
+	int				code = TCL_OK;
+	enum json_types	type;
+	Tcl_Obj*		val = NULL;
+
+	TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, obj, &type, &val));
+
+	switch (type) {
+		case JSON_OBJECT:
+		{
+			Tcl_DictSearch	search;
+			Tcl_Obj*		k = NULL;
+			Tcl_Obj*		v = NULL;
+			int				done, size, entry;
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjSize(interp, val, &size));
+			put_head(ds, type, size);
+			entry = Tcl_DStringLength(ds);
+			Tcl_DStringSetLength(ds, entry + 8*size);
+
+			TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+			for (; !done; Tcl_DictObjNext(&search, &k, &v, &done), entry += 8) {
+				Tcl_HashEntry*	he = Tcl_FindHashEntry(keys, Tcl_GetString(k));
+				uint8_t*		e = (uint8_t*)Tcl_DStringValue(ds) + entry;
+
+				set_u32(e,   (uint32_t)(uintptr_t)Tcl_GetHashValue(he));
+				set_u32(e+4, Tcl_DStringLength(ds));
+				if (TCL_OK != (code = pack_value(interp, ds, keys, v))) {
+					Tcl_DictObjDone(&search);
+					goto finally;
+				}
+			}
+			Tcl_DictObjDone(&search);
+			break;
+		}
+
+		case JSON_ARRAY:
+		{
+			Tcl_Obj**	ov;
+			int			oc, entry;
+
+			TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, val, &oc, &ov));
+			put_head(ds, type, oc);
+			entry = Tcl_DStringLength(ds);
+			Tcl_DStringSetLength(ds, entry + 4*oc);
+			for (int i=0; i<oc; i++, entry += 4) {
+				set_u32((uint8_t*)Tcl_DStringValue(ds) + entry, Tcl_DStringLength(ds));
+				TEST_OK_LABEL(finally, code, pack_value(interp, ds, keys, ov[i]));
+			}
+			break;
+		}
+
+		case JSON_BOOL:
+		{
+			int		b;
+			char	buf[2] = {JSON_BOOL};
+
+			TEST_OK_LABEL(finally, code, Tcl_GetBooleanFromObj(interp, val, &b));
+			buf[1] = b;
+			Tcl_DStringAppend(ds, buf, 2);
+			break;
+		}
+
+		case JSON_NULL:
+		{
+			const char	tag = JSON_NULL;
+
+			Tcl_DStringAppend(ds, &tag, 1);
+			break;
+		}
+
+		case JSON_STRING:
+		case JSON_NUMBER:
+		case JSON_DYN_STRING:
+		case JSON_DYN_NUMBER:
+		case JSON_DYN_BOOL:
+		case JSON_DYN_JSON:
+		case JSON_DYN_TEMPLATE:
+		case JSON_DYN_LITERAL:
+		{
+			int			len;
+			const char*	str = Tcl_GetStringFromObj(val, &len);
+
+			put_head(ds, type, len);
+			Tcl_DStringAppend(ds, str, len);
+			break;
+		}
+
+		default:
+			THROW_ERROR_LABEL(finally, code, "Invalid value type");
+	}
+
+finally:
+	return code;
+}
+
+//}}}
+static int write_tape(Tcl_Interp* interp, Tcl_Obj* json, Tcl_DString* ds) //{{{
+{
+	int				code = TCL_OK;
+	Tcl_HashTable	keys;
+	Tcl_HashEntry*	he;
+	Tcl_HashSearch	search;
+	const char**	sorted = NULL;
+	uint32_t		nkeys, i, keyofs, ofs;
+
+	Tcl_InitHashTable(&keys, TCL_STRING_KEYS);
+
+	TEST_OK_LABEL(finally, code, collect_keys(interp, json, &keys));
+
+	// Number the keys in sorted order
+	nkeys = keys.numEntries;
+	sorted = ckalloc(sizeof(const char*) * (nkeys ? nkeys : 1));
+	for (i=0, he=Tcl_FirstHashEntry(&keys, &search); he; he=Tcl_NextHashEntry(&search))
+		sorted[i++] = Tcl_GetHashKey(&keys, he);
+	qsort(sorted, nkeys, sizeof *sorted, compare_key_entries);
+	for (i=0; i<nkeys; i++)
+		Tcl_SetHashValue(Tcl_FindHashEntry(&keys, sorted[i]), (void*)(uintptr_t)i);
+
+	Tcl_DStringAppend(ds, "RLJT" "\x01\0\0\0", 8);
+	Tcl_DStringSetLength(ds, PACK_HDR_LEN);
+	TEST_OK_LABEL(finally, code, pack_value(interp, ds, &keys, json));
+
+	keyofs = Tcl_DStringLength(ds);
+	put_u32(ds, nkeys);
+	for (i=0, ofs=0; i<nkeys; i++) {
+		put_u32(ds, ofs);
+		ofs += strlen(sorted[i]);
+	}
+	put_u32(ds, ofs);
+	for (i=0; i<nkeys; i++)
+		Tcl_DStringAppend(ds, sorted[i], -1);
+
+	set_u32((uint8_t*)Tcl_DStringValue(ds) + 8,  keyofs);
+	set_u32((uint8_t*)Tcl_DStringValue(ds) + 12, Tcl_DStringLength(ds));
+
+finally:
+	if (sorted) {
+		ckfree(sorted);
+		sorted = NULL;
+	}
+	Tcl_DeleteHashTable(&keys);
+	return code;
+}
+
+//}}}
+int pack_from_json(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj** res) //{{{
+{
+	int				code = TCL_OK;
+	Tcl_DString		ds;
+
+	Tcl_DStringInit(&ds);
+	TEST_OK_LABEL(finally, code, write_tape(interp, json, &ds));
+	replace_tclobj(res, Tcl_NewByteArrayObj((const uint8_t*)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+
+finally:
+	Tcl_DStringFree(&ds);
+	return code;
+}
+
+//}}}
+int pack_freeze(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj** res) //{{{
+{
+	/* Return json as a packed value over a tape in memory: one block for the
+	 * whole value, where the normal intrep has a pair of Tcl_Objs for each
+	 * value in it.  Values that are already packed are returned as they are.
+	 */
+	int				code = TCL_OK;
+	struct tape*	tape = NULL;
+	Tcl_DString		ds;
+	int				len;
+
+	Tcl_DStringInit(&ds);
+
+	if (is_packed(json)) {
+		replace_tclobj(res, json);
+		goto finally;
+	}
+
+	TEST_OK_LABEL(finally, code, write_tape(interp, json, &ds));
+
+	tape = ckalloc(sizeof *tape);
+	*tape = (struct tape){.refCount = 1};
+	replace_tclobj(&tape->bytes, Tcl_NewByteArrayObj((const uint8_t*)Tcl_DStringValue(&ds), Tcl_DStringLength(&ds)));
+	tape->base = Tcl_GetByteArrayFromObj(tape->bytes, &len);
+	tape->len = len;
+	TEST_OK_LABEL(finally, code, tape_check(interp, tape));	// Can't fail, but sets up the key table
+	replace_tclobj(res, new_packed(tape, PACK_HDR_LEN));
+
+finally:
+	tape_release(&tape);
+	Tcl_DStringFree(&ds);
+	return code;
+}
+
+//}}}
+// Writer }}}
+// Loading {{{
+int pack_to_json(Tcl_Interp* interp, Tcl_Obj* bytes, Tcl_Obj** res) //{{{
+{
+	int				code = TCL_OK;
+	struct tape		tape = {.refCount = 1};
+	int				len;
+
+	tape.base = Tcl_GetByteArrayFromObj(bytes, &len);
+	tape.len = len;
+	TEST_OK_LABEL(finally, code, tape_check(interp, &tape));
+	TEST_OK_LABEL(finally, code, tape_to_json(Tcl_GetAssocData(interp, "rl_json", NULL), &tape, PACK_HDR_LEN, res));
+
+finally:
+	return code;
+}
+
+//}}}
+int pack_mmap(Tcl_Interp* interp, Tcl_Obj* path, Tcl_Obj** res) //{{{
+{
+	/* Map the file path and return its packed value, falling back on reading
+	 * it into a byte array where mmap isn't available (or the file is in a
+	 * virtual filesystem)
+	 */
+	int				code = TCL_OK;
+	struct tape*	tape = ckalloc(sizeof *tape);
+	Tcl_Channel		chan = NULL;
+
+	*tape = (struct tape){.refCount = 1};
+
+#ifdef HAVE_SYS_MMAN_H
+	{
+		const char*	native = Tcl_FSGetNativePath(path);
+
+		if (native) {
+			struct stat	st;
+			const int	fd = open(native, O_RDONLY);
+
+			if (fd == -1)
+				THROW_PRINTF_LABEL(finally, code, "couldn't open \"%s\": %s", Tcl_GetString(path), Tcl_PosixError(interp));
+
+			if (fstat(fd, &st) == -1) {
+				Tcl_Obj*	msg = Tcl_ObjPrintf("couldn't stat \"%s\": %s", Tcl_GetString(path), Tcl_PosixError(interp));
+				close(fd);
+				Tcl_SetObjResult(interp, msg);
+				code = TCL_ERROR;
+				goto finally;
+			}
+
+			if (st.st_size >= PACK_HDR_LEN && (uint64_t)st.st_size <= UINT32_MAX) {
+				tape->maplen = st.st_size;
+				tape->map = mmap(NULL, tape->maplen, PROT_READ, MAP_PRIVATE, fd, 0);
+				if (tape->map == MAP_FAILED) {
+					Tcl_Obj*	msg = Tcl_ObjPrintf("couldn't map \"%s\": %s", Tcl_GetString(path), Tcl_PosixError(interp));
+					tape->map = NULL;
+					close(fd);
+					Tcl_SetObjResult(interp, msg);
+					code = TCL_ERROR;
+					goto finally;
+				}
+				tape->base = tape->map;
+				tape->len = tape->maplen;
+			}
+			close(fd);
+		}
+	}
+	if (tape->map == NULL)
+#endif
+	{
+		int	len;
+
+		chan = Tcl_FSOpenFileChannel(interp, path, "r", 0);
+		if (chan == NULL) {
+			code = TCL_ERROR;
+			goto finally;
+		}
+		TEST_OK_LABEL(finally, code, Tcl_SetChannelOption(interp, chan, "-translation", "binary"));
+		replace_tclobj(&tape->bytes, Tcl_NewObj());
+		if (Tcl_ReadChars(chan, tape->bytes, -1, 0) == -1)
+			THROW_PRINTF_LABEL(finally, code, "error reading \"%s\": %s", Tcl_GetString(path), Tcl_PosixError(interp));
+		tape->base = Tcl_GetByteArrayFromObj(tape->bytes, &len);
+		tape->len = len;
+	}
+
+	TEST_OK_LABEL(finally, code, tape_check(interp, tape));
+	replace_tclobj(res, new_packed(tape, PACK_HDR_LEN));
+
+finally:
+	if (chan) {
+		Tcl_Close(NULL, chan);
+		chan = NULL;
+	}
+	tape_release(&tape);
+	return code;
+}
+
+//}}}
+// Loading }}}
+
+// vim: foldmethod=marker foldmarker={{{,}}} ts=4 shiftwidth=4
@@ -45,6 +45,10 @@ struct parse_context* push_parse_context(struct parse_context* cx, const enum js
 	new->prev = last;
 	if (last->mode == VALIDATE) {
 		new->val = NULL;
+	} else if (last->mode == NATIVE) {
+		Tcl_IncrRefCount(
+			new->val = container == JSON_OBJECT ? Tcl_NewDictObj() : Tcl_NewListObj(0, NULL)
+		);
 	} else {
 		Tcl_IncrRefCount(
 			new->val = JSON_NewJvalObj(container, container == JSON_OBJECT  ?
@@ -4,6 +4,7 @@ TCL_DECLARE_MUTEX(g_config_mutex);
 Tcl_Obj*		g_packagedir = NULL;
 Tcl_Obj*		g_includedir = NULL;
 int				g_config_refcount = 0;
+const Tcl_ObjType*	g_tcl_double_type = NULL;	// For serializers that have no interp_cx
 static Tcl_Config cfg[] = {
 	{"libdir,runtime",			RL_JSON_LIBRARY_PATH_INSTALL},	// Overwritten by _setdir, must be first
 	{"includedir,runtime",		RL_JSON_INCLUDE_PATH_INSTALL},	// Overwritten by _setdir, must be second
@@ -102,6 +103,7 @@ static const char* action_opcode_str[] = { // Must match the order of the action
 	"STORE_BOOLEAN",
 	"STORE_JSON",
 	"STORE_TEMPLATE",
+	"STORE_REPEAT",
 	"PUSH_TARGET",
 	"POP_TARGET",
 	"REPLACE_VAL",
@@ -213,15 +215,132 @@ Tcl_Obj* as_json(Tcl_Interp* interp, Tcl_Obj* from) //{{{
 
 //}}}
 
-int force_json_number(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* obj, Tcl_Obj** forced) //{{{
+int is_json_number(const char* s, int len) //{{{
 {
-	int	res = TCL_OK;
+	// Does s match the JSON number grammar exactly?  -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?
+	const char*	p = s;
+	const char*	e = s + len;
+
+	if (p < e && *p == '-') p++;
+	if (p >= e) return 0;
+	if (*p == '0') {
+		p++;
+	} else if (*p >= '1' && *p <= '9') {
+		while (++p < e && *p >= '0' && *p <= '9');
+	} else {
+		return 0;
+	}
+
+	if (p < e && *p == '.') {
+		if (++p >= e || *p < '0' || *p > '9') return 0;
+		while (++p < e && *p >= '0' && *p <= '9');
+	}
 
-	// TODO: investigate a direct bytecode version?
+	if (p < e && (*p == 'e' || *p == 'E')) {
+		if (++p < e && (*p == '+' || *p == '-')) p++;
+		if (p >= e || *p < '0' || *p > '9') return 0;
+		while (++p < e && *p >= '0' && *p <= '9');
+	}
+
+	return p == e;
+}
+
+//}}}
+static int is_tcl_space(char c) //{{{
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\v' || c == '\r' || c == '\f';
+}
+
+//}}}
+static int number_error(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* obj) //{{{
+{
+	// Report a value that isn't a number the same way [tcl::mathop::+ 0 $obj] would
+	const char*			s;
+	const char*			p;
+	const char*			e;
+	int					len;
+	const char*			desc = "non-numeric string";
+	const Tcl_ObjType*	typeDouble = l ? l->typeDouble : Tcl_GetObjType("double");
+
+	s = Tcl_GetStringFromObj(obj, &len);
+	p = s;
+	e = s + len;
+	while (p < e && is_tcl_space(*p)) p++;
+	while (e > p && is_tcl_space(e[-1])) e--;
+	if (p < e && (*p == '-' || *p == '+')) p++;
+
+	if (len == 0) {
+		desc = "empty string";
+	} else if (typeDouble && Tcl_FetchInternalRep(obj, typeDouble) != NULL) {
+		desc = "non-numeric floating-point value";		// NaN
+	} else if (e - p >= 2 && *p == '0') {
+		// Looks like an octal integer with an 8 or 9 in it
+		while (++p < e && *p >= '0' && *p <= '9');
+		if (p == e) desc = "invalid octal number";
+	}
+
+	Tcl_SetObjResult(interp, Tcl_ObjPrintf("can't use %s as operand of \"+\"", desc));
+	Tcl_SetErrorCode(interp, "ARITH", "DOMAIN", desc, NULL);
+	return TCL_ERROR;
+}
+
+//}}}
+static int double_is_finite(const Tcl_ObjType* typeDouble, Tcl_Obj* obj) //{{{
+{
+	// False only for Inf and NaN doubles, which have no JSON representation
+	Tcl_ObjInternalRep*	ir = typeDouble ? Tcl_FetchInternalRep(obj, typeDouble) : NULL;
+	double				d;
+
+	if (ir == NULL) return 1;
+	d = ir->doubleValue;
+	return !(d != d || d - d != 0);
+}
+
+//}}}
+static int nonfinite_error(Tcl_Interp* interp, Tcl_Obj* obj) //{{{
+{
+	if (interp) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Number cannot be represented in JSON: %s", Tcl_GetString(obj)));
+		Tcl_SetErrorCode(interp, "RL", "JSON", "NUMBER", NULL);
+	}
+	return TCL_ERROR;
+}
+
+//}}}
+int append_json_number(Tcl_Interp* interp, Tcl_DString* ds, Tcl_Obj* val) //{{{
+{
+	// Append the text of the JSON number val to ds.  Doubles that don't have
+	// a string rep yet are formatted straight into ds rather than generating
+	// one
+	const char*			bytes;
+	int					len;
+	Tcl_ObjInternalRep*	ir = g_tcl_double_type ? Tcl_FetchInternalRep(val, g_tcl_double_type) : NULL;
+
+	if (ir) {
+		if (unlikely(!double_is_finite(g_tcl_double_type, val)))
+			return nonfinite_error(interp, val);
+
+		if (!Tcl_HasStringRep(val)) {
+			char	buf[JSON_DOUBLE_BUFSIZE];
+
+			len = json_format_double(ir->doubleValue, buf);
+			Tcl_DStringAppend(ds, buf, len);
+			return TCL_OK;
+		}
+	}
+
+	bytes = Tcl_GetStringFromObj(val, &len);
+	Tcl_DStringAppend(ds, bytes, len);
+	return TCL_OK;
+}
+
+//}}}
+int force_json_number(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* obj, Tcl_Obj** forced) //{{{
+{
+	const char*	s;
+	int			len;
+	double		d;
 
-	/*
-display *obj
-	 */
 	if (l) {
 		// Attempt to snoop on the intrep to verify that it is one of the numeric types
 		if (
@@ -232,85 +351,53 @@ display *obj
 		   )
 		) {
 			// It's a known number type, we can safely use it directly
-			//fprintf(stderr, "force_json_number fastpath, verified obj to be a number type\n");
-			if (forced == NULL) return TCL_OK;
+			if (unlikely(!double_is_finite(l->typeDouble, obj)))
+				return nonfinite_error(interp, obj);
 
-			if (Tcl_HasStringRep(obj)) { // Has a string rep already, make sure it's not hex or octal, and not padded with whitespace
-				const char* s;
-				int			len, start=0;
+			if (forced == NULL) return TCL_OK;
 
+			if (Tcl_HasStringRep(obj)) {
 				s = Tcl_GetStringFromObj(obj, &len);
-				if (len >= 1 && s[0] == '-')
-					start++;
-
-				if (unlikely(
-					(len+start >= 1 && (
-						(s[start] == '0' && len+start >= 2 && s[start+1] != '.') || // Octal or hex, or double with leading zero not immediately followed by .)
-						s[start] == ' '  ||
-						s[start] == '\n' ||
-						s[start] == '\t' ||
-						s[start] == '\v' ||
-						s[start] == '\r' ||
-						s[start] == '\f'
-					)) ||
-					(len-start >= 2 && (
-						s[len-1] == ' '  ||
-						s[len-1] == '\n' ||
-						s[len-1] == '\t' ||
-						s[len-1] == '\v' ||
-						s[len-1] == '\r' ||
-						s[len-1] == '\f'
-					))
-				)) {
-					// The existing string rep is one of the cases
-					// (octal / hex / whitespace padded) that is not a
-					// valid JSON number.  Duplicate the obj and
+				if (unlikely(!is_json_number(s, len))) {
+					// The existing string rep is one of the Tcl number
+					// formats (octal, hex, whitespace padded, leading +, ...)
+					// that is not a valid JSON number.  Duplicate the obj and
 					// invalidate the string rep
 					Tcl_IncrRefCount(*forced = Tcl_DuplicateObj(obj));
 					Tcl_InvalidateStringRep(*forced);
-				} else {
-					// String rep is safe as a JSON number
-					Tcl_IncrRefCount(*forced = obj);
-					//fprintf(stderr, "force_json_number obj stringrep is safe json number: (%s), intrep: (%s)\n", Tcl_GetString(obj), obj->typePtr->name);
+					return TCL_OK;
 				}
-			} else {
-				// Pure number - no string rep
-				Tcl_IncrRefCount(*forced = obj);
 			}
 
+			// String rep is safe as a JSON number, or it's a pure number
+			Tcl_IncrRefCount(*forced = obj);
 			return TCL_OK;
-		} else {
-			// Could be a string that is a valid number representation, or
-			// something that will convert to a valid number.  Add 0 to it to
-			// check (all valid numbers succeed at this, and are unchanged by
-			// it).  Use the cached objs
-			Tcl_IncrRefCount(l->force_num_cmd[2] = obj);
-			res = Tcl_EvalObjv(interp, 3, l->force_num_cmd, TCL_EVAL_DIRECT);
-			Tcl_DecrRefCount(l->force_num_cmd[2]);
-			l->force_num_cmd[2] = NULL;
 		}
-
-	} else {
-		Tcl_Obj*	cmd;
-
-		cmd = Tcl_NewListObj(0, NULL);
-		TEST_OK(Tcl_ListObjAppendElement(interp, cmd, Tcl_NewStringObj("::tcl::mathop::+", -1)));
-		TEST_OK(Tcl_ListObjAppendElement(interp, cmd, Tcl_NewIntObj(0)));
-		TEST_OK(Tcl_ListObjAppendElement(interp, cmd, obj));
-
-		Tcl_IncrRefCount(cmd);
-		res = Tcl_EvalObjEx(interp, cmd, TCL_EVAL_DIRECT);
-		Tcl_DecrRefCount(cmd);
 	}
 
-	if (res == TCL_OK) {
+	s = Tcl_GetStringFromObj(obj, &len);
+	if (likely(is_json_number(s, len))) {
+		// Already a valid JSON number, use it as is
 		if (forced != NULL)
-			Tcl_IncrRefCount(*forced = Tcl_GetObjResult(interp));
+			Tcl_IncrRefCount(*forced = obj);
+		return TCL_OK;
+	}
+
+	// Could be any of the other forms Tcl accepts as a number.  Let Tcl parse
+	// it (this leaves obj with a numeric intrep: int, wide, bignum or double),
+	// and regenerate the string rep from that
+	if (Tcl_GetDoubleFromObj(NULL, obj, &d) != TCL_OK)
+		return number_error(interp, l, obj);
 
-		Tcl_ResetResult(interp);
+	if (unlikely(!double_is_finite(l ? l->typeDouble : g_tcl_double_type, obj)))
+		return nonfinite_error(interp, obj);
+
+	if (forced != NULL) {
+		Tcl_IncrRefCount(*forced = Tcl_DuplicateObj(obj));
+		Tcl_InvalidateStringRep(*forced);
 	}
 
-	return res;
+	return TCL_OK;
 }
 
 //}}}
@@ -344,7 +431,8 @@ static void append_json_string(const struct serialize_context* scx, Tcl_Obj* obj
 				case 0x9:	Tcl_DStringAppend(ds, "\\t", 2); break;
 
 				default:
-					snprintf(ustr, 7, "\\u%04X", c);
+					// RFC 8785 requires lowercase hex digits
+					snprintf(ustr, 7, scx->serialize_mode == SERIALIZE_CANONICAL ? "\\u%04x" : "\\u%04X", c);
 					Tcl_DStringAppend(ds, ustr, 6);
 					break;
 			}
@@ -361,6 +449,166 @@ static void append_json_string(const struct serialize_context* scx, Tcl_Obj* obj
 	Tcl_DStringAppend(ds, "\"", 1);
 }
 
+//}}}
+static int next_utf16_unit(const char** p, int* pending) //{{{
+{
+	// Step through a UTF-8 string as UTF-16 code units, splitting characters
+	// outside the BMP into surrogate pairs when Tcl_UniChar is wide enough
+	// to hold them
+	Tcl_UniChar	c = 0;
+	int			ch;
+
+	if (*pending) {
+		ch = *pending;
+		*pending = 0;
+		return ch;
+	}
+
+	*p += Tcl_UtfToUniChar(*p, &c);
+	ch = c;
+	if (ch > 0xFFFF) {
+		ch -= 0x10000;
+		*pending = 0xDC00 + (ch & 0x3FF);
+		return 0xD800 + (ch >> 10);
+	}
+
+	return ch;
+}
+
+//}}}
+struct canonical_member {
+	Tcl_Obj*	k;
+	Tcl_Obj*	v;
+	const char*	s;
+	int			len;
+};
+
+static int canonical_member_cmp(const void* a, const void* b) //{{{
+{
+	// RFC 8785 sorts object members by the UTF-16 code units of their keys
+	const struct canonical_member*	ma = a;
+	const struct canonical_member*	mb = b;
+	const char*		pa = ma->s;
+	const char*		pb = mb->s;
+	const char*		ea = pa + ma->len;
+	const char*		eb = pb + mb->len;
+	int				pend_a = 0, pend_b = 0, ua, ub;
+
+	// Skip any common prefix.  If the first difference is between ASCII
+	// bytes (or one key ends) the byte order is the code unit order
+	while (pa < ea && pb < eb && *pa == *pb) {pa++; pb++;}
+	if (pa == ea || pb == eb)
+		return pb < eb ? -1 : pa < ea ? 1 : 0;
+	if (!(*pa & 0x80) && !(*pb & 0x80))
+		return (unsigned char)*pa - (unsigned char)*pb;
+
+	// Otherwise back up to the start of the differing character and compare
+	// code units from there
+	while (pa > ma->s && (*pa & 0xC0) == 0x80) {pa--; pb--;}
+	while ((pa < ea || pend_a) && (pb < eb || pend_b)) {
+		ua = next_utf16_unit(&pa, &pend_a);
+		ub = next_utf16_unit(&pb, &pend_b);
+		if (ua != ub) return ua - ub;
+	}
+
+	return (pa < ea || pend_a) - (pb < eb || pend_b);
+}
+
+//}}}
+static int append_canonical_number(Tcl_Interp* interp, Tcl_DString* ds, Tcl_Obj* val) //{{{
+{
+	// Format the number as ECMAScript's Number.prototype.toString would
+	// (RFC 8785 section 3.2.2.3): the shortest digit string that round trips
+	// through an IEEE double, in plain notation for exponents in [-6, 21)
+	double	d;
+	char	digits[JSON_DOUBLE_DIGITS];
+	char	out[40];
+	char*	o = out;
+	int		k, n, i;
+
+	TEST_OK(Tcl_GetDoubleFromObj(interp, val, &d));
+
+	if (d != d || d - d != 0) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Number cannot be represented in canonical JSON: %s", Tcl_GetString(val)));
+		Tcl_SetErrorCode(interp, "RL", "JSON", "CANONICAL", "NUMBER", NULL);
+		return TCL_ERROR;
+	}
+
+	if (d == 0) {		// Includes -0
+		Tcl_DStringAppend(ds, "0", 1);
+		return TCL_OK;
+	}
+
+	if (d < 0) {
+		*o++ = '-';
+		d = -d;
+	}
+
+	k = json_double_digits(d, digits, &n);		// d = 0.digits * 10^n
+
+	if (k <= n && n <= 21) {
+		memcpy(o, digits, k);					o += k;
+		for (i=k; i<n; i++) *o++ = '0';
+	} else if (0 < n && n <= 21) {
+		memcpy(o, digits, n);					o += n;
+		*o++ = '.';
+		memcpy(o, digits+n, k-n);				o += k-n;
+	} else if (-6 < n && n <= 0) {
+		*o++ = '0';
+		*o++ = '.';
+		for (i=n; i<0; i++) *o++ = '0';
+		memcpy(o, digits, k);					o += k;
+	} else {
+		*o++ = digits[0];
+		if (k > 1) {
+			*o++ = '.';
+			memcpy(o, digits+1, k-1);			o += k-1;
+		}
+		o += sprintf(o, "e%c%d", n-1 < 0 ? '-' : '+', n-1 < 0 ? 1-n : n-1);
+	}
+
+	Tcl_DStringAppend(ds, out, o-out);
+	return TCL_OK;
+}
+
+//}}}
+static int serialize_canonical_object(Tcl_Interp* interp, struct serialize_context* scx, Tcl_Obj* val) //{{{
+{
+	int							code = TCL_OK;
+	int							size, done, i;
+	Tcl_DictSearch				search;
+	Tcl_Obj*					k;
+	Tcl_Obj*					v;
+	struct canonical_member*	members = NULL;
+	struct canonical_member		stackmembers[16];
+
+	TEST_OK(Tcl_DictObjSize(interp, val, &size));
+	members = size <= 16 ? stackmembers : ckalloc(sizeof(*members) * size);
+
+	TEST_OK_LABEL(finally, code, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+	for (i=0; !done; Tcl_DictObjNext(&search, &k, &v, &done), i++) {
+		members[i].k = k;
+		members[i].v = v;
+		members[i].s = Tcl_GetStringFromObj(k, &members[i].len);
+	}
+	Tcl_DictObjDone(&search);
+
+	qsort(members, size, sizeof(*members), canonical_member_cmp);
+
+	Tcl_DStringAppend(scx->ds, "{", 1);
+	for (i=0; i<size; i++) {
+		if (i > 0) Tcl_DStringAppend(scx->ds, ",", 1);
+		append_json_string(scx, members[i].k);
+		Tcl_DStringAppend(scx->ds, ":", 1);
+		TEST_OK_LABEL(finally, code, serialize(interp, scx, members[i].v));
+	}
+	Tcl_DStringAppend(scx->ds, "}", 1);
+
+finally:
+	if (members != stackmembers) ckfree(members);
+	return code;
+}
+
 //}}}
 static int serialize_json_val(Tcl_Interp* interp, struct serialize_context* scx, const int type, Tcl_Obj* val) //{{{
 {
@@ -373,6 +621,10 @@ static int serialize_json_val(Tcl_Interp* interp, struct serialize_context* scx,
 			break;
 			//}}}
 		case JSON_OBJECT: //{{{
+			if (scx->serialize_mode == SERIALIZE_CANONICAL) {
+				res = serialize_canonical_object(interp, scx, val);
+				break;
+			}
 			{
 				int				done, first=1;
 				Tcl_DictSearch	search;
@@ -465,6 +717,10 @@ static int serialize_json_val(Tcl_Interp* interp, struct serialize_context* scx,
 					} else {
 						first = 0;
 					}
+					if (scx->serialize_mode == SERIALIZE_CANONICAL) {
+						TEST_OK(serialize(interp, scx, ov[i]));		// Picks up cached canonical forms
+						continue;
+					}
 					JSON_GetJvalFromObj(interp, ov[i], &v_type, &iv);
 					TEST_OK(serialize_json_val(interp, scx, v_type, iv));
 				}
@@ -473,13 +729,11 @@ static int serialize_json_val(Tcl_Interp* interp, struct serialize_context* scx,
 			break;
 			//}}}
 		case JSON_NUMBER: //{{{
-			{
-				const char*	bytes;
-				int			len;
-
-				bytes = Tcl_GetStringFromObj(val, &len);
-				Tcl_DStringAppend(ds, bytes, len);
+			if (scx->serialize_mode == SERIALIZE_CANONICAL) {
+				res = append_canonical_number(interp, ds, val);
+				break;
 			}
+			res = append_json_number(interp, ds, val);
 			break;
 			//}}}
 		case JSON_BOOL: //{{{
@@ -507,7 +761,7 @@ static int serialize_json_val(Tcl_Interp* interp, struct serialize_context* scx,
 		case JSON_DYN_JSON:
 		case JSON_DYN_TEMPLATE:
 		case JSON_DYN_LITERAL: //{{{
-			if (scx->serialize_mode == SERIALIZE_NORMAL) {
+			if (scx->serialize_mode != SERIALIZE_TEMPLATE) {
 				Tcl_Obj*	tmp = Tcl_ObjPrintf("%s%s", dyn_prefix[type], Tcl_GetString(val));
 
 				Tcl_IncrRefCount(tmp);
@@ -597,6 +851,23 @@ void append_to_cx(struct parse_context* cx, Tcl_Obj* val) //{{{
 	*/
 	if (cx->mode == VALIDATE) return;
 
+	if (cx->mode == NATIVE) {
+		switch (cx->container) {
+			case JSON_OBJECT:
+				Tcl_DictObjPut(NULL, cx->val, cx->hold_key, val);
+				release_tclobj(&cx->hold_key);
+				break;
+
+			case JSON_ARRAY:
+				Tcl_ListObjAppendElement(NULL, cx->val, val);
+				break;
+
+			default:
+				replace_tclobj(&cx->val, val);
+		}
+		return;
+	}
+
 	switch (cx->container) {
 		case JSON_OBJECT:
 			//fprintf(stderr, "append_to_cx, cx->hold_key->refCount: %d (%s)\n", cx->hold_key->refCount, Tcl_GetString(cx->hold_key));
@@ -633,6 +904,24 @@ int serialize(Tcl_Interp* interp, struct serialize_context* scx, Tcl_Obj* obj) /
 
 	TEST_OK(JSON_GetJvalFromObj(interp, obj, &type, &val));
 
+	if (scx->serialize_mode == SERIALIZE_CANONICAL) {
+		// Reuse the canonical form if this value has been canonicalized
+		// before (by JSON_Canonical)
+		Tcl_ObjInternalRep*	ir = NULL;
+		struct json_cache*	cache;
+
+		TEST_OK(JSON_GetIntrepFromObj(interp, obj, &type, &ir));
+		cache = get_json_cache(ir, 0);
+		if (cache && cache->canonical) {
+			const char*	bytes;
+			int			len;
+
+			bytes = Tcl_GetStringFromObj(cache->canonical, &len);
+			Tcl_DStringAppend(scx->ds, bytes, len);
+			return TCL_OK;
+		}
+	}
+
 	res = serialize_json_val(interp, scx, type, val);
 
 	// The result of the serialization is left in scx->ds.  Once the caller
@@ -641,1870 +930,3111 @@ int serialize(Tcl_Interp* interp, struct serialize_context* scx, Tcl_Obj* obj) /
 }
 
 //}}}
-
-static int get_modifier(Tcl_Interp* interp, Tcl_Obj* modobj, enum modifiers* modifier) //{{{
+static int repeat_section(Tcl_Interp* interp, int oc, Tcl_Obj *const ov[], Tcl_Obj** name) //{{{
 {
-	// This must be kept in sync with the modifiers enum
-	static CONST char *modstrings[] = {
-		"",
-		"?length",
-		"?size",
-		"?type",
-		"?keys",
-		(char*)NULL
-	};
-	int	index;
+	// In a template, an array of the form ["~A:name", element_template] is a
+	// repeating section: it is replaced by an array with element_template
+	// applied to each of the dicts in the list name.  Sets *name if the array
+	// oc, ov is one, otherwise leaves it alone
+	enum json_types	type;
+	Tcl_Obj*		val = NULL;
+	const char*		s;
+	int				len;
 
-	TEST_OK(Tcl_GetIndexFromObj(interp, modobj, modstrings, "modifier", TCL_EXACT, &index));
-	*modifier = index;
+	if (oc != 2) return TCL_OK;
 
+	TEST_OK(JSON_GetJvalFromObj(interp, ov[0], &type, &val));
+	if (type != JSON_STRING) return TCL_OK;
+
+	s = Tcl_GetStringFromObj(val, &len);
+	if (len < 3 || s[0] != '~' || s[1] != 'A' || s[2] != ':') return TCL_OK;
+
+	replace_tclobj(name, Tcl_NewStringObj(s+3, len-3));
 	return TCL_OK;
 }
 
 //}}}
-int resolve_path(Tcl_Interp* interp, Tcl_Obj* src, Tcl_Obj *const pathv[], int pathc, Tcl_Obj** target, const int exists, const int modifiers, Tcl_Obj* def) //{{{
+struct fragments_builder {
+	Tcl_DString					text;
+	int							ofs;		// Start of the pending constant text
+	int							fragc;
+	int							fragalloc;
+	struct template_fragment*	frag;
+};
+
+static void emit_fragment(struct fragments_builder* b, enum json_types hole, int is_key, Tcl_Obj* name, Tcl_Obj* elem) //{{{
 {
-	int					i, modstrlen;
-	enum json_types		type;
-	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
-	const char*			modstr;
-	enum modifiers		modifier;
-	Tcl_Obj*			val = NULL;
-	Tcl_Obj*			step = NULL;
-	Tcl_Obj*			t = NULL;
-	int					retval = TCL_OK;
+	struct template_fragment*	f;
 
-#define EXISTS(bool) \
-	if (exists) { \
-		Tcl_SetObjResult(interp, (bool) ? l->tcl_true : l->tcl_false); \
-		goto done; \
-	} else if (!(bool) && def) { \
-		replace_tclobj(&t, def); \
-		goto done; \
+	if (b->fragc >= b->fragalloc) {
+		b->fragalloc = b->fragalloc ? b->fragalloc * 2 : 8;
+		b->frag = ckrealloc(b->frag, sizeof(struct template_fragment) * b->fragalloc);
 	}
 
-	replace_tclobj(&t, src);
+	f = &b->frag[b->fragc++];
+	f->ofs		= b->ofs;
+	f->len		= Tcl_DStringLength(&b->text) - b->ofs;
+	f->hole		= hole;
+	f->is_key	= is_key;
+	f->name		= name;
+	f->elem		= elem;
+	if (name) Tcl_IncrRefCount(name);
+	if (elem) Tcl_IncrRefCount(elem);
+
+	b->ofs = Tcl_DStringLength(&b->text);
+}
 
-	if (unlikely(JSON_GetJvalFromObj(interp, t, &type, &val) != TCL_OK)) {
-		if (exists) {
-			Tcl_ResetResult(interp);
-			// [dict exists] considers any test to be false when applied to an invalid value, so we do the same
-			EXISTS(0);
-		}
-		retval = TCL_ERROR;
-		goto done;
-	}
+//}}}
+static int compile_fragments(Tcl_Interp* interp, struct serialize_context* scx, struct fragments_builder* b, Tcl_Obj* template) //{{{
+{
+	// Serialize template as serialize_json_val would in SERIALIZE_TEMPLATE
+	// mode, but into constant text with holes in place of the substitutions.
+	// scx is in SERIALIZE_NORMAL mode, writing to b->text
+	int				code = TCL_OK;
+	enum json_types	type;
+	Tcl_Obj*		val = NULL;
 
-	//fprintf(stderr, "resolve_path, initial type %s\n", type_names[type]);
-	for (i=0; i<pathc; i++) {
-		replace_tclobj(&step, pathv[i]);
-		//fprintf(stderr, "looking at step %s\n", Tcl_GetString(step));
+	TEST_OK(JSON_GetJvalFromObj(interp, template, &type, &val));
 
-		if (i == pathc-1) {
-			modstr = Tcl_GetStringFromObj(step, &modstrlen);
-			if (modifiers && modstrlen >= 1 && modstr[0] == '?') {
-				// Allow escaping the modifier char by doubling it
-				if (modstrlen >= 2 && modstr[1] == '?') {
-					replace_tclobj(&step, Tcl_GetRange(step, 1, modstrlen-1));
-					//fprintf(stderr, "escaped modifier, interpreting as step %s\n", Tcl_GetString(step));
-				} else {
-					TEST_OK_LABEL(done, retval, get_modifier(interp, step, &modifier));
+	switch (type) {
+		case JSON_OBJECT: //{{{
+			{
+				int				done, first=1;
+				Tcl_DictSearch	search;
+				Tcl_Obj*		k;
+				Tcl_Obj*		v;
 
-					switch (modifier) {
-						case MODIFIER_LENGTH: //{{{
-							switch (type) {
-								case JSON_ARRAY:
-									{
-										int			ac;
-										Tcl_Obj**	av;
-										TEST_OK_LABEL(done, retval, Tcl_ListObjGetElements(interp, val, &ac, &av));
-										EXISTS(1);
-										replace_tclobj(&t, Tcl_NewIntObj(ac));
-									}
-									break;
-								case JSON_STRING:
-									EXISTS(1);
-									replace_tclobj(&t, Tcl_NewIntObj(Tcl_GetCharLength(val)));
-									break;
-								case JSON_DYN_STRING:
-								case JSON_DYN_NUMBER:
-								case JSON_DYN_BOOL:
-								case JSON_DYN_JSON:
-								case JSON_DYN_TEMPLATE:
-								case JSON_DYN_LITERAL:
-									EXISTS(1);
-									replace_tclobj(&t, Tcl_NewIntObj(Tcl_GetCharLength(val) + 3));
-									break;
-								default:
-									EXISTS(0);
-									THROW_ERROR_LABEL(done, retval, Tcl_GetString(step), " modifier is not supported for type ", type_names[type]);
-							}
-							break;
-							//}}}
-						case MODIFIER_SIZE: //{{{
-							if (type != JSON_OBJECT) {
-								EXISTS(0);
-								THROW_ERROR_LABEL(done, retval, Tcl_GetString(step), " modifier is not supported for type ", type_names[type]);
-							}
-							{
-								int	size;
-								TEST_OK_LABEL(done, retval, Tcl_DictObjSize(interp, val, &size));
-								EXISTS(1);
-								replace_tclobj(&t, Tcl_NewIntObj(size));
-							}
-							break;
-							//}}}
-						case MODIFIER_TYPE: //{{{
-							EXISTS(1);
-							replace_tclobj(&t, l->type[type]);
-							break;
-							//}}}
-						case MODIFIER_KEYS: //{{{
-							if (type != JSON_OBJECT) {
-								EXISTS(0);
-								THROW_ERROR_LABEL(done, retval, Tcl_GetString(step), " modifier is not supported for type ", type_names[type]);
-							}
-							{
-								Tcl_DictSearch	search;
-								Tcl_Obj*		k;
-								Tcl_Obj*		v;
-								int				done;
-								Tcl_Obj*		res = NULL;
-
-								TEST_OK_LABEL(done, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
-								if (exists) {
-									Tcl_DictObjDone(&search);
-									EXISTS(1);
-								}
-
-								replace_tclobj(&res, Tcl_NewListObj(0, NULL));
+				TEST_OK(Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
 
-								for (; !done; Tcl_DictObjNext(&search, &k, &v, &done))
-									TEST_OK_BREAK(retval, Tcl_ListObjAppendElement(interp, res, k));
+				Tcl_DStringAppend(&b->text, "{", 1);
+				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+					int			len;
+					const char*	s = Tcl_GetStringFromObj(k, &len);
 
-								Tcl_DictObjDone(&search);
-								if (retval == TCL_OK) replace_tclobj(&t, res);
-								release_tclobj(&res);
-								if (retval != TCL_OK) goto done;
-							}
-							break;
-							//}}}
-						default:
-							THROW_ERROR_LABEL(done, retval, "Unhandled modifier type: ", Tcl_GetString(Tcl_NewIntObj(modifier)));
+					if (!first) {
+						Tcl_DStringAppend(&b->text, ",", 1);
+					} else {
+						first = 0;
 					}
-					//fprintf(stderr, "Handled modifier, skipping descent check\n");
-					break;
-				}
-			}
-		}
-		switch (type) {
-			case JSON_UNDEF: //{{{
-				THROW_ERROR_LABEL(done, retval, "Found JSON_UNDEF type jval following path");
-				//}}}
-			case JSON_OBJECT: //{{{
-				{
-					Tcl_Obj*	new = NULL;
-					TEST_OK_LABEL(done, retval, Tcl_DictObjGet(interp, val, step, &new));
-					replace_tclobj(&t, new);
-				}
-				if (t == NULL) {
-					EXISTS(0);
-					Tcl_SetObjResult(interp, Tcl_ObjPrintf("Path element %d: \"%s\" not found", pathc+1, Tcl_GetString(step)));
-					retval = TCL_ERROR;
-					goto done;
-				}
-
-				//TEST_OK_LABEL(done, retval, JSON_GetJvalFromObj(interp, src, &type, &val));
-				//fprintf(stderr, "Descended into object, new type: %s, val: (%s)\n", type_names[type], Tcl_GetString(val));
-				break;
-				//}}}
-			case JSON_ARRAY: //{{{
-				{
-					int			ac, index_str_len, ok=1;
-					long		index;
-					const char*	index_str;
-					char*		end;
-					Tcl_Obj**	av;
 
-					TEST_OK_LABEL(done, retval, Tcl_ListObjGetElements(interp, val, &ac, &av));
-					//fprintf(stderr, "descending into array of length %d\n", ac);
+					if (len >= 3 && s[0] == '~' && s[2] == ':') {
+						switch (s[1]) {
+							case 'S':
+								emit_fragment(b, JSON_DYN_STRING, 1, Tcl_NewStringObj(s+3, len-3), NULL);
+								break;
 
-					if (Tcl_GetLongFromObj(NULL, step, &index) != TCL_OK) {
-						// Index isn't an integer, check for end(-int)?
-						index_str = Tcl_GetStringFromObj(step, &index_str_len);
-						if (index_str_len < 3 || strncmp("end", index_str, 3) != 0) {
-							ok = 0;
-						}
+							case 'L':
+								{
+									Tcl_Obj*	lit = NULL;
 
-						if (ok) {
-							index = ac-1;
-							if (index_str_len >= 4) {
-								if (index_str[3] != '-') {
-									ok = 0;
-								} else {
-									// errno is magically thread-safe on POSIX
-									// systems (it's thread-local)
-									errno = 0;
-									index += strtol(index_str+3, &end, 10);
-									if (errno != 0 || *end != 0)
-										ok = 0;
+									replace_tclobj(&lit, Tcl_NewStringObj(s+3, len-3));
+									append_json_string(scx, lit);
+									release_tclobj(&lit);
 								}
-							}
-						}
-
-						if (!ok)
-							THROW_ERROR_LABEL(done, retval, "Expected an integer index or end(-integer)?, got ", Tcl_GetString(step));
+								break;
 
-						//fprintf(stderr, "Resolved index of %ld from \"%s\"\n", index, index_str);
-					} else {
-						//fprintf(stderr, "Explicit index: %ld\n", index);
-					}
+							case 'N':
+							case 'B':
+							case 'J':
+							case 'T':
+								Tcl_SetObjResult(interp, Tcl_ObjPrintf("Only strings allowed as object keys, got %s", s));
+								code = TCL_ERROR;
+								break;
 
-					if (index < 0 || index >= ac) {
-						// Soft error - set target to an NULL object in
-						// keeping with [lindex] behaviour
-						EXISTS(0);
-						replace_tclobj(&t, l->json_null);
-						//fprintf(stderr, "index %ld is out of range [0, %d], setting target to a synthetic null\n", index, ac);
+							default:
+								append_json_string(scx, k);
+						}
+						if (code != TCL_OK) break;
 					} else {
-						replace_tclobj(&t, av[index]);
-						//fprintf(stderr, "extracted index %ld: (%s)\n", index, Tcl_GetString(t));
+						append_json_string(scx, k);
 					}
-				}
-				break;
-				//}}}
-			case JSON_STRING:
-			case JSON_NUMBER:
-			case JSON_BOOL:
-			case JSON_NULL:
-			case JSON_DYN_STRING:
-			case JSON_DYN_NUMBER:
-			case JSON_DYN_BOOL:
-			case JSON_DYN_JSON:
-			case JSON_DYN_TEMPLATE:
-			case JSON_DYN_LITERAL:
-				{
-					EXISTS(0);
-					Tcl_SetObjResult(interp, Tcl_ObjPrintf(
-						"Cannot descend into atomic type \"%s\" with path element %d: \"%s\"",
-						type_names[type],
-						pathc,
-						Tcl_GetString(step)
-					));
-					retval = TCL_ERROR;
-					goto done;
-				}
-			default:
-				Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unhandled type: %d", type));
-				retval = TCL_ERROR;
-				goto done;
-		}
-
-		TEST_OK_LABEL(done, retval, JSON_GetJvalFromObj(interp, t, &type, &val));
-		//fprintf(stderr, "Walked on to new type %s\n", type_names[type]);
-	}
-
-	EXISTS(type != JSON_NULL);
-
-done:
-	if (retval == TCL_OK)
-		replace_tclobj(target, t);
-	//fprintf(stderr, "Returning target: (%s)\n", Tcl_GetString(*target));
-
-	release_tclobj(&step);
-	release_tclobj(&t);
-	return retval;
-}
-
-//}}}
-int convert_to_tcl(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** out) //{{{
-{
-	enum json_types	type;
-	int				res = TCL_OK;
-	Tcl_Obj*		val = NULL;
-
-	TEST_OK(JSON_GetJvalFromObj(interp, obj, &type, &val));
-	/*
-	fprintf(stderr, "Retrieved internal rep of jval: type: %s, intrep Tcl_Obj type: %s, object: %p: \"%s\"\n",
-			type_names[type], val && val->typePtr ? val->typePtr->name : "<no type>",
-			val, val ? Tcl_GetString(val) : "<none>");
-	*/
-
-	switch (type) {
-		case JSON_OBJECT:
-			{
-				int				done;
-				Tcl_DictSearch	search;
-				Tcl_Obj*		k = NULL;
-				Tcl_Obj*		v = NULL;
-				Tcl_Obj*		vo = NULL;
-				Tcl_Obj*		new = NULL;
-
-				replace_tclobj(&new, Tcl_NewDictObj());
 
-				TEST_OK(Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
-				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-					TEST_OK_BREAK(res, convert_to_tcl(interp, v, &vo));
-					TEST_OK_BREAK(res, Tcl_DictObjPut(interp, new, k, vo));
+					Tcl_DStringAppend(&b->text, ":", 1);
+					TEST_OK_BREAK(code, compile_fragments(interp, scx, b, v));
 				}
+				Tcl_DStringAppend(&b->text, "}", 1);
 				Tcl_DictObjDone(&search);
-				release_tclobj(&vo);
-				if (res == TCL_OK) replace_tclobj(out, new);
-				release_tclobj(&new);
 			}
 			break;
-
-		case JSON_ARRAY:
+			//}}}
+		case JSON_ARRAY: //{{{
 			{
 				int			i, oc;
-				Tcl_Obj**	ov = NULL;
-				Tcl_Obj*	elem = NULL;
-				Tcl_Obj*	new = NULL;
-
-				replace_tclobj(&new, Tcl_NewListObj(0, NULL));
+				Tcl_Obj**	ov;
+				Tcl_Obj*	repeat = NULL;
 
 				TEST_OK(Tcl_ListObjGetElements(interp, val, &oc, &ov));
+
+				TEST_OK(repeat_section(interp, oc, ov, &repeat));
+				if (repeat) {
+					emit_fragment(b, JSON_ARRAY, 0, repeat, ov[1]);
+					release_tclobj(&repeat);
+					break;
+				}
+
+				Tcl_DStringAppend(&b->text, "[", 1);
 				for (i=0; i<oc; i++) {
-					TEST_OK_BREAK(res, convert_to_tcl(interp, ov[i], &elem));
-					TEST_OK_BREAK(res, Tcl_ListObjAppendElement(interp, new, elem));
+					if (i > 0) Tcl_DStringAppend(&b->text, ",", 1);
+					TEST_OK(compile_fragments(interp, scx, b, ov[i]));
 				}
-				release_tclobj(&elem);
-				if (res == TCL_OK) replace_tclobj(out, new);
-				release_tclobj(&new);
+				Tcl_DStringAppend(&b->text, "]", 1);
 			}
 			break;
-
-		case JSON_STRING:
-		case JSON_NUMBER:
-		case JSON_BOOL:
-			replace_tclobj(out, val);
-			break;
-
-		case JSON_NULL:
-			{
-				struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
-				replace_tclobj(out, l->tcl_empty);
-			}
+			//}}}
+		case JSON_DYN_LITERAL: //{{{
+			append_json_string(scx, val);
 			break;
-
-		// These are all just semantically normal JSON string values in this context
+			//}}}
 		case JSON_DYN_STRING:
 		case JSON_DYN_NUMBER:
 		case JSON_DYN_BOOL:
 		case JSON_DYN_JSON:
-		case JSON_DYN_TEMPLATE:
-		case JSON_DYN_LITERAL:
-			replace_tclobj(out, Tcl_ObjPrintf("%s%s", dyn_prefix[type], Tcl_GetString(val)));
+		case JSON_DYN_TEMPLATE: //{{{
+			emit_fragment(b, type, 0, val, NULL);
 			break;
-
-		default:
-			THROW_ERROR("Invalid value type");
+			//}}}
+		default: //{{{
+			code = serialize_json_val(interp, scx, type, val);
+			break;
+			//}}}
 	}
 
-	return res;
+	return code;
 }
 
 //}}}
-static int _new_object(Tcl_Interp* interp, int objc, Tcl_Obj *const objv[], Tcl_Obj** res) //{{{
+static void template_cache_unlink(struct interp_cx* l, struct template_cache_entry* e) //{{{
 {
-	int			i, ac, retval=TCL_OK;
-	Tcl_Obj**	av = NULL;
-	Tcl_Obj*	new_val = NULL;
-	Tcl_Obj*	val = NULL;
-
-	if (objc % 2 != 0)
-		THROW_ERROR("json new object needs an even number of arguments");
+	if (e->prev) e->prev->next = e->next; else l->template_cache_head = e->next;
+	if (e->next) e->next->prev = e->prev; else l->template_cache_tail = e->prev;
+	e->prev = e->next = NULL;
+}
 
-	replace_tclobj(&val, Tcl_NewDictObj());
+//}}}
+static void template_cache_evict(struct interp_cx* l, struct template_cache_entry* e) //{{{
+{
+	template_cache_unlink(l, e);
+	Tcl_DeleteHashEntry(e->he);
+	release_tclobj(&e->template);
+	ckfree(e);
+	l->template_cache_count--;
+}
 
-	for (i=0; i<objc; i+=2) {
-		Tcl_Obj*	k = objv[i];
-		Tcl_Obj*	v = objv[i+1];
+//}}}
+static void template_cache_clear(struct interp_cx* l) //{{{
+{
+	while (l->template_cache_head)
+		template_cache_evict(l, l->template_cache_head);
+}
 
-		TEST_OK_LABEL(end, retval, Tcl_ListObjGetElements(interp, v, &ac, &av));
-		TEST_OK_LABEL(end, retval, new_json_value_from_list(interp, ac, av, &new_val));
-		TEST_OK_LABEL(end, retval, Tcl_DictObjPut(interp, val, k, new_val));
+//}}}
+static int template_cache_lookup(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* template, Tcl_Obj** shared) //{{{
+{
+	// Templates arriving as different Tcl_Objs with the same text (from
+	// format, files, string ops) would each be parsed and compiled again.
+	// Sets *shared to the parsed value remembered for template's text, in
+	// which the compiled forms should be cached.  Values without a string
+	// rep are used directly rather than being serialized just to look them
+	// up.  The caller owns a reference to *shared
+	Tcl_HashEntry*					he;
+	struct template_cache_entry*	e;
+	int								isnew;
+	enum json_types					type;
+	Tcl_ObjInternalRep*				ir;
+
+	if (l == NULL || !Tcl_HasStringRep(template)) {
+		replace_tclobj(shared, template);
+		return TCL_OK;
 	}
 
-	replace_tclobj(res, JSON_NewJvalObj(JSON_OBJECT, val));
+	he = Tcl_CreateHashEntry(&l->template_cache, Tcl_GetString(template), &isnew);
+	if (!isnew) {
+		e = Tcl_GetHashValue(he);
+		if (e != l->template_cache_head) {
+			template_cache_unlink(l, e);
+			e->next = l->template_cache_head;
+			l->template_cache_head->prev = e;
+			l->template_cache_head = e;
+		}
+		l->template_cache_hits++;
+		replace_tclobj(shared, e->template);
+		return TCL_OK;
+	}
 
-end:
-	release_tclobj(&val);
-	release_tclobj(&new_val);
-	return retval;
+	l->template_cache_misses++;
+	e = ckalloc(sizeof(*e));
+	e->he = he;
+	e->template = NULL;
+	replace_tclobj(&e->template, Tcl_DuplicateObj(template));
+	e->prev = NULL;
+	e->next = l->template_cache_head;
+	if (e->next) e->next->prev = e; else l->template_cache_tail = e;
+	l->template_cache_head = e;
+	l->template_cache_count++;
+	Tcl_SetHashValue(he, e);
+
+	if (TCL_OK != JSON_GetIntrepFromObj(interp, e->template, &type, &ir)) {
+		template_cache_evict(l, e);
+		return TCL_ERROR;
+	}
+
+	if (l->template_cache_count > TEMPLATE_CACHE_SIZE) {
+		template_cache_evict(l, l->template_cache_tail);
+		l->template_cache_evictions++;
+	}
+
+	replace_tclobj(shared, e->template);
+	return TCL_OK;
 }
 
 //}}}
-void foreach_state_free(struct foreach_state* state) //{{{
+static void template_cache_adopt(Tcl_Obj* template, Tcl_Obj* shared) //{{{
 {
-	unsigned int i, j;
-
-	release_tclobj(&state->script);
-
-	// Close any pending searches
-	for (i=0; i<state->iterators; i++) {
-		if (state->it[i].search.dictionaryPtr != NULL)
-			Tcl_DictObjDone(&state->it[i].search);
+	// Give template the compiled forms cached on shared, which has the same text
+	enum json_types		type;
+	Tcl_ObjInternalRep*	ir;
+	Tcl_ObjInternalRep*	sharedir;
+	struct json_cache*	cache;
+	struct json_cache*	sharedcache;
 
-		for (j=0; j < state->it[i].var_c; j++)
-			Tcl_DecrRefCount(state->it[i].var_v[j]);
+	if (template == shared) return;
+	if (!JSON_IsJSON(shared, &type, &sharedir)) return;
 
-		release_tclobj(&state->it[i].varlist);
+	if (!JSON_IsJSON(template, &type, &ir)) {
+		// Not parsed yet: take a copy of the parsed intrep, which shares the cache
+		shared->typePtr->dupIntRepProc(shared, template);
+		return;
 	}
 
-	if (state->it != NULL) {
-		ckfree((char*)state->it);
-		state->it = NULL;
+	sharedcache = get_json_cache(sharedir, 0);
+	if (sharedcache == NULL) return;
+	cache = get_json_cache(ir, 1);
+	if (cache->program == NULL && sharedcache->program) {
+		cache->program = sharedcache->program;
+		cache->program->refCount++;
+	}
+	if (cache->fragments == NULL && sharedcache->fragments) {
+		cache->fragments = sharedcache->fragments;
+		cache->fragments->refCount++;
+	}
+	if (cache->match == NULL && sharedcache->match) {
+		cache->match = sharedcache->match;
+		cache->match->refCount++;
 	}
-
-	release_tclobj(&state->res);
 }
 
 //}}}
-static int NRforeach_next_loop_top(Tcl_Interp* interp, struct foreach_state* state) //{{{
+void release_template_fragments(struct template_fragments** fragments) //{{{
 {
-	struct interp_cx* l = Tcl_GetAssocData(interp, "rl_json", NULL);
-	unsigned int j, k;
+	struct template_fragments*	f = *fragments;
+	int							i;
 
-	//fprintf(stderr, "Starting iteration %d/%d\n", i, max_loops);
-	// Set the iterator variables
-	for (j=0; j < state->iterators; j++) {
-		struct foreach_iterator* this_it = &state->it[j];
+	if (f == NULL) return;
+	*fragments = NULL;
 
-		if (this_it->is_array) { // Iterating over a JSON array
-			//fprintf(stderr, "Array iteration, data_i: %d, length %d\n", this_it->data_i, this_it->data_c);
-			for (k=0; k<this_it->var_c; k++) {
-				Tcl_Obj* it_val;
+	if (--f->refCount > 0) return;
 
-				if (this_it->data_i < this_it->data_c) {
-					//fprintf(stderr, "Pulling next element %d off the data list (length %d)\n", this_it->data_i, this_it->data_c);
-					it_val = this_it->data_v[this_it->data_i++];
-				} else {
-					//fprintf(stderr, "Ran out of elements in this data list, setting null\n");
-					it_val = l->json_null;
-				}
-				//fprintf(stderr, "pre  Iteration %d, this_it: %p, setting var %p, varname ref: %d\n",
-				//		i, this_it, this_it->var_v[k]/*, Tcl_GetString(this_it->var_v[k])*/, this_it->var_v[k]->refCount);
-				//fprintf(stderr, "varname: \"%s\"\n", Tcl_GetString(it[j].var_v[k]));
-				//Tcl_ObjSetVar2(interp, this_it->var_v[k], NULL, it_val, 0);
-				Tcl_ObjSetVar2(interp, this_it->var_v[k], NULL, it_val, 0);
-				//Tcl_ObjSetVar2(interp, Tcl_NewStringObj("elem", 4), NULL, it_val, 0);
-				//fprintf(stderr, "post Iteration %d, this_it: %p, setting var %p, varname ref: %d\n",
-				//		i, this_it, this_it->var_v[k]/*, Tcl_GetString(this_it->var_v[k])*/, this_it->var_v[k]->refCount);
-			}
-		} else { // Iterating over a JSON object
-			//fprintf(stderr, "Object iteration\n");
-			if (!this_it->done) {
-				// We check that this_it->var_c == 2 in the setup
-				Tcl_ObjSetVar2(interp, this_it->var_v[0], NULL, this_it->k, 0);
-				Tcl_ObjSetVar2(interp, this_it->var_v[1], NULL, this_it->v, 0);
-				Tcl_DictObjNext(&this_it->search, &this_it->k, &this_it->v, &this_it->done);
-			}
-		}
+	for (i=0; i<f->fragc; i++) {
+		release_tclobj(&f->frag[i].name);
+		release_tclobj(&f->frag[i].elem);
 	}
 
-	Tcl_NRAddCallback(interp, NRforeach_next_loop_bottom, state, NULL, NULL, NULL);
-	return Tcl_NREvalObj(interp, state->script, 0);
+	ckfree(f->text);
+	ckfree(f);
 }
 
 //}}}
-static int NRforeach_next_loop_bottom(ClientData cdata[], Tcl_Interp* interp, int retcode) //{{{
+static int get_template_fragments(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* template, struct template_fragments** fragments) //{{{
 {
-	struct foreach_state*	state = (struct foreach_state*)cdata[0];
-	struct interp_cx*		l = Tcl_GetAssocData(interp, "rl_json", NULL);
-	Tcl_Obj*				it_res = NULL;
+	// Return the string rendering form of template, cached on its intrep.
+	// The caller owns a reference to *fragments and must release it with
+	// release_template_fragments
+	int							code = TCL_OK;
+	Tcl_ObjInternalRep*			ir;
+	enum json_types				type;
+	struct json_cache*			cache = NULL;
+	Tcl_Obj*					shared = NULL;	// Parsed template from the interp's template cache
+	struct fragments_builder	b = {.ofs = 0};
+	struct serialize_context	scx = {
+		.ds				= &b.text,
+		.serialize_mode	= SERIALIZE_NORMAL,
+		.l				= l,
+		.allow_null		= 1
+	};
+	int							i;
 
-	switch (retcode) {
-		case TCL_OK:
-			switch (state->collecting) {
-				case COLLECT_NONE: break;
-				case COLLECT_LIST:
-					Tcl_IncrRefCount(it_res = Tcl_GetObjResult(interp));
-					Tcl_ResetResult(interp);
-					TEST_OK_LABEL(done, retcode, Tcl_ListObjAppendElement(interp, state->res, it_res));
-					Tcl_DecrRefCount(it_res); it_res = NULL;
-					break;
+	Tcl_DStringInit(&b.text);
 
-				case COLLECT_ARRAY:
-				case COLLECT_OBJECT:
-					{
-						enum json_types	type;
-						Tcl_Obj*		val = NULL;		// Intrep of state->res
+	if (!JSON_IsJSON(template, &type, &ir) || (cache = get_json_cache(ir, 0)) == NULL || cache->fragments == NULL)
+		TEST_OK_LABEL(finally, code, template_cache_lookup(interp, l, template, &shared));
 
-						if (Tcl_IsShared(state->res)) {
-							Tcl_Obj*	new = NULL;
-							Tcl_IncrRefCount(new = Tcl_DuplicateObj(state->res));
-							Tcl_DecrRefCount(state->res);
-							state->res = new;	// Transfers ref from new to state->res
-						}
-						TEST_OK_LABEL(done, retcode, JSON_GetJvalFromObj(interp, state->res, &type, &val));
+	if (shared) {
+		TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, shared, &type, &ir));
+		cache = get_json_cache(ir, 0);
+	}
 
-						Tcl_IncrRefCount(it_res = Tcl_GetObjResult(interp));
-						Tcl_ResetResult(interp);
+	if (cache == NULL || cache->fragments == NULL) {
+		struct template_fragments*	f = NULL;
+		int							len;
 
-						switch (state->collecting) {
-							case COLLECT_ARRAY:
-								TEST_OK_LABEL(done, retcode, Tcl_ListObjAppendElement(interp, val, as_json(interp, it_res)));
-								break;
+		TEST_OK_LABEL(finally, code, compile_fragments(interp, &scx, &b, shared));
+		emit_fragment(&b, JSON_UNDEF, 0, NULL, NULL);
 
-							case COLLECT_OBJECT:
-								if (it_res->typePtr == l->typeDict) { // Iterate over it_res as a dictionary {{{
-									Tcl_DictSearch	search;
-									Tcl_Obj*		k = NULL;
-									Tcl_Obj*		v = NULL;
-									int				done;
+		f = ckalloc(sizeof(*f) + sizeof(struct template_fragment) * b.fragc);
+		f->refCount = 1;
+		len = Tcl_DStringLength(&b.text);
+		f->text = ckalloc(len + 1);
+		memcpy(f->text, Tcl_DStringValue(&b.text), len + 1);
+		f->fragc = b.fragc;
+		memcpy(f->frag, b.frag, sizeof(struct template_fragment) * b.fragc);
+		b.fragc = 0;	// References to the names now belong to f
 
-									TEST_OK_LABEL(done, retcode, Tcl_DictObjFirst(interp, it_res, &search, &k, &v, &done));
-									for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-										TEST_OK_LABEL(cleanup_search, retcode, Tcl_DictObjPut(interp, val, k, as_json(interp, v)));
-									}
+		cache = get_json_cache(ir, 1);
+		cache->fragments = f;
+	}
+	if (shared) template_cache_adopt(template, shared);
 
-cleanup_search:
-									Tcl_DictObjDone(&search);
-									if (retcode != TCL_OK) goto done;
-									break;
-									//}}}
-								} else { // Iterate over it_res as a list {{{
-									int			oc, i;
-									Tcl_Obj**	ov = NULL;
+	release_template_fragments(fragments);
+	cache->fragments->refCount++;
+	*fragments = cache->fragments;
 
-									TEST_OK_LABEL(done, retcode, Tcl_ListObjGetElements(interp, it_res, &oc, &ov));
+finally:
+	release_tclobj(&shared);
+	for (i=0; i<b.fragc; i++) {
+		release_tclobj(&b.frag[i].name);
+		release_tclobj(&b.frag[i].elem);
+	}
+	if (b.frag) ckfree(b.frag);
+	Tcl_DStringFree(&b.text);
+	return code;
+}
 
-									if (oc % 2 != 0)
-										THROW_ERROR_LABEL(done, retcode, "Iteration result must be a list with an even number of elements");
+//}}}
+static int render_template_fragments(Tcl_Interp* interp, struct serialize_context* scx, const struct template_fragments* fragments);
 
-									for (i=0; i<oc; i+=2)
-										TEST_OK_LABEL(done, retcode, Tcl_DictObjPut(interp, val, ov[i], as_json(interp, ov[i+1])));
-									//}}}
-								}
-								break;
+static int render_repeat_section(Tcl_Interp* interp, struct serialize_context* scx, const struct template_fragment* f) //{{{
+{
+	int							code = TCL_OK;
+	Tcl_Obj*					rows = NULL;
+	Tcl_Obj**					rowv;
+	int							rowc, i;
+	struct template_fragments*	elem = NULL;
+	Tcl_Obj*					hold_fromdict = scx->fromdict;
+
+	if (scx->fromdict) {
+		TEST_OK(Tcl_DictObjGet(interp, scx->fromdict, f->name, &rows));
+	} else {
+		rows = Tcl_ObjGetVar2(interp, f->name, NULL, 0);
+	}
 
-							default:
-								THROW_ERROR_LABEL(done, retcode, "Unexpect value for collecting");
-						}
+	if (rows == NULL) {
+		Tcl_DStringAppend(scx->ds, "null", 4);
+		return TCL_OK;
+	}
 
-						if (it_res) {
-							Tcl_DecrRefCount(it_res); it_res = NULL;
-						}
-					}
-					break;
-			}
+	Tcl_IncrRefCount(rows);
+	TEST_OK_LABEL(finally, code, Tcl_ListObjGetElements(interp, rows, &rowc, &rowv));
+	TEST_OK_LABEL(finally, code, get_template_fragments(interp, scx->l, f->elem, &elem));
+
+	Tcl_DStringAppend(scx->ds, "[", 1);
+	for (i=0; i<rowc; i++) {
+		if (i > 0) Tcl_DStringAppend(scx->ds, ",", 1);
+		scx->fromdict = rowv[i];
+		code = render_template_fragments(interp, scx, elem);
+		scx->fromdict = hold_fromdict;
+		if (code != TCL_OK) {
+			Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf("\n    (rendering row %d of \"%s\")", i, Tcl_GetString(f->name)));
+			goto finally;
+		}
+	}
+	Tcl_DStringAppend(scx->ds, "]", 1);
 
-		case TCL_CONTINUE:
-			retcode = TCL_OK;
-			break;
+finally:
+	release_template_fragments(&elem);
+	release_tclobj(&rows);
+	return code;
+}
 
-		case TCL_BREAK:
-			retcode = TCL_OK;
-			// falls through
-		default:
-			goto done;
-	}
+//}}}
+static int render_template_fragments(Tcl_Interp* interp, struct serialize_context* scx, const struct template_fragments* fragments) //{{{
+{
+	// Only the substituted values need to be serialized, the constant text is
+	// copied as is.  scx is in SERIALIZE_TEMPLATE mode
+	int		i, code = TCL_OK;
 
-	state->loop_num++;
+	for (i=0; i<fragments->fragc; i++) {
+		const struct template_fragment*	f = &fragments->frag[i];
 
-	if (state->loop_num < state->max_loops) {
-		return NRforeach_next_loop_top(interp, state);
-	} else {
-		if (state->res != NULL) {
-			Tcl_SetObjResult(interp, state->res);
-		}
-	}
+		Tcl_DStringAppend(scx->ds, fragments->text + f->ofs, f->len);
 
-done:
-	//fprintf(stderr, "done\n");
-	if (it_res != NULL) {
-		Tcl_DecrRefCount(it_res);
-		it_res = NULL;
-	}
+		if (f->hole == JSON_UNDEF) continue;
 
-	if (retcode == TCL_OK && state->res != NULL /* collecting */)
-		Tcl_SetObjResult(interp, state->res);
+		if (f->hole == JSON_ARRAY) {
+			code = render_repeat_section(interp, scx, f);
+		} else if (f->is_key) {
+			int		hold = scx->allow_null;
 
-	foreach_state_free(state);
-	Tcl_Free((char*)state);
-	state = NULL;
+			scx->allow_null = 0;
+			code = serialize_json_val(interp, scx, f->hole, f->name);
+			scx->allow_null = hold;
+		} else {
+			code = serialize_json_val(interp, scx, f->hole, f->name);
+		}
+		if (code != TCL_OK) break;
+	}
 
-	return retcode;
+	return code;
 }
 
 //}}}
-static int foreach(Tcl_Interp* interp, int objc, Tcl_Obj *const objv[], enum collecting_mode collecting) //{{{
+
+static int get_modifier(Tcl_Interp* interp, Tcl_Obj* modobj, enum modifiers* modifier) //{{{
 {
-	// Caller must ensure that objc is valid
-	unsigned int			i;
-	int						retcode=TCL_OK;
-	struct foreach_state*	state = NULL;
+	// This must be kept in sync with the modifiers enum
+	static CONST char *modstrings[] = {
+		"",
+		"?length",
+		"?size",
+		"?type",
+		"?keys",
+		(char*)NULL
+	};
+	int	index;
 
-	state = (struct foreach_state*)ckalloc(sizeof(*state));
-	state->iterators = (objc-1)/2;
-	state->it = (struct foreach_iterator*)ckalloc(sizeof(struct foreach_iterator) * state->iterators);
-	state->max_loops = 0;
-	state->loop_num = 0;
-	state->collecting = collecting;
+	TEST_OK(Tcl_GetIndexFromObj(interp, modobj, modstrings, "modifier", TCL_EXACT, &index));
+	*modifier = index;
 
-	Tcl_IncrRefCount(state->script = objv[objc-1]);
+	return TCL_OK;
+}
 
-	switch (state->collecting) {
-		case COLLECT_NONE:
-			state->res = NULL;
-			break;
-		case COLLECT_LIST:
-			Tcl_IncrRefCount(state->res = Tcl_NewListObj(0, NULL));
-			break;
-		case COLLECT_ARRAY:
-			Tcl_IncrRefCount(state->res = JSON_NewJvalObj(JSON_ARRAY, Tcl_NewListObj(0, NULL)));
-			break;
-		case COLLECT_OBJECT:
-			Tcl_IncrRefCount(state->res = JSON_NewJvalObj(JSON_OBJECT, Tcl_NewDictObj()));
-			break;
-		default:
-			THROW_ERROR_LABEL(done, retcode, "Unhandled value for collecting");
+//}}}
+static int parse_slice_index(const char* str, int len, int ac, long def, long* index) //{{{
+{
+	// Parse one bound of an array slice path step: an integer, end(-integer)?
+	// or an empty string, which gives def.  Returns 0 if str isn't valid
+	char		buf[TCL_INTEGER_SPACE+4];
+	char*		end;
+	long		base = 0;
+
+	if (len == 0) {
+		*index = def;
+		return 1;
 	}
 
-	for (i=0; i<state->iterators; i++) {
-		state->it[i].search.dictionaryPtr = NULL;
-		state->it[i].data_v = NULL;
-		state->it[i].is_array = 0;
-		state->it[i].var_v = NULL;
-		state->it[i].varlist = NULL;
+	if (len >= 3 && strncmp("end", str, 3) == 0) {
+		base = ac-1;
+		str += 3;
+		len -= 3;
+		if (len == 0) {
+			*index = base;
+			return 1;
+		}
+		if (*str != '-') return 0;
 	}
 
-	for (i=0; i<state->iterators; i++) {
-		int				loops, j;
-		enum json_types	type;
-		Tcl_Obj*		val;
-		Tcl_Obj*		varlist = objv[i*2];
-
-		if (Tcl_IsShared(varlist))
-			varlist = Tcl_DuplicateObj(varlist);
-
-		replace_tclobj(&state->it[i].varlist, varlist);
+	if (len >= (int)sizeof(buf)) return 0;
+	memcpy(buf, str, len);
+	buf[len] = 0;
 
-		TEST_OK_LABEL(done, retcode, Tcl_ListObjGetElements(interp, state->it[i].varlist, &state->it[i].var_c, &state->it[i].var_v));
-		for (j=0; j < state->it[i].var_c; j++)
-			Tcl_IncrRefCount(state->it[i].var_v[j]);
-
-		if (state->it[i].var_c == 0)
-			THROW_ERROR_LABEL(done, retcode, "foreach varlist is empty");
-
-		TEST_OK_LABEL(done, retcode, JSON_GetJvalFromObj(interp, objv[i*2+1], &type, &val));
-		switch (type) {
-			case JSON_ARRAY:
-				TEST_OK_LABEL(done, retcode,
-						Tcl_ListObjGetElements(interp, val, &state->it[i].data_c, &state->it[i].data_v));
-				state->it[i].data_i = 0;
-				state->it[i].is_array = 1;
-				loops = (int)ceil(state->it[i].data_c / (double)state->it[i].var_c);
+	// strtol would skip leading whitespace
+	if (buf[0] != '-' && buf[0] != '+' && (buf[0] < '0' || buf[0] > '9')) return 0;
 
-				break;
+	// errno is magically thread-safe on POSIX systems (it's thread-local)
+	errno = 0;
+	*index = base + strtol(buf, &end, 10);
+	return errno == 0 && *end == 0 && end != buf;
+}
 
-			case JSON_OBJECT:
-				if (state->it[i].var_c != 2)
-					THROW_ERROR_LABEL(done, retcode, "When iterating over a JSON object, varlist must be a pair of varnames (key value)");
+//}}}
+int resolve_path(Tcl_Interp* interp, Tcl_Obj* src, Tcl_Obj *const pathv[], int pathc, Tcl_Obj** target, const int exists, const int modifiers, Tcl_Obj* def) //{{{
+{
+	int					i, modstrlen, start = 0;
+	enum json_types		type;
+	struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	const char*			modstr;
+	enum modifiers		modifier;
+	Tcl_Obj*			val = NULL;
+	Tcl_Obj*			step = NULL;
+	Tcl_Obj*			t = NULL;
+	int					retval = TCL_OK;
 
-				TEST_OK_LABEL(done, retcode, Tcl_DictObjSize(interp, val, &loops));
-				TEST_OK_LABEL(done, retcode, Tcl_DictObjFirst(interp, val, &state->it[i].search, &state->it[i].k, &state->it[i].v, &state->it[i].done));
-				break;
+#define EXISTS(bool) \
+	if (exists) { \
+		Tcl_SetObjResult(interp, (bool) ? l->tcl_true : l->tcl_false); \
+		goto done; \
+	} else if (!(bool) && def) { \
+		replace_tclobj(&t, def); \
+		goto done; \
+	}
 
-			case JSON_NULL:
-				state->it[i].data_c = 0;
-				state->it[i].data_v = NULL;
-				state->it[i].data_i = 0;
-				state->it[i].is_array = 1;
-				loops = 0;
-				break;
+	replace_tclobj(&t, src);
 
-			default:
-				THROW_ERROR_LABEL(done, retcode, "Cannot iterate over JSON type ", type_names[type]);
+	if (is_packed(t)) {
+		// Walk what we can of the path in the tape, so that only the part of the value it leads to is unpacked
+		start = packed_walk_path(&t, pathv, pathc, modifiers);
+		if (start == pathc && is_packed(t)) {
+			EXISTS(packed_type(t) != JSON_NULL);
+			goto done;
 		}
-
-		if (loops > state->max_loops)
-			state->max_loops = loops;
+		if (start == pathc-1 && is_packed(t) && modifiers) {
+			// Answer a modifier from the tape if it applies to the type, otherwise the code below reports the error
+			modstr = Tcl_GetString(pathv[start]);
+			if (modstr[0] == '?' && modstr[1] != '?') {
+				TEST_OK_LABEL(done, retval, get_modifier(interp, pathv[start], &modifier));
+				type = packed_type(t);
+				switch (modifier) {
+					case MODIFIER_LENGTH:
+						if (type != JSON_ARRAY && type != JSON_STRING && !type_is_dynamic(type)) break;
+						EXISTS(1);
+						replace_tclobj(&t, Tcl_NewIntObj(packed_length(t)));
+						goto done;
+					case MODIFIER_SIZE:
+						if (type != JSON_OBJECT) break;
+						EXISTS(1);
+						replace_tclobj(&t, Tcl_NewIntObj(packed_length(t)));
+						goto done;
+					case MODIFIER_TYPE:
+						EXISTS(1);
+						replace_tclobj(&t, l->type[type]);
+						goto done;
+					case MODIFIER_KEYS:
+						if (type != JSON_OBJECT) break;
+						EXISTS(1);
+						replace_tclobj(&t, packed_keys(interp, t));
+						goto done;
+					default:
+						break;
+				}
+			}
+		}
+		// The rest of the path needs the value unpacked, but src stays packed
+		if (t == src) replace_tclobj(&t, Tcl_DuplicateObj(t));
 	}
 
-	if (state->loop_num < state->max_loops)
-		return NRforeach_next_loop_top(interp, state);
-
-done:
-	//fprintf(stderr, "done\n");
-	if (retcode == TCL_OK && state->collecting != COLLECT_NONE)
-		Tcl_SetObjResult(interp, state->res);
-
-	foreach_state_free(state);
-	Tcl_Free((char*)state);
-	state = NULL;
+	if (unlikely(JSON_GetJvalFromObj(interp, t, &type, &val) != TCL_OK)) {
+		if (exists) {
+			Tcl_ResetResult(interp);
+			// [dict exists] considers any test to be false when applied to an invalid value, so we do the same
+			EXISTS(0);
+		}
+		retval = TCL_ERROR;
+		goto done;
+	}
 
-	return retcode;
-}
+	//fprintf(stderr, "resolve_path, initial type %s\n", type_names[type]);
+	for (i=start; i<pathc; i++) {
+		replace_tclobj(&step, pathv[i]);
+		//fprintf(stderr, "looking at step %s\n", Tcl_GetString(step));
 
-//}}}
-int json_pretty(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj* indent, Tcl_Obj* pad, Tcl_DString* ds) //{{{
-{
-	int							pad_len, next_pad_len, count;
-	enum json_types				type;
-	const char*					pad_str;
-	const char*					next_pad_str;
-	Tcl_Obj*					next_pad = NULL;
-	Tcl_Obj*					val = NULL;
-	struct serialize_context	scx;
-	int							retval = TCL_OK;
+		if (i == pathc-1) {
+			modstr = Tcl_GetStringFromObj(step, &modstrlen);
+			if (modifiers && modstrlen >= 1 && modstr[0] == '?') {
+				// Allow escaping the modifier char by doubling it
+				if (modstrlen >= 2 && modstr[1] == '?') {
+					replace_tclobj(&step, Tcl_GetRange(step, 1, modstrlen-1));
+					//fprintf(stderr, "escaped modifier, interpreting as step %s\n", Tcl_GetString(step));
+				} else {
+					TEST_OK_LABEL(done, retval, get_modifier(interp, step, &modifier));
 
-	scx.ds = ds;
-	scx.serialize_mode = SERIALIZE_NORMAL;
-	scx.fromdict = NULL;
-	scx.l = Tcl_GetAssocData(interp, "rl_json", NULL);
-	scx.allow_null = 1;
+					switch (modifier) {
+						case MODIFIER_LENGTH: //{{{
+							switch (type) {
+								case JSON_ARRAY:
+									{
+										int			ac;
+										Tcl_Obj**	av;
+										TEST_OK_LABEL(done, retval, Tcl_ListObjGetElements(interp, val, &ac, &av));
+										EXISTS(1);
+										replace_tclobj(&t, Tcl_NewIntObj(ac));
+									}
+									break;
+								case JSON_STRING:
+									EXISTS(1);
+									replace_tclobj(&t, Tcl_NewIntObj(Tcl_GetCharLength(val)));
+									break;
+								case JSON_DYN_STRING:
+								case JSON_DYN_NUMBER:
+								case JSON_DYN_BOOL:
+								case JSON_DYN_JSON:
+								case JSON_DYN_TEMPLATE:
+								case JSON_DYN_LITERAL:
+									EXISTS(1);
+									replace_tclobj(&t, Tcl_NewIntObj(Tcl_GetCharLength(val) + 3));
+									break;
+								default:
+									EXISTS(0);
+									THROW_ERROR_LABEL(done, retval, Tcl_GetString(step), " modifier is not supported for type ", type_names[type]);
+							}
+							break;
+							//}}}
+						case MODIFIER_SIZE: //{{{
+							if (type != JSON_OBJECT) {
+								EXISTS(0);
+								THROW_ERROR_LABEL(done, retval, Tcl_GetString(step), " modifier is not supported for type ", type_names[type]);
+							}
+							{
+								int	size;
+								TEST_OK_LABEL(done, retval, Tcl_DictObjSize(interp, val, &size));
+								EXISTS(1);
+								replace_tclobj(&t, Tcl_NewIntObj(size));
+							}
+							break;
+							//}}}
+						case MODIFIER_TYPE: //{{{
+							EXISTS(1);
+							replace_tclobj(&t, l->type[type]);
+							break;
+							//}}}
+						case MODIFIER_KEYS: //{{{
+							if (type != JSON_OBJECT) {
+								EXISTS(0);
+								THROW_ERROR_LABEL(done, retval, Tcl_GetString(step), " modifier is not supported for type ", type_names[type]);
+							}
+							{
+								Tcl_DictSearch	search;
+								Tcl_Obj*		k;
+								Tcl_Obj*		v;
+								int				done;
+								Tcl_Obj*		res = NULL;
 
-	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, json, &type, &val));
+								TEST_OK_LABEL(done, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+								if (exists) {
+									Tcl_DictObjDone(&search);
+									EXISTS(1);
+								}
 
-	pad_str = Tcl_GetStringFromObj(pad, &pad_len);
+								replace_tclobj(&res, Tcl_NewListObj(0, NULL));
 
-	switch (type) {
-		case JSON_OBJECT: //{{{
-			{
-				int				done, k_len, max=0, size;
-				Tcl_DictSearch	search;
-				Tcl_Obj*		k;
-				Tcl_Obj*		v;
-				const char*		key_pad_buf = "                    ";	// Must be at least 20 chars long (max cap below)
+								for (; !done; Tcl_DictObjNext(&search, &k, &v, &done))
+									TEST_OK_BREAK(retval, Tcl_ListObjAppendElement(interp, res, k));
 
-				TEST_OK_LABEL(finally, retval, Tcl_DictObjSize(interp, val, &size));
-				if (size == 0) {
-					Tcl_DStringAppend(ds, "{}", 2);
+								Tcl_DictObjDone(&search);
+								if (retval == TCL_OK) replace_tclobj(&t, res);
+								release_tclobj(&res);
+								if (retval != TCL_OK) goto done;
+							}
+							break;
+							//}}}
+						default:
+							THROW_ERROR_LABEL(done, retval, "Unhandled modifier type: ", Tcl_GetString(Tcl_NewIntObj(modifier)));
+					}
+					//fprintf(stderr, "Handled modifier, skipping descent check\n");
 					break;
 				}
-
-				TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
-
-				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-					Tcl_GetStringFromObj(k, &k_len);
-					if (k_len <= 20 && k_len > max)
-						max = k_len;
+			}
+		}
+		switch (type) {
+			case JSON_UNDEF: //{{{
+				THROW_ERROR_LABEL(done, retval, "Found JSON_UNDEF type jval following path");
+				//}}}
+			case JSON_OBJECT: //{{{
+				{
+					Tcl_Obj*	new = NULL;
+					TEST_OK_LABEL(done, retval, Tcl_DictObjGet(interp, val, step, &new));
+					replace_tclobj(&t, new);
+				}
+				if (t == NULL) {
+					EXISTS(0);
+					Tcl_SetObjResult(interp, Tcl_ObjPrintf("Path element %d: \"%s\" not found", pathc+1, Tcl_GetString(step)));
+					retval = TCL_ERROR;
+					goto done;
 				}
-				Tcl_DictObjDone(&search);
 
-				if (max > 20)
-					max = 20;		// If this cap is changed be sure to adjust the key_pad_buf length above
+				//TEST_OK_LABEL(done, retval, JSON_GetJvalFromObj(interp, src, &type, &val));
+				//fprintf(stderr, "Descended into object, new type: %s, val: (%s)\n", type_names[type], Tcl_GetString(val));
+				break;
+				//}}}
+			case JSON_ARRAY: //{{{
+				{
+					int			ac, index_str_len, ok=1;
+					long		index;
+					const char*	index_str;
+					char*		end;
+					Tcl_Obj**	av;
 
-				replace_tclobj(&next_pad, Tcl_DuplicateObj(pad));
-				Tcl_AppendObjToObj(next_pad, indent);
+					TEST_OK_LABEL(done, retval, Tcl_ListObjGetElements(interp, val, &ac, &av));
+					//fprintf(stderr, "descending into array of length %d\n", ac);
 
-				next_pad_str = Tcl_GetStringFromObj(next_pad, &next_pad_len);
+					if (Tcl_GetLongFromObj(NULL, step, &index) != TCL_OK) {
+						const char*	colon;
 
-				Tcl_DStringAppend(ds, "{\n", 2);
+						index_str = Tcl_GetStringFromObj(step, &index_str_len);
 
-				count = 0;
-				TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
-				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-					Tcl_DStringAppend(ds, next_pad_str, next_pad_len);
-					append_json_string(&scx, k);
-					Tcl_DStringAppend(ds, ": ", 2);
+						colon = memchr(index_str, ':', index_str_len);
+						if (colon) {
+							// Slice: first:last, inclusive as for [lrange].
+							// The result shares the element objs of this
+							// array, so the cost is proportional to the
+							// length of the slice, not the array
+							long	first, last;
+
+							if (
+								!parse_slice_index(index_str, colon-index_str, ac, 0, &first) ||
+								!parse_slice_index(colon+1, index_str_len-(colon-index_str)-1, ac, ac-1, &last)
+							) THROW_ERROR_LABEL(done, retval, "Expected an array slice first:last, got ", Tcl_GetString(step));
+
+							if (first < 0) first = 0;
+							if (last >= ac) last = ac-1;
+							if (first > last) {
+								replace_tclobj(&t, JSON_NewJvalObj(JSON_ARRAY, Tcl_NewListObj(0, NULL)));
+							} else if (first > 0 || last < ac-1) {
+								replace_tclobj(&t, JSON_NewJvalObj(JSON_ARRAY, Tcl_NewListObj(last-first+1, av+first)));
+							}
+							// else the slice covers the whole array: t is unchanged
+							break;
+						}
 
-					Tcl_GetStringFromObj(k, &k_len);
-					if (k_len < max)
-						Tcl_DStringAppend(ds, key_pad_buf, max-k_len);
+						// Index isn't an integer, check for end(-int)?
+						if (index_str_len < 3 || strncmp("end", index_str, 3) != 0) {
+							ok = 0;
+						}
 
-					if (json_pretty(interp, v, indent, next_pad, ds) != TCL_OK) {
-						Tcl_DictObjDone(&search);
-						retval = TCL_ERROR;
-						goto finally;
-					}
+						if (ok) {
+							index = ac-1;
+							if (index_str_len >= 4) {
+								if (index_str[3] != '-') {
+									ok = 0;
+								} else {
+									// errno is magically thread-safe on POSIX
+									// systems (it's thread-local)
+									errno = 0;
+									index += strtol(index_str+3, &end, 10);
+									if (errno != 0 || *end != 0)
+										ok = 0;
+								}
+							}
+						}
 
-					if (++count < size) {
-						Tcl_DStringAppend(ds, ",\n", 2);
+						if (!ok)
+							THROW_ERROR_LABEL(done, retval, "Expected an integer index or end(-integer)?, got ", Tcl_GetString(step));
+
+						//fprintf(stderr, "Resolved index of %ld from \"%s\"\n", index, index_str);
 					} else {
-						Tcl_DStringAppend(ds, "\n", 1);
+						//fprintf(stderr, "Explicit index: %ld\n", index);
 					}
-				}
-				Tcl_DictObjDone(&search);
-
-				Tcl_DStringAppend(ds, pad_str, pad_len);
-				Tcl_DStringAppend(ds, "}", 1);
-			}
-			break;
-			//}}}
-
-		case JSON_ARRAY: //{{{
-			{
-				int			i, oc;
-				Tcl_Obj**	ov;
-
-				TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, val, &oc, &ov));
-
-				replace_tclobj(&next_pad, Tcl_DuplicateObj(pad));
-				Tcl_AppendObjToObj(next_pad, indent);
-				next_pad_str = Tcl_GetStringFromObj(next_pad, &next_pad_len);
 
-				if (oc == 0) {
-					Tcl_DStringAppend(ds, "[]", 2);
-				} else {
-					Tcl_DStringAppend(ds, "[\n", 2);
-					count = 0;
-					for (i=0; i<oc; i++) {
-						Tcl_DStringAppend(ds, next_pad_str, next_pad_len);
-						TEST_OK_LABEL(finally, retval, json_pretty(interp, ov[i], indent, next_pad, ds));
-						if (++count < oc) {
-							Tcl_DStringAppend(ds, ",\n", 2);
-						} else {
-							Tcl_DStringAppend(ds, "\n", 1);
-						}
+					if (index < 0 || index >= ac) {
+						// Soft error - set target to an NULL object in
+						// keeping with [lindex] behaviour
+						EXISTS(0);
+						replace_tclobj(&t, l->json_null);
+						//fprintf(stderr, "index %ld is out of range [0, %d], setting target to a synthetic null\n", index, ac);
+					} else {
+						replace_tclobj(&t, av[index]);
+						//fprintf(stderr, "extracted index %ld: (%s)\n", index, Tcl_GetString(t));
 					}
-					Tcl_DStringAppend(ds, pad_str, pad_len);
-					Tcl_DStringAppend(ds, "]", 1);
 				}
-			}
-			break;
-			//}}}
+				break;
+				//}}}
+			case JSON_STRING:
+			case JSON_NUMBER:
+			case JSON_BOOL:
+			case JSON_NULL:
+			case JSON_DYN_STRING:
+			case JSON_DYN_NUMBER:
+			case JSON_DYN_BOOL:
+			case JSON_DYN_JSON:
+			case JSON_DYN_TEMPLATE:
+			case JSON_DYN_LITERAL:
+				{
+					EXISTS(0);
+					Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+						"Cannot descend into atomic type \"%s\" with path element %d: \"%s\"",
+						type_names[type],
+						pathc,
+						Tcl_GetString(step)
+					));
+					retval = TCL_ERROR;
+					goto done;
+				}
+			default:
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unhandled type: %d", type));
+				retval = TCL_ERROR;
+				goto done;
+		}
 
-		default:
-			serialize_json_val(interp, &scx, type, val);
+		TEST_OK_LABEL(done, retval, JSON_GetJvalFromObj(interp, t, &type, &val));
+		//fprintf(stderr, "Walked on to new type %s\n", type_names[type]);
 	}
 
-finally:
-	release_tclobj(&next_pad);
+	EXISTS(type != JSON_NULL);
+
+done:
+	if (retval == TCL_OK)
+		replace_tclobj(target, t);
+	//fprintf(stderr, "Returning target: (%s)\n", Tcl_GetString(*target));
+
+	release_tclobj(&step);
+	release_tclobj(&t);
 	return retval;
 }
 
 //}}}
-static int json_pretty_dbg(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj* indent, Tcl_Obj* pad, Tcl_DString* ds) //{{{
+int convert_to_tcl(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** out) //{{{
 {
-	int							indent_len, pad_len, next_pad_len, count;
-	enum json_types				type;
-	const char*					pad_str;
-	const char*					next_pad_str;
-	Tcl_Obj*					next_pad = NULL;
-	Tcl_Obj*					val;
-	struct serialize_context	scx;
-	int							retval = TCL_OK;
-
-	scx.ds = ds;
-	scx.serialize_mode = SERIALIZE_NORMAL;
-	scx.fromdict = NULL;
-	scx.l = Tcl_GetAssocData(interp, "rl_json", NULL);
-	scx.allow_null = 1;
-
-	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, json, &type, &val));
+	enum json_types	type;
+	int				res = TCL_OK;
+	Tcl_Obj*		val = NULL;
 
-	Tcl_GetStringFromObj(indent, &indent_len);
-	pad_str = Tcl_GetStringFromObj(pad, &pad_len);
+	if (is_packed(obj))
+		return packed_to_tcl(interp, obj, out);
 
-	if (type == JSON_NULL) {
-		Tcl_Obj*	tmp = NULL;
-		replace_tclobj(&tmp, Tcl_ObjPrintf("(0x%lx[%d]/NULL)",
-						(unsigned long)(ptrdiff_t)json, json->refCount));
-		Tcl_DStringAppend(ds, Tcl_GetString(tmp), -1);
-		release_tclobj(&tmp);
-	} else {
-		Tcl_Obj*	tmp = NULL;
-		replace_tclobj(&tmp, Tcl_ObjPrintf("(0x%lx[%d]/0x%lx[%d] %s)",
-						(unsigned long)(ptrdiff_t)json, json->refCount,
-						(unsigned long)(ptrdiff_t)val, val->refCount, val->typePtr ? val->typePtr->name : "pure string"));
-		Tcl_DStringAppend(ds, Tcl_GetString(tmp), -1);
-		release_tclobj(&tmp);
-	}
+	TEST_OK(JSON_GetJvalFromObj(interp, obj, &type, &val));
+	/*
+	fprintf(stderr, "Retrieved internal rep of jval: type: %s, intrep Tcl_Obj type: %s, object: %p: \"%s\"\n",
+			type_names[type], val && val->typePtr ? val->typePtr->name : "<no type>",
+			val, val ? Tcl_GetString(val) : "<none>");
+	*/
 
 	switch (type) {
-		case JSON_OBJECT: //{{{
+		case JSON_OBJECT:
 			{
-				int				done, k_len, max=0, size;
+				int				done;
 				Tcl_DictSearch	search;
-				Tcl_Obj*		k;
-				Tcl_Obj*		v;
-				const char*		key_pad_buf = "                    ";	// Must be at least 20 chars long (max cap below)
-
-				TEST_OK_LABEL(finally, retval, Tcl_DictObjSize(interp, val, &size));
-				if (size == 0) {
-					Tcl_DStringAppend(ds, "{}", 2);
-					break;
-				}
-
-				TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
-
-				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-					Tcl_GetStringFromObj(k, &k_len);
-					if (k_len <= 20 && k_len > max)
-						max = k_len;
-				}
-				Tcl_DictObjDone(&search);
-
-				if (max > 20)
-					max = 20;		// If this cap is changed be sure to adjust the key_pad_buf length above
-
-				replace_tclobj(&next_pad, Tcl_DuplicateObj(pad));
-				Tcl_AppendObjToObj(next_pad, indent);
-
-				next_pad_str = Tcl_GetStringFromObj(next_pad, &next_pad_len);
+				Tcl_Obj*		k = NULL;
+				Tcl_Obj*		v = NULL;
+				Tcl_Obj*		vo = NULL;
+				Tcl_Obj*		new = NULL;
 
-				Tcl_DStringAppend(ds, "{\n", 2);
+				replace_tclobj(&new, Tcl_NewDictObj());
 
-				count = 0;
-				TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+				TEST_OK(Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
 				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-					Tcl_DStringAppend(ds, next_pad_str, next_pad_len);
-					append_json_string(&scx, k);
-					Tcl_DStringAppend(ds, ": ", 2);
-
-					Tcl_GetStringFromObj(k, &k_len);
-					if (k_len < max)
-						Tcl_DStringAppend(ds, key_pad_buf, max-k_len);
-
-					if (json_pretty_dbg(interp, v, indent, next_pad, ds) != TCL_OK) {
-						Tcl_DictObjDone(&search);
-						retval = TCL_ERROR;
-						goto finally;
-					}
-
-					if (++count < size) {
-						Tcl_DStringAppend(ds, ",\n", 2);
-					} else {
-						Tcl_DStringAppend(ds, "\n", 1);
-					}
+					TEST_OK_BREAK(res, convert_to_tcl(interp, v, &vo));
+					TEST_OK_BREAK(res, Tcl_DictObjPut(interp, new, k, vo));
 				}
 				Tcl_DictObjDone(&search);
-
-				Tcl_DStringAppend(ds, pad_str, pad_len);
-				Tcl_DStringAppend(ds, "}", 1);
+				release_tclobj(&vo);
+				if (res == TCL_OK) replace_tclobj(out, new);
+				release_tclobj(&new);
 			}
 			break;
-			//}}}
 
-		case JSON_ARRAY: //{{{
+		case JSON_ARRAY:
 			{
 				int			i, oc;
-				Tcl_Obj**	ov;
-
-				TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, val, &oc, &ov));
+				Tcl_Obj**	ov = NULL;
+				Tcl_Obj*	elem = NULL;
+				Tcl_Obj*	new = NULL;
 
-				replace_tclobj(&next_pad, Tcl_DuplicateObj(pad));
-				Tcl_AppendObjToObj(next_pad, indent);
-				next_pad_str = Tcl_GetStringFromObj(next_pad, &next_pad_len);
+				replace_tclobj(&new, Tcl_NewListObj(0, NULL));
 
-				if (oc == 0) {
-					Tcl_DStringAppend(ds, "[]", 2);
-				} else {
-					Tcl_DStringAppend(ds, "[\n", 2);
-					count = 0;
-					for (i=0; i<oc; i++) {
-						Tcl_DStringAppend(ds, next_pad_str, next_pad_len);
-						TEST_OK_LABEL(finally, retval, json_pretty_dbg(interp, ov[i], indent, next_pad, ds));
-						if (++count < oc) {
-							Tcl_DStringAppend(ds, ",\n", 2);
-						} else {
-							Tcl_DStringAppend(ds, "\n", 1);
-						}
-					}
-					Tcl_DStringAppend(ds, pad_str, pad_len);
-					Tcl_DStringAppend(ds, "]", 1);
+				TEST_OK(Tcl_ListObjGetElements(interp, val, &oc, &ov));
+				for (i=0; i<oc; i++) {
+					TEST_OK_BREAK(res, convert_to_tcl(interp, ov[i], &elem));
+					TEST_OK_BREAK(res, Tcl_ListObjAppendElement(interp, new, elem));
 				}
+				release_tclobj(&elem);
+				if (res == TCL_OK) replace_tclobj(out, new);
+				release_tclobj(&new);
 			}
 			break;
-			//}}}
-
-		default:
-			serialize_json_val(interp, &scx, type, val);
-	}
-
-finally:
-	release_tclobj(&next_pad);
-	return retval;
-}
 
-//}}}
-#if 0
-static int merge(Tcl_Interp* interp, int deep, Tcl_Obj *const orig, Tcl_Obj *const patch, Tcl_Obj **const res) //{{{
-{
-	Tcl_Obj*		val;
-	Tcl_Obj*		pval;
-	int				type, ptype, done, retcode=TCL_OK;
-	Tcl_DictSearch	search;
-	Tcl_Obj*		k;
-	Tcl_Obj*		v;
-	Tcl_Obj*		orig_v;
-	Tcl_Obj*		new_v;
-
-	*res = orig;
-
-	if (*res == NULL) {
-		*res = patch;
-		return TCL_OK;
-	}
-
-	TEST_OK(JSON_GetJvalFromObj(interp, *res, &type, &val));
-	TEST_OK(JSON_GetJvalFromObj(interp, patch, &ptype, &pval));
-
-	// In all cases, if the types don't match the patch completely
-	// replaces the destination
-	if (type != ptype) {
-		*res = patch;
-		return TCL_OK;
-	}
-
-	switch (type) {
-		case JSON_UNDEF:
-			THROW_ERROR("Tried to merge into JSON_UNDEF");
-
-		case JSON_ARRAY:
 		case JSON_STRING:
 		case JSON_NUMBER:
 		case JSON_BOOL:
+			replace_tclobj(out, val);
+			break;
+
 		case JSON_NULL:
+			{
+				struct interp_cx*	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+				replace_tclobj(out, l->tcl_empty);
+			}
+			break;
+
+		// These are all just semantically normal JSON string values in this context
 		case JSON_DYN_STRING:
 		case JSON_DYN_NUMBER:
 		case JSON_DYN_BOOL:
 		case JSON_DYN_JSON:
 		case JSON_DYN_TEMPLATE:
 		case JSON_DYN_LITERAL:
-			// For all types other than object, the patch replaces the
-			// destination.
-			/* Probably not worth it:
-			if (type == ptype == JSON_NULL) return TCL_OK;
-			*/
-			*res = patch;
-			return TCL_OK;
-
-		case JSON_OBJECT:
-			if (Tcl_IsShared(*res)) {
-				*res = Tcl_DuplicateObj(*res);
-				TEST_OK(JSON_GetJvalFromObj(interp, *res, &type, &val));
-			}
-
-			TEST_OK(Tcl_DictObjFirst(interp, pval, &search, &k, &v, &done));
-			for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-				TEST_OK_LABEL(done, retcode,
-						Tcl_DictObjGet(interp, val, k, &orig_v));
-				TEST_OK_LABEL(done, retcode,
-						merge(interp, deep>0? deep-1:deep, orig_v, v, &new_v));
-
-				if (new_v != orig_v)
-					TEST_OK_LABEL(done, retcode,
-							Tcl_DictObjPut(interp, val, k, new_v));
-			}
-done:
-			Tcl_DictObjDone(&search);
-			return retcode;
+			replace_tclobj(out, Tcl_ObjPrintf("%s%s", dyn_prefix[type], Tcl_GetString(val)));
+			break;
 
 		default:
-			THROW_ERROR("Unsupported JSON type: ", Tcl_GetString(Tcl_NewIntObj(type)));
+			THROW_ERROR("Invalid value type");
 	}
+
+	return res;
 }
 
 //}}}
-#endif
-static int prev_opcode(const struct template_cx *const cx) //{{{
+static int _new_object(Tcl_Interp* interp, int objc, Tcl_Obj *const objv[], Tcl_Obj** res) //{{{
 {
-	int			len, opcode;
-	Tcl_Obj*	last = NULL;
+	int			i, ac, retval=TCL_OK;
+	Tcl_Obj**	av = NULL;
+	Tcl_Obj*	new_val = NULL;
+	Tcl_Obj*	val = NULL;
 
-	TEST_OK(Tcl_ListObjLength(cx->interp, cx->actions, &len));
+	if (objc % 2 != 0)
+		THROW_ERROR("json new object needs an even number of arguments");
 
-	if (len == 0) return NOP;
+	replace_tclobj(&val, Tcl_NewDictObj());
 
-	TEST_OK(Tcl_ListObjIndex(cx->interp, cx->actions, len-3, &last));
-	TEST_OK(Tcl_GetIndexFromObj(cx->interp, last, action_opcode_str, "opcode", TCL_EXACT, &opcode));
+	for (i=0; i<objc; i+=2) {
+		Tcl_Obj*	k = objv[i];
+		Tcl_Obj*	v = objv[i+1];
 
-	return opcode;
-}
+		TEST_OK_LABEL(end, retval, Tcl_ListObjGetElements(interp, v, &ac, &av));
+		TEST_OK_LABEL(end, retval, new_json_value_from_list(interp, ac, av, &new_val));
+		TEST_OK_LABEL(end, retval, Tcl_DictObjPut(interp, val, k, new_val));
+	}
 
-//}}}
-static int emit_action(const struct template_cx* cx, enum action_opcode opcode, Tcl_Obj *const a, Tcl_Obj *const slot) // TODO: inline? {{{
-{
-	/*
-	fprintf(stderr, "opcode %s: %s %s\n",
-			Tcl_GetString(cx->l->action[opcode]),
-			a == NULL ? "NULL" : Tcl_GetString(a),
-			b == NULL ? "NULL" : Tcl_GetString(b));
-			*/
+	replace_tclobj(res, JSON_NewJvalObj(JSON_OBJECT, val));
 
-	TEST_OK(Tcl_ListObjAppendElement(cx->interp, cx->actions, cx->l->action[opcode]));
-	TEST_OK(Tcl_ListObjAppendElement(cx->interp, cx->actions, a==NULL ? cx->l->tcl_empty : a));
-	TEST_OK(Tcl_ListObjAppendElement(cx->interp, cx->actions, slot==NULL ? cx->l->tcl_empty : slot));
-	
-	return TCL_OK;
+end:
+	release_tclobj(&val);
+	release_tclobj(&new_val);
+	return retval;
 }
 
 //}}}
-static int emit_fetches(const struct template_cx *const cx) //{{{
+void foreach_state_free(struct foreach_state* state) //{{{
 {
-	Tcl_DictSearch	search;
-	Tcl_Obj*		elem;
-	Tcl_Obj*		v;
-	int				done, retcode=TCL_OK;
-
-	TEST_OK(Tcl_DictObjFirst(cx->interp, cx->map, &search, &elem, &v, &done));
-	for (; !done; Tcl_DictObjNext(&search, &elem, &v, &done)) {
-		int				len, fetch_idx, types_search_done=0, used_fetch=0;
-		Tcl_DictSearch	types_search;
-		Tcl_Obj*		type;
-		Tcl_Obj*		slot;
-
-		TEST_OK_LABEL(done, retcode,	emit_action(cx, FETCH_VALUE, elem, NULL)				);
-		TEST_OK_LABEL(done, retcode,	Tcl_ListObjLength(cx->interp, cx->actions, &len)		);
-		fetch_idx = len-3;		// Record the position of the fetch, in case we need to remove it later (DYN_LITERAL)
+	unsigned int i, j;
 
-		TEST_OK_LABEL(done, retcode,	Tcl_DictObjFirst(cx->interp, v, &types_search, &type, &slot, &done));
-		for (; !types_search_done; Tcl_DictObjNext(&types_search, &type, &slot, &types_search_done)) {
-			int		subst_type;
-			TEST_OK_LABEL(done2, retcode,	lookup_type(cx->interp, type, &subst_type));
+	release_tclobj(&state->script);
 
-			if (subst_type != JSON_DYN_LITERAL)
-				used_fetch = 1;
+	// Close any pending searches
+	for (i=0; i<state->iterators; i++) {
+		if (state->it[i].search.dictionaryPtr != NULL)
+			Tcl_DictObjDone(&state->it[i].search);
 
-			// Each of these actions checks for NULL in value and inserts a JSON null in that case
-			switch (subst_type) {
-				case JSON_DYN_STRING:
-					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_STRING, NULL, slot)	);
-					break;
-				case JSON_DYN_JSON:
-					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_JSON, NULL, slot)		);
-					break;
-				case JSON_DYN_TEMPLATE:
-					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_TEMPLATE, NULL, slot)	);
-					break;
-				case JSON_DYN_NUMBER:
-					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_NUMBER, NULL, slot)	);
-					break;
-				case JSON_DYN_BOOL:
-					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_BOOLEAN, NULL, slot)	);
-					break;
-				case JSON_DYN_LITERAL:
-					{
-						const char*		s;
-						int				len;
-						enum json_types	type;
+		for (j=0; j < state->it[i].var_c; j++)
+			Tcl_DecrRefCount(state->it[i].var_v[j]);
 
-						s = Tcl_GetStringFromObj(elem, &len);
-						TEMPLATE_TYPE(s, len, type);	// s is advanced past prefix
-						if (type == JSON_STRING) {
-							TEST_OK_LABEL(done2, retcode,	emit_action(cx, DECLARE_LITERAL, elem, NULL)	);
-							TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_STRING, NULL, slot)		);
-						} else {
-							TEST_OK_LABEL(done2, retcode,	emit_action(cx, DECLARE_LITERAL,
-										JSON_NewJvalObj(type, get_string(cx->l, s, len-3)), NULL)	);
-							TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_JSON, NULL, slot)			);
-						}
-					}
-					break;
-				default:
-					Tcl_SetObjResult(cx->interp, Tcl_ObjPrintf("Invalid type \"%s\"", Tcl_GetString(type)));
-					retcode = TCL_ERROR;
-					goto done2;
-			}
+		release_tclobj(&state->it[i].varlist);
+		if (state->it[i].packed) {
+			// k and v hold references when iterating over a packed value
+			release_tclobj(&state->it[i].k);
+			release_tclobj(&state->it[i].v);
+			release_tclobj(&state->it[i].packed);
 		}
-
-		if (!used_fetch)	// Value from fetch wasn't used, drop the FETCH_VALUE opcode
-			TEST_OK_LABEL(done, retcode,	Tcl_ListObjReplace(cx->interp, cx->actions, fetch_idx, 3, 0, NULL)	);
-
-done2:
-		Tcl_DictObjDone(&types_search);
-		if (retcode != TCL_OK) break;
-	}
-
-done:
-	Tcl_DictObjDone(&search);
-	return retcode;
-}
-
-//}}}
-static int get_subst_slot(struct template_cx* cx, Tcl_Obj* elem, Tcl_Obj* type, int subst_type, Tcl_Obj** slot) //{{{
-{
-	int			retcode = TCL_OK;
-	Tcl_Obj*	keydict = NULL;
-	Tcl_Obj*	slotobj = NULL;
-
-	// Find the map for this key
-	TEST_OK(Tcl_DictObjGet(cx->interp, cx->map, elem, &keydict));
-	if (keydict == NULL) {
-		keydict = Tcl_NewDictObj();
-		TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(cx->interp, cx->map, elem, keydict));
 	}
-	//fprintf(stderr, "get_subst_slot (%s) %s:\n%s\n", Tcl_GetString(elem), Tcl_GetString(type), Tcl_GetString(keydict));
 
-	// Find the allocated slot for this type for this key
-	TEST_OK_LABEL(finally, retcode, Tcl_DictObjGet(cx->interp, keydict, type, &slotobj));
-	if (slotobj != NULL) {
-		Tcl_IncrRefCount(slotobj);
-	} else {
-		replace_tclobj(&slotobj, Tcl_NewIntObj(cx->slots_used++));
-		TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(cx->interp, keydict, type, slotobj));
-		/*
-		fprintf(stderr, "Allocated new slot for %s %s: %s\n", Tcl_GetString(elem), Tcl_GetString(type), Tcl_GetString(*slot));
-	} else {
-		fprintf(stderr, "Found slot for %s %s: %s\n", Tcl_GetString(elem), Tcl_GetString(type), Tcl_GetString(*slot));
-		*/
+	if (state->it != NULL) {
+		ckfree((char*)state->it);
+		state->it = NULL;
 	}
 
-	if (retcode == TCL_OK)
-		replace_tclobj(slot, slotobj);
-
-finally:
-	release_tclobj(&slotobj);
-
-	return retcode;
+	release_tclobj(&state->res);
 }
 
 //}}}
-/*
-static int record_subst_location(Tcl_Interp* interp, Tcl_Obj* parent, Tcl_Obj* elem, Tcl_Obj* registry, Tcl_Obj* slot) //{{{
+static int NRforeach_next_loop_top(Tcl_Interp* interp, struct foreach_state* state) //{{{
 {
-	Tcl_Obj*	path_info = NULL;
+	struct interp_cx* l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	unsigned int j, k;
 
-	TEST_OK(Tcl_DictObjGet(interp, registry, parent, &path_info));
-	if (path_info == NULL) {
-		path_info = Tcl_NewDictObj();
-		TEST_OK(Tcl_DictObjPut(interp, registry, parent, path_info));
-	}
+	//fprintf(stderr, "Starting iteration %d/%d\n", i, max_loops);
+	// Set the iterator variables
+	for (j=0; j < state->iterators; j++) {
+		struct foreach_iterator* this_it = &state->it[j];
 
-	TEST_OK(Tcl_DictObjPut(interp, path_info, elem, slot));
-
-	return TCL_OK;
-}
-
-//}}}
-*/
-static int remove_action(Tcl_Interp* interp, struct template_cx* cx, int idx) //{{{
-{
-	idx *= 3;
-	if (idx < 0) {
-		int	len;
+		if (this_it->is_array) { // Iterating over a JSON array
+			//fprintf(stderr, "Array iteration, data_i: %d, length %d\n", this_it->data_i, this_it->data_c);
+			for (k=0; k<this_it->var_c; k++) {
+				Tcl_Obj* it_val;
 
-		TEST_OK(Tcl_ListObjLength(interp, cx->actions, &len));
-		idx += len;
+				if (this_it->packed && this_it->data_i < this_it->data_c) {
+					if (TCL_OK != packed_child(interp, this_it->packed, this_it->data_i++, NULL, &this_it->v))
+						return TCL_ERROR;
+					it_val = this_it->v;
+				} else if (this_it->data_i < this_it->data_c) {
+					//fprintf(stderr, "Pulling next element %d off the data list (length %d)\n", this_it->data_i, this_it->data_c);
+					it_val = this_it->data_v[this_it->data_i++];
+				} else {
+					//fprintf(stderr, "Ran out of elements in this data list, setting null\n");
+					it_val = l->json_null;
+				}
+				//fprintf(stderr, "pre  Iteration %d, this_it: %p, setting var %p, varname ref: %d\n",
+				//		i, this_it, this_it->var_v[k]/*, Tcl_GetString(this_it->var_v[k])*/, this_it->var_v[k]->refCount);
+				//fprintf(stderr, "varname: \"%s\"\n", Tcl_GetString(it[j].var_v[k]));
+				//Tcl_ObjSetVar2(interp, this_it->var_v[k], NULL, it_val, 0);
+				Tcl_ObjSetVar2(interp, this_it->var_v[k], NULL, it_val, 0);
+				//Tcl_ObjSetVar2(interp, Tcl_NewStringObj("elem", 4), NULL, it_val, 0);
+				//fprintf(stderr, "post Iteration %d, this_it: %p, setting var %p, varname ref: %d\n",
+				//		i, this_it, this_it->var_v[k]/*, Tcl_GetString(this_it->var_v[k])*/, this_it->var_v[k]->refCount);
+			}
+		} else { // Iterating over a JSON object
+			//fprintf(stderr, "Object iteration\n");
+			if (this_it->packed) {
+				if (this_it->data_i < this_it->data_c) {
+					if (TCL_OK != packed_child(interp, this_it->packed, this_it->data_i++, &this_it->k, &this_it->v))
+						return TCL_ERROR;
+					Tcl_ObjSetVar2(interp, this_it->var_v[0], NULL, this_it->k, 0);
+					Tcl_ObjSetVar2(interp, this_it->var_v[1], NULL, this_it->v, 0);
+				}
+			} else if (!this_it->done) {
+				// We check that this_it->var_c == 2 in the setup
+				Tcl_ObjSetVar2(interp, this_it->var_v[0], NULL, this_it->k, 0);
+				Tcl_ObjSetVar2(interp, this_it->var_v[1], NULL, this_it->v, 0);
+				Tcl_DictObjNext(&this_it->search, &this_it->k, &this_it->v, &this_it->done);
+			}
+		}
 	}
-	return Tcl_ListObjReplace(interp, cx->actions, idx, 3, 0, NULL);
+
+	Tcl_NRAddCallback(interp, NRforeach_next_loop_bottom, state, NULL, NULL, NULL);
+	return Tcl_NREvalObj(interp, state->script, 0);
 }
 
 //}}}
-static int template_actions(struct template_cx* cx, Tcl_Obj* template, enum action_opcode rep_action, Tcl_Obj* elem) //{{{
+static int NRforeach_next_loop_bottom(ClientData cdata[], Tcl_Interp* interp, int retcode) //{{{
 {
-	enum json_types	type;
-	Tcl_Obj*		val = NULL;
-	Tcl_Interp*		interp = cx->interp;
-	int				retval = TCL_OK;
+	struct foreach_state*	state = (struct foreach_state*)cdata[0];
+	struct interp_cx*		l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	Tcl_Obj*				it_res = NULL;
 
-	TEST_OK(JSON_GetJvalFromObj(interp, template, &type, &val));
+	switch (retcode) {
+		case TCL_OK:
+			switch (state->collecting) {
+				case COLLECT_NONE: break;
+				case COLLECT_LIST:
+					Tcl_IncrRefCount(it_res = Tcl_GetObjResult(interp));
+					Tcl_ResetResult(interp);
+					TEST_OK_LABEL(done, retcode, Tcl_ListObjAppendElement(interp, state->res, it_res));
+					Tcl_DecrRefCount(it_res); it_res = NULL;
+					break;
 
-	switch (type) {
-		case JSON_STRING:
-		case JSON_NUMBER:
-		case JSON_BOOL:
-		case JSON_NULL:
-			break;
+				case COLLECT_ARRAY:
+				case COLLECT_OBJECT:
+					{
+						enum json_types	type;
+						Tcl_Obj*		val = NULL;		// Intrep of state->res
 
-		case JSON_OBJECT:
-			{
-				int				done, retval = TCL_OK;
-				Tcl_DictSearch	search;
-				Tcl_Obj*		k;
-				Tcl_Obj*		v;
+						if (Tcl_IsShared(state->res)) {
+							Tcl_Obj*	new = NULL;
+							Tcl_IncrRefCount(new = Tcl_DuplicateObj(state->res));
+							Tcl_DecrRefCount(state->res);
+							state->res = new;	// Transfers ref from new to state->res
+						}
+						TEST_OK_LABEL(done, retcode, JSON_GetJvalFromObj(interp, state->res, &type, &val));
 
-				TEST_OK(emit_action(cx, PUSH_TARGET, Tcl_DuplicateObj(template), NULL));
-				TEST_OK(Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
-				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
-					int				len;
-					enum json_types	stype;
-					const char*		s = Tcl_GetStringFromObj(k, &len);
+						Tcl_IncrRefCount(it_res = Tcl_GetObjResult(interp));
+						Tcl_ResetResult(interp);
 
-					TEST_OK_LABEL(free_search, retval, template_actions(cx, v, REPLACE_VAL, k));
+						switch (state->collecting) {
+							case COLLECT_ARRAY:
+								TEST_OK_LABEL(done, retcode, Tcl_ListObjAppendElement(interp, val, as_json(interp, it_res)));
+								break;
 
-					TEMPLATE_TYPE(s, len, stype);	// s is advanced past prefix
-					switch (stype) {
-						case JSON_STRING:
-							break;
+							case COLLECT_OBJECT:
+								if (it_res->typePtr == l->typeDict) { // Iterate over it_res as a dictionary {{{
+									Tcl_DictSearch	search;
+									Tcl_Obj*		k = NULL;
+									Tcl_Obj*		v = NULL;
+									int				done;
 
-						case JSON_DYN_STRING:
-						case JSON_DYN_LITERAL:
-							{
-								Tcl_Obj*	slot = NULL;
-								Tcl_Obj*	elem = NULL;
-								//fprintf(stderr, "Found key subst at \"%s\": (%s) %s %s, allocated slot %s\n", Tcl_GetString(path), Tcl_GetString(k), type_names_int[stype], s+3, Tcl_GetString(slot));
-								replace_tclobj(&elem, get_string(cx->l, s, len-3));
-								retval = get_subst_slot(cx, elem, cx->l->type_int[stype], stype, &slot);
-								release_tclobj(&elem);
-								if (retval == TCL_OK)
-									retval = emit_action(cx, REPLACE_KEY, k, slot);
+									TEST_OK_LABEL(done, retcode, Tcl_DictObjFirst(interp, it_res, &search, &k, &v, &done));
+									for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+										TEST_OK_LABEL(cleanup_search, retcode, Tcl_DictObjPut(interp, val, k, as_json(interp, v)));
+									}
 
-								release_tclobj(&slot);
-								if (retval != TCL_OK) goto free_search;
-							}
-							break;
+cleanup_search:
+									Tcl_DictObjDone(&search);
+									if (retcode != TCL_OK) goto done;
+									break;
+									//}}}
+								} else { // Iterate over it_res as a list {{{
+									int			oc, i;
+									Tcl_Obj**	ov = NULL;
 
-						default:
-							THROW_ERROR_LABEL(free_search, retval, "Only strings allowed as object keys");
-					}
-				}
-free_search:
-				Tcl_DictObjDone(&search);
-				if (prev_opcode(cx) == PUSH_TARGET) {
-					remove_action(interp, cx, -1);
-				} else {
-					TEST_OK(emit_action(cx, POP_TARGET, NULL, NULL));
-					TEST_OK(emit_action(cx, rep_action, elem, cx->l->tcl_zero));
-				}
-				if (retval != TCL_OK) return retval;
-			}
-			break;
+									TEST_OK_LABEL(done, retcode, Tcl_ListObjGetElements(interp, it_res, &oc, &ov));
 
-		case JSON_ARRAY:
-			{
-				int			i, oc;
-				Tcl_Obj**	ov;
-				Tcl_Obj*	arr_elem = NULL;
+									if (oc % 2 != 0)
+										THROW_ERROR_LABEL(done, retcode, "Iteration result must be a list with an even number of elements");
 
-				TEST_OK(emit_action(cx, PUSH_TARGET, Tcl_DuplicateObj(template), NULL));
+									for (i=0; i<oc; i+=2)
+										TEST_OK_LABEL(done, retcode, Tcl_DictObjPut(interp, val, ov[i], as_json(interp, ov[i+1])));
+									//}}}
+								}
+								break;
 
-				TEST_OK(Tcl_ListObjGetElements(interp, val, &oc, &ov));
-				for (i=0; i<oc; i++) {
-					replace_tclobj(&arr_elem, Tcl_NewIntObj(i));
-					if (TCL_OK != (retval = template_actions(cx, ov[i], REPLACE_ARR, arr_elem)))
-						break;
-				}
+							default:
+								THROW_ERROR_LABEL(done, retcode, "Unexpect value for collecting");
+						}
 
-				release_tclobj(&arr_elem);
-				if (retval != TCL_OK) return retval;
-				if (prev_opcode(cx) == PUSH_TARGET) {
-					remove_action(interp, cx, -1);
-				} else {
-					TEST_OK(emit_action(cx, POP_TARGET, NULL, NULL));
-					TEST_OK(emit_action(cx, rep_action, elem, cx->l->tcl_zero));
-				}
+						if (it_res) {
+							Tcl_DecrRefCount(it_res); it_res = NULL;
+						}
+					}
+					break;
 			}
-			break;
 
-		case JSON_DYN_STRING:
-		case JSON_DYN_NUMBER:
-		case JSON_DYN_BOOL:
-		case JSON_DYN_JSON:
-		case JSON_DYN_TEMPLATE:
-		case JSON_DYN_LITERAL:
-			{
-				Tcl_Obj*	slot = NULL;
-
-				//fprintf(stderr, "Found value subst at \"%s\": (%s) %s: %s, allocated slot %s\n", Tcl_GetString(parent), Tcl_GetString(elem), type_names_int[type], Tcl_GetString(val), Tcl_GetString(slot));
-
-				retval = get_subst_slot(cx, val, cx->l->type_int[type], type, &slot);
-				if (retval == TCL_OK)
-					retval = emit_action(cx, rep_action, elem, slot);
-				release_tclobj(&slot);
-			}
+		case TCL_CONTINUE:
+			retcode = TCL_OK;
 			break;
 
+		case TCL_BREAK:
+			retcode = TCL_OK;
+			// falls through
 		default:
-			THROW_ERROR("unhandled type: %d", type);
+			goto done;
 	}
 
-	return retval;
-}
+	state->loop_num++;
 
-//}}}
-int build_template_actions(Tcl_Interp* interp, Tcl_Obj* template, Tcl_Obj** actions) //{{{
-{
-	int					retcode=TCL_OK;
-	struct template_cx	cx = {	// Unspecified members are initialized to 0
-		.interp		= interp,
-		.l			= Tcl_GetAssocData(interp, "rl_json", NULL),
-		.slots_used	= 1	// slot 0 is the scratch space, where completed targets go when popped
-	};
+	if (state->loop_num < state->max_loops) {
+		return NRforeach_next_loop_top(interp, state);
+	} else {
+		if (state->res != NULL) {
+			Tcl_SetObjResult(interp, state->res);
+		}
+	}
 
-	release_tclobj(actions);
+done:
+	//fprintf(stderr, "done\n");
+	if (it_res != NULL) {
+		Tcl_DecrRefCount(it_res);
+		it_res = NULL;
+	}
 
-	replace_tclobj(&cx.map,     Tcl_NewDictObj());
-	replace_tclobj(&cx.actions, Tcl_NewListObj(0, NULL));
+	if (retcode == TCL_OK && state->res != NULL /* collecting */)
+		Tcl_SetObjResult(interp, state->res);
 
-	TEST_OK_LABEL(done, retcode,
-		template_actions(&cx, template, REPLACE_ATOM, cx.l->tcl_empty)
-	);
+	foreach_state_free(state);
+	Tcl_Free((char*)state);
+	state = NULL;
 
-	if (cx.slots_used > 1) { // Prepend the template action to allocate the slots
-		Tcl_Obj*	actions_tail=NULL;
-		int			maxdepth=0;
+	return retcode;
+}
 
-		// Save the current actions (containing the interpolate and traversal
-		// actions), and swap in a new one that we will populate with some
-		// prefix actions (allocation and fetching)
-		replace_tclobj(&actions_tail, cx.actions);
-		replace_tclobj(&cx.actions, Tcl_NewListObj(0, NULL));
+//}}}
+static int foreach(Tcl_Interp* interp, int objc, Tcl_Obj *const objv[], enum collecting_mode collecting) //{{{
+{
+	// Caller must ensure that objc is valid
+	unsigned int			i;
+	int						retcode=TCL_OK;
+	struct foreach_state*	state = NULL;
 
-		{ // Find max cx stack depth
-			int			depth=0, actionc, i;
-			Tcl_Obj**	actionv;
+	state = (struct foreach_state*)ckalloc(sizeof(*state));
+	state->iterators = (objc-1)/2;
+	state->it = (struct foreach_iterator*)ckalloc(sizeof(struct foreach_iterator) * state->iterators);
+	state->max_loops = 0;
+	state->loop_num = 0;
+	state->collecting = collecting;
 
-			TEST_OK_LABEL(actions_done, retcode,
-				Tcl_ListObjGetElements(interp, actions_tail, &actionc, &actionv)
-			);
+	Tcl_IncrRefCount(state->script = objv[objc-1]);
 
-			for (i=0; i<actionc; i+=3) {
-				int			opcode;
+	switch (state->collecting) {
+		case COLLECT_NONE:
+			state->res = NULL;
+			break;
+		case COLLECT_LIST:
+			Tcl_IncrRefCount(state->res = Tcl_NewListObj(0, NULL));
+			break;
+		case COLLECT_ARRAY:
+			Tcl_IncrRefCount(state->res = JSON_NewJvalObj(JSON_ARRAY, Tcl_NewListObj(0, NULL)));
+			break;
+		case COLLECT_OBJECT:
+			Tcl_IncrRefCount(state->res = JSON_NewJvalObj(JSON_OBJECT, Tcl_NewDictObj()));
+			break;
+		default:
+			THROW_ERROR_LABEL(done, retcode, "Unhandled value for collecting");
+	}
 
-				TEST_OK_LABEL(actions_done, retcode,
-					Tcl_GetIndexFromObj(interp, actionv[i], action_opcode_str, "opcode", TCL_EXACT, &opcode)
-				);
-				switch (opcode) {
-					case PUSH_TARGET:
-						if (++depth > maxdepth) maxdepth = depth;
-						break;
+	for (i=0; i<state->iterators; i++) {
+		state->it[i].search.dictionaryPtr = NULL;
+		state->it[i].data_v = NULL;
+		state->it[i].is_array = 0;
+		state->it[i].var_v = NULL;
+		state->it[i].varlist = NULL;
+		state->it[i].packed = NULL;
+		state->it[i].k = NULL;
+		state->it[i].v = NULL;
+	}
 
-					case POP_TARGET:
-						depth--;
-						break;
-				}
+	for (i=0; i<state->iterators; i++) {
+		int				loops, j;
+		enum json_types	type;
+		Tcl_Obj*		val;
+		Tcl_Obj*		varlist = objv[i*2];
+
+		if (Tcl_IsShared(varlist))
+			varlist = Tcl_DuplicateObj(varlist);
+
+		replace_tclobj(&state->it[i].varlist, varlist);
+
+		TEST_OK_LABEL(done, retcode, Tcl_ListObjGetElements(interp, state->it[i].varlist, &state->it[i].var_c, &state->it[i].var_v));
+		for (j=0; j < state->it[i].var_c; j++)
+			Tcl_IncrRefCount(state->it[i].var_v[j]);
+
+		if (state->it[i].var_c == 0)
+			THROW_ERROR_LABEL(done, retcode, "foreach varlist is empty");
+
+		if (is_packed(objv[i*2+1])) {
+			// Iterate over the tape, leaving the value packed
+			type = packed_type(objv[i*2+1]);
+			if (type == JSON_ARRAY || type == JSON_OBJECT) {
+				if (type == JSON_OBJECT && state->it[i].var_c != 2)
+					THROW_ERROR_LABEL(done, retcode, "When iterating over a JSON object, varlist must be a pair of varnames (key value)");
+
+				replace_tclobj(&state->it[i].packed, objv[i*2+1]);
+				state->it[i].data_c = packed_length(state->it[i].packed);
+				state->it[i].data_i = 0;
+				state->it[i].is_array = type == JSON_ARRAY;
+				loops = type == JSON_ARRAY ?
+					(int)ceil(state->it[i].data_c / (double)state->it[i].var_c) :
+					state->it[i].data_c;
+				if (loops > state->max_loops)
+					state->max_loops = loops;
+				continue;
 			}
 		}
 
-		TEST_OK_LABEL(actions_done, retcode,
-			emit_action(&cx, ALLOCATE, Tcl_NewIntObj(maxdepth), Tcl_NewIntObj(cx.slots_used))
-		);
+		TEST_OK_LABEL(done, retcode, JSON_GetJvalFromObj(interp, objv[i*2+1], &type, &val));
+		switch (type) {
+			case JSON_ARRAY:
+				TEST_OK_LABEL(done, retcode,
+						Tcl_ListObjGetElements(interp, val, &state->it[i].data_c, &state->it[i].data_v));
+				state->it[i].data_i = 0;
+				state->it[i].is_array = 1;
+				loops = (int)ceil(state->it[i].data_c / (double)state->it[i].var_c);
 
-		TEST_OK_LABEL(actions_done, retcode,
-			emit_fetches(&cx)
-		);
+				break;
 
-		// Add back on the actions tail
-		TEST_OK_LABEL(actions_done, retcode,
-			Tcl_ListObjAppendList(interp, cx.actions, actions_tail)
-		);
+			case JSON_OBJECT:
+				if (state->it[i].var_c != 2)
+					THROW_ERROR_LABEL(done, retcode, "When iterating over a JSON object, varlist must be a pair of varnames (key value)");
 
-actions_done:
-		release_tclobj(&actions_tail);
-		if (retcode != TCL_OK) goto done;
+				TEST_OK_LABEL(done, retcode, Tcl_DictObjSize(interp, val, &loops));
+				TEST_OK_LABEL(done, retcode, Tcl_DictObjFirst(interp, val, &state->it[i].search, &state->it[i].k, &state->it[i].v, &state->it[i].done));
+				break;
+
+			case JSON_NULL:
+				state->it[i].data_c = 0;
+				state->it[i].data_v = NULL;
+				state->it[i].data_i = 0;
+				state->it[i].is_array = 1;
+				loops = 0;
+				break;
+
+			default:
+				THROW_ERROR_LABEL(done, retcode, "Cannot iterate over JSON type ", type_names[type]);
+		}
+
+		if (loops > state->max_loops)
+			state->max_loops = loops;
 	}
 
-	replace_tclobj(actions, cx.actions);
+	if (state->loop_num < state->max_loops)
+		return NRforeach_next_loop_top(interp, state);
 
 done:
-	release_tclobj(&cx.map);
-	release_tclobj(&cx.actions);
+	//fprintf(stderr, "done\n");
+	if (retcode == TCL_OK && state->collecting != COLLECT_NONE)
+		Tcl_SetObjResult(interp, state->res);
+
+	foreach_state_free(state);
+	Tcl_Free((char*)state);
+	state = NULL;
 
 	return retcode;
 }
 
 //}}}
-int lookup_type(Tcl_Interp* interp, Tcl_Obj* typeobj, int* type) //{{{
+int json_pretty(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj* indent, Tcl_Obj* pad, Tcl_DString* ds) //{{{
 {
-	return Tcl_GetIndexFromObj(interp, typeobj, type_names_int, "type", TCL_EXACT, type);
-}
+	int							pad_len, next_pad_len, count;
+	enum json_types				type;
+	const char*					pad_str;
+	const char*					next_pad_str;
+	Tcl_Obj*					next_pad = NULL;
+	Tcl_Obj*					val = NULL;
+	struct serialize_context	scx;
+	int							retval = TCL_OK;
 
-//}}}
-static inline void fill_slot(Tcl_Obj** slots, int slot, Tcl_Obj* value) //{{{
-{
-	replace_tclobj(&slots[slot], value);
-}
+	scx.ds = ds;
+	scx.serialize_mode = SERIALIZE_NORMAL;
+	scx.fromdict = NULL;
+	scx.l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	scx.allow_null = 1;
 
-//}}}
-int apply_template_actions(Tcl_Interp* interp, Tcl_Obj* template, Tcl_Obj* actions, Tcl_Obj* dict, Tcl_Obj** res) // dict may be null, which means lookup vars {{{
-{
-	struct interp_cx* l = NULL;
-#define STATIC_SLOTS	10
-	Tcl_Obj*	stackslots[STATIC_SLOTS];
-	Tcl_Obj**	slots = NULL;
-	int			slotslen = 0;
-	int			retcode = TCL_OK;
-	Tcl_Obj**	actionv;
-	int			actionc, i;
-#define STATIC_STACK	8
-	Tcl_Obj*	stackstack[STATIC_STACK];
-	Tcl_Obj**	stack = NULL;
-	int			stacklevel = 0;
-	Tcl_Obj*	subst_val = NULL;
-	Tcl_Obj*	key = NULL;
-	int			slot, stacklevels=0;
-	Tcl_Obj*	target = NULL;
-	Tcl_Obj*	hold = NULL;
+	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, json, &type, &val));
 
-	TEST_OK_LABEL(finally, retcode, Tcl_ListObjGetElements(interp, actions, &actionc, &actionv));
-	if (actionc == 0) {
-		replace_tclobj(res, Tcl_DuplicateObj(template));
-		Tcl_InvalidateStringRep(*res);		// Some code relies on the fact that the result of the template command is a normalized json doc (no unnecessary whitespace / newlines)
-		return TCL_OK;
-	}
+	pad_str = Tcl_GetStringFromObj(pad, &pad_len);
 
-	if (actionc % 3 != 0)
-		THROW_ERROR_LABEL(finally, retcode, "Invalid actions (odd number of elements)");
+	switch (type) {
+		case JSON_OBJECT: //{{{
+			{
+				int				done, k_len, max=0, size;
+				Tcl_DictSearch	search;
+				Tcl_Obj*		k;
+				Tcl_Obj*		v;
+				const char*		key_pad_buf = "                    ";	// Must be at least 20 chars long (max cap below)
 
-	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjSize(interp, val, &size));
+				if (size == 0) {
+					Tcl_DStringAppend(ds, "{}", 2);
+					break;
+				}
 
-	for (i=0; i<actionc; i+=3) {
-		int					tmp;
-		enum action_opcode	opcode;
-		Tcl_Obj*			a = actionv[i+1];
-		Tcl_Obj*			b = actionv[i+2];
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
 
-		TEST_OK_LABEL(finally, retcode, Tcl_GetIndexFromObj(interp, actionv[i], action_opcode_str, "opcode", TCL_EXACT, &tmp));
-		opcode = tmp;
-		//fprintf(stderr, "%s (%s) (%s)\n", Tcl_GetString(actionv[i]), Tcl_GetString(a), Tcl_GetString(b));
-		switch (opcode) {
-			case ALLOCATE: //{{{
-				{
-					// slots is in b, stack is in a
-					TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slotslen));
-					if (slotslen > STATIC_SLOTS) {
-						slots = ckalloc(sizeof(Tcl_Obj*) * slotslen);
-					} else {
-						slots = stackslots;
+				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+					Tcl_GetStringFromObj(k, &k_len);
+					if (k_len <= 20 && k_len > max)
+						max = k_len;
+				}
+				Tcl_DictObjDone(&search);
+
+				if (max > 20)
+					max = 20;		// If this cap is changed be sure to adjust the key_pad_buf length above
+
+				replace_tclobj(&next_pad, Tcl_DuplicateObj(pad));
+				Tcl_AppendObjToObj(next_pad, indent);
+
+				next_pad_str = Tcl_GetStringFromObj(next_pad, &next_pad_len);
+
+				Tcl_DStringAppend(ds, "{\n", 2);
+
+				count = 0;
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+					Tcl_DStringAppend(ds, next_pad_str, next_pad_len);
+					append_json_string(&scx, k);
+					Tcl_DStringAppend(ds, ": ", 2);
+
+					Tcl_GetStringFromObj(k, &k_len);
+					if (k_len < max)
+						Tcl_DStringAppend(ds, key_pad_buf, max-k_len);
+
+					if (json_pretty(interp, v, indent, next_pad, ds) != TCL_OK) {
+						Tcl_DictObjDone(&search);
+						retval = TCL_ERROR;
+						goto finally;
 					}
-					if (slotslen > 0)
-						memset(slots, 0, sizeof(Tcl_Obj*) * slotslen);
 
-					TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, a, &stacklevels));
-					if (stacklevels > STATIC_STACK) {
-						stack = ckalloc(sizeof(struct Tcl_Obj*) * stacklevels);
+					if (++count < size) {
+						Tcl_DStringAppend(ds, ",\n", 2);
 					} else {
-						stack = stackstack;	// Use the space allocated on the c stack
+						Tcl_DStringAppend(ds, "\n", 1);
 					}
-					if (stacklevels > 0)
-						memset(stack, 0, sizeof(Tcl_Obj*) * stacklevels);
 				}
-				break;
-				//}}}
-			case FETCH_VALUE: //{{{
-				replace_tclobj(&key, a);	// Keep a reference in case we need it for an error message shortly
-				if (dict) {
-					Tcl_Obj*	new = NULL;
-					TEST_OK_LABEL(finally, retcode, Tcl_DictObjGet(interp, dict, a, &new));
-					replace_tclobj(&subst_val, new);
-				} else {
-					replace_tclobj(&subst_val, Tcl_ObjGetVar2(interp, a, NULL, 0));
-				}
-				break;
-				//}}}
-			case DECLARE_LITERAL: //{{{
-				replace_tclobj(&subst_val, a);
-				break;
-				//}}}
-			case STORE_STRING: //{{{
-				TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-				if (subst_val == NULL) {
-					fill_slot(slots, slot, l->json_null);
-				} else {
-					const char*	str;
-					int			len;
-					Tcl_Obj*	jval=NULL;
+				Tcl_DictObjDone(&search);
 
-					str = Tcl_GetStringFromObj(subst_val, &len);
-					if (len == 0) {
-						replace_tclobj(&jval, l->json_empty_string);
-					} else if (len < 3) {
-						replace_tclobj(&jval, JSON_NewJvalObj(JSON_STRING, subst_val));
-					} else {
-						enum json_types	type;
+				Tcl_DStringAppend(ds, pad_str, pad_len);
+				Tcl_DStringAppend(ds, "}", 1);
+			}
+			break;
+			//}}}
 
-						TEMPLATE_TYPE(str, len, type);	// str is advanced to after the prefix
+		case JSON_ARRAY: //{{{
+			{
+				int			i, oc;
+				Tcl_Obj**	ov;
 
-						if (type == JSON_STRING) {
-							replace_tclobj(&jval, JSON_NewJvalObj(JSON_STRING, subst_val));
+				TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, val, &oc, &ov));
+
+				replace_tclobj(&next_pad, Tcl_DuplicateObj(pad));
+				Tcl_AppendObjToObj(next_pad, indent);
+				next_pad_str = Tcl_GetStringFromObj(next_pad, &next_pad_len);
+
+				if (oc == 0) {
+					Tcl_DStringAppend(ds, "[]", 2);
+				} else {
+					Tcl_DStringAppend(ds, "[\n", 2);
+					count = 0;
+					for (i=0; i<oc; i++) {
+						Tcl_DStringAppend(ds, next_pad_str, next_pad_len);
+						TEST_OK_LABEL(finally, retval, json_pretty(interp, ov[i], indent, next_pad, ds));
+						if (++count < oc) {
+							Tcl_DStringAppend(ds, ",\n", 2);
 						} else {
-							replace_tclobj(&jval, JSON_NewJvalObj(type, get_string(l, str, len-3)));
+							Tcl_DStringAppend(ds, "\n", 1);
 						}
 					}
-					fill_slot(slots, slot, jval);
-					release_tclobj(&jval);
+					Tcl_DStringAppend(ds, pad_str, pad_len);
+					Tcl_DStringAppend(ds, "]", 1);
 				}
-				break;
-				//}}}
-			case STORE_NUMBER: //{{{
-				TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-				if (subst_val == NULL) {
-					fill_slot(slots, slot, l->json_null);
-				} else {
-					Tcl_Obj* forced = NULL;
-					
-					if (likely((retcode = force_json_number(interp, l, subst_val, &forced)) == TCL_OK))
-						fill_slot(slots, slot, JSON_NewJvalObj(JSON_NUMBER, forced));
+			}
+			break;
+			//}}}
 
-					release_tclobj(&forced);
+		default:
+			serialize_json_val(interp, &scx, type, val);
+	}
 
-					if (unlikely(retcode != TCL_OK)) {
-						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error substituting value from \"%s\" into template, not a number: \"%s\"", Tcl_GetString(key), Tcl_GetString(subst_val)));
-						retcode = TCL_ERROR;
+finally:
+	release_tclobj(&next_pad);
+	return retval;
+}
+
+//}}}
+static int json_pretty_dbg(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj* indent, Tcl_Obj* pad, Tcl_DString* ds) //{{{
+{
+	int							indent_len, pad_len, next_pad_len, count;
+	enum json_types				type;
+	const char*					pad_str;
+	const char*					next_pad_str;
+	Tcl_Obj*					next_pad = NULL;
+	Tcl_Obj*					val;
+	struct serialize_context	scx;
+	int							retval = TCL_OK;
+
+	scx.ds = ds;
+	scx.serialize_mode = SERIALIZE_NORMAL;
+	scx.fromdict = NULL;
+	scx.l = Tcl_GetAssocData(interp, "rl_json", NULL);
+	scx.allow_null = 1;
+
+	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, json, &type, &val));
+
+	Tcl_GetStringFromObj(indent, &indent_len);
+	pad_str = Tcl_GetStringFromObj(pad, &pad_len);
+
+	if (type == JSON_NULL) {
+		Tcl_Obj*	tmp = NULL;
+		replace_tclobj(&tmp, Tcl_ObjPrintf("(0x%lx[%d]/NULL)",
+						(unsigned long)(ptrdiff_t)json, json->refCount));
+		Tcl_DStringAppend(ds, Tcl_GetString(tmp), -1);
+		release_tclobj(&tmp);
+	} else {
+		Tcl_Obj*	tmp = NULL;
+		replace_tclobj(&tmp, Tcl_ObjPrintf("(0x%lx[%d]/0x%lx[%d] %s)",
+						(unsigned long)(ptrdiff_t)json, json->refCount,
+						(unsigned long)(ptrdiff_t)val, val->refCount, val->typePtr ? val->typePtr->name : "pure string"));
+		Tcl_DStringAppend(ds, Tcl_GetString(tmp), -1);
+		release_tclobj(&tmp);
+	}
+
+	switch (type) {
+		case JSON_OBJECT: //{{{
+			{
+				int				done, k_len, max=0, size;
+				Tcl_DictSearch	search;
+				Tcl_Obj*		k;
+				Tcl_Obj*		v;
+				const char*		key_pad_buf = "                    ";	// Must be at least 20 chars long (max cap below)
+
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjSize(interp, val, &size));
+				if (size == 0) {
+					Tcl_DStringAppend(ds, "{}", 2);
+					break;
+				}
+
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+
+				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+					Tcl_GetStringFromObj(k, &k_len);
+					if (k_len <= 20 && k_len > max)
+						max = k_len;
+				}
+				Tcl_DictObjDone(&search);
+
+				if (max > 20)
+					max = 20;		// If this cap is changed be sure to adjust the key_pad_buf length above
+
+				replace_tclobj(&next_pad, Tcl_DuplicateObj(pad));
+				Tcl_AppendObjToObj(next_pad, indent);
+
+				next_pad_str = Tcl_GetStringFromObj(next_pad, &next_pad_len);
+
+				Tcl_DStringAppend(ds, "{\n", 2);
+
+				count = 0;
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+					Tcl_DStringAppend(ds, next_pad_str, next_pad_len);
+					append_json_string(&scx, k);
+					Tcl_DStringAppend(ds, ": ", 2);
+
+					Tcl_GetStringFromObj(k, &k_len);
+					if (k_len < max)
+						Tcl_DStringAppend(ds, key_pad_buf, max-k_len);
+
+					if (json_pretty_dbg(interp, v, indent, next_pad, ds) != TCL_OK) {
+						Tcl_DictObjDone(&search);
+						retval = TCL_ERROR;
 						goto finally;
 					}
-				}
-				break;
-				//}}}
-			case STORE_BOOLEAN: //{{{
-				TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-				if (subst_val == NULL) {
-					fill_slot(slots, slot, l->json_null);
-				} else {
-					int is_true;
 
-					if (likely((retcode = Tcl_GetBooleanFromObj(interp, subst_val, &is_true)) == TCL_OK)) {
-						fill_slot(slots, slot, is_true ? l->json_true : l->json_false);
+					if (++count < size) {
+						Tcl_DStringAppend(ds, ",\n", 2);
 					} else {
-						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error substituting value from \"%s\" into template, not a boolean: \"%s\"", Tcl_GetString(key), Tcl_GetString(subst_val)));
-						goto finally;
+						Tcl_DStringAppend(ds, "\n", 1);
 					}
 				}
-				break;
-				//}}}
-			case STORE_JSON: //{{{
-				TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-				if (subst_val == NULL) {
-					fill_slot(slots, slot, l->json_null);
+				Tcl_DictObjDone(&search);
+
+				Tcl_DStringAppend(ds, pad_str, pad_len);
+				Tcl_DStringAppend(ds, "}", 1);
+			}
+			break;
+			//}}}
+
+		case JSON_ARRAY: //{{{
+			{
+				int			i, oc;
+				Tcl_Obj**	ov;
+
+				TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, val, &oc, &ov));
+
+				replace_tclobj(&next_pad, Tcl_DuplicateObj(pad));
+				Tcl_AppendObjToObj(next_pad, indent);
+				next_pad_str = Tcl_GetStringFromObj(next_pad, &next_pad_len);
+
+				if (oc == 0) {
+					Tcl_DStringAppend(ds, "[]", 2);
 				} else {
-					TEST_OK_LABEL(finally, retcode, JSON_ForceJSON(interp, subst_val));
-					fill_slot(slots, slot, subst_val);
+					Tcl_DStringAppend(ds, "[\n", 2);
+					count = 0;
+					for (i=0; i<oc; i++) {
+						Tcl_DStringAppend(ds, next_pad_str, next_pad_len);
+						TEST_OK_LABEL(finally, retval, json_pretty_dbg(interp, ov[i], indent, next_pad, ds));
+						if (++count < oc) {
+							Tcl_DStringAppend(ds, ",\n", 2);
+						} else {
+							Tcl_DStringAppend(ds, "\n", 1);
+						}
+					}
+					Tcl_DStringAppend(ds, pad_str, pad_len);
+					Tcl_DStringAppend(ds, "]", 1);
 				}
-				break;
-				//}}}
-			case STORE_TEMPLATE: //{{{
-				{
-					Tcl_Obj*	sub_template_actions = NULL;
-					Tcl_Obj*	new = NULL;
-					int			slot;
+			}
+			break;
+			//}}}
+
+		default:
+			serialize_json_val(interp, &scx, type, val);
+	}
+
+finally:
+	release_tclobj(&next_pad);
+	return retval;
+}
+
+//}}}
+static int prev_opcode(const struct template_cx *const cx) //{{{
+{
+	int			len, opcode;
+	Tcl_Obj*	last = NULL;
+
+	TEST_OK(Tcl_ListObjLength(cx->interp, cx->actions, &len));
+
+	if (len == 0) return NOP;
+
+	TEST_OK(Tcl_ListObjIndex(cx->interp, cx->actions, len-3, &last));
+	TEST_OK(Tcl_GetIndexFromObj(cx->interp, last, action_opcode_str, "opcode", TCL_EXACT, &opcode));
+
+	return opcode;
+}
+
+//}}}
+static int emit_action(const struct template_cx* cx, enum action_opcode opcode, Tcl_Obj *const a, Tcl_Obj *const slot) // TODO: inline? {{{
+{
+	/*
+	fprintf(stderr, "opcode %s: %s %s\n",
+			Tcl_GetString(cx->l->action[opcode]),
+			a == NULL ? "NULL" : Tcl_GetString(a),
+			b == NULL ? "NULL" : Tcl_GetString(b));
+			*/
+
+	TEST_OK(Tcl_ListObjAppendElement(cx->interp, cx->actions, cx->l->action[opcode]));
+	TEST_OK(Tcl_ListObjAppendElement(cx->interp, cx->actions, a==NULL ? cx->l->tcl_empty : a));
+	TEST_OK(Tcl_ListObjAppendElement(cx->interp, cx->actions, slot==NULL ? cx->l->tcl_empty : slot));
+	
+	return TCL_OK;
+}
+
+//}}}
+static int emit_fetches(const struct template_cx *const cx) //{{{
+{
+	Tcl_DictSearch	search;
+	Tcl_Obj*		elem;
+	Tcl_Obj*		v;
+	int				done, retcode=TCL_OK;
+
+	TEST_OK(Tcl_DictObjFirst(cx->interp, cx->map, &search, &elem, &v, &done));
+	for (; !done; Tcl_DictObjNext(&search, &elem, &v, &done)) {
+		int				len, fetch_idx, types_search_done=0, used_fetch=0;
+		Tcl_DictSearch	types_search;
+		Tcl_Obj*		type;
+		Tcl_Obj*		slot;
+
+		TEST_OK_LABEL(done, retcode,	emit_action(cx, FETCH_VALUE, elem, NULL)				);
+		TEST_OK_LABEL(done, retcode,	Tcl_ListObjLength(cx->interp, cx->actions, &len)		);
+		fetch_idx = len-3;		// Record the position of the fetch, in case we need to remove it later (DYN_LITERAL)
+
+		TEST_OK_LABEL(done, retcode,	Tcl_DictObjFirst(cx->interp, v, &types_search, &type, &slot, &done));
+		for (; !types_search_done; Tcl_DictObjNext(&types_search, &type, &slot, &types_search_done)) {
+			int		subst_type;
+			TEST_OK_LABEL(done2, retcode,	lookup_type(cx->interp, type, &subst_type));
+
+			if (subst_type != JSON_DYN_LITERAL)
+				used_fetch = 1;
+
+			// Each of these actions checks for NULL in value and inserts a JSON null in that case
+			switch (subst_type) {
+				case JSON_DYN_STRING:
+					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_STRING, NULL, slot)	);
+					break;
+				case JSON_DYN_JSON:
+					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_JSON, NULL, slot)		);
+					break;
+				case JSON_DYN_TEMPLATE:
+					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_TEMPLATE, NULL, slot)	);
+					break;
+				case JSON_DYN_NUMBER:
+					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_NUMBER, NULL, slot)	);
+					break;
+				case JSON_DYN_BOOL:
+					TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_BOOLEAN, NULL, slot)	);
+					break;
+				case JSON_DYN_LITERAL:
+					{
+						const char*		s;
+						int				len;
+						enum json_types	type;
+
+						s = Tcl_GetStringFromObj(elem, &len);
+						TEMPLATE_TYPE(s, len, type);	// s is advanced past prefix
+						if (type == JSON_STRING) {
+							TEST_OK_LABEL(done2, retcode,	emit_action(cx, DECLARE_LITERAL, elem, NULL)	);
+							TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_STRING, NULL, slot)		);
+						} else {
+							TEST_OK_LABEL(done2, retcode,	emit_action(cx, DECLARE_LITERAL,
+										JSON_NewJvalObj(type, get_string(cx->l, s, len-3)), NULL)	);
+							TEST_OK_LABEL(done2, retcode,	emit_action(cx, STORE_JSON, NULL, slot)			);
+						}
+					}
+					break;
+				default:
+					Tcl_SetObjResult(cx->interp, Tcl_ObjPrintf("Invalid type \"%s\"", Tcl_GetString(type)));
+					retcode = TCL_ERROR;
+					goto done2;
+			}
+		}
+
+		if (!used_fetch)	// Value from fetch wasn't used, drop the FETCH_VALUE opcode
+			TEST_OK_LABEL(done, retcode,	Tcl_ListObjReplace(cx->interp, cx->actions, fetch_idx, 3, 0, NULL)	);
+
+done2:
+		Tcl_DictObjDone(&types_search);
+		if (retcode != TCL_OK) break;
+	}
+
+done:
+	Tcl_DictObjDone(&search);
+	return retcode;
+}
+
+//}}}
+static int get_subst_slot(struct template_cx* cx, Tcl_Obj* elem, Tcl_Obj* type, int subst_type, Tcl_Obj** slot) //{{{
+{
+	int			retcode = TCL_OK;
+	Tcl_Obj*	keydict = NULL;
+	Tcl_Obj*	slotobj = NULL;
+
+	// Find the map for this key
+	TEST_OK(Tcl_DictObjGet(cx->interp, cx->map, elem, &keydict));
+	if (keydict == NULL) {
+		keydict = Tcl_NewDictObj();
+		TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(cx->interp, cx->map, elem, keydict));
+	}
+	//fprintf(stderr, "get_subst_slot (%s) %s:\n%s\n", Tcl_GetString(elem), Tcl_GetString(type), Tcl_GetString(keydict));
+
+	// Find the allocated slot for this type for this key
+	TEST_OK_LABEL(finally, retcode, Tcl_DictObjGet(cx->interp, keydict, type, &slotobj));
+	if (slotobj != NULL) {
+		Tcl_IncrRefCount(slotobj);
+	} else {
+		replace_tclobj(&slotobj, Tcl_NewIntObj(cx->slots_used++));
+		TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(cx->interp, keydict, type, slotobj));
+		/*
+		fprintf(stderr, "Allocated new slot for %s %s: %s\n", Tcl_GetString(elem), Tcl_GetString(type), Tcl_GetString(*slot));
+	} else {
+		fprintf(stderr, "Found slot for %s %s: %s\n", Tcl_GetString(elem), Tcl_GetString(type), Tcl_GetString(*slot));
+		*/
+	}
+
+	if (retcode == TCL_OK)
+		replace_tclobj(slot, slotobj);
+
+finally:
+	release_tclobj(&slotobj);
+
+	return retcode;
+}
+
+//}}}
+/*
+static int record_subst_location(Tcl_Interp* interp, Tcl_Obj* parent, Tcl_Obj* elem, Tcl_Obj* registry, Tcl_Obj* slot) //{{{
+{
+	Tcl_Obj*	path_info = NULL;
+
+	TEST_OK(Tcl_DictObjGet(interp, registry, parent, &path_info));
+	if (path_info == NULL) {
+		path_info = Tcl_NewDictObj();
+		TEST_OK(Tcl_DictObjPut(interp, registry, parent, path_info));
+	}
+
+	TEST_OK(Tcl_DictObjPut(interp, path_info, elem, slot));
+
+	return TCL_OK;
+}
+
+//}}}
+*/
+static int remove_action(Tcl_Interp* interp, struct template_cx* cx, int idx) //{{{
+{
+	idx *= 3;
+	if (idx < 0) {
+		int	len;
+
+		TEST_OK(Tcl_ListObjLength(interp, cx->actions, &len));
+		idx += len;
+	}
+	return Tcl_ListObjReplace(interp, cx->actions, idx, 3, 0, NULL);
+}
+
+//}}}
+static int template_actions(struct template_cx* cx, Tcl_Obj* template, enum action_opcode rep_action, Tcl_Obj* elem) //{{{
+{
+	enum json_types	type;
+	Tcl_Obj*		val = NULL;
+	Tcl_Interp*		interp = cx->interp;
+	int				retval = TCL_OK;
+
+	TEST_OK(JSON_GetJvalFromObj(interp, template, &type, &val));
+
+	switch (type) {
+		case JSON_STRING:
+		case JSON_NUMBER:
+		case JSON_BOOL:
+		case JSON_NULL:
+			break;
+
+		case JSON_OBJECT:
+			{
+				int				done, retval = TCL_OK;
+				Tcl_DictSearch	search;
+				Tcl_Obj*		k;
+				Tcl_Obj*		v;
+
+				TEST_OK(emit_action(cx, PUSH_TARGET, Tcl_DuplicateObj(template), NULL));
+				TEST_OK(Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+					int				len;
+					enum json_types	stype;
+					const char*		s = Tcl_GetStringFromObj(k, &len);
+
+					TEST_OK_LABEL(free_search, retval, template_actions(cx, v, REPLACE_VAL, k));
+
+					TEMPLATE_TYPE(s, len, stype);	// s is advanced past prefix
+					switch (stype) {
+						case JSON_STRING:
+							break;
+
+						case JSON_DYN_STRING:
+						case JSON_DYN_LITERAL:
+							{
+								Tcl_Obj*	slot = NULL;
+								Tcl_Obj*	elem = NULL;
+								//fprintf(stderr, "Found key subst at \"%s\": (%s) %s %s, allocated slot %s\n", Tcl_GetString(path), Tcl_GetString(k), type_names_int[stype], s+3, Tcl_GetString(slot));
+								replace_tclobj(&elem, get_string(cx->l, s, len-3));
+								retval = get_subst_slot(cx, elem, cx->l->type_int[stype], stype, &slot);
+								release_tclobj(&elem);
+								if (retval == TCL_OK)
+									retval = emit_action(cx, REPLACE_KEY, k, slot);
+
+								release_tclobj(&slot);
+								if (retval != TCL_OK) goto free_search;
+							}
+							break;
+
+						default:
+							THROW_ERROR_LABEL(free_search, retval, "Only strings allowed as object keys");
+					}
+				}
+free_search:
+				Tcl_DictObjDone(&search);
+				if (prev_opcode(cx) == PUSH_TARGET) {
+					remove_action(interp, cx, -1);
+				} else {
+					TEST_OK(emit_action(cx, POP_TARGET, NULL, NULL));
+					TEST_OK(emit_action(cx, rep_action, elem, cx->l->tcl_zero));
+				}
+				if (retval != TCL_OK) return retval;
+			}
+			break;
+
+		case JSON_ARRAY:
+			{
+				int			i, oc;
+				Tcl_Obj**	ov;
+				Tcl_Obj*	arr_elem = NULL;
+				Tcl_Obj*	repeat = NULL;
+
+				TEST_OK(Tcl_ListObjGetElements(interp, val, &oc, &ov));
+
+				TEST_OK(repeat_section(interp, oc, ov, &repeat));
+				if (repeat) {
+					// Fetched and stored in its own slot here rather than by
+					// emit_fetches, since the slot depends on the element
+					// template as well as the name
+					Tcl_Obj*	slot = NULL;
+
+					replace_tclobj(&slot, Tcl_NewIntObj(cx->slots_used++));
+					if (
+						TCL_OK == (retval = emit_action(cx, FETCH_VALUE, repeat, NULL)) &&
+						TCL_OK == (retval = emit_action(cx, STORE_REPEAT, ov[1], slot))
+					)
+						retval = emit_action(cx, rep_action, elem, slot);
+					release_tclobj(&slot);
+					release_tclobj(&repeat);
+					break;
+				}
+
+				TEST_OK(emit_action(cx, PUSH_TARGET, Tcl_DuplicateObj(template), NULL));
+				for (i=0; i<oc; i++) {
+					replace_tclobj(&arr_elem, Tcl_NewIntObj(i));
+					if (TCL_OK != (retval = template_actions(cx, ov[i], REPLACE_ARR, arr_elem)))
+						break;
+				}
+
+				release_tclobj(&arr_elem);
+				if (retval != TCL_OK) return retval;
+				if (prev_opcode(cx) == PUSH_TARGET) {
+					remove_action(interp, cx, -1);
+				} else {
+					TEST_OK(emit_action(cx, POP_TARGET, NULL, NULL));
+					TEST_OK(emit_action(cx, rep_action, elem, cx->l->tcl_zero));
+				}
+			}
+			break;
+
+		case JSON_DYN_STRING:
+		case JSON_DYN_NUMBER:
+		case JSON_DYN_BOOL:
+		case JSON_DYN_JSON:
+		case JSON_DYN_TEMPLATE:
+		case JSON_DYN_LITERAL:
+			{
+				Tcl_Obj*	slot = NULL;
+
+				//fprintf(stderr, "Found value subst at \"%s\": (%s) %s: %s, allocated slot %s\n", Tcl_GetString(parent), Tcl_GetString(elem), type_names_int[type], Tcl_GetString(val), Tcl_GetString(slot));
+
+				retval = get_subst_slot(cx, val, cx->l->type_int[type], type, &slot);
+				if (retval == TCL_OK)
+					retval = emit_action(cx, rep_action, elem, slot);
+				release_tclobj(&slot);
+			}
+			break;
+
+		default:
+			THROW_ERROR("unhandled type: %d", type);
+	}
+
+	return retval;
+}
+
+//}}}
+int build_template_actions(Tcl_Interp* interp, Tcl_Obj* template, Tcl_Obj** actions) //{{{
+{
+	int					retcode=TCL_OK;
+	struct template_cx	cx = {	// Unspecified members are initialized to 0
+		.interp		= interp,
+		.l			= Tcl_GetAssocData(interp, "rl_json", NULL),
+		.slots_used	= 1	// slot 0 is the scratch space, where completed targets go when popped
+	};
+
+	release_tclobj(actions);
+
+	replace_tclobj(&cx.map,     Tcl_NewDictObj());
+	replace_tclobj(&cx.actions, Tcl_NewListObj(0, NULL));
+
+	TEST_OK_LABEL(done, retcode,
+		template_actions(&cx, template, REPLACE_ATOM, cx.l->tcl_empty)
+	);
+
+	if (cx.slots_used > 1) { // Prepend the template action to allocate the slots
+		Tcl_Obj*	actions_tail=NULL;
+		int			maxdepth=0;
+
+		// Save the current actions (containing the interpolate and traversal
+		// actions), and swap in a new one that we will populate with some
+		// prefix actions (allocation and fetching)
+		replace_tclobj(&actions_tail, cx.actions);
+		replace_tclobj(&cx.actions, Tcl_NewListObj(0, NULL));
+
+		{ // Find max cx stack depth
+			int			depth=0, actionc, i;
+			Tcl_Obj**	actionv;
+
+			TEST_OK_LABEL(actions_done, retcode,
+				Tcl_ListObjGetElements(interp, actions_tail, &actionc, &actionv)
+			);
+
+			for (i=0; i<actionc; i+=3) {
+				int			opcode;
+
+				TEST_OK_LABEL(actions_done, retcode,
+					Tcl_GetIndexFromObj(interp, actionv[i], action_opcode_str, "opcode", TCL_EXACT, &opcode)
+				);
+				switch (opcode) {
+					case PUSH_TARGET:
+						if (++depth > maxdepth) maxdepth = depth;
+						break;
+
+					case POP_TARGET:
+						depth--;
+						break;
+				}
+			}
+		}
+
+		TEST_OK_LABEL(actions_done, retcode,
+			emit_action(&cx, ALLOCATE, Tcl_NewIntObj(maxdepth), Tcl_NewIntObj(cx.slots_used))
+		);
+
+		TEST_OK_LABEL(actions_done, retcode,
+			emit_fetches(&cx)
+		);
+
+		// Add back on the actions tail
+		TEST_OK_LABEL(actions_done, retcode,
+			Tcl_ListObjAppendList(interp, cx.actions, actions_tail)
+		);
+
+actions_done:
+		release_tclobj(&actions_tail);
+		if (retcode != TCL_OK) goto done;
+	}
+
+	replace_tclobj(actions, cx.actions);
+
+done:
+	release_tclobj(&cx.map);
+	release_tclobj(&cx.actions);
+
+	return retcode;
+}
+
+//}}}
+static int compile_template_actions(Tcl_Interp* interp, Tcl_Obj* actions, struct template_program** program) //{{{
+{
+	// Resolve the opcodes and operands of an action list (as produced by
+	// build_template_actions) into native instructions, so that applying the
+	// template doesn't have to decode them each time
+	int							retcode = TCL_OK;
+	int							actionc, i, n, tmp;
+	Tcl_Obj**					actionv;
+	struct template_program*	p = NULL;
+
+	TEST_OK(Tcl_ListObjGetElements(interp, actions, &actionc, &actionv));
+	if (actionc % 3 != 0)
+		THROW_ERROR("Invalid actions (odd number of elements)");
+
+	n = actionc / 3;
+	p = ckalloc(sizeof(*p) + sizeof(struct template_instr) * n);
+	p->refCount = 1;
+	p->instrc = 0;
+
+	for (i=0; i<n; i++) {
+		struct template_instr*	instr = &p->instr[i];
+		Tcl_Obj*				a = actionv[i*3+1];
+		Tcl_Obj*				b = actionv[i*3+2];
+		int						blen;
+
+		TEST_OK_LABEL(finally, retcode, Tcl_GetIndexFromObj(interp, actionv[i*3], action_opcode_str, "opcode", TCL_EXACT, &tmp));
+		instr->opcode	= tmp;
+		instr->slot		= -1;
+		instr->idx		= 0;
+
+		Tcl_GetStringFromObj(b, &blen);
+		if (blen > 0)
+			TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &instr->slot));
+
+		switch (instr->opcode) {
+			case ALLOCATE:
+			case REPLACE_ARR:
+				TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, a, &instr->idx));
+				break;
+
+			case PUSH_TARGET:
+				{
+					// The target is a copy of the template's container made by
+					// build_template_actions.  Drop the cache it shares with
+					// the template, otherwise the template's cache would hold
+					// this program, which holds the target, which holds the
+					// cache
+					enum json_types		type;
+					Tcl_ObjInternalRep*	ir = NULL;
+
+					TEST_OK_LABEL(finally, retcode, JSON_GetIntrepFromObj(interp, a, &type, &ir));
+					release_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2);
+				}
+				break;
+
+			default:
+				break;
+		}
+
+		Tcl_IncrRefCount(instr->a = a);
+		p->instrc++;
+	}
+
+	*program = p;
+	p = NULL;
+
+finally:
+	release_template_program(&p);
+	return retcode;
+}
+
+//}}}
+void release_template_program(struct template_program** program) //{{{
+{
+	struct template_program*	p = *program;
+	int							i;
+
+	if (p == NULL) return;
+	*program = NULL;
+
+	if (--p->refCount > 0) return;
+
+	for (i=0; i<p->instrc; i++)
+		release_tclobj(&p->instr[i].a);
+
+	ckfree(p);
+}
+
+//}}}
+int get_template_program(Tcl_Interp* interp, Tcl_Obj* template, struct template_program** program) //{{{
+{
+	// Return the compiled form of template, which is cached on its intrep
+	// and in the interp's template cache.  The caller owns a reference to
+	// *program and must release it with release_template_program
+	int					retcode = TCL_OK;
+	Tcl_ObjInternalRep*	ir;
+	enum json_types		type;
+	struct json_cache*	cache = NULL;
+	Tcl_Obj*			actions = NULL;
+	Tcl_Obj*			shared = NULL;		// Parsed template from the interp's template cache
+
+	if (!JSON_IsJSON(template, &type, &ir) || (cache = get_json_cache(ir, 0)) == NULL || cache->program == NULL)
+		TEST_OK_LABEL(finally, retcode, template_cache_lookup(interp, Tcl_GetAssocData(interp, "rl_json", NULL), template, &shared));
+
+	if (shared) {
+		TEST_OK_LABEL(finally, retcode, JSON_GetIntrepFromObj(interp, shared, &type, &ir));
+		cache = get_json_cache(ir, 0);
+	}
+
+	if (cache == NULL || cache->program == NULL) {
+		struct template_program*	p = NULL;
+
+		TEST_OK_LABEL(finally, retcode, build_template_actions(interp, shared, &actions));
+		TEST_OK_LABEL(finally, retcode, compile_template_actions(interp, actions, &p));
+		cache = get_json_cache(ir, 1);
+		cache->program = p;
+	}
+	if (shared) template_cache_adopt(template, shared);
+
+	release_template_program(program);
+	cache->program->refCount++;
+	*program = cache->program;
+
+finally:
+	release_tclobj(&actions);
+	release_tclobj(&shared);
+	return retcode;
+}
+
+//}}}
+Tcl_Obj* template_program_actions(struct interp_cx* l, const struct template_program* program) //{{{
+{
+	// Disassemble program back into the action list form, for debugging
+	Tcl_Obj*	actions = Tcl_NewListObj(0, NULL);
+	int			i;
+
+	for (i=0; i<program->instrc; i++) {
+		const struct template_instr*	instr = &program->instr[i];
+
+		Tcl_ListObjAppendElement(NULL, actions, l->action[instr->opcode]);
+		Tcl_ListObjAppendElement(NULL, actions, instr->a);
+		Tcl_ListObjAppendElement(NULL, actions, instr->slot == -1 ? l->tcl_empty : Tcl_NewIntObj(instr->slot));
+	}
+
+	return actions;
+}
+
+//}}}
+int lookup_type(Tcl_Interp* interp, Tcl_Obj* typeobj, int* type) //{{{
+{
+	return Tcl_GetIndexFromObj(interp, typeobj, type_names_int, "type", TCL_EXACT, type);
+}
+
+//}}}
+static inline void fill_slot(Tcl_Obj** slots, int slot, Tcl_Obj* value) //{{{
+{
+	replace_tclobj(&slots[slot], value);
+}
+
+//}}}
+int apply_template_actions(Tcl_Interp* interp, Tcl_Obj* template, const struct template_program* program, Tcl_Obj* dict, Tcl_Obj** res) // dict may be null, which means lookup vars {{{
+{
+	struct interp_cx* l = NULL;
+#define STATIC_SLOTS	10
+	Tcl_Obj*	stackslots[STATIC_SLOTS];
+	Tcl_Obj**	slots = NULL;
+	int			slotslen = 0;
+	int			retcode = TCL_OK;
+	int			i;
+#define STATIC_STACK	8
+	Tcl_Obj*	stackstack[STATIC_STACK];
+	Tcl_Obj**	stack = NULL;
+	int			stacklevel = 0;
+	Tcl_Obj*	subst_val = NULL;
+	Tcl_Obj*	key = NULL;
+	int			slot, stacklevels=0;
+	Tcl_Obj*	target = NULL;
+	Tcl_Obj*	hold = NULL;
+
+	if (program->instrc == 0) {
+		replace_tclobj(res, Tcl_DuplicateObj(template));
+		Tcl_InvalidateStringRep(*res);		// Some code relies on the fact that the result of the template command is a normalized json doc (no unnecessary whitespace / newlines)
+		return TCL_OK;
+	}
+
+	l = Tcl_GetAssocData(interp, "rl_json", NULL);
+
+	for (i=0; i<program->instrc; i++) {
+		const struct template_instr*	instr = &program->instr[i];
+		Tcl_Obj*						a = instr->a;
+
+		slot = instr->slot;
+		//fprintf(stderr, "%s (%s) (%d)\n", action_opcode_str[instr->opcode], Tcl_GetString(a), slot);
+		switch (instr->opcode) {
+			case ALLOCATE: //{{{
+				{
+					// slot is the number of slots, idx is the stack depth
+					slotslen = slot;
+					if (slotslen > STATIC_SLOTS) {
+						slots = ckalloc(sizeof(Tcl_Obj*) * slotslen);
+					} else {
+						slots = stackslots;
+					}
+					if (slotslen > 0)
+						memset(slots, 0, sizeof(Tcl_Obj*) * slotslen);
+
+					stacklevels = instr->idx;
+					if (stacklevels > STATIC_STACK) {
+						stack = ckalloc(sizeof(struct Tcl_Obj*) * stacklevels);
+					} else {
+						stack = stackstack;	// Use the space allocated on the c stack
+					}
+					if (stacklevels > 0)
+						memset(stack, 0, sizeof(Tcl_Obj*) * stacklevels);
+				}
+				break;
+				//}}}
+			case FETCH_VALUE: //{{{
+				replace_tclobj(&key, a);	// Keep a reference in case we need it for an error message shortly
+				if (dict) {
+					Tcl_Obj*	new = NULL;
+					TEST_OK_LABEL(finally, retcode, Tcl_DictObjGet(interp, dict, a, &new));
+					replace_tclobj(&subst_val, new);
+				} else {
+					replace_tclobj(&subst_val, Tcl_ObjGetVar2(interp, a, NULL, 0));
+				}
+				break;
+				//}}}
+			case DECLARE_LITERAL: //{{{
+				replace_tclobj(&subst_val, a);
+				break;
+				//}}}
+			case STORE_STRING: //{{{
+				if (subst_val == NULL) {
+					fill_slot(slots, slot, l->json_null);
+				} else {
+					const char*	str;
+					int			len;
+					Tcl_Obj*	jval=NULL;
+
+					str = Tcl_GetStringFromObj(subst_val, &len);
+					if (len == 0) {
+						replace_tclobj(&jval, l->json_empty_string);
+					} else if (len < 3) {
+						replace_tclobj(&jval, JSON_NewJvalObj(JSON_STRING, subst_val));
+					} else {
+						enum json_types	type;
+
+						TEMPLATE_TYPE(str, len, type);	// str is advanced to after the prefix
+
+						if (type == JSON_STRING) {
+							replace_tclobj(&jval, JSON_NewJvalObj(JSON_STRING, subst_val));
+						} else {
+							replace_tclobj(&jval, JSON_NewJvalObj(type, get_string(l, str, len-3)));
+						}
+					}
+					fill_slot(slots, slot, jval);
+					release_tclobj(&jval);
+				}
+				break;
+				//}}}
+			case STORE_NUMBER: //{{{
+				if (subst_val == NULL) {
+					fill_slot(slots, slot, l->json_null);
+				} else {
+					Tcl_Obj* forced = NULL;
+					
+					if (likely((retcode = force_json_number(interp, l, subst_val, &forced)) == TCL_OK))
+						fill_slot(slots, slot, JSON_NewJvalObj(JSON_NUMBER, forced));
+
+					release_tclobj(&forced);
+
+					if (unlikely(retcode != TCL_OK)) {
+						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error substituting value from \"%s\" into template, not a number: \"%s\"", Tcl_GetString(key), Tcl_GetString(subst_val)));
+						retcode = TCL_ERROR;
+						goto finally;
+					}
+				}
+				break;
+				//}}}
+			case STORE_BOOLEAN: //{{{
+				if (subst_val == NULL) {
+					fill_slot(slots, slot, l->json_null);
+				} else {
+					int is_true;
+
+					if (likely((retcode = Tcl_GetBooleanFromObj(interp, subst_val, &is_true)) == TCL_OK)) {
+						fill_slot(slots, slot, is_true ? l->json_true : l->json_false);
+					} else {
+						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Error substituting value from \"%s\" into template, not a boolean: \"%s\"", Tcl_GetString(key), Tcl_GetString(subst_val)));
+						goto finally;
+					}
+				}
+				break;
+				//}}}
+			case STORE_JSON: //{{{
+				if (subst_val == NULL) {
+					fill_slot(slots, slot, l->json_null);
+				} else {
+					TEST_OK_LABEL(finally, retcode, JSON_ForceJSON(interp, subst_val));
+					fill_slot(slots, slot, subst_val);
+				}
+				break;
+				//}}}
+			case STORE_TEMPLATE: //{{{
+				{
+					struct template_program*	sub_program = NULL;
+					Tcl_Obj*					new = NULL;
+
+					if (subst_val == NULL) {
+						fill_slot(slots, slot, l->json_null);
+					} else {
+						// recursively fill out sub template, using its cached compiled form
+						if (
+							TCL_OK == (retcode = get_template_program(interp, subst_val, &sub_program)) &&
+							TCL_OK == (retcode = apply_template_actions(interp, subst_val, sub_program, dict, &new))
+						) {
+							// Result of a template substitution is guaranteed to be JSON if the return was TCL_OK
+							//TEST_OK_LABEL(finally, retcode, JSON_ForceJSON(interp, new));
+							fill_slot(slots, slot, new);
+							release_tclobj(&new);
+						}
+						release_template_program(&sub_program);
+						if (retcode != TCL_OK) goto finally;
+					}
+					break;
+				}
+				//}}}
+
+			case STORE_REPEAT: //{{{
+				if (subst_val == NULL) {
+					fill_slot(slots, slot, l->json_null);
+				} else {
+					// a is the element template, applied to each row of subst_val
+					struct template_program*	elem_program = NULL;
+					Tcl_Obj**					rowv;
+					Tcl_Obj**					elems = NULL;
+					int							rowc, r;
+
+					TEST_OK_LABEL(finally, retcode, Tcl_ListObjGetElements(interp, subst_val, &rowc, &rowv));
+					TEST_OK_LABEL(finally, retcode, get_template_program(interp, a, &elem_program));
+
+					elems = ckalloc(sizeof(Tcl_Obj*) * (rowc > 0 ? rowc : 1));
+					memset(elems, 0, sizeof(Tcl_Obj*) * rowc);
+					for (r=0; r<rowc; r++) {
+						retcode = apply_template_actions(interp, a, elem_program, rowv[r], &elems[r]);
+						if (retcode != TCL_OK) {
+							Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf("\n    (rendering row %d of \"%s\")", r, Tcl_GetString(key)));
+							break;
+						}
+					}
+
+					if (retcode == TCL_OK)
+						fill_slot(slots, slot, JSON_NewJvalObj(JSON_ARRAY, Tcl_NewListObj(rowc, elems)));
+
+					for (r=0; r<rowc; r++) release_tclobj(&elems[r]);
+					ckfree(elems);
+					release_template_program(&elem_program);
+					if (retcode != TCL_OK) goto finally;
+				}
+				break;
+				//}}}
+
+			case PUSH_TARGET:
+				if (target) Tcl_IncrRefCount(stack[stacklevel++] = target);
+				/*
+				if (Tcl_IsShared(a))
+					a = Tcl_DuplicateObj(a);
+
+				replace_tclobj(&target, a);
+					*/
+				replace_tclobj(&target, Tcl_DuplicateObj(a));
+				break;
+
+			case POP_TARGET:	// save target to slot[0] and pop the parent target off the stack
+				fill_slot(slots, 0, target);
+				if (stacklevel > 0) {
+					Tcl_Obj*	popped = stack[--stacklevel];
+
+					replace_tclobj(&target, popped);
+					release_tclobj(&stack[stacklevel]);
+				} else {
+					release_tclobj(&target);
+				}
+				break;
+
+			case REPLACE_ARR:
+				{
+					int					idx = instr->idx;
+					Tcl_ObjInternalRep*	ir = NULL;
+					Tcl_Obj*			ir_obj = NULL;
+
+					// a is idx (resolved in instr->idx), slot is the value
+					if (Tcl_IsShared(target)) {
+						THROW_ERROR_LABEL(finally, retcode, "target is shared for REPLACE_ARR");
+					}
+					ir = Tcl_FetchInternalRep(target, g_objtype_for_type[JSON_ARRAY]);
+					if (ir == NULL) {
+						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Could not fetch array intrep for target array %s", Tcl_GetString(target)));
+						retcode = TCL_ERROR;
+						goto finally;
+					}
+					ir_obj = get_unshared_val(ir);
+					TEST_OK_LABEL(finally, retcode, Tcl_ListObjReplace(interp, ir_obj, idx, 1, 1, &slots[slot]));
+					Tcl_InvalidateStringRep(target);
+					release_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2);
+				}
+				break;
+
+			case REPLACE_VAL:
+				{
+					Tcl_ObjInternalRep*	ir = NULL;
+					Tcl_Obj*			ir_obj = NULL;
+
+					// a is key, slot is the value
+					ir = Tcl_FetchInternalRep(target, g_objtype_for_type[JSON_OBJECT]);
+					if (ir == NULL) {
+						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Could not fetch array intrep for target object %s", Tcl_GetString(target)));
+						retcode = TCL_ERROR;
+						goto finally;
+					}
+					ir_obj = get_unshared_val(ir);
+					TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(interp, ir_obj, a, slots[slot]));
+					Tcl_InvalidateStringRep(target);
+					release_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2);
+				}
+				break;
+
+			case REPLACE_ATOM:
+				replace_tclobj(&target, slots[slot]);
+				break;
+
+			case REPLACE_KEY:
+				{
+					Tcl_ObjInternalRep*	ir = NULL;
+					Tcl_Obj*			ir_obj = NULL;
+
+					// a is key, slot holds the new key name
+					ir = Tcl_FetchInternalRep(target, g_objtype_for_type[JSON_OBJECT]);
+					if (ir == NULL) {
+						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Could not fetch array intrep for target object %s", Tcl_GetString(target)));
+						retcode = TCL_ERROR;
+						goto finally;
+					}
+					ir_obj = get_unshared_val(ir);
+					TEST_OK_LABEL(finally, retcode, Tcl_DictObjGet(interp, ir_obj, a, &hold));
+					Tcl_IncrRefCount(hold);
+					TEST_OK_LABEL(finally, retcode, Tcl_DictObjRemove(interp, ir_obj, a));
+					{
+						Tcl_Obj*		key_ir_obj = NULL;
+						enum json_types	key_type;
+
+						// The value in the slot is a JSON value (JSON_STRING or JSON_DYN_LITERAL), so we need to
+						// fetch its Tcl string (from its intrep)
+						TEST_OK_LABEL(finally, retcode, JSON_GetJvalFromObj(interp, slots[slot], &key_type, &key_ir_obj));
+
+						switch (key_type) {
+							case JSON_STRING:
+								TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(interp, ir_obj, key_ir_obj, hold));
+								break;
+
+							case JSON_DYN_STRING:
+							case JSON_DYN_NUMBER:
+							case JSON_DYN_BOOL:
+							case JSON_DYN_JSON:
+							case JSON_DYN_TEMPLATE:
+							case JSON_DYN_LITERAL:
+									TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(interp, ir_obj,
+												Tcl_ObjPrintf("%s%s", dyn_prefix[key_type], Tcl_GetString(key_ir_obj)), hold));
+									break;
+
+							default:
+								Tcl_SetObjResult(interp, Tcl_ObjPrintf(
+											"Only strings allowed as object keys, got: %s for key \"%s\"",
+											Tcl_GetString(slots[slot]),
+											Tcl_GetString(a) ));
+								//Tcl_SetObjErrorCode(interp, actions);
+								retcode = TCL_ERROR;
+								goto finally;
+						}
+					}
+					Tcl_InvalidateStringRep(target);
+					release_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2);
+				}
+				break;
+
+			default:
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unhandled opcode: %s", action_opcode_str[instr->opcode]));
+				retcode = TCL_ERROR;
+				goto finally;
+		}
+	}
+
+	replace_tclobj(res, target);
+
+finally:
+	if (slots) {
+		for (i=0; i<slotslen; i++) release_tclobj(&slots[i]);
+		if (slots != stackslots) ckfree(slots);
+		slots = NULL;
+	}
+
+	release_tclobj(&key);
+	release_tclobj(&subst_val);
+	release_tclobj(&target);
+	release_tclobj(&hold);
+
+	if (stack) {
+		for (i=0; i<stacklevel; i++) release_tclobj(&stack[i]);
+		if (stack != stackstack) ckfree(stack);
+		stack = NULL;
+	}
+
+	return retcode;
+}
+
+//}}}
+
+// Ensemble subcommands
+static int jsonParse(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int						retval = TCL_OK;
+	Tcl_Obj*				res = NULL;
+	enum json_types			type;
+	Tcl_ObjInternalRep*		ir = NULL;
+
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val");
+	if (JSON_IsJSON(objv[A_VAL], &type, &ir)) {
+		TEST_OK(convert_to_tcl(interp, objv[A_VAL], &res));
+	} else {
+		// Not already parsed: go straight from the text to Tcl values
+		TEST_OK(parse_to_tcl(interp, objv[A_VAL], &res));
+	}
+	Tcl_SetObjResult(interp, res);
+	release_tclobj(&res);
+
+finally:
+	return retval;
+}
+
+//}}}
+static int jsonNormalize(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	Tcl_Obj*		json = NULL;
+	int				retval = TCL_OK;
+
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val");
+
+	replace_tclobj(&json, objv[A_VAL]);
+
+	if (Tcl_IsShared(json))
+		replace_tclobj(&json, Tcl_DuplicateObj(json));
+
+	TEST_OK_LABEL(finally, retval, JSON_ForceJSON(interp, json));
+	Tcl_InvalidateStringRep(json);
+
+	// Defer string rep generation to our caller
+	Tcl_SetObjResult(interp, json);
+
+finally:
+	release_tclobj(&json);
+	return retval;
+}
+
+//}}}
+static int jsonType(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	enum json_types		type;
+	Tcl_Obj*			val;
+	Tcl_Obj*			target = NULL;
+	int					retval = TCL_OK;
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+
+	enum {A_cmd, A_VAL, A_args};
+	const int A_PATH = A_args;
+	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
+
+	if (A_PATH < objc) {
+		TEST_OK_LABEL(finally, retval, resolve_path(interp, objv[A_VAL], objv+A_PATH, objc-A_PATH, &target, 0, 0, NULL));
+	} else {
+		replace_tclobj(&target, objv[A_VAL]);
+	}
+
+	if (is_packed(target)) {
+		type = packed_type(target);
+	} else {
+		TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, target, &type, &val));
+	}
+
+	Tcl_SetObjResult(interp, l->type[type]);
+
+finally:
+	release_tclobj(&target);
+	return retval;
+}
+
+//}}}
+static int jsonLength(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+	int					length;
+	int					retval = TCL_OK;
+	Tcl_Obj*			target = NULL;
+	Tcl_Obj*			path = NULL;
+
+	enum {A_cmd, A_VAL, A_args};
+	const int A_PATH = A_args;
+	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
+
+	replace_tclobj(&path,
+			A_PATH < objc ?  Tcl_NewListObj(objc-A_PATH, objv+A_PATH)  :  l->tcl_empty_list
+	);
+
+	retval = JSON_Length(interp, objv[A_VAL], path, &length);
+
+	if (retval == TCL_OK) {
+		switch (length) {
+			case 0:  Tcl_SetObjResult(interp, l->tcl_zero);           break;
+			case 1:  Tcl_SetObjResult(interp, l->tcl_one);            break;
+			default: Tcl_SetObjResult(interp, Tcl_NewIntObj(length)); break;
+		}
+	}
+
+finally:
+	release_tclobj(&path);
+	release_tclobj(&target);
+	return retval;
+}
+
+//}}}
+static int jsonKeys(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+	Tcl_Obj*			path = NULL;
+	Tcl_Obj*			keylist = NULL;
+	int					retval = TCL_OK;
+
+	enum {A_cmd, A_VAL, A_args};
+	const int A_PATH = A_args;
+	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
+
+	if (A_PATH < objc) {
+		replace_tclobj(&path, Tcl_NewListObj(objc-A_PATH, objv+A_PATH));
+	} else {
+		replace_tclobj(&path, l->tcl_empty_list);
+	}
+
+	TEST_OK_LABEL(finally, retval, JSON_Keys(interp, objv[A_VAL], path, &keylist));
+
+	Tcl_SetObjResult(interp, keylist);
+	
+finally:
+	release_tclobj(&path);
+	release_tclobj(&keylist);
+	return retval;
+}
+
+//}}}
+static int jsonExists(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	Tcl_Obj*		target = NULL;
+	int				retval = TCL_OK;
+
+	enum {A_cmd, A_VAL, A_args};
+	const int A_PATH = A_args;
+	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
+
+	if (A_PATH < objc) {
+		TEST_OK_LABEL(finally, retval, resolve_path(interp, objv[A_VAL], objv+A_PATH, objc-A_PATH, &target, 1, 1, NULL));
+		// resolve_path sets the interp result in exists mode
+	} else if (is_packed(objv[A_VAL])) {
+		Tcl_SetObjResult(interp, Tcl_NewBooleanObj(packed_type(objv[A_VAL]) != JSON_NULL));
+	} else {
+		enum json_types	type;
+		Tcl_Obj*		val;
+		TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, objv[A_VAL], &type, &val));
+		Tcl_SetObjResult(interp, Tcl_NewBooleanObj(type != JSON_NULL));
+	}
+
+finally:
+	release_tclobj(&target);
+	return retval;
+}
+
+//}}}
+static int jsonGet(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int			code = TCL_OK;
+	Tcl_Obj*	target = NULL;
+	Tcl_Obj*	res = NULL;
+	Tcl_Obj*	def = NULL;
+	int			convert = 1;
+	int			argbase = 1;
+	static const char* opts[] = {
+		"-default",
+		"--",			// Unnecessary for this case, but supported for convention
+		NULL
+	};
+	enum {
+		OPT_DEFAULT,
+		OPT_END_OPTIONS
+	};
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?path ...?");
+		code = TCL_ERROR;
+		goto finally;
+	}
+
+	// Consume any leading options {{{
+	while (argbase < objc) {
+		int	optidx;
+
+		enum json_types	type = JSON_GetJSONType(objv[argbase]);
+		if (type != JSON_UNDEF) break;		// Arg is already a JSON value, stop consuming options
+		const char*	str = Tcl_GetString(objv[argbase]);		// If it's not a native json value we will need this string rep to parse for the next step, so potientially regenerating the stringrep here isn't a concern
+		if (str[0] != '-') break;			// Not an option
+		TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[argbase], opts, "option", TCL_EXACT, &optidx));
+
+		switch (optidx) {
+			case OPT_DEFAULT:
+				if (objc - argbase < 2) {
+					Tcl_SetErrorCode(interp, "TCL", "ARGUMENT", "MISSING", NULL);
+					THROW_ERROR_LABEL(finally, code, "missing argument to \"", Tcl_GetString(objv[argbase]), "\"");
+				}
+				replace_tclobj(&def, objv[argbase+1]);
+				argbase += 2;
+				break;
+
+			case OPT_END_OPTIONS:
+				argbase++;
+				goto endoptions;
+
+			default:
+				THROW_ERROR_LABEL(finally, code, "Unhandled get option idx");
+		}
+	}
+endoptions:
+
+	if (objc == argbase) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?path ...?");
+		code = TCL_ERROR;
+		goto finally;
+	}
+	//}}}
+
+	if (objc >= argbase+2) {
+		const char*		s = NULL;
+		int				l;
+
+		TEST_OK_LABEL(finally, code, resolve_path(interp, objv[argbase], objv+argbase+1, objc-(argbase+1), &target, 0, 1, def));
+		s = Tcl_GetStringFromObj(objv[objc-1], &l);
+		if (s[0] == '?' && s[1] != '?') {
+			// If the last element of the path is an unquoted
+			// modifier, we need to skip the conversion from JSON
+			// (it won't be json, but the modifier result)
+			convert = 0;
+		}
+	} else {
+		enum json_types		type;
+		Tcl_ObjInternalRep*	ir;
+		replace_tclobj(&target, objv[argbase]);
+		if (is_packed(target)) {
+			type = packed_type(target);
+		} else {
+			TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, target, &type, &ir));	// Force parsing objv[argbase] as JSON
+		}
+		if (type == JSON_NULL && def)
+			replace_tclobj(&target, def);
+	}
+
+	if (convert && target != def) {
+		TEST_OK_LABEL(finally, code, convert_to_tcl(interp, target, &res));
+	} else {
+		replace_tclobj(&res, target);
+	}
+
+	Tcl_SetObjResult(interp, res);
+
+finally:
+	release_tclobj(&def);
+	release_tclobj(&target);
+	release_tclobj(&res);
+
+	return code;
+}
+
+//}}}
+static int jsonExtract(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int				code = TCL_OK;
+	Tcl_Obj*		target = NULL;
+	Tcl_Obj*		def = NULL;
+	int				argbase = 1;
+	static const char* opts[] = {
+		"-default",
+		"--",			// Unnecessary for this case, but supported for convention
+		NULL
+	};
+	enum {
+		OPT_DEFAULT,
+		OPT_END_OPTIONS
+	};
+
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?path ...?");
+		return TCL_ERROR;
+	}
+
+	// Consume any leading options {{{
+	while (argbase < objc) {
+		int	optidx;
+
+		enum json_types	type = JSON_GetJSONType(objv[argbase]);
+		if (type != JSON_UNDEF) break;		// Arg is already a JSON value, stop consuming options
+		const char*	str = Tcl_GetString(objv[argbase]);		// If it's not a native json value we will need this string rep to parse for the next step, so potientially regenerating the stringrep here isn't a concern
+		if (str[0] != '-') break;			// Not an option
+		TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[argbase], opts, "option", TCL_EXACT, &optidx));
+
+		switch (optidx) {
+			case OPT_DEFAULT:
+				if (objc - argbase < 2) {
+					Tcl_SetErrorCode(interp, "TCL", "ARGUMENT", "MISSING", NULL);
+					THROW_ERROR_LABEL(finally, code, "missing argument to \"", Tcl_GetString(objv[argbase]), "\"");
+				}
+				{
+					enum json_types	type;
+					Tcl_Obj*		val;
+					// Ensure the default is valid, even if we don't use it (fail early)
+					TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, objv[argbase+1], &type, &val));
+				}
+				replace_tclobj(&def, objv[argbase+1]);
+				argbase += 2;
+				break;
+
+			case OPT_END_OPTIONS:
+				argbase++;
+				goto endoptions;
+
+			default:
+				THROW_ERROR_LABEL(finally, code, "Unhandled get option idx");
+		}
+	}
+endoptions:
+
+	if (objc == argbase) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?path ...?");
+		code = TCL_ERROR;
+		goto finally;
+	}
+	//}}}
+
+	if (objc >= argbase+2) {
+		TEST_OK_LABEL(finally, code, resolve_path(interp, objv[argbase], objv+argbase+1, objc-(argbase+1), &target, 0, 0, def));
+	} else {
+		enum json_types	type;
+		Tcl_Obj*		val;
+		if (is_packed(objv[argbase])) {
+			type = packed_type(objv[argbase]);
+		} else {
+			TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, objv[argbase], &type, &val));	// Just a validation, keeps the contract that we return JSON
+		}
+		replace_tclobj(&target, objv[argbase]);
+		if (type == JSON_NULL && def)
+			replace_tclobj(&target, def);
+	}
+
+	Tcl_SetObjResult(interp, target);
+
+finally:
+	release_tclobj(&target);
+	release_tclobj(&def);
+	return code;
+}
+
+//}}}
+static int jsonSet(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	Tcl_Obj*	path = NULL;
+	Tcl_Obj*	src = NULL;		// ref is borrowed from either the variable or newval
+	int			retval = TCL_OK;
+	Tcl_Obj*	newval = NULL;
+
+	enum {A_cmd, A_VARNAME, A_args};
+	const int A_PATH = A_args;
+	const int A_VAL  = objc-1;
+	CHECK_MIN_ARGS_LABEL(finally, retval, "varname ?path ...? json_val");
+
+	src = Tcl_ObjGetVar2(interp, objv[A_VARNAME], NULL, 0);
+	if (src == NULL) {
+		replace_tclobj(&newval, JSON_NewJvalObj(JSON_OBJECT, Tcl_NewDictObj()));
+		src = newval;
+	} else if (Tcl_IsShared(src)) {
+		replace_tclobj(&newval, Tcl_DuplicateObj(src));
+		src = newval;
+	}
+
+	replace_tclobj(&path, Tcl_NewListObj(A_VAL-A_PATH, objv+A_PATH));
+	TEST_OK_LABEL(finally, retval, JSON_Set(interp, src, path, objv[A_VAL]));
+
+	src = Tcl_ObjSetVar2(interp, objv[A_VARNAME], NULL, src, TCL_LEAVE_ERR_MSG);
+	if (src == NULL) {
+		retval = TCL_ERROR;
+		goto finally;
+	}
+	Tcl_SetObjResult(interp, src);
+
+finally:
+	release_tclobj(&path);
+	release_tclobj(&newval);
+	return retval;
+}
+
+//}}}
+static int jsonUnset(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	Tcl_Obj*	path = NULL;
+	Tcl_Obj*	src = NULL;		// ref is borrowed from either the variable or newval
+	Tcl_Obj*	newval = NULL;
+	int			retval = TCL_OK;
 
-					TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-					if (subst_val == NULL) {
-						fill_slot(slots, slot, l->json_null);
-					} else {
-						// recursively fill out sub template
-						if (
-							TCL_OK == (retcode = build_template_actions(interp, subst_val, &sub_template_actions)) &&
-							TCL_OK == (retcode = apply_template_actions(interp, subst_val, sub_template_actions, dict, &new))
-						) {
-							// Result of a template substitution is guaranteed to be JSON if the return was TCL_OK
-							//TEST_OK_LABEL(finally, retcode, JSON_ForceJSON(interp, new));
-							fill_slot(slots, slot, new);
-							release_tclobj(&new);
-						}
-						release_tclobj(&sub_template_actions);
-						if (retcode != TCL_OK) goto finally;
-					}
-					break;
-				}
-				//}}}
+	enum {A_cmd, A_VARNAME, A_args};
+	const int A_PATH = A_args;
+	CHECK_MIN_ARGS_LABEL(finally, retval, "varname ?path ...?");
 
-			case PUSH_TARGET:
-				if (target) Tcl_IncrRefCount(stack[stacklevel++] = target);
-				/*
-				if (Tcl_IsShared(a))
-					a = Tcl_DuplicateObj(a);
+	src = Tcl_ObjGetVar2(interp, objv[A_VARNAME], NULL, TCL_LEAVE_ERR_MSG);
+	if (src == NULL) {
+		retval = TCL_ERROR;
+		goto finally;
+	}
 
-				replace_tclobj(&target, a);
-					*/
-				replace_tclobj(&target, Tcl_DuplicateObj(a));
-				break;
+	if (Tcl_IsShared(src)) {
+		replace_tclobj(&newval, Tcl_DuplicateObj(src));
+		src = newval;
+	}
 
-			case POP_TARGET:	// save target to slot[0] and pop the parent target off the stack
-				fill_slot(slots, 0, target);
-				if (stacklevel > 0) {
-					Tcl_Obj*	popped = stack[--stacklevel];
+	replace_tclobj(&path, Tcl_NewListObj(objc-A_PATH, objv+A_PATH));
+	TEST_OK_LABEL(finally, retval, JSON_Unset(interp, src, path));
 
-					replace_tclobj(&target, popped);
-					release_tclobj(&stack[stacklevel]);
-				} else {
-					release_tclobj(&target);
-				}
-				break;
+	// Have to unconditionally set the variable to even if the value was
+	// unshared or variable write traces won't fire on this change
+	src = Tcl_ObjSetVar2(interp, objv[A_VARNAME], NULL, src, TCL_LEAVE_ERR_MSG);
+	if (src == NULL) {
+		retval = TCL_ERROR;
+		goto finally;
+	}
+	Tcl_SetObjResult(interp, src);
 
-			case REPLACE_ARR:
-				{
-					int					slot, idx;
-					Tcl_ObjInternalRep*	ir = NULL;
-					Tcl_Obj*			ir_obj = NULL;
+finally:
+	release_tclobj(&path);
+	release_tclobj(&newval);
+	return retval;
+}
 
-					// a is idx, b is slot
-					TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-					TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, a, &idx));
-					if (Tcl_IsShared(target)) {
-						THROW_ERROR_LABEL(finally, retcode, "target is shared for REPLACE_ARR");
-					}
-					ir = Tcl_FetchInternalRep(target, g_objtype_for_type[JSON_ARRAY]);
-					if (ir == NULL) {
-						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Could not fetch array intrep for target array %s", Tcl_GetString(target)));
-						retcode = TCL_ERROR;
-						goto finally;
-					}
-					ir_obj = get_unshared_val(ir);
-					TEST_OK_LABEL(finally, retcode, Tcl_ListObjReplace(interp, ir_obj, idx, 1, 1, &slots[slot]));
-					Tcl_InvalidateStringRep(target);
-					release_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2);
-				}
-				break;
+//}}}
+static int jsonNew(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int			retval = TCL_OK;
+	Tcl_Obj*	res = NULL;
 
-			case REPLACE_VAL:
-				{
-					int					slot;
-					Tcl_ObjInternalRep*	ir = NULL;
-					Tcl_Obj*			ir_obj = NULL;
+	enum {A_cmd, A_TYPE, A_args};
+	CHECK_MIN_ARGS_LABEL(finally, retval, "type ?val?");
 
-					// a is key, b is slot
-					TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-					ir = Tcl_FetchInternalRep(target, g_objtype_for_type[JSON_OBJECT]);
-					if (ir == NULL) {
-						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Could not fetch array intrep for target object %s", Tcl_GetString(target)));
-						retcode = TCL_ERROR;
-						goto finally;
-					}
-					ir_obj = get_unshared_val(ir);
-					TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(interp, ir_obj, a, slots[slot]));
-					Tcl_InvalidateStringRep(target);
-					release_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2);
-				}
-				break;
+	TEST_OK(new_json_value_from_list(interp, objc-A_TYPE, objv+A_TYPE, &res));
+	Tcl_SetObjResult(interp, res);
 
-			case REPLACE_ATOM:
-				{
-					int		slot;
+finally:
+	release_tclobj(&res);
+	return retval;
+}
 
-					// b is slot
-					TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-					replace_tclobj(&target, slots[slot]);
-				}
-				break;
+//}}}
+static int jsonString(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+#if DEDUP
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+#endif
+	int					len;
+	const char*			s;
+	enum json_types		type;
+	int					retval = TCL_OK;
 
-			case REPLACE_KEY:
-				{
-					int					slot;
-					Tcl_ObjInternalRep*	ir = NULL;
-					Tcl_Obj*			ir_obj = NULL;
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "value");
 
-					// a is key, b is slot (which holds the new key name)
-					TEST_OK_LABEL(finally, retcode, Tcl_GetIntFromObj(interp, b, &slot));
-					ir = Tcl_FetchInternalRep(target, g_objtype_for_type[JSON_OBJECT]);
-					if (ir == NULL) {
-						Tcl_SetObjResult(interp, Tcl_ObjPrintf("Could not fetch array intrep for target object %s", Tcl_GetString(target)));
-						retcode = TCL_ERROR;
-						goto finally;
-					}
-					ir_obj = get_unshared_val(ir);
-					TEST_OK_LABEL(finally, retcode, Tcl_DictObjGet(interp, ir_obj, a, &hold));
-					Tcl_IncrRefCount(hold);
-					TEST_OK_LABEL(finally, retcode, Tcl_DictObjRemove(interp, ir_obj, a));
-					{
-						Tcl_Obj*		key_ir_obj = NULL;
-						enum json_types	key_type;
+	s = Tcl_GetStringFromObj(objv[A_VAL], &len);
+	TEMPLATE_TYPE(s, len, type);	// s is advanced past prefix
 
-						// The value in the slot is a JSON value (JSON_STRING or JSON_DYN_LITERAL), so we need to
-						// fetch its Tcl string (from its intrep)
-						TEST_OK_LABEL(finally, retcode, JSON_GetJvalFromObj(interp, slots[slot], &key_type, &key_ir_obj));
+	if (type == JSON_STRING) {
+		Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_STRING, get_string(l, s, len)));
+	} else {
+		Tcl_SetObjResult(interp, JSON_NewJvalObj(type, get_string(l, s, len-3)));
+	}
 
-						switch (key_type) {
-							case JSON_STRING:
-								TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(interp, ir_obj, key_ir_obj, hold));
-								break;
+finally:
+	return retval;
+}
 
-							case JSON_DYN_STRING:
-							case JSON_DYN_NUMBER:
-							case JSON_DYN_BOOL:
-							case JSON_DYN_JSON:
-							case JSON_DYN_TEMPLATE:
-							case JSON_DYN_LITERAL:
-									TEST_OK_LABEL(finally, retcode, Tcl_DictObjPut(interp, ir_obj,
-												Tcl_ObjPrintf("%s%s", dyn_prefix[key_type], Tcl_GetString(key_ir_obj)), hold));
-									break;
+//}}}
+static int jsonNumber(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	Tcl_Obj*			forced = NULL;
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+	int					retval = TCL_OK;
 
-							default:
-								Tcl_SetObjResult(interp, Tcl_ObjPrintf(
-											"Only strings allowed as object keys, got: %s for key \"%s\"",
-											Tcl_GetString(slots[slot]),
-											Tcl_GetString(a) ));
-								//Tcl_SetObjErrorCode(interp, actions);
-								retcode = TCL_ERROR;
-								goto finally;
-						}
-					}
-					Tcl_InvalidateStringRep(target);
-					release_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2);
-				}
-				break;
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "value");
 
-			default:
-				Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unhandled opcode: %s", Tcl_GetString(actionv[i])));
-				retcode = TCL_ERROR;
-				goto finally;
-		}
-	}
+	TEST_OK_LABEL(finally, retval, force_json_number(interp, l, objv[A_VAL], &forced));
+	Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_NUMBER, forced));
 
-	replace_tclobj(res, target);
+finally:
+	release_tclobj(&forced);
+	return retval;
+}
+
+//}}}
+static int jsonBoolean(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int			retval = TCL_OK;
+
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "value");
+
+	int	b;
+	TEST_OK_LABEL(finally, retval, Tcl_GetBooleanFromObj(interp, objv[A_VAL], &b));
+	Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_BOOL, Tcl_NewBooleanObj(b)));
 
 finally:
-	if (slots) {
-		for (i=0; i<slotslen; i++) release_tclobj(&slots[i]);
-		if (slots != stackslots) ckfree(slots);
-		slots = NULL;
-	}
+	return retval;
+}
 
-	release_tclobj(&key);
-	release_tclobj(&subst_val);
-	release_tclobj(&target);
-	release_tclobj(&hold);
+//}}}
+static int jsonObject(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int			retval = TCL_OK;
+	int			oc;
+	Tcl_Obj**	ov;
+	Tcl_Obj*	res = NULL;
 
-	if (stack) {
-		for (i=0; i<stacklevel; i++) release_tclobj(&stack[i]);
-		if (stack != stackstack) ckfree(stack);
-		stack = NULL;
+	if (objc == 2) {
+		TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, objv[1], &oc, &ov));
+		TEST_OK_LABEL(finally, retval, _new_object(interp, oc, ov, &res));
+	} else {
+		TEST_OK_LABEL(finally, retval, _new_object(interp, objc-1, objv+1, &res));
 	}
+	Tcl_SetObjResult(interp, res);
 
-	return retcode;
+finally:
+	release_tclobj(&res);
+	return retval;
 }
 
 //}}}
+static int jsonArray(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int			i, ac, retval = TCL_OK;;
+	Tcl_Obj**	av;
+	Tcl_Obj*	elem = NULL;
+	Tcl_Obj*	val = NULL;
 
-// Ensemble subcommands
-static int jsonParse(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	int				retval = TCL_OK;
-	Tcl_Obj*		res = NULL;
+	replace_tclobj(&val, Tcl_NewListObj(objc-1, NULL));
 
-	enum {A_cmd, A_VAL, A_objc};
-	CHECK_ARGS_LABEL(finally, retval, "json_val");
-	TEST_OK(JSON_ForceJSON(interp, objv[A_VAL]));	// Force parsing objv[A_VAL] as JSON
-	TEST_OK(convert_to_tcl(interp, objv[A_VAL], &res));
-	Tcl_SetObjResult(interp, res);
-	release_tclobj(&res);
+	for (i=1; i<objc; i++) {
+		TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, objv[i], &ac, &av));
+		TEST_OK_LABEL(finally, retval, new_json_value_from_list(interp, ac, av, &elem));
+		TEST_OK_LABEL(finally, retval, Tcl_ListObjAppendElement(interp, val, elem));
+	}
+	Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_ARRAY, val));
 
 finally:
+	release_tclobj(&elem);
+	release_tclobj(&val);
 	return retval;
 }
 
 //}}}
-static int jsonNormalize(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonDecode(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	Tcl_Obj*		json = NULL;
-	int				retval = TCL_OK;
-
-	enum {A_cmd, A_VAL, A_objc};
-	CHECK_ARGS_LABEL(finally, retval, "json_val");
-
-	replace_tclobj(&json, objv[A_VAL]);
+	Tcl_Obj*	encoding = NULL;
+	Tcl_Obj*	res = NULL;
+	int			retval = TCL_OK;
 
-	if (Tcl_IsShared(json))
-		replace_tclobj(&json, Tcl_DuplicateObj(json));
+	enum {A_cmd, A_BYTES, A_args, A_objc};
+	const int A_ENCODING = A_args;
+	CHECK_RANGE_ARGS_LABEL(finally, retval, "bytes ?encoding?");
 
-	TEST_OK_LABEL(finally, retval, JSON_ForceJSON(interp, json));
-	Tcl_InvalidateStringRep(json);
+	if (A_ENCODING < objc)
+		replace_tclobj(&encoding, objv[A_ENCODING]);
 
-	// Defer string rep generation to our caller
-	Tcl_SetObjResult(interp, json);
+	TEST_OK_LABEL(finally, retval, JSON_Decode(interp, objv[A_BYTES], encoding, &res));
+	Tcl_SetObjResult(interp, res);
 
 finally:
-	release_tclobj(&json);
+	release_tclobj(&res);
+	release_tclobj(&encoding);
 	return retval;
 }
 
 //}}}
-static int jsonType(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonIsNull(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	enum json_types		type;
-	Tcl_Obj*			val;
-	Tcl_Obj*			target = NULL;
-	int					retval = TCL_OK;
-	struct interp_cx*	l = (struct interp_cx*)cdata;
+	Tcl_Obj*		target = NULL;
+	Tcl_Obj*		val;
+	enum json_types	type;
+	int				retval = TCL_OK;
 
 	enum {A_cmd, A_VAL, A_args};
 	const int A_PATH = A_args;
 	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
 
 	if (A_PATH < objc) {
-		TEST_OK_LABEL(finally, retval, resolve_path(interp, objv[A_VAL], objv+A_PATH, objc-A_PATH, &target, 0, 0, NULL));
+		TEST_OK(resolve_path(interp, objv[A_VAL], objv+A_PATH, objc-A_PATH, &target, 0, 0, NULL));
 	} else {
 		replace_tclobj(&target, objv[A_VAL]);
 	}
 
 	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, target, &type, &val));
-
-	Tcl_SetObjResult(interp, l->type[type]);
+	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(type == JSON_NULL));
 
 finally:
 	release_tclobj(&target);
@@ -2512,566 +4042,878 @@ finally:
 }
 
 //}}}
-static int jsonLength(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonTemplateString(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	struct interp_cx*	l = (struct interp_cx*)cdata;
-	int					length;
-	int					retval = TCL_OK;
-	Tcl_Obj*			target = NULL;
-	Tcl_Obj*			path = NULL;
+	int							retval = TCL_OK;
+	Tcl_DString					ds;
+	struct serialize_context	scx = {
+		.ds				= &ds,
+		.serialize_mode	= SERIALIZE_TEMPLATE,
+		.l				= (struct interp_cx*)cdata,
+		.allow_null		= 1
+	};
+	struct template_fragments*	fragments = NULL;
 
-	enum {A_cmd, A_VAL, A_args};
-	const int A_PATH = A_args;
-	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
+	Tcl_DStringInit(&ds);
 
-	replace_tclobj(&path,
-			A_PATH < objc ?  Tcl_NewListObj(objc-A_PATH, objv+A_PATH)  :  l->tcl_empty_list
-	);
+	enum {A_cmd, A_TEMPLATE, A_args, A_objc};
+	const int A_DICT = A_args;
+	CHECK_RANGE_ARGS_LABEL(finally, retval, "json_template ?source_dict?");
 
-	retval = JSON_Length(interp, objv[A_VAL], path, &length);
+	if (A_DICT < objc)
+		replace_tclobj(&scx.fromdict, objv[A_DICT]);
 
-	if (retval == TCL_OK) {
-		switch (length) {
-			case 0:  Tcl_SetObjResult(interp, l->tcl_zero);           break;
-			case 1:  Tcl_SetObjResult(interp, l->tcl_one);            break;
-			default: Tcl_SetObjResult(interp, Tcl_NewIntObj(length)); break;
-		}
-	}
+	TEST_OK_LABEL(finally, retval, get_template_fragments(interp, scx.l, objv[A_TEMPLATE], &fragments));
+	TEST_OK_LABEL(finally, retval, render_template_fragments(interp, &scx, fragments));
+	Tcl_DStringResult(interp, scx.ds);
 
 finally:
-	release_tclobj(&path);
-	release_tclobj(&target);
-	return retval;
+	scx.ds = NULL;
+	Tcl_DStringFree(&ds);
+	release_tclobj(&scx.fromdict);
+	release_template_fragments(&fragments);
+	return retval == TCL_OK ? TCL_OK : TCL_ERROR;
 }
 
 //}}}
-static int jsonKeys(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonTemplate(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	struct interp_cx*	l = (struct interp_cx*)cdata;
-	Tcl_Obj*			path = NULL;
-	Tcl_Obj*			keylist = NULL;
-	int					retval = TCL_OK;
-
-	enum {A_cmd, A_VAL, A_args};
-	const int A_PATH = A_args;
-	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
+	int			retval = TCL_OK;
+	Tcl_Obj*	res = NULL;
 
-	if (A_PATH < objc) {
-		replace_tclobj(&path, Tcl_NewListObj(objc-A_PATH, objv+A_PATH));
-	} else {
-		replace_tclobj(&path, l->tcl_empty_list);
-	}
+	enum {A_cmd, A_TEMPLATE, A_args, A_objc};
+	const int A_DICT = A_args;
+	CHECK_RANGE_ARGS_LABEL(finally, retval, "json_template ?source_dict?");
 
-	TEST_OK_LABEL(finally, retval, JSON_Keys(interp, objv[A_VAL], path, &keylist));
+	TEST_OK_LABEL(finally, retval, JSON_Template(interp, objv[A_TEMPLATE], A_DICT < objc ? objv[A_DICT] : NULL, &res));
+	Tcl_SetObjResult(interp, res);
 
-	Tcl_SetObjResult(interp, keylist);
-	
 finally:
-	release_tclobj(&path);
-	release_tclobj(&keylist);
+	release_tclobj(&res);
 	return retval;
 }
 
 //}}}
-static int jsonExists(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	Tcl_Obj*		target = NULL;
-	int				retval = TCL_OK;
+struct match_builder {
+	int					instrc;
+	int					instralloc;
+	int					depth;
+	int					maxdepth;
+	int					bindc;
+	struct match_instr*	instr;
+};
 
-	enum {A_cmd, A_VAL, A_args};
-	const int A_PATH = A_args;
-	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
+static void emit_match(struct match_builder* b, enum match_opcode opcode, enum json_types type, int idx, Tcl_Obj* a) //{{{
+{
+	struct match_instr*	instr;
 
-	if (A_PATH < objc) {
-		TEST_OK_LABEL(finally, retval, resolve_path(interp, objv[A_VAL], objv+A_PATH, objc-A_PATH, &target, 1, 1, NULL));
-		// resolve_path sets the interp result in exists mode
-	} else {
-		enum json_types	type;
-		Tcl_Obj*		val;
-		TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, objv[A_VAL], &type, &val));
-		Tcl_SetObjResult(interp, Tcl_NewBooleanObj(type != JSON_NULL));
+	if (b->instrc >= b->instralloc) {
+		b->instralloc = b->instralloc ? b->instralloc * 2 : 16;
+		b->instr = ckrealloc(b->instr, sizeof(struct match_instr) * b->instralloc);
 	}
 
-finally:
-	release_tclobj(&target);
-	return retval;
+	instr = &b->instr[b->instrc++];
+	instr->opcode	= opcode;
+	instr->type		= type;
+	instr->idx		= idx;
+	instr->a		= NULL;
+	replace_tclobj(&instr->a, a);
+
+	switch (opcode) {
+		case MATCH_KEY:
+		case MATCH_IDX:
+			if (++b->depth > b->maxdepth) b->maxdepth = b->depth;
+			break;
+		case MATCH_UP:
+			b->depth--;
+			break;
+		default:
+			break;
+	}
 }
 
 //}}}
-static int jsonGet(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int compile_match(Tcl_Interp* interp, struct match_builder* b, Tcl_Obj* template) //{{{
 {
-	int			code = TCL_OK;
-	Tcl_Obj*	target = NULL;
-	Tcl_Obj*	res = NULL;
-	Tcl_Obj*	def = NULL;
-	int			convert = 1;
-	int			argbase = 1;
-	static const char* opts[] = {
-		"-default",
-		"--",			// Unnecessary for this case, but supported for convention
-		NULL
-	};
-	enum {
-		OPT_DEFAULT,
-		OPT_END_OPTIONS
-	};
+	// Build the plan for matching against template: descend into every
+	// member and element it has, check the constants and bind the values at
+	// the placeholders.  Members of a document that the template doesn't
+	// mention are never visited
+	enum json_types	type;
+	Tcl_Obj*		val = NULL;
+	int				retval = TCL_OK;
 
-	if (objc < 2) {
-		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?path ...?");
-		code = TCL_ERROR;
-		goto finally;
-	}
+	TEST_OK(JSON_GetJvalFromObj(interp, template, &type, &val));
 
-	// Consume any leading options {{{
-	while (argbase < objc) {
-		int	optidx;
+	switch (type) {
+		case JSON_OBJECT: //{{{
+			{
+				int				done, size;
+				Tcl_DictSearch	search;
+				Tcl_Obj*		k;
+				Tcl_Obj*		v;
 
-		enum json_types	type = JSON_GetJSONType(objv[argbase]);
-		if (type != JSON_UNDEF) break;		// Arg is already a JSON value, stop consuming options
-		const char*	str = Tcl_GetString(objv[argbase]);		// If it's not a native json value we will need this string rep to parse for the next step, so potientially regenerating the stringrep here isn't a concern
-		if (str[0] != '-') break;			// Not an option
-		TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[argbase], opts, "option", TCL_EXACT, &optidx));
+				TEST_OK(Tcl_DictObjSize(interp, val, &size));
+				if (size == 0) {
+					emit_match(b, MATCH_TYPE, JSON_OBJECT, 0, NULL);
+					break;
+				}
 
-		switch (optidx) {
-			case OPT_DEFAULT:
-				if (objc - argbase < 2) {
-					Tcl_SetErrorCode(interp, "TCL", "ARGUMENT", "MISSING", NULL);
-					THROW_ERROR_LABEL(finally, code, "missing argument to \"", Tcl_GetString(objv[argbase]), "\"");
+				TEST_OK(Tcl_DictObjFirst(interp, val, &search, &k, &v, &done));
+				for (; !done; Tcl_DictObjNext(&search, &k, &v, &done)) {
+					int			len;
+					const char*	s = Tcl_GetStringFromObj(k, &len);
+
+					// Keys follow the rules of json template: ~L: quotes a
+					// literal key, and a placeholder key can't be matched
+					// since it doesn't say which member to descend into
+					if (len >= 3 && s[0] == '~' && s[2] == ':') {
+						switch (s[1]) {
+							case 'L':
+								emit_match(b, MATCH_KEY, JSON_UNDEF, 0, Tcl_GetRange(k, 3, len-1));
+								goto key_done;
+							case 'S':
+							case 'N':
+							case 'B':
+							case 'J':
+							case 'T':
+								Tcl_SetObjResult(interp, Tcl_ObjPrintf("Can't match against a placeholder key: \"%s\"", s));
+								Tcl_SetErrorCode(interp, "RL", "JSON", "MATCH", "KEY", NULL);
+								retval = TCL_ERROR;
+								goto search_done;
+						}
+					}
+					emit_match(b, MATCH_KEY, JSON_UNDEF, 0, k);
+key_done:
+					TEST_OK_BREAK(retval, compile_match(interp, b, v));
+					emit_match(b, MATCH_UP, JSON_UNDEF, 0, NULL);
 				}
-				replace_tclobj(&def, objv[argbase+1]);
-				argbase += 2;
-				break;
+search_done:
+				Tcl_DictObjDone(&search);
+			}
+			break;
+			//}}}
+		case JSON_ARRAY: //{{{
+			{
+				int			oc, i;
+				Tcl_Obj**	ov;
 
-			case OPT_END_OPTIONS:
-				argbase++;
-				goto endoptions;
+				TEST_OK(Tcl_ListObjGetElements(interp, val, &oc, &ov));
+				if (oc == 0) {
+					emit_match(b, MATCH_TYPE, JSON_ARRAY, 0, NULL);
+					break;
+				}
 
-			default:
-				THROW_ERROR_LABEL(finally, code, "Unhandled get option idx");
-		}
+				for (i=0; i<oc; i++) {
+					emit_match(b, MATCH_IDX, JSON_UNDEF, i, NULL);
+					TEST_OK(compile_match(interp, b, ov[i]));
+					emit_match(b, MATCH_UP, JSON_UNDEF, 0, NULL);
+				}
+			}
+			break;
+			//}}}
+		case JSON_DYN_STRING:
+		case JSON_DYN_NUMBER:
+		case JSON_DYN_BOOL:
+		case JSON_DYN_JSON:
+			emit_match(b, MATCH_BIND, type, b->bindc++, val);
+			break;
+
+		case JSON_DYN_TEMPLATE:
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("Can't match against a template substitution: \"~T:%s\"", Tcl_GetString(val)));
+			Tcl_SetErrorCode(interp, "RL", "JSON", "MATCH", "TEMPLATE", NULL);
+			return TCL_ERROR;
+
+		case JSON_DYN_LITERAL:
+			emit_match(b, MATCH_CONST, JSON_STRING, 0, JSON_NewJvalObj(JSON_STRING, val));
+			break;
+
+		default:
+			// A new value rather than template itself, which could be the
+			// root whose cache will hold this program
+			emit_match(b, MATCH_CONST, type, 0, JSON_NewJvalObj(type, val));
+			break;
 	}
-endoptions:
 
-	if (objc == argbase) {
-		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?path ...?");
-		code = TCL_ERROR;
-		goto finally;
-	}
-	//}}}
+	return retval;
+}
+
+//}}}
+void release_match_program(struct match_program** program) //{{{
+{
+	struct match_program*	p = *program;
+	int						i;
+
+	if (p == NULL) return;
+	*program = NULL;
+
+	if (--p->refCount > 0) return;
+
+	for (i=0; i<p->instrc; i++)
+		release_tclobj(&p->instr[i].a);
 
-	if (objc >= argbase+2) {
-		const char*		s = NULL;
-		int				l;
+	ckfree(p);
+}
 
-		TEST_OK_LABEL(finally, code, resolve_path(interp, objv[argbase], objv+argbase+1, objc-(argbase+1), &target, 0, 1, def));
-		s = Tcl_GetStringFromObj(objv[objc-1], &l);
-		if (s[0] == '?' && s[1] != '?') {
-			// If the last element of the path is an unquoted
-			// modifier, we need to skip the conversion from JSON
-			// (it won't be json, but the modifier result)
-			convert = 0;
-		}
-	} else {
-		enum json_types		type;
-		Tcl_ObjInternalRep*	ir;
-		replace_tclobj(&target, objv[argbase]);
-		TEST_OK_LABEL(finally, code, JSON_GetIntrepFromObj(interp, target, &type, &ir));	// Force parsing objv[argbase] as JSON
-		if (type == JSON_NULL && def)
-			replace_tclobj(&target, def);
+//}}}
+static int get_match_program(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* template, struct match_program** program) //{{{
+{
+	// Return the match plan for template, cached on its intrep and in the
+	// interp's template cache.  The caller owns a reference to *program and
+	// must release it with release_match_program
+	int						retval = TCL_OK;
+	Tcl_ObjInternalRep*		ir;
+	enum json_types			type;
+	struct json_cache*		cache = NULL;
+	Tcl_Obj*				shared = NULL;		// Parsed template from the interp's template cache
+	struct match_builder	b = {0};
+	int						i;
+
+	if (!JSON_IsJSON(template, &type, &ir) || (cache = get_json_cache(ir, 0)) == NULL || cache->match == NULL)
+		TEST_OK_LABEL(finally, retval, template_cache_lookup(interp, l, template, &shared));
+
+	if (shared) {
+		TEST_OK_LABEL(finally, retval, JSON_GetIntrepFromObj(interp, shared, &type, &ir));
+		cache = get_json_cache(ir, 0);
 	}
 
-	if (convert && target != def) {
-		TEST_OK_LABEL(finally, code, convert_to_tcl(interp, target, &res));
-	} else {
-		replace_tclobj(&res, target);
+	if (cache == NULL || cache->match == NULL) {
+		struct match_program*	p = NULL;
+
+		TEST_OK_LABEL(finally, retval, compile_match(interp, &b, shared));
+
+		p = ckalloc(sizeof(*p) + sizeof(struct match_instr) * b.instrc);
+		p->refCount = 1;
+		p->depth = b.maxdepth;
+		p->bindc = b.bindc;
+		p->instrc = b.instrc;
+		if (b.instrc) memcpy(p->instr, b.instr, sizeof(struct match_instr) * b.instrc);
+		b.instrc = 0;	// References to the operands now belong to p
+
+		cache = get_json_cache(ir, 1);
+		cache->match = p;
 	}
+	if (shared) template_cache_adopt(template, shared);
 
-	Tcl_SetObjResult(interp, res);
+	release_match_program(program);
+	cache->match->refCount++;
+	*program = cache->match;
 
 finally:
-	release_tclobj(&def);
-	release_tclobj(&target);
-	release_tclobj(&res);
-
-	return code;
+	for (i=0; i<b.instrc; i++)
+		release_tclobj(&b.instr[i].a);
+	if (b.instr) ckfree(b.instr);
+	release_tclobj(&shared);
+	return retval;
 }
 
 //}}}
-static int jsonExtract(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int run_match(Tcl_Interp* interp, const struct match_program* program, Tcl_Obj* doc, Tcl_Obj** bound, int* matched) //{{{
 {
-	int				code = TCL_OK;
-	Tcl_Obj*		target = NULL;
-	Tcl_Obj*		def = NULL;
-	int				argbase = 1;
-	static const char* opts[] = {
-		"-default",
-		"--",			// Unnecessary for this case, but supported for convention
-		NULL
-	};
-	enum {
-		OPT_DEFAULT,
-		OPT_END_OPTIONS
-	};
+	// Walk doc according to program, setting bound[slot] for each
+	// placeholder (left NULL where the document has null).  *matched is
+	// set to 0 as soon as the document doesn't fit the template
+	int					retval = TCL_OK;
+	int					i, sp = 0, equal;
+	Tcl_Obj*			stackstack[16];
+	Tcl_Obj**			stack = program->depth <= 16 ? stackstack : ckalloc(sizeof(Tcl_Obj*) * program->depth);
+	Tcl_Obj*			cur = doc;		// Borrowed, doc or the containers on the stack hold the references
+	Tcl_Obj*			val = NULL;
+	Tcl_Obj*			child = NULL;
+	enum json_types		type;
 
-	if (objc < 2) {
-		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?path ...?");
-		return TCL_ERROR;
-	}
+	*matched = 0;
 
-	// Consume any leading options {{{
-	while (argbase < objc) {
-		int	optidx;
+	for (i=0; i<program->instrc; i++) {
+		const struct match_instr*	instr = &program->instr[i];
 
-		enum json_types	type = JSON_GetJSONType(objv[argbase]);
-		if (type != JSON_UNDEF) break;		// Arg is already a JSON value, stop consuming options
-		const char*	str = Tcl_GetString(objv[argbase]);		// If it's not a native json value we will need this string rep to parse for the next step, so potientially regenerating the stringrep here isn't a concern
-		if (str[0] != '-') break;			// Not an option
-		TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[argbase], opts, "option", TCL_EXACT, &optidx));
+		switch (instr->opcode) {
+			case MATCH_KEY:
+				TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, cur, &type, &val));
+				if (type != JSON_OBJECT) goto finally;
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjGet(interp, val, instr->a, &child));
+				if (child == NULL) goto finally;
+				stack[sp++] = cur;
+				cur = child;
+				break;
 
-		switch (optidx) {
-			case OPT_DEFAULT:
-				if (objc - argbase < 2) {
-					Tcl_SetErrorCode(interp, "TCL", "ARGUMENT", "MISSING", NULL);
-					THROW_ERROR_LABEL(finally, code, "missing argument to \"", Tcl_GetString(objv[argbase]), "\"");
+			case MATCH_IDX:
+				TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, cur, &type, &val));
+				if (type != JSON_ARRAY) goto finally;
+				TEST_OK_LABEL(finally, retval, Tcl_ListObjIndex(interp, val, instr->idx, &child));
+				if (child == NULL) goto finally;
+				stack[sp++] = cur;
+				cur = child;
+				break;
+
+			case MATCH_UP:
+				cur = stack[--sp];
+				break;
+
+			case MATCH_TYPE:
+				TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, cur, &type, &val));
+				if (type != instr->type) goto finally;
+				break;
+
+			case MATCH_CONST:
+				TEST_OK_LABEL(finally, retval, JSON_Equal(interp, cur, instr->a, &equal));
+				if (!equal) goto finally;
+				break;
+
+			case MATCH_BIND:
+				TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, cur, &type, &val));
+				if (type == JSON_NULL) {
+					release_tclobj(&bound[instr->idx]);
+					break;
 				}
-				{
-					enum json_types	type;
-					Tcl_Obj*		val;
-					// Ensure the default is valid, even if we don't use it (fail early)
-					TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, objv[argbase+1], &type, &val));
+				switch (instr->type) {
+					case JSON_DYN_STRING:
+						// Template strings in the document are just strings here
+						if (type != JSON_STRING && type < JSON_DYN_STRING) goto finally;
+						TEST_OK_LABEL(finally, retval, convert_to_tcl(interp, cur, &bound[instr->idx]));
+						break;
+					case JSON_DYN_NUMBER:
+						if (type != JSON_NUMBER) goto finally;
+						replace_tclobj(&bound[instr->idx], val);
+						break;
+					case JSON_DYN_BOOL:
+						if (type != JSON_BOOL) goto finally;
+						replace_tclobj(&bound[instr->idx], val);
+						break;
+					case JSON_DYN_JSON:
+						replace_tclobj(&bound[instr->idx], cur);
+						break;
+					default:
+						THROW_ERROR_LABEL(finally, retval, "Unhandled placeholder type");
 				}
-				replace_tclobj(&def, objv[argbase+1]);
-				argbase += 2;
 				break;
 
-			case OPT_END_OPTIONS:
-				argbase++;
-				goto endoptions;
-
 			default:
-				THROW_ERROR_LABEL(finally, code, "Unhandled get option idx");
+				THROW_ERROR_LABEL(finally, retval, "Unhandled match opcode");
 		}
 	}
-endoptions:
-
-	if (objc == argbase) {
-		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?path ...?");
-		code = TCL_ERROR;
-		goto finally;
-	}
-	//}}}
-
-	if (objc >= argbase+2) {
-		TEST_OK_LABEL(finally, code, resolve_path(interp, objv[argbase], objv+argbase+1, objc-(argbase+1), &target, 0, 0, def));
-	} else {
-		enum json_types	type;
-		Tcl_Obj*		val;
-		TEST_OK_LABEL(finally, code, JSON_GetJvalFromObj(interp, objv[argbase], &type, &val));	// Just a validation, keeps the contract that we return JSON
-		replace_tclobj(&target, objv[argbase]);
-		if (type == JSON_NULL && def)
-			replace_tclobj(&target, def);
-	}
 
-	Tcl_SetObjResult(interp, target);
+	*matched = 1;
 
 finally:
-	release_tclobj(&target);
-	release_tclobj(&def);
-	return code;
+	if (stack != stackstack) ckfree(stack);
+	return retval;
 }
 
 //}}}
-static int jsonSet(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonMatch(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	Tcl_Obj*	path = NULL;
-	Tcl_Obj*	src = NULL;		// ref is borrowed from either the variable or newval
-	int			retval = TCL_OK;
-	Tcl_Obj*	newval = NULL;
+	struct interp_cx*		l = (struct interp_cx*)cdata;
+	int						retval = TCL_OK;
+	int						i, matched = 0;
+	struct match_program*	program = NULL;
+	Tcl_Obj*				stackbound[16];
+	Tcl_Obj**				bound = NULL;
+	int						bindc = 0;
+	Tcl_Obj*				dict = NULL;		// Borrowed, the variable or newdict holds the reference
+	Tcl_Obj*				newdict = NULL;
+
+	enum {A_cmd, A_TEMPLATE, A_DOC, A_args, A_objc};
+	const int A_DICTVAR = A_args;
+	CHECK_RANGE_ARGS_LABEL(finally, retval, "json_template json_val ?dictvar?");
+
+	TEST_OK_LABEL(finally, retval, get_match_program(interp, l, objv[A_TEMPLATE], &program));
+	TEST_OK_LABEL(finally, retval, JSON_ForceJSON(interp, objv[A_DOC]));
+
+	bindc = program->bindc;
+	bound = bindc <= 16 ? stackbound : ckalloc(sizeof(Tcl_Obj*) * bindc);
+	if (bindc) memset(bound, 0, sizeof(Tcl_Obj*) * bindc);
+
+	TEST_OK_LABEL(finally, retval, run_match(interp, program, objv[A_DOC], bound, &matched));
+
+	if (matched) {
+		// Bind the values only once the whole document has matched
+		if (A_DICTVAR < objc) {
+			// Merge into the dict already in the variable, as dict set does.
+			// An unshared dict is updated in place, borrowing the variable's
+			// reference, otherwise newdict holds the one we update
+			dict = Tcl_ObjGetVar2(interp, objv[A_DICTVAR], NULL, 0);
+
+			if (dict == NULL) {
+				replace_tclobj(&newdict, Tcl_NewDictObj());
+			} else {
+				int	size;
 
-	enum {A_cmd, A_VARNAME, A_args};
-	const int A_PATH = A_args;
-	const int A_VAL  = objc-1;
-	CHECK_MIN_ARGS_LABEL(finally, retval, "varname ?path ...? json_val");
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjSize(interp, dict, &size));
+				if (Tcl_IsShared(dict))
+					replace_tclobj(&newdict, Tcl_DuplicateObj(dict));
+			}
+			if (newdict) dict = newdict;
+		}
 
-	src = Tcl_ObjGetVar2(interp, objv[A_VARNAME], NULL, 0);
-	if (src == NULL) {
-		replace_tclobj(&newval, JSON_NewJvalObj(JSON_OBJECT, Tcl_NewDictObj()));
-		src = newval;
-	} else if (Tcl_IsShared(src)) {
-		replace_tclobj(&newval, Tcl_DuplicateObj(src));
-		src = newval;
-	}
+		for (i=0; i<program->instrc; i++) {
+			const struct match_instr*	instr = &program->instr[i];
 
-	replace_tclobj(&path, Tcl_NewListObj(A_VAL-A_PATH, objv+A_PATH));
-	TEST_OK_LABEL(finally, retval, JSON_Set(interp, src, path, objv[A_VAL]));
+			if (instr->opcode != MATCH_BIND) continue;
 
-	src = Tcl_ObjSetVar2(interp, objv[A_VARNAME], NULL, src, TCL_LEAVE_ERR_MSG);
-	if (src == NULL) {
-		retval = TCL_ERROR;
-		goto finally;
+			if (dict) {
+				if (bound[instr->idx]) {
+					TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, dict, instr->a, bound[instr->idx]));
+				} else {
+					TEST_OK_LABEL(finally, retval, Tcl_DictObjRemove(interp, dict, instr->a));
+				}
+			} else if (bound[instr->idx]) {
+				if (NULL == Tcl_ObjSetVar2(interp, instr->a, NULL, bound[instr->idx], TCL_LEAVE_ERR_MSG)) {
+					retval = TCL_ERROR;
+					goto finally;
+				}
+			} else {
+				// The document has null here: unset the variable, as [json template] substitutes null for unset variables
+				Tcl_UnsetVar2(interp, Tcl_GetString(instr->a), NULL, 0);
+			}
+		}
+
+		if (dict && NULL == Tcl_ObjSetVar2(interp, objv[A_DICTVAR], NULL, dict, TCL_LEAVE_ERR_MSG)) {
+			retval = TCL_ERROR;
+			goto finally;
+		}
 	}
-	Tcl_SetObjResult(interp, src);
+
+	Tcl_SetObjResult(interp, matched ? l->tcl_true : l->tcl_false);
 
 finally:
-	release_tclobj(&path);
-	release_tclobj(&newval);
+	if (bound) {
+		for (i=0; i<bindc; i++) release_tclobj(&bound[i]);
+		if (bound != stackbound) ckfree(bound);
+	}
+	release_tclobj(&newdict);
+	release_match_program(&program);
 	return retval;
 }
 
 //}}}
-static int jsonUnset(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int _foreach(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[], enum collecting_mode mode) //{{{
 {
-	Tcl_Obj*	path = NULL;
-	Tcl_Obj*	src = NULL;		// ref is borrowed from either the variable or newval
-	Tcl_Obj*	newval = NULL;
-	int			retval = TCL_OK;
+	if (objc < 4 || (objc-4) % 2 != 0) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?varlist datalist ...? script");
+		return TCL_ERROR;
+	}
 
-	enum {A_cmd, A_VARNAME, A_args};
-	const int A_PATH = A_args;
-	CHECK_MIN_ARGS_LABEL(finally, retval, "varname ?path ...?");
+	return foreach(interp, objc-1, objv+1, mode);
+}
 
-	src = Tcl_ObjGetVar2(interp, objv[A_VARNAME], NULL, TCL_LEAVE_ERR_MSG);
-	if (src == NULL) {
-		retval = TCL_ERROR;
-		goto finally;
-	}
+//}}}
+static int jsonNRForeach(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	return _foreach(cdata, interp, objc, objv, COLLECT_NONE);
+}
 
-	if (Tcl_IsShared(src)) {
-		replace_tclobj(&newval, Tcl_DuplicateObj(src));
-		src = newval;
-	}
+//}}}
+_Pragma("GCC diagnostic push");
+_Pragma("GCC diagnostic ignored \"-Wunused-function\"");
+static int jsonForeach(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	return Tcl_NRCallObjProc(interp, jsonNRForeach, cdata, objc, objv);
+}
 
-	replace_tclobj(&path, Tcl_NewListObj(objc-A_PATH, objv+A_PATH));
-	TEST_OK_LABEL(finally, retval, JSON_Unset(interp, src, path));
+//}}}
+_Pragma("GCC diagnostic pop");
+static int jsonNRLmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	return _foreach(cdata, interp, objc, objv, COLLECT_LIST);
+}
 
-	// Have to unconditionally set the variable to even if the value was
-	// unshared or variable write traces won't fire on this change
-	src = Tcl_ObjSetVar2(interp, objv[A_VARNAME], NULL, src, TCL_LEAVE_ERR_MSG);
-	if (src == NULL) {
-		retval = TCL_ERROR;
-		goto finally;
-	}
-	Tcl_SetObjResult(interp, src);
+//}}}
+_Pragma("GCC diagnostic push");
+_Pragma("GCC diagnostic ignored \"-Wunused-function\"");
+static int jsonLmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	return Tcl_NRCallObjProc(interp, jsonNRLmap, cdata, objc, objv);
+}
 
-finally:
-	release_tclobj(&path);
-	release_tclobj(&newval);
-	return retval;
+//}}}
+_Pragma("GCC diagnostic pop");
+static int jsonNRAmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	return _foreach(cdata, interp, objc, objv, COLLECT_ARRAY);
+}
+
+//}}}
+_Pragma("GCC diagnostic push");
+_Pragma("GCC diagnostic ignored \"-Wunused-function\"");
+static int jsonAmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	return Tcl_NRCallObjProc(interp, jsonNRAmap, cdata, objc, objv);
+}
+
+//}}}
+_Pragma("GCC diagnostic pop");
+static int jsonNROmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	return _foreach(cdata, interp, objc, objv, COLLECT_OBJECT);
+}
+
+//}}}
+_Pragma("GCC diagnostic push");
+_Pragma("GCC diagnostic ignored \"-Wunused-function\"");
+static int jsonOmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	return Tcl_NRCallObjProc(interp, jsonNROmap, cdata, objc, objv);
 }
 
 //}}}
-static int jsonNew(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+_Pragma("GCC diagnostic pop");
+static int jsonFreeCache(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	int			retval = TCL_OK;
-	Tcl_Obj*	res = NULL;
+#if DEDUP
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+#endif
+	int					retval = TCL_OK;
 
-	enum {A_cmd, A_TYPE, A_args};
-	CHECK_MIN_ARGS_LABEL(finally, retval, "type ?val?");
+	enum {A_cmd, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "");
 
-	TEST_OK(new_json_value_from_list(interp, objc-A_TYPE, objv+A_TYPE, &res));
-	Tcl_SetObjResult(interp, res);
+	free_cache(l);
 
 finally:
-	release_tclobj(&res);
 	return retval;
 }
 
 //}}}
-static int jsonString(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonTemplateCache(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-#if DEDUP
 	struct interp_cx*	l = (struct interp_cx*)cdata;
-#endif
-	int					len;
-	const char*			s;
-	enum json_types		type;
-	int					retval = TCL_OK;
+	int					op, retval = TCL_OK;
+	Tcl_Obj*			stats = NULL;
+	static const char* ops[] = {
+		"clear",
+		"stats",
+		(char*)NULL
+	};
+	enum {
+		OP_CLEAR,
+		OP_STATS
+	};
 
-	enum {A_cmd, A_VAL, A_objc};
-	CHECK_ARGS_LABEL(finally, retval, "value");
+	enum {A_cmd, A_OP, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "clear|stats");
 
-	s = Tcl_GetStringFromObj(objv[A_VAL], &len);
-	TEMPLATE_TYPE(s, len, type);	// s is advanced past prefix
+	TEST_OK_LABEL(finally, retval, Tcl_GetIndexFromObj(interp, objv[A_OP], ops, "operation", TCL_EXACT, &op));
 
-	if (type == JSON_STRING) {
-		Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_STRING, get_string(l, s, len)));
-	} else {
-		Tcl_SetObjResult(interp, JSON_NewJvalObj(type, get_string(l, s, len-3)));
+	switch (op) {
+		case OP_CLEAR:
+			template_cache_clear(l);
+			l->template_cache_hits = 0;
+			l->template_cache_misses = 0;
+			l->template_cache_evictions = 0;
+			break;
+
+		case OP_STATS:
+			replace_tclobj(&stats, Tcl_NewDictObj());
+			TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("size", -1),      Tcl_NewIntObj(l->template_cache_count)));
+			TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("capacity", -1),  Tcl_NewIntObj(TEMPLATE_CACHE_SIZE)));
+			TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("hits", -1),      Tcl_NewWideIntObj(l->template_cache_hits)));
+			TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("misses", -1),    Tcl_NewWideIntObj(l->template_cache_misses)));
+			TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, stats, Tcl_NewStringObj("evictions", -1), Tcl_NewWideIntObj(l->template_cache_evictions)));
+			Tcl_SetObjResult(interp, stats);
+			break;
+
+		default:
+			THROW_ERROR_LABEL(finally, retval, "Unhandled operation");
 	}
 
 finally:
+	release_tclobj(&stats);
 	return retval;
 }
 
 //}}}
-static int jsonNumber(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonNop(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	Tcl_Obj*			forced = NULL;
-	struct interp_cx*	l = (struct interp_cx*)cdata;
-	int					retval = TCL_OK;
-
-	enum {A_cmd, A_VAL, A_objc};
-	CHECK_ARGS_LABEL(finally, retval, "value");
-
-	TEST_OK_LABEL(finally, retval, force_json_number(interp, l, objv[A_VAL], &forced));
-	Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_NUMBER, forced));
-
-finally:
-	release_tclobj(&forced);
-	return retval;
+	return TCL_OK;
 }
 
 //}}}
-static int jsonBoolean(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonPretty(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	int			retval = TCL_OK;
+	int			code = TCL_OK;
+	Tcl_Obj*	pretty = NULL;
+	Tcl_Obj*	indent = NULL;
+	Tcl_Obj*	target = NULL;
+	int			argbase = 1;
+	static const char* opts[] = {
+		"-indent",
+		"--",			// Unnecessary for this case, but supported for convention
+		NULL
+	};
+	enum {
+		OPT_INDENT,
+		OPT_END_OPTIONS
+	};
 
-	enum {A_cmd, A_VAL, A_objc};
-	CHECK_ARGS_LABEL(finally, retval, "value");
+	enum {A_cmd, A_VAL, A_args};
+	CHECK_MIN_ARGS_LABEL(finally, code, "pretty ?-indent indent? json_val ?key ...?");
 
-	int	b;
-	TEST_OK_LABEL(finally, retval, Tcl_GetBooleanFromObj(interp, objv[A_VAL], &b));
-	Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_BOOL, Tcl_NewBooleanObj(b)));
+	// Consume any leading options {{{
+	while (argbase < objc) {
+		int	optidx;
 
-finally:
-	return retval;
-}
+		enum json_types	type = JSON_GetJSONType(objv[argbase]);
+		if (type != JSON_UNDEF) break;		// Arg is already a JSON value, stop consuming options
+		const char*	str = Tcl_GetString(objv[argbase]);		// If it's not a native json value we will need this string rep to parse for the next step, so potientially regenerating the stringrep here isn't a concern
+		if (str[0] != '-') break;			// Not an option
+		TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[argbase], opts, "option", TCL_EXACT, &optidx));
 
-//}}}
-static int jsonObject(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	int			retval = TCL_OK;
-	int			oc;
-	Tcl_Obj**	ov;
-	Tcl_Obj*	res = NULL;
+		switch (optidx) {
+			case OPT_INDENT:
+				if (objc - argbase < 2) {
+					Tcl_SetErrorCode(interp, "TCL", "ARGUMENT", "MISSING", NULL);
+					THROW_ERROR_LABEL(finally, code, "missing argument to \"", Tcl_GetString(objv[argbase]), "\"");
+				}
+				replace_tclobj(&indent, objv[argbase+1]);
+				argbase += 2;
+				break;
 
-	if (objc == 2) {
-		TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, objv[1], &oc, &ov));
-		TEST_OK_LABEL(finally, retval, _new_object(interp, oc, ov, &res));
+			case OPT_END_OPTIONS:
+				argbase++;
+				goto endoptions;
+
+			default:
+				THROW_ERROR_LABEL(finally, code, "Unhandled get option idx");
+		}
+	}
+endoptions:
+
+	if (objc == argbase) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?key ...?");
+		code = TCL_ERROR;
+		goto finally;
+	}
+	//}}}
+
+	if (objc > argbase+1) {
+		TEST_OK_LABEL(finally, code, resolve_path(interp, objv[argbase], objv+argbase+1, objc-(argbase+1), &target, 0, 0, NULL));
 	} else {
-		TEST_OK_LABEL(finally, retval, _new_object(interp, objc-1, objv+1, &res));
+		replace_tclobj(&target, objv[argbase]);
 	}
-	Tcl_SetObjResult(interp, res);
+
+	TEST_OK_LABEL(finally, code, JSON_Pretty(interp, target, indent, &pretty));
+
+	Tcl_SetObjResult(interp, pretty);
 
 finally:
-	release_tclobj(&res);
-	return retval;
+	replace_tclobj(&target, NULL);
+	replace_tclobj(&pretty, NULL);
+	replace_tclobj(&indent, NULL);
+
+	return code;
 }
 
 //}}}
-static int jsonArray(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonValid(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	int			i, ac, retval = TCL_OK;;
-	Tcl_Obj**	av;
-	Tcl_Obj*	elem = NULL;
-	Tcl_Obj*	val = NULL;
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+	int					i, valid, retval=TCL_OK;
+	struct parse_error	details = {};
+	Tcl_Obj*			detailsvar = NULL;		// ref is borrowed from variable
+	Tcl_Obj*			details_obj = NULL;
+	Tcl_Obj*			k = NULL;
+	Tcl_Obj*			v = NULL;
+	enum extensions	extensions = EXT_COMMENTS;		// By default, use the default set of extensions we accept
+	static const char *options[] = {
+		"-extensions",
+		"-details",
+		(char*)NULL
+	};
+	enum {
+		O_EXTENSIONS,
+		O_DETAILS
+	};
 
-	replace_tclobj(&val, Tcl_NewListObj(objc-1, NULL));
+	if (objc < 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-extensions extensionslist -details detailsvar? json_val");
+		retval = TCL_ERROR;
+		goto finally;
+	}
 
-	for (i=1; i<objc; i++) {
-		TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, objv[i], &ac, &av));
-		TEST_OK_LABEL(finally, retval, new_json_value_from_list(interp, ac, av, &elem));
-		TEST_OK_LABEL(finally, retval, Tcl_ListObjAppendElement(interp, val, elem));
+	for (i=1; i<objc-1; i++) {
+		int		option;
+		TEST_OK_LABEL(finally, retval, Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT, &option));
+		switch (option) {
+			case O_EXTENSIONS:
+				{
+					Tcl_Obj**		ov;
+					int				oc, idx;
+
+					extensions = 0;		// An explicit list was supplied, reset the extensions
+
+					if (i >= objc-2) {
+						// Missing value for -extensions
+						Tcl_WrongNumArgs(interp, i+1, objv, "extensionslist json_val");
+						retval = TCL_ERROR;
+						goto finally;
+					}
+
+					i++;	// Point at the next arg: the extensionslist
+
+					TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, objv[i], &oc, &ov));
+					for (idx=0; idx<oc; idx++) {
+						int	ext;
+						TEST_OK_LABEL(finally, retval, Tcl_GetIndexFromObj(interp, ov[idx], extension_str, "extension", TCL_EXACT, &ext));
+						extensions |= ext;
+					}
+				}
+				break;
+
+			case O_DETAILS:
+				{
+					if (i >= objc-2) {
+						// Missing value for -extensions
+						Tcl_WrongNumArgs(interp, i+1, objv, "detailsvar json_val");
+						retval = TCL_ERROR;
+						goto finally;
+					}
+
+					i++;	// Point at the next arg: the extensionslist
+					detailsvar = objv[i];
+				}
+				break;
+
+			default:
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unexpected option %d", option));
+				retval = TCL_ERROR;
+				goto finally;
+		}
+	}
+
+	TEST_OK_LABEL(finally, retval, JSON_Valid(interp, objv[objc-1], &valid, extensions, &details));
+	Tcl_SetObjResult(interp, valid ? l->tcl_true : l->tcl_false);
+
+	if (!valid && detailsvar) {
+		replace_tclobj(&details_obj, Tcl_NewDictObj());
+
+		replace_tclobj(&k, get_string(l, "errmsg", 6));
+		replace_tclobj(&v, Tcl_NewStringObj(details.errmsg, -1));
+		TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, details_obj, k, v));
+
+		replace_tclobj(&k, get_string(l, "doc", 3));
+		replace_tclobj(&v, Tcl_NewStringObj(details.doc, -1));
+		TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, details_obj, k, v));
+
+		replace_tclobj(&k, get_string(l, "char_ofs", 8));
+		replace_tclobj(&v, Tcl_NewIntObj(details.char_ofs));
+		TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, details_obj, k, v));
+
+		if (NULL == Tcl_ObjSetVar2(interp, detailsvar, NULL, details_obj, TCL_LEAVE_ERR_MSG)) {
+			retval = TCL_ERROR;
+			goto finally;
+		}
 	}
-	Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_ARRAY, val));
 
 finally:
-	release_tclobj(&elem);
-	release_tclobj(&val);
+	release_tclobj(&details_obj);
+	release_tclobj(&k);
+	release_tclobj(&v);
 	return retval;
 }
 
 //}}}
-static int jsonDecode(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonDebug(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	Tcl_Obj*	encoding = NULL;
-	Tcl_Obj*	res = NULL;
-	int			retval = TCL_OK;
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+	int					retval = TCL_OK;
+	Tcl_DString			ds;
+	Tcl_Obj*			indent = NULL;
+	Tcl_Obj*			pad = NULL;
 
-	enum {A_cmd, A_BYTES, A_args, A_objc};
-	const int A_ENCODING = A_args;
-	CHECK_RANGE_ARGS_LABEL(finally, retval, "bytes ?encoding?");
+	Tcl_DStringInit(&ds);
 
-	if (A_ENCODING < objc)
-		replace_tclobj(&encoding, objv[A_ENCODING]);
+	enum {A_cmd, A_VAL, A_args, A_objc};
+	const int A_INDENT = A_args;
+	CHECK_RANGE_ARGS_LABEL(finally, retval, "json_val ?indent?");
 
-	TEST_OK_LABEL(finally, retval, JSON_Decode(interp, objv[A_BYTES], encoding, &res));
-	Tcl_SetObjResult(interp, res);
+	replace_tclobj(&indent, A_INDENT < objc ?
+			objv[A_INDENT] :
+			get_string(l, "    ", 4)
+	);
+
+	replace_tclobj(&pad, l->tcl_empty);
+	TEST_OK_LABEL(finally, retval, json_pretty_dbg(interp, objv[A_VAL], indent, pad, &ds));
+	Tcl_DStringResult(interp, &ds);
 
 finally:
-	release_tclobj(&res);
-	release_tclobj(&encoding);
+	release_tclobj(&pad);
+	release_tclobj(&indent);
+	Tcl_DStringFree(&ds);
 	return retval;
 }
 
 //}}}
-static int jsonIsNull(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonTemplateActions(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	Tcl_Obj*		target = NULL;
-	Tcl_Obj*		val;
-	enum json_types	type;
-	int				retval = TCL_OK;
-
-	enum {A_cmd, A_VAL, A_args};
-	const int A_PATH = A_args;
-	CHECK_MIN_ARGS_LABEL(finally, retval, "json_val ?path ...?");
+	struct interp_cx*			l = (struct interp_cx*)cdata;
+	int							retval = TCL_OK;
+	struct template_program*	program = NULL;
 
-	if (A_PATH < objc) {
-		TEST_OK(resolve_path(interp, objv[A_VAL], objv+A_PATH, objc-A_PATH, &target, 0, 0, NULL));
-	} else {
-		replace_tclobj(&target, objv[A_VAL]);
-	}
+	enum {A_cmd, A_TEMPLATE, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_template");
 
-	TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, target, &type, &val));
-	Tcl_SetObjResult(interp, Tcl_NewBooleanObj(type == JSON_NULL));
+	TEST_OK_LABEL(finally, retval, get_template_program(interp, objv[A_TEMPLATE], &program));
+	Tcl_SetObjResult(interp, template_program_actions(l, program));
 
 finally:
-	release_tclobj(&target);
+	release_template_program(&program);
 	return retval;
 }
 
 //}}}
-static int jsonTemplateString(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonMerge(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	int							retval = TCL_OK;
-	Tcl_DString					ds;
-	struct serialize_context	scx = {
-		.ds				= &ds,
-		.serialize_mode	= SERIALIZE_TEMPLATE,
-		.l				= (struct interp_cx*)cdata,
-		.allow_null		= 1
-	};
+	Tcl_Obj*	src = NULL;		// ref is borrowed from either the variable or newval
+	Tcl_Obj*	newval = NULL;
+	int			retval = TCL_OK;
+	int			i;
 
-	Tcl_DStringInit(&ds);
+	enum {A_cmd, A_VARNAME, A_PATCH, A_args};
+	CHECK_MIN_ARGS_LABEL(finally, retval, "varname patch ?patch ...?");
 
-	enum {A_cmd, A_TEMPLATE, A_args, A_objc};
-	const int A_DICT = A_args;
-	CHECK_RANGE_ARGS_LABEL(finally, retval, "json_template ?source_dict?");
+	src = Tcl_ObjGetVar2(interp, objv[A_VARNAME], NULL, 0);
+	if (src == NULL) {
+		replace_tclobj(&newval, JSON_NewJvalObj(JSON_OBJECT, Tcl_NewDictObj()));
+		src = newval;
+	} else if (Tcl_IsShared(src)) {
+		replace_tclobj(&newval, Tcl_DuplicateObj(src));
+		src = newval;
+	}
 
-	if (A_DICT < objc)
-		replace_tclobj(&scx.fromdict, objv[A_DICT]);
+	// Parse every patch before merging any, so that a bad one leaves the variable as it was
+	for (i=A_PATCH; i<objc; i++) {
+		enum json_types	type;
+		Tcl_Obj*		val = NULL;
 
-	TEST_OK_LABEL(finally, retval, serialize(interp, &scx, objv[A_TEMPLATE]));
-	Tcl_DStringResult(interp, scx.ds);
+		TEST_OK_LABEL(finally, retval, JSON_GetJvalFromObj(interp, objv[i], &type, &val));
+	}
+
+	for (i=A_PATCH; i<objc; i++)
+		TEST_OK_LABEL(finally, retval, JSON_Merge(interp, src, objv[i]));
+
+	src = Tcl_ObjSetVar2(interp, objv[A_VARNAME], NULL, src, TCL_LEAVE_ERR_MSG);
+	if (src == NULL) {
+		retval = TCL_ERROR;
+		goto finally;
+	}
+	Tcl_SetObjResult(interp, src);
 
 finally:
-	scx.ds = NULL;
-	Tcl_DStringFree(&ds);
-	release_tclobj(&scx.fromdict);
-	return retval == TCL_OK ? TCL_OK : TCL_ERROR;
+	release_tclobj(&newval);
+	return retval;
 }
 
 //}}}
-static int jsonTemplate(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonPatch(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
 	int			retval = TCL_OK;
 	Tcl_Obj*	res = NULL;
 
-	enum {A_cmd, A_TEMPLATE, A_args, A_objc};
-	const int A_DICT = A_args;
-	CHECK_RANGE_ARGS_LABEL(finally, retval, "json_template ?source_dict?");
+	enum {A_cmd, A_VAL, A_PATCH, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val patch");
 
-	TEST_OK_LABEL(finally, retval, JSON_Template(interp, objv[A_TEMPLATE], A_DICT < objc ? objv[A_DICT] : NULL, &res));
+	TEST_OK_LABEL(finally, retval, JSON_Patch(interp, objv[A_VAL], objv[A_PATCH], &res));
 	Tcl_SetObjResult(interp, res);
 
 finally:
@@ -3080,402 +4922,510 @@ finally:
 }
 
 //}}}
-static int _foreach(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[], enum collecting_mode mode) //{{{
+static int jsonDiff(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	if (objc < 4 || (objc-4) % 2 != 0) {
-		Tcl_WrongNumArgs(interp, 1, objv, "?varlist datalist ...? script");
-		return TCL_ERROR;
-	}
+	int			retval = TCL_OK;
+	Tcl_Obj*	patch = NULL;
 
-	return foreach(interp, objc-1, objv+1, mode);
-}
+	enum {A_cmd, A_FROM, A_TO, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val json_val");
 
-//}}}
-static int jsonNRForeach(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	return _foreach(cdata, interp, objc, objv, COLLECT_NONE);
-}
+	TEST_OK_LABEL(finally, retval, JSON_Diff(interp, objv[A_FROM], objv[A_TO], &patch));
+	Tcl_SetObjResult(interp, patch);
 
-//}}}
-_Pragma("GCC diagnostic push");
-_Pragma("GCC diagnostic ignored \"-Wunused-function\"");
-static int jsonForeach(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	return Tcl_NRCallObjProc(interp, jsonNRForeach, cdata, objc, objv);
+finally:
+	release_tclobj(&patch);
+	return retval;
 }
 
 //}}}
-_Pragma("GCC diagnostic pop");
-static int jsonNRLmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonEqual(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	return _foreach(cdata, interp, objc, objv, COLLECT_LIST);
-}
+	struct interp_cx*	l = (struct interp_cx*)cdata;
+	int					retval = TCL_OK;
+	int					equal;
 
-//}}}
-_Pragma("GCC diagnostic push");
-_Pragma("GCC diagnostic ignored \"-Wunused-function\"");
-static int jsonLmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	return Tcl_NRCallObjProc(interp, jsonNRLmap, cdata, objc, objv);
-}
+	enum {A_cmd, A_A, A_B, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val json_val");
 
-//}}}
-_Pragma("GCC diagnostic pop");
-static int jsonNRAmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	return _foreach(cdata, interp, objc, objv, COLLECT_ARRAY);
-}
+	TEST_OK_LABEL(finally, retval, JSON_Equal(interp, objv[A_A], objv[A_B], &equal));
+	Tcl_SetObjResult(interp, equal ? l->tcl_true : l->tcl_false);
 
-//}}}
-_Pragma("GCC diagnostic push");
-_Pragma("GCC diagnostic ignored \"-Wunused-function\"");
-static int jsonAmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	return Tcl_NRCallObjProc(interp, jsonNRAmap, cdata, objc, objv);
+finally:
+	return retval;
 }
 
 //}}}
-_Pragma("GCC diagnostic pop");
-static int jsonNROmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonHash(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	return _foreach(cdata, interp, objc, objv, COLLECT_OBJECT);
-}
+	int				retval = TCL_OK;
+	Tcl_WideInt		hash;
 
-//}}}
-_Pragma("GCC diagnostic push");
-_Pragma("GCC diagnostic ignored \"-Wunused-function\"");
-static int jsonOmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	return Tcl_NRCallObjProc(interp, jsonNROmap, cdata, objc, objv);
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val");
+
+	TEST_OK_LABEL(finally, retval, JSON_Hash(interp, objv[A_VAL], &hash));
+	Tcl_SetObjResult(interp, Tcl_NewWideIntObj(hash));
+
+finally:
+	return retval;
 }
 
 //}}}
-_Pragma("GCC diagnostic pop");
-static int jsonFreeCache(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonCanonical(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-#if DEDUP
-	struct interp_cx*	l = (struct interp_cx*)cdata;
-#endif
-	int					retval = TCL_OK;
+	int				retval = TCL_OK;
+	Tcl_Obj*		canonical = NULL;
 
-	enum {A_cmd, A_objc};
-	CHECK_ARGS_LABEL(finally, retval, "");
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val");
 
-	free_cache(l);
+	TEST_OK_LABEL(finally, retval, JSON_Canonical(interp, objv[A_VAL], &canonical));
+	Tcl_SetObjResult(interp, canonical);
 
 finally:
+	release_tclobj(&canonical);
 	return retval;
 }
 
 //}}}
-static int jsonNop(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
-{
-	return TCL_OK;
-}
-
-//}}}
-static int jsonPretty(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonToCbor(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	int			code = TCL_OK;
-	Tcl_Obj*	pretty = NULL;
-	Tcl_Obj*	indent = NULL;
-	Tcl_Obj*	target = NULL;
-	int			argbase = 1;
-	static const char* opts[] = {
-		"-indent",
-		"--",			// Unnecessary for this case, but supported for convention
-		NULL
-	};
-	enum {
-		OPT_INDENT,
-		OPT_END_OPTIONS
-	};
-
-	enum {A_cmd, A_VAL, A_args};
-	CHECK_MIN_ARGS_LABEL(finally, code, "pretty ?-indent indent? json_val ?key ...?");
-
-	// Consume any leading options {{{
-	while (argbase < objc) {
-		int	optidx;
-
-		enum json_types	type = JSON_GetJSONType(objv[argbase]);
-		if (type != JSON_UNDEF) break;		// Arg is already a JSON value, stop consuming options
-		const char*	str = Tcl_GetString(objv[argbase]);		// If it's not a native json value we will need this string rep to parse for the next step, so potientially regenerating the stringrep here isn't a concern
-		if (str[0] != '-') break;			// Not an option
-		TEST_OK_LABEL(finally, code, Tcl_GetIndexFromObj(interp, objv[argbase], opts, "option", TCL_EXACT, &optidx));
-
-		switch (optidx) {
-			case OPT_INDENT:
-				if (objc - argbase < 2) {
-					Tcl_SetErrorCode(interp, "TCL", "ARGUMENT", "MISSING", NULL);
-					THROW_ERROR_LABEL(finally, code, "missing argument to \"", Tcl_GetString(objv[argbase]), "\"");
-				}
-				replace_tclobj(&indent, objv[argbase+1]);
-				argbase += 2;
-				break;
-
-			case OPT_END_OPTIONS:
-				argbase++;
-				goto endoptions;
-
-			default:
-				THROW_ERROR_LABEL(finally, code, "Unhandled get option idx");
-		}
-	}
-endoptions:
+	int				retval = TCL_OK;
+	Tcl_Obj*		cbor = NULL;
+	int				canonical = 0;
 
-	if (objc == argbase) {
-		Tcl_WrongNumArgs(interp, 1, objv, "?-default defaultValue? json_val ?key ...?");
-		code = TCL_ERROR;
+	if (objc == 3 && strcmp(Tcl_GetString(objv[1]), "-canonical") == 0) {
+		canonical = 1;
+	} else if (objc != 2) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-canonical? json_val");
+		retval = TCL_ERROR;
 		goto finally;
 	}
-	//}}}
 
-	if (objc > argbase+1) {
-		TEST_OK_LABEL(finally, code, resolve_path(interp, objv[argbase], objv+argbase+1, objc-(argbase+1), &target, 0, 0, NULL));
-	} else {
-		replace_tclobj(&target, objv[argbase]);
-	}
+	TEST_OK_LABEL(finally, retval, cbor_from_json(interp, objv[objc-1], canonical, &cbor));
+	Tcl_SetObjResult(interp, cbor);
 
-	TEST_OK_LABEL(finally, code, JSON_Pretty(interp, target, indent, &pretty));
+finally:
+	release_tclobj(&cbor);
+	return retval;
+}
+
+//}}}
+static int jsonToMsgpack(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int				retval = TCL_OK;
+	Tcl_Obj*		msgpack = NULL;
+
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val");
 
-	Tcl_SetObjResult(interp, pretty);
+	TEST_OK_LABEL(finally, retval, msgpack_from_json(interp, objv[A_VAL], &msgpack));
+	Tcl_SetObjResult(interp, msgpack);
 
 finally:
-	replace_tclobj(&target, NULL);
-	replace_tclobj(&pretty, NULL);
-	replace_tclobj(&indent, NULL);
+	release_tclobj(&msgpack);
+	return retval;
+}
 
-	return code;
+//}}}
+static int jsonPack(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int				retval = TCL_OK;
+	Tcl_Obj*		packed = NULL;
+
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val");
+
+	TEST_OK_LABEL(finally, retval, pack_from_json(interp, objv[A_VAL], &packed));
+	Tcl_SetObjResult(interp, packed);
+
+finally:
+	release_tclobj(&packed);
+	return retval;
 }
 
 //}}}
-static int jsonValid(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonUnpack(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	struct interp_cx*	l = (struct interp_cx*)cdata;
-	int					i, valid, retval=TCL_OK;
-	struct parse_error	details = {};
-	Tcl_Obj*			detailsvar = NULL;		// ref is borrowed from variable
-	Tcl_Obj*			details_obj = NULL;
-	Tcl_Obj*			k = NULL;
-	Tcl_Obj*			v = NULL;
-	enum extensions	extensions = EXT_COMMENTS;		// By default, use the default set of extensions we accept
-	static const char *options[] = {
-		"-extensions",
-		"-details",
-		(char*)NULL
-	};
-	enum {
-		O_EXTENSIONS,
-		O_DETAILS
-	};
+	int				retval = TCL_OK;
+	Tcl_Obj*		json = NULL;
 
-	if (objc < 2) {
-		Tcl_WrongNumArgs(interp, 1, objv, "?-extensions extensionslist -details detailsvar? json_val");
-		retval = TCL_ERROR;
-		goto finally;
-	}
+	enum {A_cmd, A_BYTES, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "bytes");
 
-	for (i=1; i<objc-1; i++) {
-		int		option;
-		TEST_OK_LABEL(finally, retval, Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT, &option));
-		switch (option) {
-			case O_EXTENSIONS:
-				{
-					Tcl_Obj**		ov;
-					int				oc, idx;
+	TEST_OK_LABEL(finally, retval, pack_to_json(interp, objv[A_BYTES], &json));
+	Tcl_SetObjResult(interp, json);
 
-					extensions = 0;		// An explicit list was supplied, reset the extensions
+finally:
+	release_tclobj(&json);
+	return retval;
+}
 
-					if (i >= objc-2) {
-						// Missing value for -extensions
-						Tcl_WrongNumArgs(interp, i+1, objv, "extensionslist json_val");
-						retval = TCL_ERROR;
-						goto finally;
-					}
+//}}}
+static int jsonMmap(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int				retval = TCL_OK;
+	Tcl_Obj*		json = NULL;
 
-					i++;	// Point at the next arg: the extensionslist
+	enum {A_cmd, A_PATH, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "filename");
 
-					TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, objv[i], &oc, &ov));
-					for (idx=0; idx<oc; idx++) {
-						int	ext;
-						TEST_OK_LABEL(finally, retval, Tcl_GetIndexFromObj(interp, ov[idx], extension_str, "extension", TCL_EXACT, &ext));
-						extensions |= ext;
-					}
-				}
-				break;
+	TEST_OK_LABEL(finally, retval, pack_mmap(interp, objv[A_PATH], &json));
+	Tcl_SetObjResult(interp, json);
 
-			case O_DETAILS:
-				{
-					if (i >= objc-2) {
-						// Missing value for -extensions
-						Tcl_WrongNumArgs(interp, i+1, objv, "detailsvar json_val");
-						retval = TCL_ERROR;
-						goto finally;
-					}
+finally:
+	release_tclobj(&json);
+	return retval;
+}
 
-					i++;	// Point at the next arg: the extensionslist
-					detailsvar = objv[i];
-				}
-				break;
+//}}}
+static int jsonFreeze(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+{
+	int				retval = TCL_OK;
+	Tcl_Obj*		frozen = NULL;
 
-			default:
-				Tcl_SetObjResult(interp, Tcl_ObjPrintf("Unexpected option %d", option));
-				retval = TCL_ERROR;
-				goto finally;
-		}
-	}
+	enum {A_cmd, A_VAL, A_objc};
+	CHECK_ARGS_LABEL(finally, retval, "json_val");
 
-	TEST_OK_LABEL(finally, retval, JSON_Valid(interp, objv[objc-1], &valid, extensions, &details));
-	Tcl_SetObjResult(interp, valid ? l->tcl_true : l->tcl_false);
+	TEST_OK_LABEL(finally, retval, pack_freeze(interp, objv[A_VAL], &frozen));
+	Tcl_SetObjResult(interp, frozen);
 
-	if (!valid && detailsvar) {
-		replace_tclobj(&details_obj, Tcl_NewDictObj());
+finally:
+	release_tclobj(&frozen);
+	return retval;
+}
 
-		replace_tclobj(&k, get_string(l, "errmsg", 6));
-		replace_tclobj(&v, Tcl_NewStringObj(details.errmsg, -1));
-		TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, details_obj, k, v));
+//}}}
+enum column_type {
+	COL_STRING,
+	COL_NUMBER,
+	COL_BOOLEAN,
+	COL_JSON
+};
+static const char* column_type_str[] = {
+	"string",
+	"number",
+	"boolean",
+	"json",
+	(char*)NULL
+};
 
-		replace_tclobj(&k, get_string(l, "doc", 3));
-		replace_tclobj(&v, Tcl_NewStringObj(details.doc, -1));
-		TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, details_obj, k, v));
+struct row_column {
+	Tcl_Obj*			name;			// Shared as the key in every row
+	enum column_type	type;
+	int					nullable;		// Empty values become null
+};
 
-		replace_tclobj(&k, get_string(l, "char_ofs", 8));
-		replace_tclobj(&v, Tcl_NewIntObj(details.char_ofs));
-		TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, details_obj, k, v));
+static int get_column_types(Tcl_Interp* interp, Tcl_Obj* typelist, int colc, struct row_column* cols) //{{{
+{
+	// Types are one of column_type_str, optionally suffixed with "?" to
+	// have empty values become null
+	Tcl_Obj**	tv;
+	Tcl_Obj*	base = NULL;
+	int			tc, c, len, type, retval = TCL_OK;
+	const char*	s;
+
+	TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, typelist, &tc, &tv));
+	if (tc != colc) {
+		Tcl_SetObjResult(interp, Tcl_ObjPrintf("Expecting %d column types, got %d", colc, tc));
+		Tcl_SetErrorCode(interp, "RL", "JSON", "FROM_ROWS", "TYPES", NULL);
+		retval = TCL_ERROR;
+		goto finally;
+	}
 
-		if (NULL == Tcl_ObjSetVar2(interp, detailsvar, NULL, details_obj, TCL_LEAVE_ERR_MSG)) {
-			retval = TCL_ERROR;
-			goto finally;
+	for (c=0; c<colc; c++) {
+		s = Tcl_GetStringFromObj(tv[c], &len);
+		cols[c].nullable = len > 0 && s[len-1] == '?';
+		if (cols[c].nullable) {
+			replace_tclobj(&base, Tcl_NewStringObj(s, len-1));
+		} else {
+			replace_tclobj(&base, tv[c]);
 		}
+		TEST_OK_LABEL(finally, retval, Tcl_GetIndexFromObj(interp, base, column_type_str, "column type", TCL_EXACT, &type));
+		cols[c].type = type;
 	}
 
 finally:
-	release_tclobj(&details_obj);
-	release_tclobj(&k);
-	release_tclobj(&v);
+	release_tclobj(&base);
 	return retval;
 }
 
 //}}}
-static int jsonDebug(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int from_rows_value(Tcl_Interp* interp, struct interp_cx* l, const struct row_column* col, Tcl_Obj* v, Tcl_Obj** res) //{{{
 {
-	struct interp_cx*	l = (struct interp_cx*)cdata;
-	int					retval = TCL_OK;
-	Tcl_DString			ds;
-	Tcl_Obj*			indent = NULL;
-	Tcl_Obj*			pad = NULL;
+	Tcl_Obj*	forced = NULL;
+	int			b, retval = TCL_OK;
 
-	Tcl_DStringInit(&ds);
+	if (col->nullable && Tcl_GetCharLength(v) == 0) {
+		replace_tclobj(res, l->json_null);
+		goto finally;
+	}
 
-	enum {A_cmd, A_VAL, A_args, A_objc};
-	const int A_INDENT = A_args;
-	CHECK_RANGE_ARGS_LABEL(finally, retval, "json_val ?indent?");
+	switch (col->type) {
+		case COL_STRING:
+			replace_tclobj(res, JSON_NewJvalObj(JSON_STRING, v));
+			break;
 
-	replace_tclobj(&indent, A_INDENT < objc ?
-			objv[A_INDENT] :
-			get_string(l, "    ", 4)
-	);
+		case COL_NUMBER:
+			TEST_OK_LABEL(finally, retval, force_json_number(interp, l, v, &forced));
+			replace_tclobj(res, JSON_NewJvalObj(JSON_NUMBER, forced));
+			break;
 
-	replace_tclobj(&pad, l->tcl_empty);
-	TEST_OK_LABEL(finally, retval, json_pretty_dbg(interp, objv[A_VAL], indent, pad, &ds));
-	Tcl_DStringResult(interp, &ds);
+		case COL_BOOLEAN:
+			TEST_OK_LABEL(finally, retval, Tcl_GetBooleanFromObj(interp, v, &b));
+			replace_tclobj(res, b ? l->json_true : l->json_false);
+			break;
+
+		case COL_JSON:
+			TEST_OK_LABEL(finally, retval, JSON_ForceJSON(interp, v));
+			replace_tclobj(res, v);
+			break;
+
+		default:
+			THROW_ERROR_LABEL(finally, retval, "Unhandled column type");
+	}
 
 finally:
-	release_tclobj(&pad);
-	release_tclobj(&indent);
-	Tcl_DStringFree(&ds);
+	release_tclobj(&forced);
 	return retval;
 }
 
 //}}}
-static int jsonTemplateActions(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int from_rows_text(Tcl_Interp* interp, struct serialize_context* scx, const struct row_column* col, Tcl_Obj* v) //{{{
 {
-	int					retval = TCL_OK;
-	Tcl_Obj*			actions = NULL;
-	Tcl_ObjInternalRep*	ir;
-	enum json_types		type;
+	// Append the serialized form of v directly, without building the JSON value
+	Tcl_Obj*	forced = NULL;
+	int			b, retval = TCL_OK;
 
-	enum {A_cmd, A_TEMPLATE, A_objc};
-	CHECK_ARGS_LABEL(finally, retval, "json_template");
+	if (col->nullable && Tcl_GetCharLength(v) == 0) {
+		Tcl_DStringAppend(scx->ds, "null", 4);
+		goto finally;
+	}
+
+	switch (col->type) {
+		case COL_STRING:
+			append_json_string(scx, v);
+			break;
 
-	TEST_OK_LABEL(finally, retval, JSON_GetIntrepFromObj(interp, objv[A_TEMPLATE], &type, &ir));
+		case COL_NUMBER:
+			TEST_OK_LABEL(finally, retval, force_json_number(interp, scx->l, v, &forced));
+			TEST_OK_LABEL(finally, retval, append_json_number(interp, scx->ds, forced));
+			break;
 
-	replace_tclobj(&actions, ir->twoPtrValue.ptr2);
-	if (actions == NULL) {
-		TEST_OK_LABEL(finally, retval, build_template_actions(interp, objv[A_TEMPLATE], &actions));
-		replace_tclobj((Tcl_Obj**)&ir->twoPtrValue.ptr2, actions);
-	}
+		case COL_BOOLEAN:
+			TEST_OK_LABEL(finally, retval, Tcl_GetBooleanFromObj(interp, v, &b));
+			if (b) {
+				Tcl_DStringAppend(scx->ds, "true", 4);
+			} else {
+				Tcl_DStringAppend(scx->ds, "false", 5);
+			}
+			break;
+
+		case COL_JSON:
+			TEST_OK_LABEL(finally, retval, serialize(interp, scx, v));
+			break;
 
-	Tcl_SetObjResult(interp, actions);
+		default:
+			THROW_ERROR_LABEL(finally, retval, "Unhandled column type");
+	}
 
 finally:
-	release_tclobj(&actions);
+	release_tclobj(&forced);
 	return retval;
 }
 
 //}}}
-#if 0
-static int jsonMerge(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
+static int jsonFromRows(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *const objv[]) //{{{
 {
-	int		i=2, deep=0, checking_flags=1, str_len;
-	const char*	str;
-	Tcl_Obj*	res = NULL;
-	Tcl_Obj*	patch;
-	Tcl_Obj*	new;
-	static const char* flags[] = {
-		"--",
-		"-deep",
+	struct interp_cx*			l = (struct interp_cx*)cdata;
+	int							i, c, r, colc, rowc, valc, nested=0, text=0, retval=TCL_OK;
+	Tcl_Obj*					typelist = NULL;
+	Tcl_Obj**					colv = NULL;
+	Tcl_Obj**					rowv = NULL;
+	Tcl_Obj**					valv = NULL;
+	Tcl_Obj**					elems = NULL;
+	Tcl_Obj*					row = NULL;
+	Tcl_Obj*					val = NULL;
+	Tcl_Obj*					keys = NULL;		// Serialized "name": prefixes, for -text
+	struct row_column*			cols = NULL;
+	struct row_column			stackcols[16];
+	Tcl_DString					ds;
+	struct serialize_context	scx;
+	static const char *options[] = {
+		"-types",
+		"-nested",
+		"-text",
 		(char*)NULL
 	};
 	enum {
-		FLAG_ENDARGS,
-		FLAG_DEEP
+		O_TYPES,
+		O_NESTED,
+		O_TEXT
 	};
-	int	index;
 
-	THROW_ERROR("merge method is not functional yet, sorry");
+	Tcl_DStringInit(&ds);
 
-	if (objc < 1) CHECK_ARGS(0, "?flag ...? ?json_val ...?");
+	if (objc < 3) {
+		Tcl_WrongNumArgs(interp, 1, objv, "?-types typelist? ?-nested? ?-text? columns rows");
+		retval = TCL_ERROR;
+		goto finally;
+	}
 
-	while (i < objc) {
-		patch = objv[i++];
+	for (i=1; i<objc-2; i++) {
+		int		option;
+		TEST_OK_LABEL(finally, retval, Tcl_GetIndexFromObj(interp, objv[i], options, "option", TCL_EXACT, &option));
+		switch (option) {
+			case O_TYPES:
+				if (i >= objc-3) {
+					// Missing value for -types
+					Tcl_WrongNumArgs(interp, i+1, objv, "typelist columns rows");
+					retval = TCL_ERROR;
+					goto finally;
+				}
+				typelist = objv[++i];
+				break;
 
-		// Nasty optimization - prevent generating string rep of
-		// a pure JSON value to check if it is a flag (can never
-		// be: "-" isn't valid as the first char of a JSON value)
-		if (patch->typePtr == &json_type)
-			checking_flags = 0;
+			case O_NESTED:	nested = 1;	break;
+			case O_TEXT:	text = 1;	break;
 
-		if (checking_flags) {
-			str = Tcl_GetStringFromObj(patch, &str_len);
-			if (str_len > 0 && str[0] == '-') {
-				TEST_OK(Tcl_GetIndexFromObj(interp, patch, flags,
-							"flag", TCL_EXACT, &index));
-				switch (index) {
-					case FLAG_ENDARGS: checking_flags = 0; break;
-					case FLAG_DEEP:    deep = 1;           break;
-					default: THROW_ERROR("Invalid flag");
-				}
-				continue;
+			default:
+				THROW_ERROR_LABEL(finally, retval, "Unhandled option");
+		}
+	}
+
+	TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, objv[objc-2], &colc, &colv));
+	cols = colc <= 16 ? stackcols : ckalloc(sizeof(*cols) * colc);
+
+	for (c=0; c<colc; c++) {
+		cols[c].name = colv[c];
+		cols[c].type = COL_STRING;
+		cols[c].nullable = 0;
+	}
+	if (typelist)
+		TEST_OK_LABEL(finally, retval, get_column_types(interp, typelist, colc, cols));
+
+	// Duplicate column names would silently drop values
+	for (c=1; c<colc; c++) {
+		const char*	name = Tcl_GetString(colv[c]);
+		for (i=0; i<c; i++) {
+			if (strcmp(name, Tcl_GetString(colv[i])) == 0) {
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("Duplicate column name \"%s\"", name));
+				Tcl_SetErrorCode(interp, "RL", "JSON", "FROM_ROWS", "COLUMNS", NULL);
+				retval = TCL_ERROR;
+				goto finally;
+			}
+		}
+	}
+
+	TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, objv[objc-1], &rowc, &rowv));
+	if (!nested) {
+		// Flat list of values, colc per row
+		if (colc == 0 ? rowc != 0 : rowc % colc != 0) {
+			Tcl_SetObjResult(interp, Tcl_ObjPrintf("Number of values (%d) is not a multiple of the number of columns (%d)", rowc, colc));
+			Tcl_SetErrorCode(interp, "RL", "JSON", "FROM_ROWS", "ROWS", NULL);
+			retval = TCL_ERROR;
+			goto finally;
+		}
+		if (colc) rowc /= colc;
+	}
+
+	if (text) {
+		scx.ds = &ds;
+		scx.serialize_mode = SERIALIZE_NORMAL;
+		scx.fromdict = NULL;
+		scx.l = l;
+		scx.allow_null = 1;
+
+		// Serialize each key once
+		replace_tclobj(&keys, Tcl_NewListObj(colc, NULL));
+		for (c=0; c<colc; c++) {
+			Tcl_DStringSetLength(&ds, 0);
+			Tcl_DStringAppend(&ds, c == 0 ? "{" : ",", 1);
+			append_json_string(&scx, cols[c].name);
+			Tcl_DStringAppend(&ds, ":", 1);
+			TEST_OK_LABEL(finally, retval, Tcl_ListObjAppendElement(interp, keys,
+						Tcl_NewStringObj(Tcl_DStringValue(&ds), Tcl_DStringLength(&ds))));
+		}
+		Tcl_DStringSetLength(&ds, 0);
+		Tcl_DStringAppend(&ds, "[", 1);
+	} else {
+		elems = ckalloc(sizeof(Tcl_Obj*) * (rowc > 0 ? rowc : 1));
+		memset(elems, 0, sizeof(Tcl_Obj*) * rowc);
+	}
+
+	for (r=0; r<rowc; r++) {
+		if (nested) {
+			TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, rowv[r], &valc, &valv));
+			if (valc != colc) {
+				Tcl_SetObjResult(interp, Tcl_ObjPrintf("Row %d has %d values, expecting %d", r, valc, colc));
+				Tcl_SetErrorCode(interp, "RL", "JSON", "FROM_ROWS", "ROWS", NULL);
+				retval = TCL_ERROR;
+				goto finally;
 			}
+		} else {
+			valv = rowv + r*colc;
 		}
 
-		if (res == NULL) {
-			res = patch;
+		if (text) {
+			Tcl_Obj**	keyv;
+			int			keyc;
+
+			TEST_OK_LABEL(finally, retval, Tcl_ListObjGetElements(interp, keys, &keyc, &keyv));
+			if (r > 0) Tcl_DStringAppend(&ds, ",", 1);
+			if (colc == 0) Tcl_DStringAppend(&ds, "{", 1);
+			for (c=0; c<colc; c++) {
+				const char*	s;
+				int			len;
+
+				s = Tcl_GetStringFromObj(keyv[c], &len);
+				Tcl_DStringAppend(&ds, s, len);
+				retval = from_rows_text(interp, &scx, &cols[c], valv[c]);
+				if (retval != TCL_OK) {
+					Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf("\n    (converting row %d column \"%s\")", r, Tcl_GetString(cols[c].name)));
+					goto finally;
+				}
+			}
+			Tcl_DStringAppend(&ds, "}", 1);
 		} else {
-			TEST_OK(merge(interp, deep, res, patch, &new));
-			if (new != res)
-				res = new;
+			replace_tclobj(&row, Tcl_NewDictObj());
+			for (c=0; c<colc; c++) {
+				retval = from_rows_value(interp, l, &cols[c], valv[c], &val);
+				if (retval != TCL_OK) {
+					Tcl_AppendObjToErrorInfo(interp, Tcl_ObjPrintf("\n    (converting row %d column \"%s\")", r, Tcl_GetString(cols[c].name)));
+					goto finally;
+				}
+				TEST_OK_LABEL(finally, retval, Tcl_DictObjPut(interp, row, cols[c].name, val));
+			}
+			replace_tclobj(&elems[r], JSON_NewJvalObj(JSON_OBJECT, row));
 		}
 	}
 
-	if (res != NULL)
-		Tcl_SetObjResult(interp, res);
+	if (text) {
+		Tcl_DStringAppend(&ds, "]", 1);
+		Tcl_DStringResult(interp, &ds);
+	} else {
+		Tcl_SetObjResult(interp, JSON_NewJvalObj(JSON_ARRAY, Tcl_NewListObj(rowc, elems)));
+	}
+
+finally:
+	if (elems) {
+		for (r=0; r<rowc; r++) release_tclobj(&elems[r]);
+		ckfree(elems);
+		elems = NULL;
+	}
+	if (cols && cols != stackcols) {
+		ckfree(cols);
+		cols = NULL;
+	}
+	release_tclobj(&row);
+	release_tclobj(&val);
+	release_tclobj(&keys);
+	Tcl_DStringFree(&ds);
+	return retval;
 }
 
 //}}}
-#endif
 
 static int new_json_value_from_list(Tcl_Interp* interp, int objc, Tcl_Obj *const objv[], Tcl_Obj** res) //{{{
 {
@@ -3594,7 +5544,21 @@ static int jsonNRObj(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *co
 		"pretty",
 		"valid",
 		"debug",
-//		"merge",
+		"merge",
+		"patch",
+		"diff",
+		"equal",
+		"hash",
+		"canonical",
+		"from_rows",
+		"template_cache",
+		"match",
+		"tocbor",
+		"tomsgpack",
+		"pack",
+		"unpack",
+		"mmap",
+		"freeze",
 
 		// Create json types
 		"string",
@@ -3637,7 +5601,21 @@ static int jsonNRObj(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *co
 		M_PRETTY,
 		M_VALID,
 		M_DEBUG,
-//		M_MERGE,
+		M_MERGE,
+		M_PATCH,
+		M_DIFF,
+		M_EQUAL,
+		M_HASH,
+		M_CANONICAL,
+		M_FROM_ROWS,
+		M_TEMPLATE_CACHE,
+		M_MATCH,
+		M_TOCBOR,
+		M_TOMSGPACK,
+		M_PACK,
+		M_UNPACK,
+		M_MMAP,
+		M_FREEZE,
 		M_STRING,
 		M_NUMBER,
 		M_BOOLEAN,
@@ -3689,7 +5667,21 @@ static int jsonNRObj(ClientData cdata, Tcl_Interp* interp, int objc, Tcl_Obj *co
 		case M_PRETTY:		return jsonPretty(cdata, interp, objc-1, objv+1);
 		case M_VALID:		return jsonValid(cdata, interp, objc-1, objv+1);
 		case M_DEBUG:		return jsonDebug(cdata, interp, objc-1, objv+1);
-	//	case M_MERGE:		return jsonMerge(cdata, interp, objc-1, objv+1);
+		case M_MERGE:		return jsonMerge(cdata, interp, objc-1, objv+1);
+		case M_PATCH:		return jsonPatch(cdata, interp, objc-1, objv+1);
+		case M_DIFF:		return jsonDiff(cdata, interp, objc-1, objv+1);
+		case M_EQUAL:		return jsonEqual(cdata, interp, objc-1, objv+1);
+		case M_HASH:		return jsonHash(cdata, interp, objc-1, objv+1);
+		case M_CANONICAL:	return jsonCanonical(cdata, interp, objc-1, objv+1);
+		case M_FROM_ROWS:	return jsonFromRows(cdata, interp, objc-1, objv+1);
+		case M_TEMPLATE_CACHE:	return jsonTemplateCache(cdata, interp, objc-1, objv+1);
+		case M_MATCH:		return jsonMatch(cdata, interp, objc-1, objv+1);
+		case M_TOCBOR:		return jsonToCbor(cdata, interp, objc-1, objv+1);
+		case M_TOMSGPACK:	return jsonToMsgpack(cdata, interp, objc-1, objv+1);
+		case M_PACK:		return jsonPack(cdata, interp, objc-1, objv+1);
+		case M_UNPACK:		return jsonUnpack(cdata, interp, objc-1, objv+1);
+		case M_MMAP:		return jsonMmap(cdata, interp, objc-1, objv+1);
+		case M_FREEZE:		return jsonFreeze(cdata, interp, objc-1, objv+1);
 
 		case M_TEMPLATE_ACTIONS:	return jsonTemplateActions(cdata, interp, objc-1, objv+1);
 		case M_FREE_CACHE:	return jsonFreeCache(cdata, interp, objc-1, objv+1);
@@ -3776,9 +5768,6 @@ void free_interp_cx(ClientData cdata, Tcl_Interp* interp) //{{{
 	release_tclobj(&l->tcl_empty_dict);
 	release_tclobj(&l->tcl_empty_list);
 
-	for (i=0; i<2; i++)
-		release_tclobj(&l->force_num_cmd[i]);
-
 	for (i=0; i<JSON_TYPE_MAX; i++) {
 		release_tclobj(&l->type_int[i]);
 		release_tclobj(&l->type[i]);
@@ -3787,13 +5776,20 @@ void free_interp_cx(ClientData cdata, Tcl_Interp* interp) //{{{
 	for (i=0; i<TEMPLATE_ACTIONS_END; i++)
 		release_tclobj(&l->action[i]);
 
+	template_cache_clear(l);
+	Tcl_DeleteHashTable(&l->template_cache);
+
+	cbor_index_clear(l);
+	Tcl_DeleteHashTable(&l->cbor_index);
+
+	cbor_streams_clear(l);
+	Tcl_DeleteHashTable(&l->cbor_streams);
+
 #if DEDUP
 	free_cache(l);
 	Tcl_DeleteHashTable(&l->kc);
 #endif
 
-	release_tclobj(&l->apply);
-	release_tclobj(&l->decode_bytes);
 
 	release_tclobj(&l->cbor_true);
 	release_tclobj(&l->cbor_false);
@@ -3931,11 +5927,6 @@ DLLEXPORT int Rl_json_Init(Tcl_Interp* interp) //{{{
 	Tcl_IncrRefCount(l->tcl_empty_dict  = Tcl_NewDictObj());
 	Tcl_IncrRefCount(l->tcl_empty_list  = Tcl_NewListObj(0, NULL));
 
-	// Hack to ensure a value is a number (could be any of the Tcl number types: double, int, wide, bignum)
-	Tcl_IncrRefCount(l->force_num_cmd[0] = Tcl_NewStringObj("::tcl::mathop::+", -1));
-	Tcl_IncrRefCount(l->force_num_cmd[1] = Tcl_NewIntObj(0));
-	l->force_num_cmd[2] = NULL;
-
 	// Const type name objects
 	for (i=0; i<JSON_TYPE_MAX; i++) {
 		Tcl_IncrRefCount(l->type_int[i] = Tcl_NewStringObj(type_names_int[i], -1));
@@ -3946,6 +5937,10 @@ DLLEXPORT int Rl_json_Init(Tcl_Interp* interp) //{{{
 	for (i=0; i<TEMPLATE_ACTIONS_END; i++)
 		Tcl_IncrRefCount(l->action[i] = Tcl_NewStringObj(action_opcode_str[i], -1));
 
+	Tcl_InitHashTable(&l->template_cache, TCL_STRING_KEYS);
+	Tcl_InitHashTable(&l->cbor_index, TCL_ONE_WORD_KEYS);
+	Tcl_InitHashTable(&l->cbor_streams, TCL_ONE_WORD_KEYS);
+
 #if DEDUP
 	Tcl_InitHashTable(&l->kc, TCL_STRING_KEYS);
 	l->kc_count = 0;
@@ -3955,112 +5950,13 @@ DLLEXPORT int Rl_json_Init(Tcl_Interp* interp) //{{{
 	l->typeDict   = Tcl_GetObjType("dict");
 	l->typeInt    = Tcl_GetObjType("int");
 	l->typeDouble = Tcl_GetObjType("double");
+	g_tcl_double_type = l->typeDouble;
 	l->typeBignum = Tcl_GetObjType("bignum");
 	if (l->typeDict == NULL) THROW_ERROR("Can't retrieve objType for dict");
 	if (l->typeInt == NULL) THROW_ERROR("Can't retrieve objType for int");
 	if (l->typeDouble == NULL) THROW_ERROR("Can't retrieve objType for double");
 	//if (l->typeBignum == NULL) THROW_ERROR("Can't retrieve objType for bignum");
 
-	Tcl_IncrRefCount(l->apply = Tcl_NewStringObj("apply", 5));
-	Tcl_IncrRefCount(l->decode_bytes = Tcl_NewStringObj( // Tcl lambda to decode raw bytes to a unicode string {{{
-		"{bytes {encoding auto}} {\n"
-		//"		puts \"Decoding using $encoding: [regexp -all -inline .. [binary encode hex $bytes]]\"\n"
-		"	set decode_utf16 {{bytes encoding} {\n"
-		//"		puts \"Decoding using $encoding: [regexp -all -inline .. [binary encode hex $bytes]]\"\n"
-		"		set process_utf16_word {char {\n"
-		"			upvar 1 w1 w1  w2 w2\n"
-		"\n"
-		"			set t	[expr {$char & 0b1111110000000000}]\n"
-		"			if {$t == 0b1101100000000000} { # high surrogate\n"
-		"				set w1	[expr {$char & 0b0000001111111111}]\n"
-		"			} elseif {$t == 0b1101110000000000} { # low surrogate\n"
-		"				set w2	[expr {$char & 0b0000001111111111}]\n"
-		"			} else {\n"
-		//"puts \"emitting [format %x $char]: ([format %c $char])\"\n"
-		"				return [format %c $char]\n"
-		"			}\n"
-		"\n"
-		"			if {[info exists w1] && [info exists w2]} {\n"
-		"				set char	[expr {($w1 << 10) | $w2 | 0x10000}]\n"
-		//"puts [format {W1: %04x, W2: %04x, char: %x} $w1 $w2 $char]\n"
-		"				unset -nocomplain w1 w2\n"
-		//"puts \"emitting [format %x $char]: ([format %c $char])\"\n"
-		"				return [format %c $char]\n"
-		"			}\n"
-		"\n"
-		"			return\n"
-		"		}}\n"
-		"\n"
-		"		if {[string range $encoding 0 1] eq {x }} {\n"
-		"			set encoding [string range $encoding 2 end]\n"	// Hack to allow the test suite to force manual decoding
-		"		} elseif {$encoding in [encoding names]} {\n"
-		"			return [encoding convertfrom $encoding $bytes]\n"
-		"		}\n"
-		//"		puts \"Manual $encoding decode\"\n"
-		"		binary scan $bytes [expr {$encoding eq {utf-16le} ? {su*} : {Su*}}] chars\n"
-		//"		puts \"chars:\n\t[join [lmap e $chars {format %04x $e}] \\n\\t]\"\n"
-		"		set res	{}\n"
-		"		foreach char $chars {\n"
-		"			append res [apply $process_utf16_word $char]\n"
-		"		}\n"
-		"		set res\n"
-		"	}}\n"
-		"\n"
-		"	set decode_utf32 {{bytes encoding} {\n"
-		//"		puts \"Decoding using $encoding: [regexp -all -inline .. [binary encode hex $bytes]]\"\n"
-		"		if {[string range $encoding 0 1] eq {x }} {\n"
-		"			set encoding [string range $encoding 2 end]\n"	// Hack to allow the test suite to force manual decoding
-		"		} elseif {$encoding in [encoding names]} {\n"
-		//"			puts \"$encoding is in \\[encoding names\\], using native\"\n"
-		"			return [encoding convertfrom $encoding $bytes]\n"
-		"		}\n"
-		//"		puts \"Manual $encoding decode\"\n"
-		"		binary scan $bytes [expr {$encoding eq {utf-32le} ? {iu*} : {Iu*}}] chars\n"
-		//"		puts \"chars:\n\t[join [lmap e $chars {format %04x $e}] \\n\\t]\"\n"
-		"		set res	{}\n"
-		"		foreach char $chars {\n"
-		"			append res [format %c $char]\n"
-		"		}\n"
-		"		set res\n"
-		"	}}\n"
-		"\n"
-		"	if {$encoding eq {auto}} {\n"
-		"		set bom	[binary encode hex [string range $bytes 0 3]]\n"
-		"		switch -glob -- $bom {\n"
-		"			0000feff { set encoding utf-32be }\n"
-		"			fffe0000 { set encoding utf-32le }\n"
-		"			feff*    { set encoding utf-16be }\n"
-		"			fffe*    { set encoding utf-16le }\n"
-		"\n"
-		"			efbbbf -\n"
-		"			default { # No BOM, or UTF-8 BOM\n"
-		"				set encoding utf-8\n"
-		"			}\n"
-		"		}\n"
-		"	}\n"
-		"\n"
-		"	switch -- $encoding {\n"
-		"		utf-8 {\n"
-		"			encoding convertfrom utf-8 $bytes\n"
-		"		}\n"
-		"\n"
-		"		{x utf-16le} -\n"
-		"		{x utf-16be} -\n"
-		"		utf-16le -\n"
-		"		utf-16be { apply $decode_utf16 $bytes $encoding }\n"
-		"\n"
-		"		{x utf-32le} -\n"
-		"		{x utf-32be} -\n"
-		"		utf-32le -\n"
-		"		utf-32be { apply $decode_utf32 $bytes $encoding }\n"
-		"\n"
-		"		default {\n"
-		"			error \"Unsupported encoding \\\"$encoding\\\"\"\n"
-		"		}\n"
-		"	}\n"
-		"}\n" , -1));
-	//}}}
-
 	replace_tclobj(&l->cbor_true,      Tcl_NewStringObj("true",  4));
 	replace_tclobj(&l->cbor_false,     Tcl_NewStringObj("false", 5));
 	replace_tclobj(&l->cbor_null,      Tcl_NewStringObj("", 0));
@@ -4096,6 +5992,21 @@ DLLEXPORT int Rl_json_Init(Tcl_Interp* interp) //{{{
 			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("extract",    -1));
 			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("set",        -1));
 			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("unset",      -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("merge",      -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("patch",      -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("diff",       -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("equal",      -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("hash",       -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("canonical",  -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("from_rows",  -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("template_cache", -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("match",      -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("tocbor",     -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("tomsgpack",  -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("pack",       -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("unpack",     -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("mmap",       -1));
+			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("freeze",     -1));
 			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("fmt",        -1));
 			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("new",        -1));
 			Tcl_ListObjAppendElement(NULL, subcommands, Tcl_NewStringObj("string",     -1));
@@ -4153,7 +6064,21 @@ DLLEXPORT int Rl_json_Init(Tcl_Interp* interp) //{{{
 		Tcl_CreateObjCommand(interp, ENS "valid",      jsonValid, l, NULL);
 		Tcl_CreateObjCommand(interp, ENS "debug",      jsonDebug, l, NULL);
 		Tcl_CreateObjCommand(interp, ENS "template_actions",      jsonTemplateActions, l, NULL);
-		//Tcl_CreateObjCommand(interp, ENS "merge",      jsonMerge, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "merge",      jsonMerge, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "patch",      jsonPatch, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "diff",       jsonDiff, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "equal",      jsonEqual, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "hash",       jsonHash, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "canonical",  jsonCanonical, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "from_rows",  jsonFromRows, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "template_cache", jsonTemplateCache, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "match",      jsonMatch, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "tocbor",     jsonToCbor, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "tomsgpack",  jsonToMsgpack, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "pack",       jsonPack, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "unpack",     jsonUnpack, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "mmap",       jsonMmap, l, NULL);
+		Tcl_CreateObjCommand(interp, ENS "freeze",     jsonFreeze, l, NULL);
 #else
 		Tcl_NRCreateCommand(interp, NS "::json", jsonObj, jsonNRObj, l, NULL);
 #endif
@@ -4162,6 +6087,7 @@ DLLEXPORT int Rl_json_Init(Tcl_Interp* interp) //{{{
 	}
 
 	if (TCL_OK != cbor_init(interp, l)) return TCL_ERROR;
+	if (TCL_OK != msgpack_init(interp, l)) return TCL_ERROR;
 
 	if (TCL_OK != _setdir(interp)) return TCL_ERROR;
 
@@ -4190,6 +6116,7 @@ DLLEXPORT int Rl_json_Unload(Tcl_Interp* interp, int flags) //{{{
 	release_instances();
 
 	cbor_release(interp);
+	msgpack_release(interp);
 
 	Tcl_DeleteAssocData(interp, "rl_json");
 
@@ -117,12 +117,24 @@ EXTERN int		JSON_Foreach(Tcl_Interp*interp, Tcl_Obj*iterators,
 EXTERN int		JSON_Valid(Tcl_Interp*interp, Tcl_Obj*json,
 				int*valid, enum extensions extensions,
 				struct parse_error*details);
-/* Slot 34 is reserved */
-/* Slot 35 is reserved */
-/* Slot 36 is reserved */
-/* Slot 37 is reserved */
-/* Slot 38 is reserved */
-/* Slot 39 is reserved */
+/* 34 */
+EXTERN int		JSON_Merge(Tcl_Interp*interp, Tcl_Obj*obj,
+				Tcl_Obj*patch);
+/* 35 */
+EXTERN int		JSON_Patch(Tcl_Interp*interp, Tcl_Obj*obj,
+				Tcl_Obj*patch, Tcl_Obj**res);
+/* 36 */
+EXTERN int		JSON_Diff(Tcl_Interp*interp, Tcl_Obj*from,
+				Tcl_Obj*to, Tcl_Obj**patch);
+/* 37 */
+EXTERN int		JSON_Equal(Tcl_Interp*interp, Tcl_Obj*a, Tcl_Obj*b,
+				int*equal);
+/* 38 */
+EXTERN int		JSON_Hash(Tcl_Interp*interp, Tcl_Obj*obj,
+				Tcl_WideInt*hash);
+/* 39 */
+EXTERN int		JSON_Canonical(Tcl_Interp*interp, Tcl_Obj*obj,
+				Tcl_Obj**canonical);
 /* 40 */
 EXTERN int		CBOR_GetDataItemFromPath(Tcl_Interp*interp,
 				Tcl_Obj*cborObj, Tcl_Obj*pathObj,
@@ -170,12 +182,12 @@ typedef struct Rl_jsonStubs {
     int (*jSON_Decode) (Tcl_Interp*interp, Tcl_Obj*bytes, Tcl_Obj*encoding, Tcl_Obj**decodedstring); /* 31 */
     int (*jSON_Foreach) (Tcl_Interp*interp, Tcl_Obj*iterators, JSON_ForeachBody*body, enum collecting_mode collect, Tcl_Obj**res, ClientData cdata); /* 32 */
     int (*jSON_Valid) (Tcl_Interp*interp, Tcl_Obj*json, int*valid, enum extensions extensions, struct parse_error*details); /* 33 */
-    void (*reserved34)(void);
-    void (*reserved35)(void);
-    void (*reserved36)(void);
-    void (*reserved37)(void);
-    void (*reserved38)(void);
-    void (*reserved39)(void);
+    int (*jSON_Merge) (Tcl_Interp*interp, Tcl_Obj*obj, Tcl_Obj*patch); /* 34 */
+    int (*jSON_Patch) (Tcl_Interp*interp, Tcl_Obj*obj, Tcl_Obj*patch, Tcl_Obj**res); /* 35 */
+    int (*jSON_Diff) (Tcl_Interp*interp, Tcl_Obj*from, Tcl_Obj*to, Tcl_Obj**patch); /* 36 */
+    int (*jSON_Equal) (Tcl_Interp*interp, Tcl_Obj*a, Tcl_Obj*b, int*equal); /* 37 */
+    int (*jSON_Hash) (Tcl_Interp*interp, Tcl_Obj*obj, Tcl_WideInt*hash); /* 38 */
+    int (*jSON_Canonical) (Tcl_Interp*interp, Tcl_Obj*obj, Tcl_Obj**canonical); /* 39 */
     int (*cBOR_GetDataItemFromPath) (Tcl_Interp*interp, Tcl_Obj*cborObj, Tcl_Obj*pathObj, const uint8_t**dataitemPtr, const uint8_t**ePtr, Tcl_DString*tagsPtr); /* 40 */
     int (*cBOR_Length) (Tcl_Interp*interp, const uint8_t*p, const uint8_t*e, size_t*lenPtr); /* 41 */
 } Rl_jsonStubs;
@@ -260,12 +272,18 @@ extern const Rl_jsonStubs *rl_jsonStubsPtr;
 	(rl_jsonStubsPtr->jSON_Foreach) /* 32 */
 #define JSON_Valid \
 	(rl_jsonStubsPtr->jSON_Valid) /* 33 */
-/* Slot 34 is reserved */
-/* Slot 35 is reserved */
-/* Slot 36 is reserved */
-/* Slot 37 is reserved */
-/* Slot 38 is reserved */
-/* Slot 39 is reserved */
+#define JSON_Merge \
+	(rl_jsonStubsPtr->jSON_Merge) /* 34 */
+#define JSON_Patch \
+	(rl_jsonStubsPtr->jSON_Patch) /* 35 */
+#define JSON_Diff \
+	(rl_jsonStubsPtr->jSON_Diff) /* 36 */
+#define JSON_Equal \
+	(rl_jsonStubsPtr->jSON_Equal) /* 37 */
+#define JSON_Hash \
+	(rl_jsonStubsPtr->jSON_Hash) /* 38 */
+#define JSON_Canonical \
+	(rl_jsonStubsPtr->jSON_Canonical) /* 39 */
 #define CBOR_GetDataItemFromPath \
 	(rl_jsonStubsPtr->cBOR_GetDataItemFromPath) /* 40 */
 #define CBOR_Length \
@@ -32,7 +32,8 @@
 
 enum parse_mode {
 	PARSE,
-	VALIDATE
+	VALIDATE,
+	NATIVE		// Build plain Tcl dicts, lists and strings rather than JSON values
 };
 
 struct parse_context {
@@ -63,6 +64,21 @@ struct foreach_iterator {
 	Tcl_Obj*		k;
 	Tcl_Obj*		v;
 	int				done;
+
+	// Iterating over a packed array or object (json freeze, json mmap)
+	Tcl_Obj*		packed;
+};
+
+// The intrep ptr2 of a JSON value holds a JSON_cache Tcl_Obj, created on
+// demand, that records information derived from the value.  Anything that
+// modifies the value in place must release it, which get_unshared_val does
+struct json_cache {
+	struct template_program*	program;	// Compiled template (get_template_program)
+	struct template_fragments*	fragments;	// Compiled template for template_string (get_template_fragments)
+	struct match_program*		match;		// Compiled template for json match (get_match_program)
+	int				have_hash;
+	Tcl_WideUInt	hash;		// Structural hash (JSON_Hash)
+	Tcl_Obj*		canonical;	// RFC 8785 serialization (JSON_Canonical)
 };
 
 struct foreach_state {
@@ -77,7 +93,8 @@ struct foreach_state {
 
 enum serialize_modes {
 	SERIALIZE_NORMAL,		// We're updating the string rep of a json value or template
-	SERIALIZE_TEMPLATE		// We're interpolating values into a template
+	SERIALIZE_TEMPLATE,		// We're interpolating values into a template
+	SERIALIZE_CANONICAL		// RFC 8785 canonical form (JSON_Canonical)
 };
 
 struct serialize_context {
@@ -119,6 +136,7 @@ enum action_opcode {
 	STORE_BOOLEAN,
 	STORE_JSON,
 	STORE_TEMPLATE,
+	STORE_REPEAT,
 	PUSH_TARGET,
 	POP_TARGET,
 	REPLACE_VAL,
@@ -129,6 +147,67 @@ enum action_opcode {
 	TEMPLATE_ACTIONS_END
 };
 
+// A template compiled to native instructions: the opcodes and slot numbers
+// are resolved once when the template is compiled rather than on every
+// application
+struct template_instr {
+	enum action_opcode	opcode;
+	Tcl_Obj*			a;		// Key, array index, literal or target, depending on opcode
+	int					slot;	// -1 if the opcode doesn't take a slot
+	int					idx;	// Integer value of a for ALLOCATE (stack depth) and REPLACE_ARR (array index)
+};
+
+struct template_program {
+	int						refCount;	// Shared by duplicated json_caches
+	int						instrc;
+	struct template_instr	instr[];
+};
+
+// A template compiled for rendering straight to a string: the serialized
+// template as constant (already escaped) fragments, each followed by a hole
+// to be filled from the substitution source
+struct template_fragment {
+	int				ofs;		// Offset of the constant text in template_fragments.text
+	int				len;
+	enum json_types	hole;		// JSON_DYN_* type of the hole following the text, JSON_UNDEF if none
+	int				is_key;		// The hole is an object key (nulls aren't allowed)
+	Tcl_Obj*		name;		// The key or variable name to substitute into the hole
+	Tcl_Obj*		elem;		// Element template for a repeating section (hole is JSON_ARRAY)
+};
+
+struct template_fragments {
+	int							refCount;	// Shared by duplicated json_caches
+	char*						text;
+	int							fragc;
+	struct template_fragment	frag[];
+};
+
+// Plan for matching a document against a template (json match): a walk
+// over just the paths in the template, binding the values at placeholders
+enum match_opcode {
+	MATCH_KEY,		// Descend into member a of the current object
+	MATCH_IDX,		// Descend into element idx of the current array
+	MATCH_UP,		// Return to the parent
+	MATCH_TYPE,		// Current value must be of type (an empty {} or [] in the template)
+	MATCH_CONST,	// Current value must equal a
+	MATCH_BIND		// Bind the current value, of placeholder type, to name a in slot idx
+};
+
+struct match_instr {
+	enum match_opcode	opcode;
+	enum json_types		type;
+	int					idx;
+	Tcl_Obj*			a;
+};
+
+struct match_program {
+	int					refCount;	// Shared by duplicated json_caches
+	int					depth;		// Deepest nesting of MATCH_KEY / MATCH_IDX
+	int					bindc;
+	int					instrc;
+	struct match_instr	instr[];
+};
+
 #if DEDUP
 struct kc_entry {
 	Tcl_Obj			*val;
@@ -166,6 +245,38 @@ struct kc_entry {
 
 #endif
 
+#define TEMPLATE_CACHE_SIZE	64		// Max number of templates remembered per interp by their text
+
+struct template_cache_entry {
+	Tcl_HashEntry*					he;			// Keyed by the template text
+	Tcl_Obj*						template;	// Parsed, holds the compiled forms in its cache
+	struct template_cache_entry*	prev;		// More recently used
+	struct template_cache_entry*	next;		// Less recently used
+};
+
+#define CBOR_INDEX_CACHE_SIZE	8		// Max number of CBOR values with offset indexes remembered per interp
+
+struct cbor_index_entry {
+	Tcl_HashEntry*				he;			// Keyed by the address of the Tcl_Obj holding the CBOR bytes
+	Tcl_Obj*					cbor;		// That Tcl_Obj, referenced only once offsets are recorded
+	const uint8_t*				bytes;		// The bytes the offsets were recorded against
+	size_t						len;
+	int							lookups;	// Containers are only indexed from the second lookup on
+	Tcl_HashTable				containers;	// Offset of a container's head -> struct cbor_container*
+	struct cbor_index_entry*	prev;		// More recently used
+	struct cbor_index_entry*	next;		// Less recently used
+};
+
+struct cbor_stream {
+	Tcl_HashEntry*	he;			// Keyed by the channel, NULL once it has closed
+	Tcl_Channel		chan;		// NULL once it has closed
+	int				refs;		// Held by the table and by each cbor foreach reading from it
+	uint8_t*		buf;		// Bytes read from chan ...
+	size_t			start;		// ... from here not yet yielded as items
+	size_t			len;
+	size_t			cap;
+};
+
 struct interp_cx {
 	Tcl_Interp*		interp;
 	Tcl_Obj*		tcl_true;
@@ -180,7 +291,6 @@ struct interp_cx {
 	Tcl_Obj*		tcl_empty_dict;
 	Tcl_Obj*		tcl_empty_list;
 	Tcl_Obj*		action[TEMPLATE_ACTIONS_END];
-	Tcl_Obj*		force_num_cmd[3];
 	Tcl_Obj*		type_int[JSON_TYPE_MAX];	// Tcl_Obj for JSON_STRING, JSON_ARRAY, etc
 	Tcl_Obj*		type[JSON_TYPE_MAX];		// Holds the Tcl_Obj values returned for [json type ...]
 #if DEDUP
@@ -194,12 +304,25 @@ struct interp_cx {
 	const Tcl_ObjType*	typeInt;		// Evil hack to snoop on the type of a number, so that we don't have to add 0 to a candidate to know if it's a valid number
 	const Tcl_ObjType*	typeDouble;
 	const Tcl_ObjType*	typeBignum;
-	Tcl_Obj*		apply;
-	Tcl_Obj*		decode_bytes;
 	Tcl_Obj*		cbor_true;			// cbor_true/false distinct from tcl_true/false because they have different string reps
 	Tcl_Obj*		cbor_false;
 	Tcl_Obj*		cbor_null;
 	Tcl_Obj*		cbor_undefined;
+	Tcl_HashTable	template_cache;
+	struct template_cache_entry*	template_cache_head;	// Most recently used
+	struct template_cache_entry*	template_cache_tail;	// Least recently used, evicted first
+	int				template_cache_count;
+	Tcl_WideInt		template_cache_hits;
+	Tcl_WideInt		template_cache_misses;
+	Tcl_WideInt		template_cache_evictions;
+	Tcl_HashTable	cbor_index;
+	struct cbor_index_entry*	cbor_index_head;	// Most recently used
+	struct cbor_index_entry*	cbor_index_tail;	// Least recently used, evicted first
+	int				cbor_index_count;
+	Tcl_WideInt		cbor_index_hits;
+	Tcl_WideInt		cbor_index_misses;
+	Tcl_WideInt		cbor_index_evictions;
+	Tcl_HashTable	cbor_streams;		// Bytes read from channels by cbor foreach but not yet yielded: Tcl_Channel -> struct cbor_stream*
 };
 
 void append_to_cx(struct parse_context *cx, Tcl_Obj *val);
@@ -211,6 +334,7 @@ int lookup_type(Tcl_Interp* interp, Tcl_Obj* typeobj, int* type);
 int is_template(const char* s, int len);
 
 extern Tcl_ObjType* g_objtype_for_type[];
+extern const Tcl_ObjType* g_tcl_double_type;
 extern const char* type_names_int[];
 extern const char* type_names[];
 
@@ -248,16 +372,26 @@ int JSON_GetJvalFromObj(Tcl_Interp *interp, Tcl_Obj *obj, enum json_types *type,
 int JSON_IsJSON(Tcl_Obj* obj, enum json_types* type, Tcl_ObjInternalRep** ir);
 int type_is_dynamic(const enum json_types type);
 int force_json_number(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* obj, Tcl_Obj** forced);
+int append_json_number(Tcl_Interp* interp, Tcl_DString* ds, Tcl_Obj* val);
 Tcl_Obj* as_json(Tcl_Interp* interp, Tcl_Obj* from);
 const char* get_dyn_prefix(enum json_types type);
 const char* get_type_name(enum json_types type);
 Tcl_Obj* get_unshared_val(Tcl_ObjInternalRep* ir);
-int apply_template_actions(Tcl_Interp* interp, Tcl_Obj* template, Tcl_Obj* actions, Tcl_Obj* dict, Tcl_Obj** res);
+struct json_cache* get_json_cache(Tcl_ObjInternalRep* ir, int create);
+int apply_template_actions(Tcl_Interp* interp, Tcl_Obj* template, const struct template_program* program, Tcl_Obj* dict, Tcl_Obj** res);
 int build_template_actions(Tcl_Interp* interp, Tcl_Obj* template, Tcl_Obj** actions);
+int get_template_program(Tcl_Interp* interp, Tcl_Obj* template, struct template_program** program);
+void release_template_program(struct template_program** program);
+Tcl_Obj* template_program_actions(struct interp_cx* l, const struct template_program* program);
+void release_template_fragments(struct template_fragments** fragments);
+void release_match_program(struct match_program** program);
 int convert_to_tcl(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** out);
+int parse_to_tcl(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** out);
+int is_json_number(const char* s, int len);
 int resolve_path(Tcl_Interp* interp, Tcl_Obj* src, Tcl_Obj *const pathv[], int pathc, Tcl_Obj** target, const int exists, const int modifiers, Tcl_Obj* def);
 int json_pretty(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj* indent, Tcl_Obj* pad, Tcl_DString* ds);
 void foreach_state_free(struct foreach_state* state);
+int utf8_to_tclobj(Tcl_Interp* interp, const uint8_t* b, size_t len, Tcl_Obj** out);
 
 #define TEMPLATE_TYPE(s, len, out) \
 	if (s[0] == '~' && (len) >= 3 && s[2] == ':') { \
@@ -275,9 +409,69 @@ void foreach_state_free(struct foreach_state* state);
 
 #include "dedup.h"
 
+// dtoa.c
+#define JSON_DOUBLE_DIGITS	17		// Most digits a shortest round trip double needs
+#define JSON_DOUBLE_BUFSIZE	32		// Enough for -d.dddddddddddddddde-308
+int json_double_digits(double d, char* digits, int* point);
+int json_format_double(double d, char* buf);
+
 // CBOR private headers:
 int cbor_init(Tcl_Interp* interp, struct interp_cx* l);
 void cbor_release(Tcl_Interp* interp);
+void cbor_index_clear(struct interp_cx* l);
+void cbor_streams_clear(struct interp_cx* l);
+int cbor_from_json(Tcl_Interp* interp, Tcl_Obj* json, int canonical, Tcl_Obj** res);
+
+// Shared by the CBOR and MessagePack implementations (cbor.c):
+enum indexmode {
+	IDX_ABS,
+	IDX_ENDREL
+};
+enum bytes_encoding {
+	BYTES_BASE64URL,
+	BYTES_BASE64,
+	BYTES_BASE16
+};
+struct cbor_key {		// The forms of a path element that map keys are compared against
+	int				is_int;
+	Tcl_WideInt		ival;
+	size_t			len;
+	const uint8_t*	utf8;
+	int				is_integer;	// Any integer, with its magnitude as CBOR encodes it (of -1-n when negative) ...
+	int				negative;
+	uint64_t		mag64;		// ... when it fits in 64 bits, and ...
+	size_t			maglen;		// ... as big-endian bytes without leading zeros
+	const uint8_t*	mag;
+};
+float decode_float(const uint8_t* p);
+double decode_double(const uint8_t* p);
+int parse_index(Tcl_Interp* interp, Tcl_Obj* obj, enum indexmode* mode, ssize_t* ofs);
+Tcl_Obj* new_tcl_uint64(uint64_t val);
+Tcl_Obj* new_tcl_nint64(uint64_t val);
+void get_cbor_key(Tcl_Obj* obj, Tcl_DString* scratch, struct cbor_key* key);
+const uint8_t* tcl_to_utf8(const char* str, int len, Tcl_DString* scratch, size_t* lenPtr);
+int get_double(Tcl_Interp* interp, struct interp_cx* l, Tcl_Obj* obj, double* d);
+void append_bytes_encoded(Tcl_DString* ds, const uint8_t* bytes, size_t len, enum bytes_encoding enc);
+void append_json_escaped(Tcl_DString* ds, const uint8_t* s, size_t len);
+
+// MessagePack private headers:
+int msgpack_init(Tcl_Interp* interp, struct interp_cx* l);
+void msgpack_release(Tcl_Interp* interp);
+int msgpack_from_json(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj** res);
+
+// Packed JSON private headers:
+int pack_from_json(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj** res);
+int pack_to_json(Tcl_Interp* interp, Tcl_Obj* bytes, Tcl_Obj** res);
+int pack_mmap(Tcl_Interp* interp, Tcl_Obj* path, Tcl_Obj** res);
+int is_packed(Tcl_Obj* obj);
+enum json_types packed_type(Tcl_Obj* obj);
+int packed_to_json(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** res);
+int packed_walk_path(Tcl_Obj** target, Tcl_Obj*const pathv[], int pathc, const int modifiers);
+int packed_to_tcl(Tcl_Interp* interp, Tcl_Obj* obj, Tcl_Obj** res);
+int packed_length(Tcl_Obj* obj);
+int packed_child(Tcl_Interp* interp, Tcl_Obj* obj, int i, Tcl_Obj** key, Tcl_Obj** val);
+Tcl_Obj* packed_keys(Tcl_Interp* interp, Tcl_Obj* obj);
+int pack_freeze(Tcl_Interp* interp, Tcl_Obj* json, Tcl_Obj** res);
 
 // Polyfill
 #ifndef Tcl_GetBytesFromObj
@@ -39,12 +39,12 @@ const Rl_jsonStubs rl_jsonStubs = {
     JSON_Decode, /* 31 */
     JSON_Foreach, /* 32 */
     JSON_Valid, /* 33 */
-    0, /* 34 */
-    0, /* 35 */
-    0, /* 36 */
-    0, /* 37 */
-    0, /* 38 */
-    0, /* 39 */
+    JSON_Merge, /* 34 */
+    JSON_Patch, /* 35 */
+    JSON_Diff, /* 36 */
+    JSON_Equal, /* 37 */
+    JSON_Hash, /* 38 */
+    JSON_Canonical, /* 39 */
     CBOR_GetDataItemFromPath, /* 40 */
     CBOR_Length, /* 41 */
 };